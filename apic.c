@@ -0,0 +1,608 @@
+#include <stdio.h>
+#include <string.h>
+#include "cpux86.h"
+#include "machine.h"
+#include "log.h"
+
+
+// ローカルAPIC、I/O APIC、MSR
+//   MMIOがないのでローカルAPICはx2APICのMSR(0x800~)だけで読み書きする(起動時からx2APICモード)
+//   他のvCPUへの割り込みは相手のIRRをアトミック命令で立ててwake_fdで起こし、相手のスレッドがスライスの区切りで受け付ける
+//   タイマーはそのvCPUの仮想クロック(TSC)を分周して数える
+
+#define APIC_VERSION		0x00050014	// LVT 6個、バージョン0x14
+#define APIC_SVR_ENABLE		0x100
+#define APIC_LVT_MASKED		0x10000
+#define APIC_LVT_PERIODIC	0x20000
+
+// ICR
+#define APIC_DM_FIXED		0
+#define APIC_DM_LOWEST		1
+#define APIC_DM_INIT		5
+#define APIC_DM_SIPI		6
+#define APIC_DEST_LOGICAL	0x800
+#define APIC_LEVEL_ASSERT	0x4000
+#define APIC_BROADCAST		0xFFFFFFFF
+
+// MSR
+#define MSR_TSC			0x10
+#define MSR_APIC_BASE	0x1B
+#define MSR_X2APIC		0x800	// 0x800~0x8FF
+
+
+// apic
+
+// 最優先(一番大きい)のベクタ(なければ-1)
+static int apic_highest(uint32 *bits)
+{
+	uint32 val;
+	int i;
+
+	for (i=7; 0<=i; i--) {
+		val = __atomic_load_n(&(bits[i]), __ATOMIC_ACQUIRE);
+		if (val) {
+			return i * 32 + 31 - __builtin_clz(val);
+		}
+	}
+	return -1;
+}
+
+// Processor Priority Register
+static uint32 apic_ppr(Apic *apic)
+{
+	int isr;
+
+	isr = apic_highest(apic->isr);
+	if (0 <= isr && (apic->tpr & 0xF0) < (isr & 0xF0)) {
+		return isr & 0xF0;
+	}
+	return apic->tpr & 0xFF;
+}
+
+// INITで戻す(IDとIA32_APIC_BASEはそのまま)
+void apic_reset(CPUx86 *cpu)
+{
+	Apic *apic = &(cpu->apic);
+	int i;
+
+	apic->tpr = 0;
+	apic->svr = 0xFF;
+	for (i=0; i<8; i++) {
+		__atomic_store_n(&(apic->irr[i]), 0, __ATOMIC_RELEASE);
+		apic->isr[i] = 0;
+	}
+	apic->esr = 0;
+	apic->icr = 0;
+	for (i=0; i<6; i++) {
+		apic->lvt[i] = APIC_LVT_MASKED;
+	}
+	apic->timer_initial = 0;
+	apic->timer_divide = 0;
+	apic->timer_start = 0;
+	apic->timer_deadline = CLOCK_NEVER;
+}
+
+// APはINIT、SIPIを待つ状態で始める
+void apic_init(CPUx86 *cpu, uint32 id)
+{
+	Apic *apic = &(cpu->apic);
+
+	apic->id = id;
+	apic->base = APIC_BASE_ADDR | APIC_BASE_EN | APIC_BASE_EXTD | (id==0 ? APIC_BASE_BSP : 0);
+	apic->pending = 0;
+	apic->sipi_vector = 0;
+	apic_reset(cpu);
+	if (id!=0) {
+		apic->wait_sipi = 1;
+		cpu->halted = 1;
+	}
+}
+
+// IRRを立てて起こす(どのスレッドからも呼べる)
+void apic_set_irq(CPUx86 *cpu, int vector)
+{
+	// 0~15は不正なベクタ
+	if (vector < 16) {
+		return;
+	}
+	__atomic_fetch_or(&(cpu->apic.irr[vector >> 5]), 1U << (vector & 31), __ATOMIC_RELEASE);
+	pc_kick(cpu);
+}
+
+// 分周(0~7: 2, 4, 8, 16, 32, 64, 128, 1)のシフト量
+static int apic_timer_shift(Apic *apic)
+{
+	uint32 div;
+
+	div = (apic->timer_divide & 3) | (apic->timer_divide >> 1 & 4);
+	return (div + 1) & 7;
+}
+
+static void apic_timer_start(CPUx86 *cpu, uint32 count)
+{
+	Apic *apic = &(cpu->apic);
+
+	apic->timer_initial = count;
+	apic->timer_start = clock_tsc(cpu);
+	apic->timer_deadline = CLOCK_NEVER;
+	if (count) {
+		apic->timer_deadline = apic->timer_start + ((uint64)count << apic_timer_shift(apic));
+		if (apic->timer_deadline < cpu->clock.deadline) {
+			cpu->clock.deadline = apic->timer_deadline;
+		}
+	}
+}
+
+static uint32 apic_timer_count(CPUx86 *cpu)
+{
+	Apic *apic = &(cpu->apic);
+	uint64 elapsed;
+
+	if (apic->timer_initial==0) {
+		return 0;
+	}
+	elapsed = (clock_tsc(cpu) - apic->timer_start) >> apic_timer_shift(apic);
+	if (apic->lvt[0] & APIC_LVT_PERIODIC) {
+		return apic->timer_initial - elapsed % apic->timer_initial;
+	}
+	return elapsed < apic->timer_initial ? apic->timer_initial - elapsed : 0;
+}
+
+// タイマーが0になっていれば割り込みを立てて、次に0になる時刻(TSC)を返す
+uint64 apic_update(CPUx86 *cpu)
+{
+	Apic *apic = &(cpu->apic);
+	uint64 now;
+	uint64 period;
+
+	if (apic->timer_deadline==CLOCK_NEVER) {
+		return CLOCK_NEVER;
+	}
+	now = clock_tsc(cpu);
+	if (now < apic->timer_deadline) {
+		return apic->timer_deadline;
+	}
+	if (!(apic->lvt[0] & APIC_LVT_MASKED)) {
+		apic_set_irq(cpu, apic->lvt[0] & 0xFF);
+	}
+	if (apic->lvt[0] & APIC_LVT_PERIODIC) {
+		// 遅れた周期はまとめて1回にする
+		period = (uint64)apic->timer_initial << apic_timer_shift(apic);
+		apic->timer_start += (now - apic->timer_start) / period * period;
+		apic->timer_deadline = apic->timer_start + period;
+	} else {
+		apic->timer_deadline = CLOCK_NEVER;
+	}
+	return apic->timer_deadline;
+}
+
+// 受け付けられる最優先のベクタをISRに移して返す(なければ-1)
+int apic_interrupt(CPUx86 *cpu)
+{
+	Apic *apic = &(cpu->apic);
+	int vector;
+
+	if (!(apic->base & APIC_BASE_EN) || !(apic->svr & APIC_SVR_ENABLE)) {
+		return -1;
+	}
+	vector = apic_highest(apic->irr);
+	if (vector < 0 || (uint32)(vector & 0xF0) <= (apic_ppr(apic) & 0xF0)) {
+		return -1;
+	}
+	__atomic_fetch_and(&(apic->irr[vector >> 5]), ~(1U << (vector & 31)), __ATOMIC_ACQ_REL);
+	apic->isr[vector >> 5] |= 1U << (vector & 31);
+	return vector;
+}
+
+static void apic_eoi(Apic *apic)
+{
+	int vector;
+
+	vector = apic_highest(apic->isr);
+	if (0 <= vector) {
+		apic->isr[vector >> 5] &= ~(1U << (vector & 31));
+	}
+}
+
+// 届いたINIT、SIPIを処理する(そのvCPUのスレッドでスライスの区切りに呼ぶ)
+//   INIT: レジスタを初期化してSIPIを待つ(BSPは無視する)
+//   SIPI: リアルモードのベクタ×0x1000番地から始める
+void apic_startup(CPUx86 *cpu)
+{
+	Apic *apic = &(cpu->apic);
+	uint32 pending;
+
+	pending = __atomic_exchange_n(&(apic->pending), 0, __ATOMIC_ACQ_REL);
+	if ((pending & APIC_PENDING_INIT) && !(apic->base & APIC_BASE_BSP)) {
+		cpu_reset(cpu);
+		apic_reset(cpu);
+		apic->wait_sipi = 1;
+		cpu->halted = 1;
+	}
+	if ((pending & APIC_PENDING_SIPI) && apic->wait_sipi) {
+		apic->wait_sipi = 0;
+		cpu->halted = 0;
+		seg_load_real(cpu, SEG_CS, apic->sipi_vector << 8);
+		cpu->eip = 0;
+	}
+}
+
+static void apic_deliver(CPUx86 *cpu, int mode, int vector)
+{
+	Apic *apic = &(cpu->apic);
+
+	switch (mode) {
+	case APIC_DM_FIXED:
+	case APIC_DM_LOWEST:
+		apic_set_irq(cpu, vector);
+		break;
+	case APIC_DM_INIT:
+		__atomic_fetch_or(&(apic->pending), APIC_PENDING_INIT, __ATOMIC_RELEASE);
+		pc_kick(cpu);
+		break;
+	case APIC_DM_SIPI:
+		apic->sipi_vector = vector;
+		__atomic_fetch_or(&(apic->pending), APIC_PENDING_SIPI, __ATOMIC_RELEASE);
+		pc_kick(cpu);
+		break;
+	default:
+		log_warning("apic: delivery mode %d is not supported\n", mode);
+		break;
+	}
+}
+
+// x2APICの宛先(物理: APIC ID、論理: クラスタ<<16 | クラスタの中のビット)
+static int apic_match(CPUx86 *cpu, uint32 dest, int logical)
+{
+	uint32 id = cpu->apic.id;
+
+	if (dest==APIC_BROADCAST) {
+		return 1;
+	}
+	if (logical) {
+		return (dest >> 16)==(id >> 4) && (dest & (1U << (id & 15)));
+	}
+	return dest==id;
+}
+
+// 割り込みを送る(shorthand 0: 宛先、1: 自分、2: 自分を含むすべて、3: 自分以外のすべて)
+static void apic_send(CPUx86 *cpu, uint32 dest, int logical, int shorthand, int mode, int vector)
+{
+	Machine *m = cpu->machine;
+	CPUx86 *target;
+	int i;
+
+	for (i=0; i<m->cpu_count; i++) {
+		target = m->cpu[i];
+		if ((shorthand==0 && !apic_match(target, dest, logical)) || (shorthand==1 && target!=cpu) || (shorthand==3 && target==cpu)) {
+			continue;
+		}
+		apic_deliver(target, mode, vector);
+		// 最低優先度はどれか1つに送る
+		if (mode==APIC_DM_LOWEST) {
+			break;
+		}
+	}
+}
+
+// x2APICのレジスタを読む(読めなければ0を返す)
+static int apic_read(CPUx86 *cpu, uint32 msr, uint64 *val)
+{
+	Apic *apic = &(cpu->apic);
+
+	switch (msr) {
+	case 0x802:	// ID
+		*val = apic->id;
+		break;
+	case 0x803:	// Version
+		*val = APIC_VERSION;
+		break;
+	case 0x808:	// TPR
+		*val = apic->tpr;
+		break;
+	case 0x80A:	// PPR
+		*val = apic_ppr(apic);
+		break;
+	case 0x80D:	// LDR
+		*val = (apic->id >> 4) << 16 | 1U << (apic->id & 15);
+		break;
+	case 0x80F:	// SVR
+		*val = apic->svr;
+		break;
+	case 0x828:	// ESR
+		*val = apic->esr;
+		break;
+	case 0x830:	// ICR
+		*val = apic->icr;
+		break;
+	case 0x832:	// LVT Timer
+	case 0x833:	// LVT Thermal
+	case 0x834:	// LVT Performance Counter
+	case 0x835:	// LVT LINT0
+	case 0x836:	// LVT LINT1
+	case 0x837:	// LVT Error
+		*val = apic->lvt[msr - 0x832];
+		break;
+	case 0x838:	// Initial Count
+		*val = apic->timer_initial;
+		break;
+	case 0x839:	// Current Count
+		*val = apic_timer_count(cpu);
+		break;
+	case 0x83E:	// Divide Configuration
+		*val = apic->timer_divide;
+		break;
+	default:
+		if (0x810 <= msr && msr < 0x818) {
+			// ISR
+			*val = apic->isr[msr - 0x810];
+		} else if (0x818 <= msr && msr < 0x820) {
+			// TMR(エッジトリガのみ)
+			*val = 0;
+		} else if (0x820 <= msr && msr < 0x828) {
+			// IRR
+			*val = __atomic_load_n(&(apic->irr[msr - 0x820]), __ATOMIC_ACQUIRE);
+		} else {
+			return 0;
+		}
+		break;
+	}
+	return 1;
+}
+
+// x2APICのレジスタに書く(書けなければ0を返す)
+static int apic_write(CPUx86 *cpu, uint32 msr, uint64 val)
+{
+	Apic *apic = &(cpu->apic);
+
+	switch (msr) {
+	case 0x808:	// TPR
+		apic->tpr = val & 0xFF;
+		break;
+	case 0x80B:	// EOI
+		if (val!=0) {
+			return 0;
+		}
+		apic_eoi(apic);
+		break;
+	case 0x80F:	// SVR
+		apic->svr = val & 0x1FF;
+		break;
+	case 0x828:	// ESR
+		apic->esr = 0;
+		break;
+	case 0x830:	// ICR(宛先はEDX)
+		apic->icr = val;
+		// INITのデアサートは何もしない
+		if ((val >> 8 & 7)==APIC_DM_INIT && !(val & APIC_LEVEL_ASSERT)) {
+			break;
+		}
+		apic_send(cpu, val >> 32, (val & APIC_DEST_LOGICAL)!=0, val >> 18 & 3, val >> 8 & 7, val & 0xFF);
+		break;
+	case 0x832:	// LVT Timer(TSCデッドラインモードはない)
+		apic->lvt[0] = val & (0xFF | APIC_LVT_MASKED | APIC_LVT_PERIODIC);
+		break;
+	case 0x833:	// LVT Thermal
+	case 0x834:	// LVT Performance Counter
+	case 0x835:	// LVT LINT0
+	case 0x836:	// LVT LINT1
+	case 0x837:	// LVT Error
+		apic->lvt[msr - 0x832] = val & 0x1A7FF;
+		break;
+	case 0x838:	// Initial Count
+		apic_timer_start(cpu, val);
+		break;
+	case 0x83E:	// Divide Configuration
+		apic->timer_divide = val & 0x0B;
+		break;
+	case 0x83F:	// SELF IPI
+		apic_set_irq(cpu, val & 0xFF);
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+// IA32_APIC_BASEとx2APICのレジスタ(ローカルAPICはSMPのときだけ)
+static int apic_msr_read(CPUx86 *cpu, uint32 msr, uint64 *val)
+{
+	Apic *apic = &(cpu->apic);
+
+	if (cpu->machine==NULL) {
+		return 0;
+	}
+	if (msr==MSR_APIC_BASE) {
+		*val = apic->base;
+		return 1;
+	}
+	if (msr < MSR_X2APIC || MSR_X2APIC + 0xFF < msr || (apic->base & (APIC_BASE_EN | APIC_BASE_EXTD))!=(APIC_BASE_EN | APIC_BASE_EXTD)) {
+		return 0;
+	}
+	return apic_read(cpu, msr, val);
+}
+
+static int apic_msr_write(CPUx86 *cpu, uint32 msr, uint64 val)
+{
+	Apic *apic = &(cpu->apic);
+
+	if (cpu->machine==NULL) {
+		return 0;
+	}
+	if (msr==MSR_APIC_BASE) {
+		// ENとEXTDだけ変えられる(EXTDだけは不正)
+		if ((val & (APIC_BASE_EN | APIC_BASE_EXTD))==APIC_BASE_EXTD) {
+			return 0;
+		}
+		apic->base = (apic->base & ~(uint64)(APIC_BASE_EN | APIC_BASE_EXTD)) | (val & (APIC_BASE_EN | APIC_BASE_EXTD));
+		return 1;
+	}
+	if (msr < MSR_X2APIC || MSR_X2APIC + 0xFF < msr || (apic->base & (APIC_BASE_EN | APIC_BASE_EXTD))!=(APIC_BASE_EN | APIC_BASE_EXTD)) {
+		return 0;
+	}
+	return apic_write(cpu, msr, val);
+}
+
+
+// io apic
+
+static uint32 ioapic_read(IoApic *io)
+{
+	int pin;
+
+	switch (io->index) {
+	case 0x00:	// ID
+	case 0x02:	// Arbitration
+		return io->id << 24;
+	case 0x01:	// Version
+		return (IOAPIC_PINS - 1) << 16 | IOAPIC_VERSION;
+	}
+	if (0x10 <= io->index && io->index < 0x10 + IOAPIC_PINS * 2) {
+		pin = (io->index - 0x10) >> 1;
+		return (io->index & 1) ? io->redir[pin] >> 32 : (uint32)io->redir[pin];
+	}
+	return 0;
+}
+
+static void ioapic_write(IoApic *io, uint32 val)
+{
+	int pin;
+
+	if (io->index==0x00) {
+		io->id = val >> 24 & 0x0F;
+		return;
+	}
+	if (0x10 <= io->index && io->index < 0x10 + IOAPIC_PINS * 2) {
+		pin = (io->index - 0x10) >> 1;
+		if (io->index & 1) {
+			io->redir[pin] = (uint64)(val & 0xFF000000) << 32 | (uint32)io->redir[pin];
+		} else {
+			// Delivery StatusとRemote IRRは読み出しのみ
+			io->redir[pin] = (io->redir[pin] & 0xFFFFFFFF00000000ULL) | (val & ~0x5000);
+		}
+	}
+}
+
+static uint32 ioapic_in(CPUx86 *cpu, void *opaque, uint16 port, int size)
+{
+	IoApic *io = opaque;
+
+	if (port - IOAPIC_PORT < 4) {
+		return io->index;
+	}
+	return ioapic_read(io);
+}
+
+static void ioapic_out(CPUx86 *cpu, void *opaque, uint16 port, int size, uint32 val)
+{
+	IoApic *io = opaque;
+
+	if (port - IOAPIC_PORT < 4) {
+		io->index = val;
+		return;
+	}
+	ioapic_write(io, val);
+}
+
+// ISAのIRQnをピンnにつなぐ(pic_set_irqから、io_lockを持って呼ぶ)
+// レベルトリガのピンもエッジトリガとして立ち上がりで送る
+void ioapic_set_irq(CPUx86 *cpu, int irq, int level)
+{
+	IoApic *io = &(cpu->machine->ioapic);
+	uint32 bit = 1U << irq;
+	uint64 redir;
+	uint32 dest;
+
+	if (!level) {
+		io->level &= ~bit;
+		return;
+	}
+	if (io->level & bit) {
+		return;
+	}
+	io->level |= bit;
+	redir = io->redir[irq];
+	if (redir & IOAPIC_MASKED) {
+		return;
+	}
+	// 8bitの宛先(論理はフラットモデル、0xFFはブロードキャスト)をx2APICの宛先にする
+	dest = redir >> 56;
+	apic_send(cpu, dest==0xFF ? APIC_BROADCAST : dest, (redir & APIC_DEST_LOGICAL)!=0, 0, redir >> 8 & 7, redir & 0xFF);
+}
+
+// BSPのデバイスに登録する(IDはAPIC IDの後ろ)
+void ioapic_init(CPUx86 *cpu)
+{
+	IoApic *io = &(cpu->machine->ioapic);
+	int i;
+
+	memset(io, 0, sizeof(IoApic));
+	io->id = cpu->machine->cpu_count;
+	for (i=0; i<IOAPIC_PINS; i++) {
+		io->redir[i] = IOAPIC_MASKED;
+	}
+	io_register(cpu, IOAPIC_PORT, IOAPIC_PORTS, ioapic_in, ioapic_out, io);
+}
+
+
+// msr
+
+// CPL0のみ(MSRがなければ#UD)
+static int msr_allowed(CPUx86 *cpu)
+{
+	if (!cpu_feature(cpu, CPUID_MSR)) {
+		cpu_fault(cpu, EXC_UD, 0);
+		return 0;
+	}
+	if (cpu_cr0(cpu, CR0_PE) && (cpu->cpl!=0 || (cpu->eflags & CPU_EFLAGS_VM))) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return 0;
+	}
+	return 1;
+}
+
+// 0F 32 : rdmsr(ECXのMSRをEDX:EAXに読む)
+void opcode_rdmsr(CPUx86 *cpu)
+{
+	uint32 msr;
+	uint64 val;
+
+	if (!msr_allowed(cpu)) {
+		return;
+	}
+	msr = cpu_regist_ecx(cpu);
+	if (msr==MSR_TSC) {
+		val = clock_tsc(cpu);
+		if (cpu->replay_mode) {
+			val = replay_tsc(cpu, val);
+		}
+	} else if (!apic_msr_read(cpu, msr, &val)) {
+		log_info("rdmsr: unknown msr 0x%X\n", msr);
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
+	}
+	cpu_regist_eax(cpu) = val & 0xFFFFFFFF;
+	cpu_regist_edx(cpu) = val >> 32;
+}
+
+// 0F 30 : wrmsr(EDX:EAXをECXのMSRに書く)
+void opcode_wrmsr(CPUx86 *cpu)
+{
+	uint32 msr;
+	uint64 val;
+
+	if (!msr_allowed(cpu)) {
+		return;
+	}
+	msr = cpu_regist_ecx(cpu);
+	val = (uint64)cpu_regist_edx(cpu) << 32 | cpu_regist_eax(cpu);
+	if (msr==MSR_TSC) {
+		// 仮想クロックは戻せないので書き込みは無視する
+		log_info("wrmsr: TSC write ignored\n");
+		return;
+	}
+	if (!apic_msr_write(cpu, msr, val)) {
+		log_info("wrmsr: unknown msr 0x%X\n", msr);
+		cpu_fault(cpu, EXC_GP, 0);
+	}
+}
@@ -0,0 +1,796 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "cpux86.h"
+#include "blk.h"
+#include "log.h"
+
+
+// ブロックデバイス
+//   イメージ形式(BlkFormat)、非同期I/O(io_uringまたはスレッドプール)、virtio-blk
+
+
+// raw
+
+static int raw_probe(const uint8 *buf, int len)
+{
+	return 1;
+}
+
+static int raw_open(BlkImage *img, const char *fname, int readonly)
+{
+	off_t size;
+
+	img->fd = open(fname, readonly ? O_RDONLY : O_RDWR);
+	if (img->fd < 0) {
+		return 0;
+	}
+	size = lseek(img->fd, 0, SEEK_END);
+	if (size < 0) {
+		close(img->fd);
+		return 0;
+	}
+	img->size = size;
+	return 1;
+}
+
+static ssize_t raw_preadv(BlkImage *img, const struct iovec *iov, int iovcnt, uint64 offset)
+{
+	return preadv(img->fd, iov, iovcnt, offset);
+}
+
+static ssize_t raw_pwritev(BlkImage *img, const struct iovec *iov, int iovcnt, uint64 offset)
+{
+	return pwritev(img->fd, iov, iovcnt, offset);
+}
+
+static int raw_flush(BlkImage *img)
+{
+	return fdatasync(img->fd);
+}
+
+static void raw_close(BlkImage *img)
+{
+	close(img->fd);
+}
+
+const BlkFormat blk_format_raw = {"raw", raw_probe, raw_open, raw_preadv, raw_pwritev, raw_flush, raw_close, 1};
+
+
+// image
+
+// 先頭から形式を決める(どれでもなければraw)
+static const BlkFormat *blk_formats[] = {&blk_format_cow, &blk_format_raw};
+
+int blk_open(BlkImage *img, const char *fname, int readonly)
+{
+	uint8 buf[BLK_SECTOR];
+	int len;
+	int fd;
+	int i;
+
+	memset(img, 0, sizeof(BlkImage));
+	img->fd = -1;
+	img->readonly = readonly;
+	fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		log_warning("blk: cannot open %s: %s\n", fname, strerror(errno));
+		return 0;
+	}
+	len = pread(fd, buf, sizeof(buf), 0);
+	close(fd);
+	for (i=0; i<sizeof(blk_formats) / sizeof(blk_formats[0]); i++) {
+		if (blk_formats[i]->probe(buf, len < 0 ? 0 : len)) {
+			img->format = blk_formats[i];
+			break;
+		}
+	}
+	if (!img->format->open(img, fname, readonly)) {
+		log_warning("blk: cannot open %s: %s\n", fname, strerror(errno));
+		img->format = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+void blk_close(BlkImage *img)
+{
+	if (img->format) {
+		img->format->close(img);
+		img->format = NULL;
+	}
+}
+
+
+// thread pool
+
+// ワーカーのスレッドで同期的に読み書きする
+static void blk_aio_do(BlkImage *img, BlkRequest *req)
+{
+	switch (req->op) {
+	case BLK_OP_READ:
+		req->result = img->format->preadv(img, req->iov, req->iovcnt, req->offset);
+		break;
+	case BLK_OP_WRITE:
+		req->result = img->format->pwritev(img, req->iov, req->iovcnt, req->offset);
+		break;
+	case BLK_OP_FLUSH:
+		req->result = img->format->flush(img);
+		break;
+	}
+	if (req->result < 0) {
+		req->result = -errno;
+	}
+}
+
+static void blk_aio_wake(BlkAio *aio)
+{
+	uint64 one = 1;
+
+	if (write(aio->wake_fd, &one, sizeof(one)) < 0) {
+		// 起こせなくてもスライスの区切りで受け取る
+	}
+}
+
+static void* blk_worker(void *arg)
+{
+	BlkAio *aio = arg;
+	BlkRequest *req;
+
+	pthread_mutex_lock(&(aio->lock));
+	for (;;) {
+		while (aio->queue==NULL && !aio->stop) {
+			pthread_cond_wait(&(aio->cond), &(aio->lock));
+		}
+		if (aio->queue==NULL) {
+			break;
+		}
+		req = aio->queue;
+		aio->queue = req->next;
+		if (aio->queue==NULL) {
+			aio->queue_tail = &(aio->queue);
+		}
+		pthread_mutex_unlock(&(aio->lock));
+
+		blk_aio_do(aio->img, req);
+
+		pthread_mutex_lock(&(aio->lock));
+		req->next = aio->done;
+		aio->done = req;
+		aio->completed++;
+		pthread_cond_signal(&(aio->done_cond));
+		blk_aio_wake(aio);
+	}
+	pthread_mutex_unlock(&(aio->lock));
+	return NULL;
+}
+
+static int blk_threads_init(BlkAio *aio)
+{
+	int i;
+
+	pthread_mutex_init(&(aio->lock), NULL);
+	pthread_cond_init(&(aio->cond), NULL);
+	pthread_cond_init(&(aio->done_cond), NULL);
+	aio->queue_tail = &(aio->queue);
+	for (i=0; i<BLK_THREADS; i++) {
+		if (pthread_create(&(aio->threads[i]), NULL, blk_worker, aio)) {
+			log_error("blk: cannot create worker thread\n");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+// io_uring(liburingは使わずにシステムコールで)
+
+static void blk_uring_delete(BlkAio *aio)
+{
+	if (aio->sqes) {
+		munmap(aio->sqes, aio->sqes_size);
+	}
+	if (aio->cq_ring && aio->cq_ring!=aio->sq_ring) {
+		munmap(aio->cq_ring, aio->cq_ring_size);
+	}
+	if (aio->sq_ring) {
+		munmap(aio->sq_ring, aio->sq_ring_size);
+	}
+	close(aio->ring_fd);
+	aio->ring_fd = -1;
+}
+
+static int blk_uring_init(BlkAio *aio)
+{
+	struct io_uring_params params;
+	uint8 *sq;
+	uint8 *cq;
+
+	memset(&params, 0, sizeof(params));
+	aio->ring_fd = syscall(__NR_io_uring_setup, VIRTQ_NUM, &params);
+	if (aio->ring_fd < 0) {
+		return 0;
+	}
+
+	aio->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32);
+	aio->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (aio->sq_ring_size < aio->cq_ring_size) {
+			aio->sq_ring_size = aio->cq_ring_size;
+		}
+		aio->cq_ring_size = 0;
+	}
+	aio->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	sq = mmap(NULL, aio->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_SQ_RING);
+	if (sq==MAP_FAILED) {
+		close(aio->ring_fd);
+		return 0;
+	}
+	cq = sq;
+	if (aio->cq_ring_size) {
+		cq = mmap(NULL, aio->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_CQ_RING);
+		if (cq==MAP_FAILED) {
+			munmap(sq, aio->sq_ring_size);
+			close(aio->ring_fd);
+			return 0;
+		}
+	}
+	aio->sqes = mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_SQES);
+	if (aio->sqes==MAP_FAILED) {
+		if (cq!=sq) {
+			munmap(cq, aio->cq_ring_size);
+		}
+		munmap(sq, aio->sq_ring_size);
+		close(aio->ring_fd);
+		return 0;
+	}
+	aio->sq_ring = sq;
+	aio->cq_ring = cq;
+	aio->sq_tail = (uint32*)(sq + params.sq_off.tail);
+	aio->sq_mask = (uint32*)(sq + params.sq_off.ring_mask);
+	aio->sq_array = (uint32*)(sq + params.sq_off.array);
+	aio->cq_head = (uint32*)(cq + params.cq_off.head);
+	aio->cq_tail = (uint32*)(cq + params.cq_off.tail);
+	aio->cq_mask = (uint32*)(cq + params.cq_off.ring_mask);
+	aio->cqes = cq + params.cq_off.cqes;
+
+	// 完了をeventfdで知らせる(HLTで待っているvCPUを起こす)
+	if (syscall(__NR_io_uring_register, aio->ring_fd, IORING_REGISTER_EVENTFD, &(aio->wake_fd), 1) < 0) {
+		blk_uring_delete(aio);
+		return 0;
+	}
+	return 1;
+}
+
+static void blk_uring_prep(BlkAio *aio, BlkRequest *req)
+{
+	struct io_uring_sqe *sqe;
+	uint32 tail;
+	uint32 index;
+
+	tail = *(aio->sq_tail);
+	index = tail & *(aio->sq_mask);
+	sqe = &(((struct io_uring_sqe*)aio->sqes)[index]);
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	switch (req->op) {
+	case BLK_OP_READ:
+		sqe->opcode = IORING_OP_READV;
+		break;
+	case BLK_OP_WRITE:
+		sqe->opcode = IORING_OP_WRITEV;
+		break;
+	case BLK_OP_FLUSH:
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		break;
+	}
+	sqe->fd = aio->img->fd;
+	if (req->op!=BLK_OP_FLUSH) {
+		sqe->addr = (uint64)(uintptr_t)req->iov;
+		sqe->len = req->iovcnt;
+		sqe->off = req->offset;
+	}
+	sqe->user_data = (uint64)(uintptr_t)req;
+	aio->sq_array[index] = index;
+	__atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	aio->pending++;
+}
+
+static int blk_uring_enter(BlkAio *aio, int min_complete)
+{
+	int ret;
+
+	ret = syscall(__NR_io_uring_enter, aio->ring_fd, aio->pending, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (ret < 0) {
+		if (errno!=EAGAIN && errno!=EBUSY && errno!=EINTR) {
+			log_warning("blk: io_uring_enter: %s\n", strerror(errno));
+		}
+		return 0;
+	}
+	aio->pending -= ret;
+	return 1;
+}
+
+static BlkRequest* blk_uring_reap(BlkAio *aio)
+{
+	struct io_uring_cqe *cqe;
+	BlkRequest *list = NULL;
+	BlkRequest *req;
+	uint32 head;
+	uint32 tail;
+
+	head = *(aio->cq_head);
+	tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+	while (head!=tail) {
+		cqe = &(((struct io_uring_cqe*)aio->cqes)[head & *(aio->cq_mask)]);
+		req = (BlkRequest*)(uintptr_t)cqe->user_data;
+		req->result = cqe->res;
+		req->next = list;
+		list = req;
+		aio->inflight--;
+		head++;
+	}
+	__atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+	return list;
+}
+
+
+// aio
+
+// VCPU_BLK_AIO=threadsならio_uringを使わない
+int blk_aio_init(BlkAio *aio, BlkImage *img, int wake_fd)
+{
+	char *env;
+
+	memset(aio, 0, sizeof(BlkAio));
+	aio->img = img;
+	aio->wake_fd = wake_fd;
+	aio->ring_fd = -1;
+	env = getenv("VCPU_BLK_AIO");
+	if (img->format->direct && !(env && strcmp(env, "threads")==0) && blk_uring_init(aio)) {
+		aio->mode = BLK_AIO_URING;
+		return 1;
+	}
+	aio->mode = BLK_AIO_THREADS;
+	return blk_threads_init(aio);
+}
+
+void blk_aio_delete(BlkAio *aio)
+{
+	int i;
+
+	if (aio->mode==BLK_AIO_THREADS) {
+		pthread_mutex_lock(&(aio->lock));
+		aio->stop = 1;
+		pthread_cond_broadcast(&(aio->cond));
+		pthread_mutex_unlock(&(aio->lock));
+		for (i=0; i<BLK_THREADS; i++) {
+			if (aio->threads[i]) {
+				pthread_join(aio->threads[i], NULL);
+			}
+		}
+		pthread_mutex_destroy(&(aio->lock));
+		pthread_cond_destroy(&(aio->cond));
+		pthread_cond_destroy(&(aio->done_cond));
+		return;
+	}
+	if (0 <= aio->ring_fd) {
+		blk_uring_delete(aio);
+	}
+}
+
+// 要求をためる(blk_aio_flushでまとめて投げる)
+void blk_aio_submit(BlkAio *aio, BlkRequest *req)
+{
+	aio->inflight++;
+	if (aio->mode==BLK_AIO_URING) {
+		blk_uring_prep(aio, req);
+		return;
+	}
+	pthread_mutex_lock(&(aio->lock));
+	req->next = NULL;
+	*(aio->queue_tail) = req;
+	aio->queue_tail = &(req->next);
+	pthread_mutex_unlock(&(aio->lock));
+}
+
+void blk_aio_flush(BlkAio *aio)
+{
+	if (aio->mode==BLK_AIO_URING) {
+		if (aio->pending) {
+			blk_uring_enter(aio, 0);
+		}
+		return;
+	}
+	pthread_mutex_lock(&(aio->lock));
+	pthread_cond_broadcast(&(aio->cond));
+	pthread_mutex_unlock(&(aio->lock));
+}
+
+// 終わった要求を返す(waitなら投げた要求がすべて終わるまで待つ)
+BlkRequest* blk_aio_reap(BlkAio *aio, int wait)
+{
+	BlkRequest *list;
+	BlkRequest *req;
+
+	if (aio->mode==BLK_AIO_URING) {
+		if (aio->pending) {
+			blk_uring_enter(aio, 0);
+		}
+		if (wait && aio->inflight) {
+			blk_uring_enter(aio, aio->inflight);
+		}
+		return blk_uring_reap(aio);
+	}
+
+	pthread_mutex_lock(&(aio->lock));
+	if (wait) {
+		while (aio->completed < aio->inflight) {
+			pthread_cond_wait(&(aio->done_cond), &(aio->lock));
+		}
+	}
+	list = aio->done;
+	for (req=list; req; req=req->next) {
+		aio->inflight--;
+	}
+	aio->done = NULL;
+	aio->completed = 0;
+	pthread_mutex_unlock(&(aio->lock));
+	return list;
+}
+
+
+// virtio-blk
+
+static uint32 vblk_host_features(VirtioBlk *blk)
+{
+	uint32 features;
+
+	features = VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_FLUSH;
+	if (blk->image.readonly) {
+		features |= VIRTIO_BLK_F_RO;
+	}
+	return features;
+}
+
+static void vblk_config(VirtioBlk *blk, uint8 *config)
+{
+	memset(config, 0, VIRTIO_PORTS - VIRTIO_CONFIG);
+	*(uint64*)(config + VIRTIO_BLK_CAPACITY) = blk->image.size / BLK_SECTOR;
+	*(uint32*)(config + VIRTIO_BLK_SEG_MAX) = VIRTQ_SEG_MAX - 2;
+	*(uint32*)(config + VIRTIO_BLK_BLK_SIZE) = BLK_SECTOR;
+}
+
+// 要求を終わらせてusedに返す(割り込みはまとめて上げる)
+static void vblk_complete(CPUx86 *cpu, VirtioBlk *blk, uint16 head, uint32 status_addr, int status, uint32 len)
+{
+	cpu->mem[status_addr] = status;
+	// 短い転送でもステータスは記録する
+	replay_dma(cpu, status_addr, 1);
+	virtq_push(cpu, &(blk->vq), head, len + 1);
+	if (status!=VIRTIO_BLK_S_OK) {
+		blk->stat_errors++;
+	}
+}
+
+static void vblk_interrupt(CPUx86 *cpu, VirtioBlk *blk)
+{
+	if (virtq_interrupt(cpu, &(blk->vq))) {
+		blk->isr |= 1;
+		pic_set_irq(cpu, BLK_IRQ, 1);
+		pic_set_irq(cpu, BLK_IRQ, 0);
+	}
+}
+
+// 1つの要求を読んで投げる(すぐ終わるものは0を返す)
+static int vblk_request(CPUx86 *cpu, VirtioBlk *blk, VirtqElem *elem)
+{
+	BlkRequest *req;
+	VirtqSeg *hdr;
+	VirtqSeg *status;
+	uint32 type;
+	uint64 sector;
+	char id[VIRTIO_BLK_ID_BYTES];
+	int i;
+
+	hdr = &(elem->seg[0]);
+	status = &(elem->seg[elem->count - 1]);
+	if (elem->count < 2 || hdr->write || hdr->len < 16 || !status->write || status->len < 1) {
+		log_warning("vblk: malformed request %d\n", elem->head);
+		virtq_push(cpu, &(blk->vq), elem->head, 0);
+		blk->stat_errors++;
+		return 0;
+	}
+	type = *(uint32*)(cpu->mem + hdr->addr);
+	sector = *(uint64*)(cpu->mem + hdr->addr + 8);
+	status->addr += status->len - 1;
+
+	req = blk->free;
+	req->head = elem->head;
+	req->status = status->addr;
+	req->offset = sector * BLK_SECTOR;
+	req->iovcnt = 0;
+	req->len = 0;
+	for (i=1; i<elem->count - 1; i++) {
+		if (elem->seg[i].write!=(type==VIRTIO_BLK_T_IN || type==VIRTIO_BLK_T_GET_ID)) {
+			vblk_complete(cpu, blk, elem->head, status->addr, VIRTIO_BLK_S_IOERR, 0);
+			return 0;
+		}
+		req->iov[req->iovcnt].iov_base = cpu->mem + elem->seg[i].addr;
+		req->iov[req->iovcnt].iov_len = elem->seg[i].len;
+		req->iovcnt++;
+		req->len += elem->seg[i].len;
+	}
+
+	switch (type) {
+	case VIRTIO_BLK_T_IN:
+	case VIRTIO_BLK_T_OUT:
+		if (req->len % BLK_SECTOR || blk->image.size / BLK_SECTOR < sector || blk->image.size < req->offset + req->len) {
+			vblk_complete(cpu, blk, elem->head, status->addr, VIRTIO_BLK_S_IOERR, 0);
+			return 0;
+		}
+		if (type==VIRTIO_BLK_T_OUT && blk->image.readonly) {
+			vblk_complete(cpu, blk, elem->head, status->addr, VIRTIO_BLK_S_IOERR, 0);
+			return 0;
+		}
+		if (type==VIRTIO_BLK_T_IN) {
+			// aioのスレッドが直接書くので、終わるまでそのページは翻訳しない
+			for (i=1; i<elem->count - 1; i++) {
+				jit_dma_begin(cpu, elem->seg[i].addr, elem->seg[i].len);
+			}
+		}
+		req->op = type==VIRTIO_BLK_T_IN ? BLK_OP_READ : BLK_OP_WRITE;
+		break;
+	case VIRTIO_BLK_T_FLUSH:
+		req->op = BLK_OP_FLUSH;
+		req->len = 0;
+		break;
+	case VIRTIO_BLK_T_GET_ID:
+		memset(id, 0, sizeof(id));
+		snprintf(id, sizeof(id), "vcpu-blk");
+		if (req->iovcnt==0) {
+			vblk_complete(cpu, blk, elem->head, status->addr, VIRTIO_BLK_S_IOERR, 0);
+			return 0;
+		}
+		i = req->iov[0].iov_len < sizeof(id) ? req->iov[0].iov_len : sizeof(id);
+		memcpy(req->iov[0].iov_base, id, i);
+		vblk_complete(cpu, blk, elem->head, status->addr, VIRTIO_BLK_S_OK, i);
+		return 0;
+	default:
+		vblk_complete(cpu, blk, elem->head, status->addr, VIRTIO_BLK_S_UNSUPP, 0);
+		return 0;
+	}
+
+	blk->free = req->next;
+	blk_aio_submit(&(blk->aio), req);
+	blk->stat_requests++;
+	blk->stat_bytes += req->len;
+	return 1;
+}
+
+// availの要求をまとめて投げる(空きがなければ残りは次のvblk_pollで)
+static void vblk_kick(CPUx86 *cpu, VirtioBlk *blk)
+{
+	VirtqElem elem;
+	int submitted = 0;
+	int completed = 0;
+	int ret;
+
+	if (!(blk->status & VIRTIO_STATUS_DRIVER_OK)) {
+		return;
+	}
+	while (blk->free) {
+		ret = virtq_pop(cpu, &(blk->vq), &elem);
+		if (ret==0) {
+			break;
+		}
+		if (ret < 0) {
+			virtq_push(cpu, &(blk->vq), elem.head, 0);
+			blk->stat_errors++;
+			completed++;
+			continue;
+		}
+		if (vblk_request(cpu, blk, &elem)) {
+			submitted++;
+		} else {
+			completed++;
+		}
+	}
+	if (submitted) {
+		blk_aio_flush(&(blk->aio));
+		blk->stat_batches++;
+	}
+	if (completed) {
+		vblk_interrupt(cpu, blk);
+	}
+}
+
+// 終わった読み込みのページを翻訳できるように戻す
+static void vblk_dma_end(CPUx86 *cpu, BlkRequest *req)
+{
+	int i;
+
+	if (req->op!=BLK_OP_READ) {
+		return;
+	}
+	for (i=0; i<req->iovcnt; i++) {
+		jit_dma_end(cpu, (uint8*)req->iov[i].iov_base - cpu->mem, req->iov[i].iov_len);
+	}
+}
+
+// 投げた要求がなくなるまで待ってからリセットする
+static void vblk_reset(CPUx86 *cpu, VirtioBlk *blk)
+{
+	BlkRequest *req;
+	BlkRequest *next;
+	int i;
+
+	for (req=blk_aio_reap(&(blk->aio), 1); req; req=next) {
+		next = req->next;
+		vblk_dma_end(cpu, req);
+	}
+	virtq_reset(&(blk->vq));
+	blk->guest_features = 0;
+	blk->queue_sel = 0;
+	blk->status = 0;
+	blk->isr = 0;
+	blk->free = NULL;
+	for (i=VIRTQ_NUM-1; 0<=i; i--) {
+		blk->req[i].next = blk->free;
+		blk->free = &(blk->req[i]);
+	}
+}
+
+static uint32 vblk_in(CPUx86 *cpu, void *opaque, uint16 port, int size)
+{
+	VirtioBlk *blk = opaque;
+	uint8 config[VIRTIO_PORTS - VIRTIO_CONFIG];
+	uint32 offset;
+	uint32 val;
+
+	offset = port - BLK_PORT;
+	switch (offset) {
+	case VIRTIO_HOST_FEATURES:
+		return vblk_host_features(blk);
+	case VIRTIO_GUEST_FEATURES:
+		return blk->guest_features;
+	case VIRTIO_QUEUE_PFN:
+		return blk->queue_sel==0 ? blk->vq.pfn : 0;
+	case VIRTIO_QUEUE_NUM:
+		return blk->queue_sel==0 ? VIRTQ_NUM : 0;
+	case VIRTIO_QUEUE_SEL:
+		return blk->queue_sel;
+	case VIRTIO_STATUS:
+		return blk->status;
+	case VIRTIO_ISR:
+		val = blk->isr;
+		blk->isr = 0;
+		return val;
+	}
+	if (VIRTIO_CONFIG <= offset && offset + size <= VIRTIO_PORTS) {
+		vblk_config(blk, config);
+		val = 0;
+		memcpy(&val, config + offset - VIRTIO_CONFIG, size);
+		return val;
+	}
+	return 0xFFFFFFFF;
+}
+
+static void vblk_out(CPUx86 *cpu, void *opaque, uint16 port, int size, uint32 val)
+{
+	VirtioBlk *blk = opaque;
+
+	switch (port - BLK_PORT) {
+	case VIRTIO_GUEST_FEATURES:
+		blk->guest_features = val & vblk_host_features(blk);
+		break;
+	case VIRTIO_QUEUE_PFN:
+		if (blk->queue_sel==0 && !virtq_set_pfn(cpu, &(blk->vq), val)) {
+			blk->status |= VIRTIO_STATUS_FAILED;
+		}
+		break;
+	case VIRTIO_QUEUE_SEL:
+		blk->queue_sel = val;
+		break;
+	case VIRTIO_QUEUE_NOTIFY:
+		if (val==0) {
+			vblk_kick(cpu, blk);
+		}
+		break;
+	case VIRTIO_STATUS:
+		if ((val & 0xFF)==0) {
+			vblk_reset(cpu, blk);
+		} else {
+			blk->status = val;
+		}
+		break;
+	}
+}
+
+// ポート0xC000~0xC03Fにvirtio-blkをつなぐ
+int vblk_attach(CPUx86 *cpu, const char *fname, int readonly)
+{
+	VirtioBlk *blk;
+
+	if (cpu->blk) {
+		log_warning("vblk: already attached\n");
+		return 0;
+	}
+	blk = calloc(1, sizeof(VirtioBlk));
+	if (blk==NULL) {
+		return 0;
+	}
+	if (!blk_open(&(blk->image), fname, readonly)) {
+		free(blk);
+		return 0;
+	}
+	if (!blk_aio_init(&(blk->aio), &(blk->image), cpu->wake_fd)) {
+		blk_close(&(blk->image));
+		free(blk);
+		return 0;
+	}
+	vblk_reset(cpu, blk);
+	io_register(cpu, BLK_PORT, VIRTIO_PORTS, vblk_in, vblk_out, blk);
+	cpu->blk = blk;
+	log_info("vblk: %s %llu sectors (%s, %s)\n", fname, blk->image.size / BLK_SECTOR, blk->image.format->name, blk->aio.mode==BLK_AIO_URING ? "io_uring" : "threads");
+	return 1;
+}
+
+void vblk_delete(CPUx86 *cpu)
+{
+	VirtioBlk *blk = cpu->blk;
+
+	if (blk==NULL) {
+		return;
+	}
+	blk_aio_reap(&(blk->aio), 1);
+	blk_aio_delete(&(blk->aio));
+	blk_close(&(blk->image));
+	free(blk);
+	cpu->blk = NULL;
+}
+
+// スライスの区切りで終わった要求をusedに返す
+// CLOCK_MODE_DETERMINISTICは投げた要求が終わるまで待つ(終わる時刻を命令数で決める)
+void vblk_poll(CPUx86 *cpu)
+{
+	VirtioBlk *blk = cpu->blk;
+	BlkRequest *req;
+	BlkRequest *next;
+	int status;
+	int completed = 0;
+
+	if (blk->aio.inflight==0) {
+		return;
+	}
+	for (req=blk_aio_reap(&(blk->aio), cpu->clock.mode==CLOCK_MODE_DETERMINISTIC); req; req=next) {
+		next = req->next;
+		vblk_dma_end(cpu, req);
+		status = req->result==req->len || (req->op==BLK_OP_FLUSH && req->result==0) ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+		if (status!=VIRTIO_BLK_S_OK) {
+			log_warning("vblk: request %d failed: %s\n", req->head, req->result < 0 ? strerror(-req->result) : "short");
+		}
+		vblk_complete(cpu, blk, req->head, req->status, status, req->op==BLK_OP_READ ? req->len : 0);
+		req->next = blk->free;
+		blk->free = req;
+		completed++;
+	}
+	if (completed) {
+		vblk_interrupt(cpu, blk);
+		// 空きを待っていた要求
+		vblk_kick(cpu, blk);
+	}
+}
+
+int vblk_busy(CPUx86 *cpu)
+{
+	return cpu->blk && cpu->blk->aio.inflight;
+}
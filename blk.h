@@ -0,0 +1,162 @@
+#ifndef BLK_H
+#define BLK_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "cpux86.h"
+#include "virtio.h"
+
+
+// ブロックデバイス(virtio-blk、I/Oポート0xC000、IRQ11)
+
+#define BLK_SECTOR		512
+#define BLK_THREADS		4			// スレッドプールのワーカー数
+#define BLK_PORT		0xC000
+#define BLK_IRQ			11
+
+// virtio-blk
+#define VIRTIO_BLK_F_SEG_MAX	0x00000004
+#define VIRTIO_BLK_F_RO			0x00000020
+#define VIRTIO_BLK_F_BLK_SIZE	0x00000040
+#define VIRTIO_BLK_F_FLUSH		0x00000200
+
+// 設定(VIRTIO_CONFIGから)
+#define VIRTIO_BLK_CAPACITY		0x00	// 64bit セクタ数
+#define VIRTIO_BLK_SIZE_MAX		0x08
+#define VIRTIO_BLK_SEG_MAX		0x0C
+#define VIRTIO_BLK_BLK_SIZE		0x14
+
+#define VIRTIO_BLK_T_IN			0
+#define VIRTIO_BLK_T_OUT		1
+#define VIRTIO_BLK_T_FLUSH		4
+#define VIRTIO_BLK_T_GET_ID		8
+
+#define VIRTIO_BLK_S_OK			0
+#define VIRTIO_BLK_S_IOERR		1
+#define VIRTIO_BLK_S_UNSUPP		2
+
+#define VIRTIO_BLK_ID_BYTES		20
+
+
+// イメージ形式
+
+typedef struct BlkImage BlkImage;
+
+typedef struct {
+	const char *name;
+	int (*probe)(const uint8 *buf, int len);	// ファイルの先頭を見て自分の形式なら1
+	int (*open)(BlkImage *img, const char *fname, int readonly);
+	ssize_t (*preadv)(BlkImage *img, const struct iovec *iov, int iovcnt, uint64 offset);
+	ssize_t (*pwritev)(BlkImage *img, const struct iovec *iov, int iovcnt, uint64 offset);
+	int (*flush)(BlkImage *img);
+	void (*close)(BlkImage *img);
+	uint8 direct;	// 1: fdのoffsetにそのまま読み書きできる(io_uringで投げられる)
+} BlkFormat;
+
+struct BlkImage {
+	const BlkFormat *format;
+	int fd;
+	uint64 size;		// バイト
+	uint8 readonly;
+	void *opaque;		// 形式ごとの状態(スレッドプールのワーカーから同時に使われる)
+};
+
+
+// 非同期I/O
+//   vCPUのスレッドは要求を投げるだけで待たない
+//   終わった要求はスライスの区切りでvCPUのスレッドが受け取り、usedに返して割り込みを上げる
+
+#define BLK_OP_READ		0
+#define BLK_OP_WRITE	1
+#define BLK_OP_FLUSH	2
+
+typedef struct BlkRequest {
+	int op;
+	uint64 offset;
+	struct iovec iov[VIRTQ_SEG_MAX];	// ゲストのRAMを直接指す
+	int iovcnt;
+	uint32 len;
+	ssize_t result;		// 読み書きしたバイト数(負なら-errno)
+	uint16 head;		// virtqueueの要求
+	uint32 status;		// 状態を書くゲストのアドレス
+	struct BlkRequest *next;
+} BlkRequest;
+
+#define BLK_AIO_THREADS		0
+#define BLK_AIO_URING		1
+
+typedef struct {
+	int mode;
+	BlkImage *img;
+	int wake_fd;		// 終わったら書く(HLTで待っているvCPUを起こす)
+	int inflight;
+
+	// スレッドプール
+	pthread_t threads[BLK_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		// 要求を投げた
+	pthread_cond_t done_cond;	// 要求が終わった
+	BlkRequest *queue;	// 投げた要求
+	BlkRequest **queue_tail;
+	BlkRequest *done;	// 終わった要求
+	int completed;		// doneの数
+	int stop;
+
+	// io_uring
+	int ring_fd;
+	int pending;		// 次のio_uring_enterで投げる数
+	uint8 *sq_ring;
+	size_t sq_ring_size;
+	uint8 *cq_ring;
+	size_t cq_ring_size;
+	void *sqes;
+	size_t sqes_size;
+	uint32 *sq_tail;
+	uint32 *sq_mask;
+	uint32 *sq_array;
+	uint32 *cq_head;
+	uint32 *cq_tail;
+	uint32 *cq_mask;
+	void *cqes;
+} BlkAio;
+
+
+// デバイス
+
+struct VirtioBlk {
+	BlkImage image;
+	BlkAio aio;
+	VirtQueue vq;
+	uint32 guest_features;
+	uint16 queue_sel;
+	uint8 status;
+	uint8 isr;
+	BlkRequest req[VIRTQ_NUM];	// 同時に投げられるのはキューの長さまで
+	BlkRequest *free;
+
+	// 統計
+	uint64 stat_requests;
+	uint64 stat_batches;	// まとめて投げた回数
+	uint64 stat_bytes;
+	uint64 stat_errors;
+};
+
+
+// blk.c
+extern const BlkFormat blk_format_raw;
+extern int blk_open(BlkImage *img, const char *fname, int readonly);
+extern void blk_close(BlkImage *img);
+extern int blk_aio_init(BlkAio *aio, BlkImage *img, int wake_fd);
+extern void blk_aio_delete(BlkAio *aio);
+extern void blk_aio_submit(BlkAio *aio, BlkRequest *req);
+extern void blk_aio_flush(BlkAio *aio);
+extern BlkRequest* blk_aio_reap(BlkAio *aio, int wait);
+
+// cow.c
+extern const BlkFormat blk_format_cow;
+extern int cow_create(const char *fname, const char *base, uint64 size);
+extern int cow_compact(const char *fname);
+
+
+#endif
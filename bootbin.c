@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "cpux86.h"
 
 int main(int argc, char *argv[])
@@ -10,10 +11,21 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	cpu = new_cpux86(1024*1024*32);
+	// VCPU_CPUS=n(SMP、APはゲストがINIT、SIPIで起こす)
+	cpu = new_machine(1024*1024*32, getenv("VCPU_CPUS") ? atoi(getenv("VCPU_CPUS")) : 1);
 	if (-1<mem_store_file(cpu, 0x00, argv[1])) {
 		cpu->eip = 0x00;
-		run_cpux86(cpu);
+		// VCPU_GDB=[host:]port かUNIXソケットのパス(gdbがつなぐまで最初の命令の前で待つ)
+		if (getenv("VCPU_GDB")) {
+			gdb_listen(cpu, getenv("VCPU_GDB"));
+		}
+		// VCPU_RECORD=ログファイル(今の状態から外の入力を記録する)、VCPU_REPLAY=ログファイル(記録を実行し直す)
+		if (getenv("VCPU_REPLAY")) {
+			replay_play(cpu, getenv("VCPU_REPLAY"));
+		} else if (getenv("VCPU_RECORD")) {
+			replay_record(cpu, getenv("VCPU_RECORD"));
+		}
+		run_machine(cpu);
 	} else {
 		fprintf(stderr, "file read error\n");
 	}
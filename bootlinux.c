@@ -1,19 +1,39 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "cpux86.h"
 
 int main(void)
 {
 	CPUx86 *cpu;
 
-	cpu = new_cpux86(1024*1024*32);
+	// VCPU_CPUS=n(SMP、APはゲストがINIT、SIPIで起こす)
+	cpu = new_machine(1024*1024*32, getenv("VCPU_CPUS") ? atoi(getenv("VCPU_CPUS")) : 1);
 	mem_store_file(cpu, 0x00100000, "../jslinux/files/vmlinux26.bin");
 	mem_store_file(cpu, 0x00400000, "../jslinux/files/root.bin");
 	mem_store_file(cpu, 0x10000, "../jslinux/files/linuxstart.bin");
+	// VCPU_DISK=イメージファイル(virtio-blk)
+	if (getenv("VCPU_DISK")) {
+		vblk_attach(cpu, getenv("VCPU_DISK"), 0);
+	}
+	// VCPU_NET=1(virtio-net、同じプロセスのゲストとスイッチでつなぐ)
+	if (getenv("VCPU_NET")) {
+		vnet_attach(cpu);
+	}
 	cpu->eip = 0x10000;
 	cpu_regist_eax(cpu) = 0x2000000;
 	cpu_regist_ebx(cpu) = 0x200000;
 	set_cpu_cr0(cpu, CR0_PE, 1);
-	run_cpux86(cpu);
+	// VCPU_GDB=[host:]port かUNIXソケットのパス(gdbがつなぐまで最初の命令の前で待つ)
+	if (getenv("VCPU_GDB")) {
+		gdb_listen(cpu, getenv("VCPU_GDB"));
+	}
+	// VCPU_RECORD=ログファイル(今の状態から外の入力を記録する)、VCPU_REPLAY=ログファイル(記録を実行し直す)
+	if (getenv("VCPU_REPLAY")) {
+		replay_play(cpu, getenv("VCPU_REPLAY"));
+	} else if (getenv("VCPU_RECORD")) {
+		replay_record(cpu, getenv("VCPU_RECORD"));
+	}
+	run_machine(cpu);
 	delete_cpux86(cpu);
 
 	return 0;
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cpux86.h"
+#include "log.h"
+
+
+// 仮想クロック: RDTSC、PIT、RTCの時刻(TSC)を1か所で決める
+//   CLOCK_MODE_DETERMINISTIC: 命令数だけで進むので同じ入力なら何度でも同じ時刻になる
+//   CLOCK_MODE_REALTIME: ホストのCLOCK_MONOTONICに倍率を掛ける
+//   CLOCK_MODE_WARP: CLOCK_MODE_REALTIMEと同じだが、HLTで待つときは眠らずに次のタイマーまで飛ばす
+
+
+// host
+
+uint64 clock_host_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// from_hzで数えたvalをto_hzに換算する(桁あふれしないように秒と端数に分ける)
+uint64 clock_convert(uint64 val, uint64 from_hz, uint64 to_hz)
+{
+	return val / from_hz * to_hz + val % from_hz * to_hz / from_hz;
+}
+
+
+// clock
+
+// VCPU_CLOCK=deterministic|realtime|warp、VCPU_CLOCK_SCALE=倍率
+void clock_init(CPUx86 *cpu)
+{
+	char *env;
+	int mode;
+	double scale;
+
+	mode = CLOCK_MODE_REALTIME;
+	env = getenv("VCPU_CLOCK");
+	if (env) {
+		if (strcmp(env, "deterministic")==0) {
+			mode = CLOCK_MODE_DETERMINISTIC;
+		} else if (strcmp(env, "warp")==0) {
+			mode = CLOCK_MODE_WARP;
+		} else if (strcmp(env, "realtime")!=0) {
+			log_warning("VCPU_CLOCK: unknown mode %s\n", env);
+		}
+	}
+	scale = 1.0;
+	env = getenv("VCPU_CLOCK_SCALE");
+	if (env && 0.0 < atof(env)) {
+		scale = atof(env);
+	}
+	clock_set_mode(cpu, mode, scale);
+}
+
+// 時刻は0からやり直す(起動前に呼ぶ)
+void clock_set_mode(CPUx86 *cpu, int mode, double scale)
+{
+	Clock *clock = &(cpu->clock);
+
+	clock->mode = mode;
+	clock->scale = scale;
+	clock->icount = 0;
+	clock->slice = 0;
+	clock->host_start = clock_host_ns();
+	clock->warp = 0;
+	clock->tsc = 0;
+	clock->epoch = mode==CLOCK_MODE_DETERMINISTIC ? CLOCK_EPOCH : (uint64)time(NULL);
+	clock->deadline = CLOCK_NEVER;
+}
+
+// 現在の時刻(TSC)
+uint64 clock_tsc(CPUx86 *cpu)
+{
+	Clock *clock = &(cpu->clock);
+	uint64 tsc;
+
+	if (clock->mode==CLOCK_MODE_DETERMINISTIC) {
+		tsc = (clock->icount + clock->slice) * CLOCK_INSN_CYCLES;
+	} else {
+		tsc = (uint64)((double)clock_convert(clock_host_ns() - clock->host_start, 1000000000ULL, CLOCK_TSC_HZ) * clock->scale);
+	}
+	tsc += clock->warp;
+
+	// 倍率の誤差やホストの時計で戻らないようにする
+	if (tsc < clock->tsc) {
+		tsc = clock->tsc;
+	}
+	clock->tsc = tsc;
+	return tsc;
+}
+
+// スライスで実行した命令数を足す
+void clock_advance(CPUx86 *cpu, uint32 n)
+{
+	cpu->clock.icount += n;
+	cpu->clock.slice = 0;
+}
+
+// CLOCK_MODE_DETERMINISTICは次のタイマーで止まるように実行する命令数を減らす
+int clock_budget(CPUx86 *cpu, int budget)
+{
+	Clock *clock = &(cpu->clock);
+	uint64 now;
+	uint64 insns;
+
+	// 再生中は次の記録の位置で止める
+	if (cpu->replay_mode==REPLAY_PLAY) {
+		return replay_budget(cpu, budget);
+	}
+	if (clock->mode!=CLOCK_MODE_DETERMINISTIC || clock->deadline==CLOCK_NEVER) {
+		return budget;
+	}
+	now = clock_tsc(cpu);
+	if (clock->deadline <= now) {
+		return 1;
+	}
+	insns = (clock->deadline - now + CLOCK_INSN_CYCLES - 1) / CLOCK_INSN_CYCLES;
+	return insns < (uint64)budget ? (int)insns : budget;
+}
+
+// HLTで割り込みを待つ: 次のタイマーまで時刻を進める(CLOCK_MODE_REALTIMEは眠る)
+// 終わっていないI/Oがあればその完了でも起きる
+// 起こすものがなければ0を返す
+int clock_idle(CPUx86 *cpu)
+{
+	Clock *clock = &(cpu->clock);
+	uint64 now;
+	int64 ns;
+	int busy;
+
+	if (cpu->replay_mode==REPLAY_PLAY) {
+		return replay_idle(cpu);
+	}
+	busy = pc_busy(cpu);
+	if (!cpu_eflags(cpu, CPU_EFLAGS_IF) || (clock->deadline==CLOCK_NEVER && !busy)) {
+		return 0;
+	}
+	now = clock_tsc(cpu);
+	if (clock->deadline <= now) {
+		return 1;
+	}
+	// CLOCK_MODE_DETERMINISTICはディスクの完了を次のスライスの区切りで待つ
+	if (clock->mode==CLOCK_MODE_DETERMINISTIC && vblk_busy(cpu)) {
+		return 1;
+	}
+	if (clock->mode==CLOCK_MODE_REALTIME || busy) {
+		ns = -1;
+		if (clock->deadline!=CLOCK_NEVER) {
+			ns = (int64)((double)clock_convert(clock->deadline - now, CLOCK_TSC_HZ, 1000000000ULL) / clock->scale);
+		}
+		pc_wait(cpu, ns);
+	} else {
+		clock->warp += clock->deadline - now;
+	}
+	return 1;
+}
+
+
+// opcode
+
+void opcode_rdtsc(CPUx86 *cpu)
+{
+	uint64 tsc;
+
+	if (!cpu_feature(cpu, CPUID_TSC)) {
+		cpu_fault(cpu, EXC_UD, 0);
+		return;
+	}
+	// CR4.TSDならリング0のみ
+	if ((cpu->cr4 & CR4_TSD) && cpu_cr0(cpu, CR0_PE) && (cpu->cpl!=0 || (cpu->eflags & CPU_EFLAGS_VM))) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
+	}
+	tsc = clock_tsc(cpu);
+	if (cpu->replay_mode) {
+		tsc = replay_tsc(cpu, tsc);
+	}
+	cpu_regist_eax(cpu) = tsc & 0xFFFFFFFF;
+	cpu_regist_edx(cpu) = tsc >> 32;
+}
@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include "cpux86.h"
+#include "log.h"
+
+
+// コンソール(I/Oポート0xC040)
+//   ゲストはRAMのリングに書いてドアベルを1回鳴らすだけで、1文字ずつポートを叩かない
+//   リングはI/Oスレッドがホストのfd(VCPU_CONSOLE、なければ標準出力)へwritevで直接書き出す
+//
+//   リング(CON_RINGに置く)
+//     +0 head  ゲストが書いた総バイト数(ゲストが進める)
+//     +4 tail  書き出した総バイト数(ホストが進める、head - tailが空き待ち)
+//     +8 flags CON_RING_F_DOORBELL: I/Oスレッドが寝ている(鳴らさないと書き出しが遅れる)
+//     +16 data[CON_RING_SIZE]
+
+#define CON_PORT		0xC040
+#define CON_PORTS		0x20
+
+#define CON_RING		0x00	// 32bit RW リングの物理アドレス(0: 止める)
+#define CON_RING_SIZE	0x04	// 32bit RW データの大きさ(2のべき、CON_RINGより先に書く)
+#define CON_DOORBELL	0x08	// W
+#define CON_DATA		0x0C	// 8bit W リングを置く前の1文字ずつの出力
+#define CON_ID			0x10	// 32bit R CON_ID_MAGIC
+
+#define CON_ID_MAGIC	0x4E4F4356	// "VCON"
+
+#define CON_RING_HEAD	0
+#define CON_RING_TAIL	4
+#define CON_RING_FLAGS	8
+#define CON_RING_DATA	16
+#define CON_RING_F_DOORBELL	1
+
+#define CON_RING_MIN	16
+#define CON_RING_MAX	(16 * 1024 * 1024)
+#define CON_EARLY		4096	// CON_DATAのバッファ
+#define CON_IDLE_MS		10		// ドアベルを取りこぼしても遅れはここまで
+
+struct Console {
+	CPUx86 *cpu;
+	int fd;
+	int close_fd;
+	int kick_fd;			// eventfd(ドアベル)
+	pthread_t thread;
+	uint8 started;
+	int stop;
+	int idle;				// I/Oスレッドが寝ている
+	pthread_mutex_t lock;	// I/Oスレッドが書き出している間は設定を変えない
+
+	uint32 ring;			// 0: なし
+	uint32 size;
+	uint32 size_reg;		// 次のCON_RINGで使う大きさ
+	uint32 tail;
+
+	uint8 early[CON_EARLY];
+	int early_len;
+
+	// 統計
+	uint64 stat_bytes;
+	uint64 stat_writes;		// writevの回数
+	uint64 stat_doorbells;
+	uint64 stat_wakeups;	// ドアベルでI/Oスレッドを起こした回数
+};
+
+
+// drain
+
+static void con_write_all(Console *con, const uint8 *buf, int len)
+{
+	ssize_t ret;
+
+	while (0 < len) {
+		ret = write(con->fd, buf, len);
+		if (ret < 0) {
+			if (errno==EINTR) {
+				continue;
+			}
+			return;
+		}
+		buf += ret;
+		len -= ret;
+		con->stat_bytes += ret;
+		con->stat_writes++;
+	}
+}
+
+static uint32* con_ring_word(Console *con, uint32 offset)
+{
+	return (uint32*)(con->cpu->mem + con->ring + offset);
+}
+
+// たまっている出力を書き出す(書き出したバイト数を返す)
+static int con_drain(Console *con)
+{
+	struct iovec iov[2];
+	uint8 *data;
+	uint32 head;
+	uint32 len;
+	uint32 offset;
+	ssize_t ret;
+	int total = 0;
+	int n;
+
+	pthread_mutex_lock(&(con->lock));
+	if (con->early_len) {
+		total += con->early_len;
+		con_write_all(con, con->early, con->early_len);
+		con->early_len = 0;
+	}
+	if (con->ring) {
+		head = __atomic_load_n(con_ring_word(con, CON_RING_HEAD), __ATOMIC_ACQUIRE);
+		len = head - con->tail;
+		if (con->size < len) {
+			log_warning("console: ring overrun head=%u tail=%u\n", head, con->tail);
+			con->tail = head;
+			__atomic_store_n(con_ring_word(con, CON_RING_TAIL), con->tail, __ATOMIC_RELEASE);
+			replay_dma(con->cpu, con->ring + CON_RING_TAIL, 4);
+		} else if (len) {
+			// 折り返していれば2つに分けてゲストのRAMから直接書く
+			data = con->cpu->mem + con->ring + CON_RING_DATA;
+			offset = con->tail & (con->size - 1);
+			iov[0].iov_base = data + offset;
+			iov[0].iov_len = len < con->size - offset ? len : con->size - offset;
+			n = 1;
+			if (iov[0].iov_len < len) {
+				iov[1].iov_base = data;
+				iov[1].iov_len = len - iov[0].iov_len;
+				n = 2;
+			}
+			ret = writev(con->fd, iov, n);
+			if (ret < 0 && errno!=EINTR && errno!=EAGAIN) {
+				// 書けなければ捨てる(ゲストを止めない)
+				log_warning("console: %s\n", strerror(errno));
+				ret = len;
+			}
+			if (0 < ret) {
+				con->tail += ret;
+				__atomic_store_n(con_ring_word(con, CON_RING_TAIL), con->tail, __ATOMIC_RELEASE);
+				replay_dma(con->cpu, con->ring + CON_RING_TAIL, 4);
+				con->stat_bytes += ret;
+				con->stat_writes++;
+				total += ret;
+			}
+		}
+	}
+	pthread_mutex_unlock(&(con->lock));
+	return total;
+}
+
+static int con_pending(Console *con)
+{
+	int pending;
+
+	pthread_mutex_lock(&(con->lock));
+	pending = con->early_len || (con->ring && __atomic_load_n(con_ring_word(con, CON_RING_HEAD), __ATOMIC_ACQUIRE)!=con->tail);
+	pthread_mutex_unlock(&(con->lock));
+	return pending;
+}
+
+static void con_set_doorbell(Console *con, int on)
+{
+	uint32 *flags;
+
+	pthread_mutex_lock(&(con->lock));
+	if (con->ring) {
+		flags = con_ring_word(con, CON_RING_FLAGS);
+		__atomic_store_n(flags, on ? (*flags | CON_RING_F_DOORBELL) : (*flags & ~CON_RING_F_DOORBELL), __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&(con->lock));
+}
+
+static void* con_thread(void *arg)
+{
+	Console *con = arg;
+	struct pollfd pfd;
+	uint64 val;
+
+	for (;;) {
+		if (con_drain(con)) {
+			continue;
+		}
+		if (__atomic_load_n(&(con->stop), __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		// 寝る前にドアベルを頼み、その間に書かれていないか確かめる
+		__atomic_store_n(&(con->idle), 1, __ATOMIC_SEQ_CST);
+		con_set_doorbell(con, 1);
+		if (!con_pending(con)) {
+			pfd.fd = con->kick_fd;
+			pfd.events = POLLIN;
+			if (0 < poll(&pfd, 1, CON_IDLE_MS) && read(con->kick_fd, &val, sizeof(val)) < 0) {
+				// 他で読まれた
+			}
+		}
+		__atomic_store_n(&(con->idle), 0, __ATOMIC_SEQ_CST);
+		con_set_doorbell(con, 0);
+	}
+	return NULL;
+}
+
+static void con_start(Console *con)
+{
+	// 記録中はI/Oスレッドでtailを進めない
+	if (con->started || con->cpu->replay_mode) {
+		return;
+	}
+	if (pthread_create(&(con->thread), NULL, con_thread, con)) {
+		log_warning("console: cannot create I/O thread\n");
+		return;
+	}
+	con->started = 1;
+}
+
+static void con_kick(Console *con)
+{
+	uint64 one = 1;
+
+	con->stat_doorbells++;
+	// CLOCK_MODE_DETERMINISTICと記録中はその場で書き出す(tailの進み方を命令数で決める)
+	if (con->cpu->clock.mode==CLOCK_MODE_DETERMINISTIC || con->cpu->replay_mode || !con->started) {
+		con_drain(con);
+		return;
+	}
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&(con->idle), __ATOMIC_SEQ_CST)) {
+		con->stat_wakeups++;
+		if (write(con->kick_fd, &one, sizeof(one)) < 0) {
+			// CON_IDLE_MSで起きる
+		}
+	}
+}
+
+
+// port
+
+static uint32 con_in(CPUx86 *cpu, void *opaque, uint16 port, int size)
+{
+	Console *con = opaque;
+
+	switch (port - CON_PORT) {
+	case CON_RING:
+		return con->ring;
+	case CON_RING_SIZE:
+		return con->size_reg;
+	case CON_ID:
+		return CON_ID_MAGIC;
+	}
+	return 0xFFFFFFFF;
+}
+
+static void con_set_ring(Console *con, uint32 addr)
+{
+	uint32 size = con->size_reg;
+
+	// 前のリングは書き出してから外す
+	con_drain(con);
+	if (addr && (size < CON_RING_MIN || CON_RING_MAX < size || (size & (size - 1))
+			|| (addr & 3) || con->cpu->mem_size < (size_t)addr + CON_RING_DATA + size)) {
+		log_warning("console: bad ring 0x%X size 0x%X\n", addr, size);
+		addr = 0;
+	}
+	pthread_mutex_lock(&(con->lock));
+	// ヘッダはI/Oスレッドが書くので、リングを置いている間はそのページを翻訳しない
+	if (con->ring) {
+		jit_dma_end(con->cpu, con->ring, CON_RING_DATA);
+	}
+	con->ring = addr;
+	con->size = size;
+	if (addr) {
+		jit_dma_begin(con->cpu, addr, CON_RING_DATA);
+		con->tail = *con_ring_word(con, CON_RING_TAIL);
+	}
+	pthread_mutex_unlock(&(con->lock));
+	if (addr) {
+		con_start(con);
+	}
+}
+
+static void con_out(CPUx86 *cpu, void *opaque, uint16 port, int size, uint32 val)
+{
+	Console *con = opaque;
+	int full;
+
+	switch (port - CON_PORT) {
+	case CON_RING:
+		con_set_ring(con, val);
+		break;
+	case CON_RING_SIZE:
+		con->size_reg = val;
+		break;
+	case CON_DOORBELL:
+		con_kick(con);
+		break;
+	case CON_DATA:
+		pthread_mutex_lock(&(con->lock));
+		con->early[con->early_len++] = val;
+		full = con->early_len==CON_EARLY;
+		pthread_mutex_unlock(&(con->lock));
+		if (full || (val & 0xFF)=='\n') {
+			con_kick(con);
+		}
+		break;
+	}
+}
+
+
+// console
+
+// VCPU_CONSOLE=出力ファイル(なければ標準出力)
+void con_init(CPUx86 *cpu)
+{
+	Console *con;
+	char *env;
+
+	con = calloc(1, sizeof(Console));
+	con->cpu = cpu;
+	con->fd = STDOUT_FILENO;
+	env = getenv("VCPU_CONSOLE");
+	if (env && *env) {
+		con->fd = open(env, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (con->fd < 0) {
+			log_warning("console: cannot open %s: %s\n", env, strerror(errno));
+			con->fd = STDOUT_FILENO;
+		} else {
+			con->close_fd = 1;
+		}
+	}
+	con->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pthread_mutex_init(&(con->lock), NULL);
+	io_register(cpu, CON_PORT, CON_PORTS, con_in, con_out, con);
+	cpu->con = con;
+}
+
+// 残りを書き出してから止める
+void con_delete(CPUx86 *cpu)
+{
+	Console *con = cpu->con;
+	uint64 one = 1;
+
+	if (con==NULL) {
+		return;
+	}
+	if (con->started) {
+		__atomic_store_n(&(con->stop), 1, __ATOMIC_RELEASE);
+		if (write(con->kick_fd, &one, sizeof(one)) < 0) {
+			// CON_IDLE_MSで起きる
+		}
+		pthread_join(con->thread, NULL);
+	}
+	con_drain(con);
+	if (con->close_fd) {
+		close(con->fd);
+	}
+	if (0 <= con->kick_fd) {
+		close(con->kick_fd);
+	}
+	pthread_mutex_destroy(&(con->lock));
+	free(con);
+	cpu->con = NULL;
+}
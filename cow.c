@@ -0,0 +1,687 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cpux86.h"
+#include "blk.h"
+#include "log.h"
+
+
+// COWオーバーレイ形式
+//   共有する読み出し専用のベースイメージ(raw)と、ゲストごとの疎なオーバーレイ
+//   オーバーレイは書き込んだクラスタだけを持ち、L1→L2の2段の表で引く
+//     クラスタ0: ヘッダ(COW_HEADER_SIZE)とL1表
+//     L1[i]: L2表のファイル上の位置(0: なし)
+//     L2[j]: データクラスタのファイル上の位置(0: ベースを読む、ベースの外は0)
+//   表の更新はメモリ上で行い、フラッシュでまとめて書く(書く前に落ちたクラスタはcow_compactで回収する)
+
+#define COW_MAGIC			0x574F4356	// "VCOW"
+#define COW_VERSION			1
+#define COW_CLUSTER_BITS	16			// 64KB
+#define COW_HEADER_SIZE		4096
+#define COW_BASE_MAX		256
+#define COW_L2_CACHE		16			// メモリに置くL2表の数
+
+typedef struct {
+	uint32 magic;
+	uint32 version;
+	uint32 cluster_bits;
+	uint32 l1_size;			// L1表の要素数
+	uint64 size;			// 仮想ディスクのバイト数
+	uint64 l1_offset;
+	char base[COW_BASE_MAX];	// ベースイメージ(相対パスはオーバーレイのディレクトリから、空: なし)
+} CowHeader;
+
+typedef struct {
+	int32 index;		// L1表の添字(-1: 空き)
+	uint64 *table;
+	uint8 dirty;
+	uint64 used;		// LRU
+} CowL2;
+
+typedef struct {
+	CowHeader header;
+	uint32 cluster_size;
+	uint32 l2_entries;
+	int base_fd;			// -1: なし
+	uint64 base_size;
+	uint64 *l1;
+	uint8 l1_dirty;
+	CowL2 l2[COW_L2_CACHE];
+	uint64 tick;
+	uint64 next_free;		// 次に割り当てるクラスタ
+	uint8 *buf;				// クラスタのコピー用
+	pthread_mutex_t lock;	// スレッドプールのワーカーから同時に呼ばれる
+} Cow;
+
+#define COW_ERROR	((uint64)-1)
+
+
+// iovec
+
+// iovのskipバイト目からlenバイトをpartに切り出す
+static int cow_iov_slice(const struct iovec *iov, int iovcnt, size_t skip, size_t len, struct iovec *part)
+{
+	int count = 0;
+	int i;
+
+	for (i=0; i<iovcnt && len; i++) {
+		if (iov[i].iov_len <= skip) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		part[count].iov_base = (uint8*)iov[i].iov_base + skip;
+		part[count].iov_len = iov[i].iov_len - skip < len ? iov[i].iov_len - skip : len;
+		len -= part[count].iov_len;
+		skip = 0;
+		count++;
+	}
+	return count;
+}
+
+static void cow_iov_zero(struct iovec *part, int count, size_t skip)
+{
+	int i;
+
+	for (i=0; i<count; i++) {
+		if (part[i].iov_len <= skip) {
+			skip -= part[i].iov_len;
+			continue;
+		}
+		memset((uint8*)part[i].iov_base + skip, 0, part[i].iov_len - skip);
+		skip = 0;
+	}
+}
+
+static size_t cow_iov_len(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
+
+	for (i=0; i<iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	return len;
+}
+
+static int cow_pread_full(int fd, uint8 *buf, size_t len, uint64 offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(fd, buf, len, offset);
+		if (ret < 0) {
+			if (errno==EINTR) {
+				continue;
+			}
+			return 0;
+		}
+		if (ret==0) {
+			// ファイルの終わりから後ろは0
+			memset(buf, 0, len);
+			break;
+		}
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 1;
+}
+
+static int cow_pwrite_full(int fd, const uint8 *buf, size_t len, uint64 offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, buf, len, offset);
+		if (ret < 0) {
+			if (errno==EINTR) {
+				continue;
+			}
+			return 0;
+		}
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 1;
+}
+
+
+// base
+
+// ベースのoffsetからpartに読む(ベースの外は0)
+static ssize_t cow_read_base(Cow *cow, struct iovec *part, int count, uint64 offset)
+{
+	size_t len;
+	ssize_t ret = 0;
+
+	len = cow_iov_len(part, count);
+	if (0 <= cow->base_fd && offset < cow->base_size) {
+		ret = preadv(cow->base_fd, part, count, offset);
+		if (ret < 0) {
+			return -1;
+		}
+	}
+	cow_iov_zero(part, count, ret);
+	return len;
+}
+
+// ベースのクラスタをbufに読む(ベースの外は0)
+static int cow_read_base_cluster(Cow *cow, uint64 vcluster, uint8 *buf)
+{
+	uint64 offset;
+
+	offset = vcluster << cow->header.cluster_bits;
+	if (cow->base_fd < 0 || cow->base_size <= offset) {
+		memset(buf, 0, cow->cluster_size);
+		return 1;
+	}
+	return cow_pread_full(cow->base_fd, buf, cow->cluster_size, offset);
+}
+
+
+// cluster map
+
+static uint64 cow_alloc_cluster(Cow *cow)
+{
+	uint64 offset;
+
+	offset = cow->next_free;
+	cow->next_free += cow->cluster_size;
+	return offset;
+}
+
+static int cow_l2_writeback(BlkImage *img, Cow *cow, CowL2 *l2)
+{
+	if (!l2->dirty) {
+		return 1;
+	}
+	if (!cow_pwrite_full(img->fd, (uint8*)l2->table, cow->cluster_size, cow->l1[l2->index])) {
+		return 0;
+	}
+	l2->dirty = 0;
+	return 1;
+}
+
+// L1[index]のL2表(allocならなければ作る、なければNULL)
+static uint64* cow_l2_get(BlkImage *img, Cow *cow, uint32 index, int alloc)
+{
+	CowL2 *l2;
+	CowL2 *victim;
+	int i;
+
+	victim = &(cow->l2[0]);
+	for (i=0; i<COW_L2_CACHE; i++) {
+		l2 = &(cow->l2[i]);
+		if (l2->index==index) {
+			l2->used = ++(cow->tick);
+			return l2->table;
+		}
+		if (l2->index < 0 || (0 <= victim->index && l2->used < victim->used)) {
+			victim = l2;
+		}
+	}
+	if (cow->l1[index]==0 && !alloc) {
+		return NULL;
+	}
+
+	if (0 <= victim->index && !cow_l2_writeback(img, cow, victim)) {
+		return NULL;
+	}
+	victim->index = -1;
+	if (cow->l1[index]==0) {
+		memset(victim->table, 0, cow->cluster_size);
+		cow->l1[index] = cow_alloc_cluster(cow);
+		cow->l1_dirty = 1;
+		victim->dirty = 1;
+	} else {
+		if (!cow_pread_full(img->fd, (uint8*)victim->table, cow->cluster_size, cow->l1[index])) {
+			return NULL;
+		}
+		victim->dirty = 0;
+	}
+	victim->index = index;
+	victim->used = ++(cow->tick);
+	return victim->table;
+}
+
+static CowL2* cow_l2_find(Cow *cow, uint64 *table)
+{
+	int i;
+
+	for (i=0; i<COW_L2_CACHE; i++) {
+		if (cow->l2[i].table==table) {
+			return &(cow->l2[i]);
+		}
+	}
+	return NULL;
+}
+
+// 仮想クラスタのファイル上の位置(0: オーバーレイにない)
+// alloc: 0 引くだけ 1 割り当ててベースをコピーする 2 割り当てるだけ(クラスタ全体を書く)
+static uint64 cow_lookup(BlkImage *img, Cow *cow, uint64 vcluster, int alloc)
+{
+	uint64 *table;
+	uint64 offset;
+	uint32 index;
+
+	index = vcluster / cow->l2_entries;
+	if (cow->header.l1_size <= index) {
+		errno = EINVAL;
+		return COW_ERROR;
+	}
+	table = cow_l2_get(img, cow, index, alloc);
+	if (table==NULL) {
+		return alloc ? COW_ERROR : 0;
+	}
+	offset = table[vcluster % cow->l2_entries];
+	if (offset || !alloc) {
+		return offset;
+	}
+
+	offset = cow_alloc_cluster(cow);
+	if (alloc==1) {
+		if (!cow_read_base_cluster(cow, vcluster, cow->buf) || !cow_pwrite_full(img->fd, cow->buf, cow->cluster_size, offset)) {
+			return COW_ERROR;
+		}
+	}
+	table[vcluster % cow->l2_entries] = offset;
+	cow_l2_find(cow, table)->dirty = 1;
+	return offset;
+}
+
+
+// format
+
+static int cow_probe(const uint8 *buf, int len)
+{
+	return 4 <= len && *(uint32*)buf==COW_MAGIC;
+}
+
+// 相対パスのベースはオーバーレイのディレクトリから
+static void cow_base_path(const char *fname, const char *base, char *path, size_t size)
+{
+	const char *slash;
+
+	slash = strrchr(fname, '/');
+	if (base[0]=='/' || slash==NULL) {
+		snprintf(path, size, "%s", base);
+	} else {
+		snprintf(path, size, "%.*s/%s", (int)(slash - fname), fname, base);
+	}
+}
+
+static int cow_open_base(Cow *cow, const char *fname)
+{
+	char path[COW_BASE_MAX + 4096];
+	off_t size;
+
+	cow->base_fd = -1;
+	if (cow->header.base[0]=='\0') {
+		return 1;
+	}
+	cow_base_path(fname, cow->header.base, path, sizeof(path));
+	cow->base_fd = open(path, O_RDONLY);
+	if (cow->base_fd < 0) {
+		log_warning("cow: cannot open base %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+	size = lseek(cow->base_fd, 0, SEEK_END);
+	cow->base_size = size < 0 ? 0 : size;
+	return 1;
+}
+
+static void cow_free(Cow *cow)
+{
+	int i;
+
+	if (0 <= cow->base_fd) {
+		close(cow->base_fd);
+	}
+	for (i=0; i<COW_L2_CACHE; i++) {
+		free(cow->l2[i].table);
+	}
+	free(cow->l1);
+	free(cow->buf);
+	pthread_mutex_destroy(&(cow->lock));
+	free(cow);
+}
+
+static int cow_open(BlkImage *img, const char *fname, int readonly)
+{
+	Cow *cow;
+	off_t size;
+	int i;
+
+	img->fd = open(fname, readonly ? O_RDONLY : O_RDWR);
+	if (img->fd < 0) {
+		return 0;
+	}
+	cow = calloc(1, sizeof(Cow));
+	pthread_mutex_init(&(cow->lock), NULL);
+	cow->base_fd = -1;
+	img->opaque = cow;
+	if (!cow_pread_full(img->fd, (uint8*)&(cow->header), sizeof(CowHeader), 0)
+			|| cow->header.magic!=COW_MAGIC || cow->header.version!=COW_VERSION
+			|| cow->header.cluster_bits < 12 || 24 < cow->header.cluster_bits) {
+		log_warning("cow: %s: bad header\n", fname);
+		errno = EINVAL;
+		goto fail;
+	}
+	cow->header.base[COW_BASE_MAX - 1] = '\0';
+	cow->cluster_size = 1 << cow->header.cluster_bits;
+	cow->l2_entries = cow->cluster_size / sizeof(uint64);
+	if ((uint64)cow->header.l1_size * cow->l2_entries * cow->cluster_size < cow->header.size) {
+		log_warning("cow: %s: L1 table too small\n", fname);
+		errno = EINVAL;
+		goto fail;
+	}
+
+	cow->l1 = calloc(cow->header.l1_size, sizeof(uint64));
+	cow->buf = malloc(cow->cluster_size);
+	for (i=0; i<COW_L2_CACHE; i++) {
+		cow->l2[i].index = -1;
+		cow->l2[i].table = malloc(cow->cluster_size);
+	}
+	if (!cow_pread_full(img->fd, (uint8*)cow->l1, cow->header.l1_size * sizeof(uint64), cow->header.l1_offset)) {
+		goto fail;
+	}
+	if (!cow_open_base(cow, fname)) {
+		goto fail;
+	}
+
+	size = lseek(img->fd, 0, SEEK_END);
+	cow->next_free = ((uint64)size + cow->cluster_size - 1) & ~(uint64)(cow->cluster_size - 1);
+	if (cow->next_free < cow->cluster_size) {
+		cow->next_free = cow->cluster_size;
+	}
+	img->size = cow->header.size;
+	return 1;
+
+fail:
+	i = errno;
+	cow_free(cow);
+	img->opaque = NULL;
+	close(img->fd);
+	errno = i;
+	return 0;
+}
+
+static ssize_t cow_preadv(BlkImage *img, const struct iovec *iov, int iovcnt, uint64 offset)
+{
+	Cow *cow = img->opaque;
+	struct iovec part[VIRTQ_SEG_MAX];
+	uint64 pos;
+	uint64 host;
+	size_t total;
+	size_t done;
+	size_t len;
+	uint32 in;
+	ssize_t ret;
+	int count;
+
+	total = cow_iov_len(iov, iovcnt);
+	for (done=0; done<total; done+=len) {
+		pos = offset + done;
+		in = pos & (cow->cluster_size - 1);
+		len = cow->cluster_size - in < total - done ? cow->cluster_size - in : total - done;
+		count = cow_iov_slice(iov, iovcnt, done, len, part);
+
+		pthread_mutex_lock(&(cow->lock));
+		host = cow_lookup(img, cow, pos >> cow->header.cluster_bits, 0);
+		pthread_mutex_unlock(&(cow->lock));
+		if (host==COW_ERROR) {
+			return -1;
+		}
+		if (host) {
+			ret = preadv(img->fd, part, count, host + in);
+		} else {
+			ret = cow_read_base(cow, part, count, pos);
+		}
+		if (ret < 0) {
+			return -1;
+		}
+		if (ret!=len) {
+			return done + ret;
+		}
+	}
+	return total;
+}
+
+static ssize_t cow_pwritev(BlkImage *img, const struct iovec *iov, int iovcnt, uint64 offset)
+{
+	Cow *cow = img->opaque;
+	struct iovec part[VIRTQ_SEG_MAX];
+	uint64 pos;
+	uint64 host;
+	size_t total;
+	size_t done;
+	size_t len;
+	uint32 in;
+	ssize_t ret;
+	int count;
+
+	total = cow_iov_len(iov, iovcnt);
+	for (done=0; done<total; done+=len) {
+		pos = offset + done;
+		in = pos & (cow->cluster_size - 1);
+		len = cow->cluster_size - in < total - done ? cow->cluster_size - in : total - done;
+		count = cow_iov_slice(iov, iovcnt, done, len, part);
+
+		// クラスタの一部だけを書くなら先にベースをコピーする
+		pthread_mutex_lock(&(cow->lock));
+		host = cow_lookup(img, cow, pos >> cow->header.cluster_bits, len==cow->cluster_size ? 2 : 1);
+		pthread_mutex_unlock(&(cow->lock));
+		if (host==COW_ERROR) {
+			return -1;
+		}
+		ret = pwritev(img->fd, part, count, host + in);
+		if (ret < 0) {
+			return -1;
+		}
+		if (ret!=len) {
+			return done + ret;
+		}
+	}
+	return total;
+}
+
+// データを書いてから表を書く(表が指すクラスタは必ず書き終わっている)
+static int cow_flush(BlkImage *img)
+{
+	Cow *cow = img->opaque;
+	int ret = -1;
+	int i;
+
+	pthread_mutex_lock(&(cow->lock));
+	if (fdatasync(img->fd) < 0) {
+		goto out;
+	}
+	for (i=0; i<COW_L2_CACHE; i++) {
+		if (0 <= cow->l2[i].index && !cow_l2_writeback(img, cow, &(cow->l2[i]))) {
+			goto out;
+		}
+	}
+	if (cow->l1_dirty) {
+		if (!cow_pwrite_full(img->fd, (uint8*)cow->l1, cow->header.l1_size * sizeof(uint64), cow->header.l1_offset)) {
+			goto out;
+		}
+		cow->l1_dirty = 0;
+	}
+	ret = fdatasync(img->fd);
+out:
+	pthread_mutex_unlock(&(cow->lock));
+	return ret;
+}
+
+static void cow_close(BlkImage *img)
+{
+	Cow *cow = img->opaque;
+
+	if (!img->readonly && cow_flush(img) < 0) {
+		log_warning("cow: flush on close: %s\n", strerror(errno));
+	}
+	cow_free(cow);
+	img->opaque = NULL;
+	close(img->fd);
+}
+
+const BlkFormat blk_format_cow = {"cow", cow_probe, cow_open, cow_preadv, cow_pwritev, cow_flush, cow_close, 0};
+
+
+// offline
+
+// オーバーレイを作る(sizeが0ならベースの大きさ)
+int cow_create(const char *fname, const char *base, uint64 size)
+{
+	CowHeader header;
+	char path[COW_BASE_MAX + 4096];
+	uint8 *cluster;
+	uint64 span;
+	int fd;
+	int ok;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = COW_MAGIC;
+	header.version = COW_VERSION;
+	header.cluster_bits = COW_CLUSTER_BITS;
+	if (base && *base) {
+		if (COW_BASE_MAX <= strlen(base)) {
+			log_warning("cow: base path too long\n");
+			return 0;
+		}
+		strcpy(header.base, base);
+		if (size==0) {
+			cow_base_path(fname, base, path, sizeof(path));
+			fd = open(path, O_RDONLY);
+			if (fd < 0) {
+				log_warning("cow: cannot open base %s: %s\n", path, strerror(errno));
+				return 0;
+			}
+			size = lseek(fd, 0, SEEK_END);
+			close(fd);
+		}
+	}
+	size = (size + BLK_SECTOR - 1) & ~(uint64)(BLK_SECTOR - 1);
+	span = (uint64)(1 << COW_CLUSTER_BITS) / sizeof(uint64) << COW_CLUSTER_BITS;
+	header.size = size;
+	header.l1_size = (size + span - 1) / span;
+	header.l1_offset = COW_HEADER_SIZE;
+	if (COW_HEADER_SIZE + header.l1_size * sizeof(uint64) > (1 << COW_CLUSTER_BITS)) {
+		log_warning("cow: disk too large\n");
+		return 0;
+	}
+
+	fd = open(fname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		log_warning("cow: cannot create %s: %s\n", fname, strerror(errno));
+		return 0;
+	}
+	cluster = calloc(1, 1 << COW_CLUSTER_BITS);
+	memcpy(cluster, &header, sizeof(header));
+	ok = cow_pwrite_full(fd, cluster, 1 << COW_CLUSTER_BITS, 0) && fsync(fd)==0;
+	free(cluster);
+	close(fd);
+	return ok;
+}
+
+// オーバーレイを詰め直す
+//   どの表からも指されていないクラスタ(フラッシュ前に落ちたもの)と、ベースと同じ内容のクラスタを捨てる
+int cow_compact(const char *fname)
+{
+	BlkImage img;
+	BlkImage out;
+	Cow *cow;
+	Cow *dst;
+	char tmp[4096];
+	uint8 *data;
+	uint8 *base;
+	uint64 *table;
+	uint64 vcluster;
+	uint64 kept = 0;
+	uint64 dropped = 0;
+	uint32 index;
+	uint32 i;
+	int ok = 0;
+
+	memset(&img, 0, sizeof(img));
+	img.readonly = 1;
+	if (!cow_open(&img, fname, 1)) {
+		log_warning("cow: cannot open %s: %s\n", fname, strerror(errno));
+		return 0;
+	}
+	cow = img.opaque;
+
+	snprintf(tmp, sizeof(tmp), "%s.compact", fname);
+	unlink(tmp);
+	if (!cow_create(tmp, NULL, cow->header.size)) {
+		cow_close(&img);
+		return 0;
+	}
+	memset(&out, 0, sizeof(out));
+	if (!cow_open(&out, tmp, 0)) {
+		cow_close(&img);
+		unlink(tmp);
+		return 0;
+	}
+	dst = out.opaque;
+	// ベースはそのまま引き継ぐ
+	memcpy(dst->header.base, cow->header.base, COW_BASE_MAX);
+
+	data = malloc(cow->cluster_size);
+	base = malloc(cow->cluster_size);
+	for (index=0; index<cow->header.l1_size; index++) {
+		if (cow->l1[index]==0) {
+			continue;
+		}
+		table = cow_l2_get(&img, cow, index, 0);
+		if (table==NULL) {
+			goto out;
+		}
+		for (i=0; i<cow->l2_entries; i++) {
+			if (table[i]==0) {
+				continue;
+			}
+			vcluster = (uint64)index * cow->l2_entries + i;
+			if (!cow_pread_full(img.fd, data, cow->cluster_size, table[i]) || !cow_read_base_cluster(cow, vcluster, base)) {
+				goto out;
+			}
+			if (memcmp(data, base, cow->cluster_size)==0) {
+				dropped++;
+				continue;
+			}
+			if (cow_lookup(&out, dst, vcluster, 2)==COW_ERROR) {
+				goto out;
+			}
+			if (!cow_pwrite_full(out.fd, data, cow->cluster_size, cow_lookup(&out, dst, vcluster, 0))) {
+				goto out;
+			}
+			kept++;
+		}
+	}
+	if (!cow_pwrite_full(out.fd, (uint8*)&(dst->header), sizeof(CowHeader), 0) || cow_flush(&out) < 0) {
+		goto out;
+	}
+	ok = 1;
+out:
+	free(data);
+	free(base);
+	if (!ok) {
+		log_warning("cow: compact %s: %s\n", fname, strerror(errno));
+	}
+	cow_close(&out);
+	cow_close(&img);
+	if (ok && rename(tmp, fname) < 0) {
+		log_warning("cow: rename %s: %s\n", tmp, strerror(errno));
+		ok = 0;
+	}
+	if (!ok) {
+		unlink(tmp);
+	} else {
+		log_info("cow: %s: %llu clusters kept, %llu same as base\n", fname, kept, dropped);
+	}
+	return ok;
+}
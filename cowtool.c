@@ -0,0 +1,22 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpux86.h"
+#include "blk.h"
+
+// COWオーバーレイの作成と詰め直し(ゲストを止めてから使う)
+int main(int argc, char *argv[])
+{
+	if (argc==4 && strcmp(argv[1], "create")==0) {
+		return cow_create(argv[2], argv[3], 0) ? 0 : 1;
+	}
+	if (argc==5 && strcmp(argv[1], "create")==0) {
+		return cow_create(argv[2], strcmp(argv[3], "-")==0 ? NULL : argv[3], strtoull(argv[4], NULL, 0)) ? 0 : 1;
+	}
+	if (argc==3 && strcmp(argv[1], "compact")==0) {
+		return cow_compact(argv[2]) ? 0 : 1;
+	}
+	fprintf(stderr, "Usage: %s create overlay base|- [size]\n", argv[0]);
+	fprintf(stderr, "       %s compact overlay\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpux86.h"
+#include "log.h"
+
+
+// CPUID: 見せるCPUの種類と機能
+// 機能ビットを落とした命令は実行しても#UDになる(ゲストが選ぶコードと実際に動く命令を揃える)
+
+
+// profile
+
+typedef struct {
+	const char *name;
+	int family;
+	int model;
+	int stepping;
+	uint32 features;
+	const char *brand;
+} CpuidProfile;
+
+static const CpuidProfile cpuid_profiles[] = {
+	{"486",		4, 8, 0,	CPUID_FPU, NULL},
+	{"pentium",	5, 2, 12,	CPUID_FPU | CPUID_TSC, NULL},
+	{"p6",		6, 1, 9,	CPUID_FPU | CPUID_TSC | CPUID_CMOV, NULL},
+	{"sse2",	15, 2, 9,	CPUID_FPU | CPUID_TSC | CPUID_CMOV | CPUID_MMX | CPUID_FXSR | CPUID_SSE | CPUID_SSE2, "Intel(R) Pentium(R) 4 CPU"},
+};
+
+static const struct {
+	const char *name;
+	uint32 bit;
+} cpuid_feature_names[] = {
+	{"fpu", CPUID_FPU},
+	{"tsc", CPUID_TSC},
+	{"msr", CPUID_MSR},
+	{"cx8", CPUID_CX8},
+	{"apic", CPUID_APIC},
+	{"cmov", CPUID_CMOV},
+	{"mmx", CPUID_MMX},
+	{"fxsr", CPUID_FXSR},
+	{"sse", CPUID_SSE},
+	{"sse2", CPUID_SSE2},
+};
+
+static void cpuid_set_signature(CPUx86 *cpu, int family, int model, int stepping)
+{
+	// ファミリ15以上は拡張ファミリに足す
+	if (15 < family) {
+		cpu->cpuid.signature = (family - 15) << 20 | 15 << 8;
+	} else {
+		cpu->cpuid.signature = family << 8;
+	}
+	cpu->cpuid.signature |= (model & 0xF0) << 12 | (model & 0x0F) << 4 | (stepping & 0x0F);
+}
+
+static void cpuid_set_features(CPUx86 *cpu, uint32 features)
+{
+	if (features & ~CPUID_SUPPORTED) {
+		log_warning("cpuid: unsupported features 0x%08X are hidden\n", features & ~CPUID_SUPPORTED);
+	}
+	cpu->cpuid.features = features & CPUID_SUPPORTED;
+}
+
+int cpuid_set_profile(CPUx86 *cpu, const char *name)
+{
+	const CpuidProfile *profile;
+	int i;
+
+	for (i=0; i<sizeof(cpuid_profiles) / sizeof(cpuid_profiles[0]); i++) {
+		profile = &(cpuid_profiles[i]);
+		if (strcmp(profile->name, name)==0) {
+			memset(&(cpu->cpuid), 0, sizeof(cpu->cpuid));
+			strcpy(cpu->cpuid.vendor, "GenuineIntel");
+			cpu->cpuid.max_leaf = 1;
+			cpuid_set_signature(cpu, profile->family, profile->model, profile->stepping);
+			cpuid_set_features(cpu, profile->features);
+			if (profile->brand) {
+				strncpy(cpu->cpuid.brand, profile->brand, sizeof(cpu->cpuid.brand) - 1);
+				cpu->cpuid.max_ext_leaf = 0x80000004;
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static uint32 cpuid_parse_features(char *list)
+{
+	uint32 features = 0;
+	char *name;
+	int i;
+
+	for (name=strtok(list, " \t,"); name; name=strtok(NULL, " \t,")) {
+		for (i=0; i<sizeof(cpuid_feature_names) / sizeof(cpuid_feature_names[0]); i++) {
+			if (strcmp(cpuid_feature_names[i].name, name)==0) {
+				features |= cpuid_feature_names[i].bit;
+				break;
+			}
+		}
+		if (i==sizeof(cpuid_feature_names) / sizeof(cpuid_feature_names[0])) {
+			log_warning("cpuid: unknown feature %s\n", name);
+		}
+	}
+	return features;
+}
+
+// 設定ファイル: 1行に「キー 値」、#から行末はコメント
+//   profile 486|pentium|p6|sse2	最初に書く(残りはプロファイルからの変更)
+//   vendor GenuineIntel
+//   family 6 / model 1 / stepping 9
+//   brand 文字列
+//   enable mmx fxsr / disable cmov
+int cpuid_load(CPUx86 *cpu, char *fname)
+{
+	FILE *fp;
+	char line[256];
+	char *key;
+	char *val;
+	char *p;
+	int family;
+	int model;
+	int stepping;
+
+	fp = fopen(fname, "r");
+	if (fp==NULL) {
+		log_warning("cpuid: cannot open %s\n", fname);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		if ((p = strchr(line, '#'))) {
+			*p = '\0';
+		}
+		key = strtok(line, " \t\r\n");
+		if (key==NULL) {
+			continue;
+		}
+		val = strtok(NULL, "\r\n");
+		if (val==NULL) {
+			val = "";
+		}
+		while (*val==' ' || *val=='\t') {
+			val++;
+		}
+
+		family = (cpu->cpuid.signature >> 8 & 0x0F) + (cpu->cpuid.signature >> 20 & 0xFF);
+		model = (cpu->cpuid.signature >> 4 & 0x0F) | (cpu->cpuid.signature >> 12 & 0xF0);
+		stepping = cpu->cpuid.signature & 0x0F;
+		if (strcmp(key, "profile")==0) {
+			if (!cpuid_set_profile(cpu, val)) {
+				log_warning("cpuid: unknown profile %s\n", val);
+			}
+		} else if (strcmp(key, "vendor")==0) {
+			memset(cpu->cpuid.vendor, 0, sizeof(cpu->cpuid.vendor));
+			strncpy(cpu->cpuid.vendor, val, sizeof(cpu->cpuid.vendor) - 1);
+		} else if (strcmp(key, "brand")==0) {
+			memset(cpu->cpuid.brand, 0, sizeof(cpu->cpuid.brand));
+			strncpy(cpu->cpuid.brand, val, sizeof(cpu->cpuid.brand) - 1);
+			cpu->cpuid.max_ext_leaf = *val ? 0x80000004 : 0;
+		} else if (strcmp(key, "family")==0) {
+			cpuid_set_signature(cpu, strtol(val, NULL, 0), model, stepping);
+		} else if (strcmp(key, "model")==0) {
+			cpuid_set_signature(cpu, family, strtol(val, NULL, 0), stepping);
+		} else if (strcmp(key, "stepping")==0) {
+			cpuid_set_signature(cpu, family, model, strtol(val, NULL, 0));
+		} else if (strcmp(key, "enable")==0) {
+			cpuid_set_features(cpu, cpu->cpuid.features | cpuid_parse_features(val));
+		} else if (strcmp(key, "disable")==0) {
+			cpuid_set_features(cpu, cpu->cpuid.features & ~cpuid_parse_features(val));
+		} else {
+			log_warning("cpuid: unknown key %s\n", key);
+		}
+	}
+	fclose(fp);
+	return 1;
+}
+
+// VCPU_CPUID=プロファイル名または設定ファイル(なければ実装しているすべての機能)
+void cpuid_init(CPUx86 *cpu)
+{
+	char *env;
+
+	cpuid_set_profile(cpu, "sse2");
+	env = getenv("VCPU_CPUID");
+	if (env && *env && !cpuid_set_profile(cpu, env)) {
+		cpuid_load(cpu, env);
+	}
+}
+
+// MOV CR4で立てられるビット
+uint32 cpuid_cr4_mask(CPUx86 *cpu)
+{
+	uint32 mask = 0;
+
+	if (cpu_feature(cpu, CPUID_TSC)) {
+		mask |= CR4_TSD;
+	}
+	if (cpu_feature(cpu, CPUID_FXSR)) {
+		mask |= CR4_OSFXSR;
+	}
+	if (cpu_feature(cpu, CPUID_SSE)) {
+		mask |= CR4_OSXMMEXCPT;
+	}
+	return mask;
+}
+
+
+// opcode
+
+void opcode_cpuid(CPUx86 *cpu)
+{
+	Cpuid *cpuid = &(cpu->cpuid);
+	uint32 leaf;
+	uint32 regs[4];
+
+	leaf = cpu_regist_eax(cpu);
+	// 範囲外は基本リーフの最大のものを返す(拡張リーフがなければ0x80000000は0)
+	if (leaf & 0x80000000) {
+		if (leaf!=0x80000000 && cpuid->max_ext_leaf < leaf) {
+			leaf = cpuid->max_leaf;
+		}
+	} else if (cpuid->max_leaf < leaf) {
+		leaf = cpuid->max_leaf;
+	}
+
+	memset(regs, 0, sizeof(regs));
+	switch (leaf) {
+	case 0:
+		regs[0] = cpuid->max_leaf;
+		memcpy(&regs[1], cpuid->vendor, 4);
+		memcpy(&regs[3], cpuid->vendor + 4, 4);
+		memcpy(&regs[2], cpuid->vendor + 8, 4);
+		break;
+	case 1:
+		regs[0] = cpuid->signature;
+		regs[1] = cpu->apic.id << 24;	// 初期APIC ID
+		regs[2] = cpuid->features_ecx;
+		regs[3] = cpuid->features;
+		break;
+	case 0x80000000:
+		regs[0] = cpuid->max_ext_leaf;
+		break;
+	case 0x80000002:
+	case 0x80000003:
+	case 0x80000004:
+		memcpy(regs, cpuid->brand + (leaf - 0x80000002) * 16, 16);
+		break;
+	}
+	cpu_regist_eax(cpu) = regs[0];
+	cpu_regist_ebx(cpu) = regs[1];
+	cpu_regist_ecx(cpu) = regs[2];
+	cpu_regist_edx(cpu) = regs[3];
+}
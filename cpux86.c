@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include "cpux86.h"
 #include "log.h"
@@ -146,50 +147,47 @@ int mem_store_fp(CPUx86 *cpu, uint32 idx, FILE *fp)
 	return tidx-idx;
 }
 
+// 命令フェッチ(CS:EIP)
+
 uint8 mem_eip_load8(CPUx86 *cpu)
 {
-	uint8 val = cpu->mem[cpu->eip];
+	uint8 val = *seg_mem_ptr(cpu, cpu->segs[SEG_CS].base + cpu->eip, 1);
 	cpu->eip += 1;
 	return val;
 }
 
 uint32 mem_eip_load8_se(CPUx86 *cpu)
 {
-	uint8 val8 = mem_eip_load8(cpu);
-	uint32 val32;
-	if (val8 & 0x80) {
-		//val32 = val8 | 0xFFFFFF00;
-		val32 = val8 | 0x0000FF00;
-	} else {
-		val32 = val8 & 0x000000FF;
-	}
-	return val32;
+	return (uint32)(int32)(int8)mem_eip_load8(cpu);
 }
 
 uint16 mem_eip_load16(CPUx86 *cpu)
 {
-	uint16 val = cpu->mem[cpu->eip] + (cpu->mem[cpu->eip+1]<<8);
+	uint8 *p = seg_mem_ptr(cpu, cpu->segs[SEG_CS].base + cpu->eip, 2);
+	uint16 val = p[0] + (p[1]<<8);
 	cpu->eip += 2;
 	return val;
 }
 
 uint32 mem_eip_load24(CPUx86 *cpu)
 {
-	uint32 val = cpu->mem[cpu->eip] + (cpu->mem[cpu->eip+1]<<8) + (cpu->mem[cpu->eip+2]<<16);
+	uint8 *p = seg_mem_ptr(cpu, cpu->segs[SEG_CS].base + cpu->eip, 3);
+	uint32 val = p[0] + (p[1]<<8) + (p[2]<<16);
 	cpu->eip += 3;
 	return val;
 }
 
 uint32 mem_eip_load32(CPUx86 *cpu)
 {
-	uint32 val = cpu->mem[cpu->eip] + (cpu->mem[cpu->eip+1]<<8) + (cpu->mem[cpu->eip+2]<<16) + (cpu->mem[cpu->eip+3]<<24);
+	uint8 *p = seg_mem_ptr(cpu, cpu->segs[SEG_CS].base + cpu->eip, 4);
+	uint32 val = p[0] + (p[1]<<8) + (p[2]<<16) + (p[3]<<24);
 	cpu->eip += 4;
 	return val;
 }
 
 void* mem_eip_ptr(CPUx86 *cpu, int add)
 {
-	void *p = &(cpu->mem[cpu->eip]);
+	void *p = seg_mem_ptr(cpu, cpu->segs[SEG_CS].base + cpu->eip, add);
 	cpu->eip += add;
 	return p;
 }
@@ -199,21 +197,46 @@ void* mem_eip_ptr(CPUx86 *cpu, int add)
 
 uint32 seg_ss(CPUx86 *cpu)
 {
-	if (cpu_cr0(cpu, CR0_PE)) {
-		// プロテクトモード
-		if (0<cpu->ss) {
-			// セグメントレジスタ有効
-			if ((cpu->ss>>4) < cpu->gdtr.limit) {
-				return cpu->mem[cpu->gdtr.base + cpu->ss];
-			} else {
-				// index error
-			}
+	return cpu->segs[SEG_SS].base;
+}
+
+// オーバーライドプリフィックスのセグメント(なければseg)
+int cpu_prefix_segment(CPUx86 *cpu, int seg)
+{
+	if (cpu->prefix.segment_es) {
+		return SEG_ES;
+	} else if (cpu->prefix.segment_cs) {
+		return SEG_CS;
+	} else if (cpu->prefix.segment_ss) {
+		return SEG_SS;
+	} else if (cpu->prefix.segment_ds) {
+		return SEG_DS;
+	} else if (cpu->prefix.segment_fs) {
+		return SEG_FS;
+	} else if (cpu->prefix.segment_gs) {
+		return SEG_GS;
+	}
+	return seg;
+}
+
+// メモリオペランドのセグメント(EBP ESPをベースにするものはSS、ほかはDS)
+int cpu_modrm_segment(CPUx86 *cpu)
+{
+	if (cpu_address_size(cpu)==2) {
+		// [BP + SI] [BP + DI] [BP + disp]
+		if (cpu->modrm_rm==2 || cpu->modrm_rm==3 || (cpu->modrm_rm==6 && cpu->modrm_mod!=0)) {
+			return cpu_prefix_segment(cpu, SEG_SS);
 		}
-	} else {
-		// リアルモード
-		return cpu->ss << 4;
+	} else if (cpu->modrm_rm==4) {
+		// [<SIB>]
+		if (cpu->sib_base==4 || (cpu->sib_base==5 && cpu->modrm_mod!=0)) {
+			return cpu_prefix_segment(cpu, SEG_SS);
+		}
+	} else if (cpu->modrm_rm==5 && cpu->modrm_mod!=0) {
+		// [EBP + disp]
+		return cpu_prefix_segment(cpu, SEG_SS);
 	}
-	return 0;
+	return cpu_prefix_segment(cpu, SEG_DS);
 }
 
 
@@ -226,7 +249,7 @@ void mem_eip_load_modrm(CPUx86 *cpu)
 	cpu->modrm_mod = tmp>>6 & 0x03;
 	cpu->modrm_reg = tmp>>3 & 0x07;
 	cpu->modrm_rm = tmp & 0x07;
-	if (cpu_cr0(cpu, CR0_PE) && cpu->modrm_mod!=3 && cpu->modrm_rm==4) {
+	if (cpu_address_size(cpu)==4 && cpu->modrm_mod!=3 && cpu->modrm_rm==4) {
 		tmp = mem_eip_load8(cpu);
 		cpu->sib_scale = tmp>>6 & 0x03;
 		cpu->sib_index = tmp>>3 & 0x07;
@@ -244,6 +267,8 @@ uint32 cpu_sib_offset(CPUx86 *cpu)
 
 	// base
 	if (cpu->modrm_mod==0x00 && cpu->sib_base==5) {
+		// [disp32 + index*scale]
+		offset += mem_eip_load32(cpu);
 	} else {
 		offset += cpu->regs[cpu->sib_base];
 	}
@@ -251,16 +276,15 @@ uint32 cpu_sib_offset(CPUx86 *cpu)
 	// index scale
 	if (cpu->sib_index==4) {
 	} else {
-		offset += cpu->regs[cpu->sib_index] < cpu->sib_scale;
+		offset += cpu->regs[cpu->sib_index] << cpu->sib_scale;
 	}
 
 	return offset;
 }
 
 
-#define cpu_operand_size(cpu)	((cpu_cr0(cpu, CR0_PE)==(cpu)->prefix.operand_size) ? 2 : 4)
-
-uint32 cpu_modrm_offset(CPUx86 *cpu)
+// 32bitアドレス
+uint32 cpu_modrm_offset32(CPUx86 *cpu)
 {
 	int mod;
 	int rm;
@@ -270,165 +294,176 @@ uint32 cpu_modrm_offset(CPUx86 *cpu)
 	rm = cpu->modrm_rm;
 	offset = 0xFFFFFFFF;
 
-	if (cpu_cr0(cpu, CR0_PE)) {
-		// プロテクトモード
-		switch (mod) {
-		case 0x00:
-			switch (rm) {
-			case 0x00:	// [EAX]
-			case 0x01:	// [ECX]
-			case 0x02:	// [EDX]
-			case 0x03:	// [EBX]
-			case 0x06:	// [ESI]
-			case 0x07:	// [EDI]
-				offset = cpu->regs[rm];
-				break;
-			case 0x04:	// [<SIB>]
-				offset = cpu_sib_offset(cpu);
-				break;
-			case 0x05:	// [disp32]
-				offset = mem_eip_load32(cpu);
-				break;
-			}
+	switch (mod) {
+	case 0x00:
+		switch (rm) {
+		case 0x00:	// [EAX]
+		case 0x01:	// [ECX]
+		case 0x02:	// [EDX]
+		case 0x03:	// [EBX]
+		case 0x06:	// [ESI]
+		case 0x07:	// [EDI]
+			offset = cpu->regs[rm];
 			break;
-		case 0x01:
-			switch (rm) {
-			case 0x00:	// [EAX + disp8]
-			case 0x01:	// [ECX + disp8]
-			case 0x02:	// [EDX + disp8]
-			case 0x03:	// [EBX + disp8]
-			case 0x05:	// [EBP + disp8]
-			case 0x06:	// [ESI + disp8]
-			case 0x07:	// [EDI + disp8]
-				offset = cpu->regs[rm] + mem_eip_load8_se(cpu);
-				break;
-			case 0x04:	// [<SIB> + disp8]
-				offset = cpu_sib_offset(cpu) + mem_eip_load8_se(cpu);
-				break;
-			}
-			break;
-		case 0x02:
-			switch (rm) {
-			case 0x00:	// [EAX + disp16]
-			case 0x01:	// [ECX + disp16]
-			case 0x02:	// [EDX + disp16]
-			case 0x03:	// [EBX + disp16]
-			case 0x05:	// [EBP + disp16]
-			case 0x06:	// [ESI + disp16]
-			case 0x07:	// [EDI + disp16]
-				offset = cpu->regs[rm] + mem_eip_load16(cpu);
-				break;
-			case 0x04:	// [<SIB> + disp16]
-				offset = cpu_sib_offset(cpu) + mem_eip_load16(cpu);
-				break;
-			}
+		case 0x04:	// [<SIB>]
+			offset = cpu_sib_offset(cpu);
 			break;
-		case 0x03:
+		case 0x05:	// [disp32]
+			offset = mem_eip_load32(cpu);
 			break;
 		}
-	} else {
-		// リアルモード
-		switch (mod) {
-		case 0x00:	// [レジスタ + レジスタ]
-			switch (rm) {
-			case 0x04:
-				rm = mem_eip_load8(cpu) & 0x07;
-				offset = cpu->regs[rm];
-				break;
-			default:
-				offset = cpu->regs[rm];
-				break;
-			}
+		break;
+	case 0x01:
+		switch (rm) {
+		case 0x00:	// [EAX + disp8]
+		case 0x01:	// [ECX + disp8]
+		case 0x02:	// [EDX + disp8]
+		case 0x03:	// [EBX + disp8]
+		case 0x05:	// [EBP + disp8]
+		case 0x06:	// [ESI + disp8]
+		case 0x07:	// [EDI + disp8]
+			offset = cpu->regs[rm] + (int8)mem_eip_load8(cpu);
 			break;
-		case 0x01:	// [レジスタ + disp8]
-			switch (rm) {
-			case 0x00:	// [BX + SI + disp8]
-				offset = cpu_regist_bx(cpu) + cpu_regist_si(cpu) + mem_eip_load8_se(cpu);
-				break;
-			case 0x01:	// [BX + DI + disp8]
-				offset = cpu_regist_bx(cpu) + cpu_regist_di(cpu) + mem_eip_load8_se(cpu);
-				break;
-			case 0x02:	// [BP + SI + disp8]
-				offset = cpu_regist_bp(cpu) + cpu_regist_si(cpu) + mem_eip_load8_se(cpu);
-				break;
-			case 0x03:	// [BP + DI + disp8]
-				offset = cpu_regist_bp(cpu) + cpu_regist_di(cpu) + mem_eip_load8_se(cpu);
-				break;
-			case 0x04:	// [SI + disp8]
-				rm = mem_eip_load8_se(cpu) & 0x07;
-				offset = cpu_regist_si(cpu) + mem_eip_load8_se(cpu);
-				break;
-			case 0x05:	// [DI + disp8]
-				offset = cpu_regist_di(cpu) + mem_eip_load8_se(cpu);
-				break;
-			case 0x06:	// [BP + disp8]
-				offset = cpu_regist_bp(cpu) + mem_eip_load8_se(cpu);
-				break;
-			case 0x07:	// [BX + disp8]
-				offset = cpu_regist_bx(cpu) + mem_eip_load8_se(cpu);
-				break;
-			}
-			offset += cpu->regs[rm];
+		case 0x04:	// [<SIB> + disp8]
+			offset = cpu_sib_offset(cpu);
+			offset += (int8)mem_eip_load8(cpu);
 			break;
-		case 0x02:	// [レジスタ + disp16]
-			switch (rm) {
-			case 0x00:	// [BX + SI + disp16]
-				offset = cpu_regist_bx(cpu) + cpu_regist_si(cpu) + mem_eip_load16(cpu);
-				break;
-			case 0x01:	// [BX + DI + disp16]
-				offset = cpu_regist_bx(cpu) + cpu_regist_di(cpu) + mem_eip_load16(cpu);
-				break;
-			case 0x02:	// [BP + SI + disp16]
-				offset = cpu_regist_bp(cpu) + cpu_regist_si(cpu) + mem_eip_load16(cpu);
-				break;
-			case 0x03:	// [BP + DI + disp16]
-				offset = cpu_regist_bp(cpu) + cpu_regist_di(cpu) + mem_eip_load16(cpu);
-				break;
-			case 0x04:	// [SI + disp16]
-				offset = cpu_regist_si(cpu) + mem_eip_load16(cpu);
-				break;
-			case 0x05:	// [DI + disp16]
-				offset = cpu_regist_di(cpu) + mem_eip_load16(cpu);
-				break;
-			case 0x06:	// [BP + disp16]
-				offset = cpu_regist_bp(cpu) + mem_eip_load16(cpu);
-				break;
-			case 0x07:	// [BX + disp16]
-				offset = cpu_regist_bx(cpu) + mem_eip_load16(cpu);
-				break;
-			}
-			offset += cpu->regs[rm];
+		}
+		break;
+	case 0x02:
+		switch (rm) {
+		case 0x00:	// [EAX + disp32]
+		case 0x01:	// [ECX + disp32]
+		case 0x02:	// [EDX + disp32]
+		case 0x03:	// [EBX + disp32]
+		case 0x05:	// [EBP + disp32]
+		case 0x06:	// [ESI + disp32]
+		case 0x07:	// [EDI + disp32]
+			offset = cpu->regs[rm] + mem_eip_load32(cpu);
 			break;
-		case 0x03:	// レジスタ
+		case 0x04:	// [<SIB> + disp32]
+			offset = cpu_sib_offset(cpu);
+			offset += mem_eip_load32(cpu);
 			break;
 		}
+		break;
+	case 0x03:
+		break;
 	}
 	return offset;
 }
 
+// 16bitアドレス(リアルモード、仮想8086モード、16bitセグメント)
+uint32 cpu_modrm_offset16(CPUx86 *cpu)
+{
+	uint32 offset;
+
+	// ベースとインデックス
+	switch (cpu->modrm_rm) {
+	case 0x00:	// [BX + SI]
+		offset = cpu_regist_bx(cpu) + cpu_regist_si(cpu);
+		break;
+	case 0x01:	// [BX + DI]
+		offset = cpu_regist_bx(cpu) + cpu_regist_di(cpu);
+		break;
+	case 0x02:	// [BP + SI]
+		offset = cpu_regist_bp(cpu) + cpu_regist_si(cpu);
+		break;
+	case 0x03:	// [BP + DI]
+		offset = cpu_regist_bp(cpu) + cpu_regist_di(cpu);
+		break;
+	case 0x04:	// [SI]
+		offset = cpu_regist_si(cpu);
+		break;
+	case 0x05:	// [DI]
+		offset = cpu_regist_di(cpu);
+		break;
+	case 0x06:	// [BP] (mod 00は[disp16])
+		offset = cpu->modrm_mod==0x00 ? 0 : cpu_regist_bp(cpu);
+		break;
+	default:	// [BX]
+		offset = cpu_regist_bx(cpu);
+		break;
+	}
+
+	// ディスプレースメント
+	switch (cpu->modrm_mod) {
+	case 0x00:
+		if (cpu->modrm_rm==0x06) {
+			offset = mem_eip_load16(cpu);
+		}
+		break;
+	case 0x01:	// disp8
+		offset += mem_eip_load8_se(cpu);
+		break;
+	case 0x02:	// disp16
+		offset += mem_eip_load16(cpu);
+		break;
+	}
+	return offset & 0xFFFF;
+}
+
+// メモリオペランドのオフセット(アドレスサイズで16bit/32bitのどちらかだけを計算する)
+uint32 cpu_modrm_offset(CPUx86 *cpu)
+{
+	if (cpu_address_size(cpu)==2) {
+		return cpu_modrm_offset16(cpu);
+	}
+	return cpu_modrm_offset32(cpu);
+}
+
 void cpu_modrm_address(CPUx86 *cpu, uintp *result)
 {
 	uint32 offset;
 
 	if (cpu->modrm_mod==3) {
 		result->ptr.voidp = &(cpu->regs[cpu->modrm_rm]);
-		result->type = 4;
+		result->type = cpu_operand_size(cpu);
 	} else {
-		offset = cpu_modrm_offset(cpu);
-		result->ptr.voidp = &(cpu->mem[offset]);
+		offset = cpu_modrm_offset(cpu) + cpu->segs[cpu_modrm_segment(cpu)].base;
+		result->ptr.voidp = seg_mem_ptr(cpu, offset, cpu_operand_size(cpu));
 		result->type = cpu_operand_size(cpu);
 	}
 }
 
+// moffs(セグメントはDS、オフセットはアドレスサイズ)
+void cpu_moffs_address(CPUx86 *cpu, uintp *result)
+{
+	uint32 offset;
+
+	if (cpu_address_size(cpu)==2) {
+		offset = mem_eip_load16(cpu);
+	} else {
+		offset = mem_eip_load32(cpu);
+	}
+	result->ptr.voidp = seg_mem_ptr(cpu, cpu->segs[cpu_prefix_segment(cpu, SEG_DS)].base + offset, cpu_operand_size(cpu));
+	result->type = cpu_operand_size(cpu);
+}
+
+// 8bitオペランド(レジスタはAL~BL AH~BH)
+void cpu_modrm_address8(CPUx86 *cpu, uintp *result)
+{
+	uint32 offset;
+
+	if (cpu->modrm_mod==3) {
+		result->ptr.uint8p = cpu_reg8(cpu, cpu->modrm_rm);
+	} else {
+		offset = cpu_modrm_offset(cpu) + cpu->segs[cpu_modrm_segment(cpu)].base;
+		result->ptr.voidp = seg_mem_ptr(cpu, offset, 1);
+	}
+	result->type = 1;
+}
+
 void cpu_modrm_address_m16_32(CPUx86 *cpu, uintp *limit, uintp *base)
 {
 	uint32 offset;
 
 	if (cpu->modrm_mod==3) {
-		log_error("cpu_modrm_address_m16_32 exception\n");
+		// m16&32にレジスタは指定できない
+		cpu_fault(cpu, EXC_UD, 0);
 	} else {
-		offset = cpu_modrm_offset(cpu);
-		limit->ptr.voidp = &(cpu->mem[offset]);
+		offset = cpu_modrm_offset(cpu) + cpu->segs[cpu_modrm_segment(cpu)].base;
+		limit->ptr.voidp = seg_mem_ptr(cpu, offset, 6);
 		limit->type = 2;
 		base->ptr.voidp = &(cpu->mem[offset+2]);
 		base->type = 4;
@@ -436,6 +471,114 @@ void cpu_modrm_address_m16_32(CPUx86 *cpu, uintp *limit, uintp *base)
 }
 
 
+// string
+
+#define STRING_PAGE_SIZE	0x1000
+
+// 繰り返し回数(ECX/CX)を返す
+uint32 string_count(CPUx86 *cpu)
+{
+	if (cpu_address_size(cpu)==2) {
+		return cpu_regist_cx(cpu);
+	}
+	return cpu_regist_ecx(cpu);
+}
+
+// 繰り返し回数(ECX/CX)を設定
+void set_string_count(CPUx86 *cpu, uint32 count)
+{
+	if (cpu_address_size(cpu)==2) {
+		cpu_regist_ecx(cpu) = (cpu_regist_ecx(cpu) & 0xFFFF0000) | (count & 0xFFFF);
+	} else {
+		cpu_regist_ecx(cpu) = count;
+	}
+}
+
+// DS:ESI/ES:EDI(DS:SI/ES:DI)の指すリニアアドレスを返す(ESIのDSはオーバーライドできる)
+uint32 string_addr(CPUx86 *cpu, int reg)
+{
+	uint32 base;
+	if (reg==6) {
+		base = cpu->segs[cpu_prefix_segment(cpu, SEG_DS)].base;
+	} else {
+		base = cpu->segs[SEG_ES].base;
+	}
+	if (cpu_address_size(cpu)==2) {
+		return base + (cpu->regs[reg] & 0xFFFF);
+	}
+	return base + cpu->regs[reg];
+}
+
+// ESI/EDI(SI/DI)をn要素分進める(DFに従う)
+void string_advance(CPUx86 *cpu, int reg, uint32 n, int size)
+{
+	uint32 delta;
+	delta = n * size;
+	if (cpu_eflags(cpu, CPU_EFLAGS_DF)) {
+		delta = -delta;
+	}
+	if (cpu_address_size(cpu)==2) {
+		cpu->regs[reg] = (cpu->regs[reg] & 0xFFFF0000) | ((cpu->regs[reg] + delta) & 0xFFFF);
+	} else {
+		cpu->regs[reg] += delta;
+	}
+}
+
+// ESI/EDI(SI/DI)の指す位置からページ境界を越えずに処理できる要素数(最低1)をcountで制限して返す
+//   16bitアドレスではSI/DIが0xFFFFで折り返す手前までに制限する(折り返しはその後の要素ごとの処理で)
+uint32 string_chunk(CPUx86 *cpu, int reg, uint32 count, int size)
+{
+	uint32 addr;
+	uint32 offset;
+	uint32 n;
+	uint32 m;
+	addr = string_addr(cpu, reg);
+	if (cpu_eflags(cpu, CPU_EFLAGS_DF)) {
+		n = (addr & (STRING_PAGE_SIZE - 1)) / size + 1;
+	} else {
+		n = (STRING_PAGE_SIZE - (addr & (STRING_PAGE_SIZE - 1))) / size;
+	}
+	if (cpu_address_size(cpu)==2) {
+		offset = cpu->regs[reg] & 0xFFFF;
+		if (cpu_eflags(cpu, CPU_EFLAGS_DF)) {
+			m = offset / size + 1;
+		} else {
+			m = (0x10000 - offset) / size;
+		}
+		if (m < n) {
+			n = m;
+		}
+	}
+	if (n==0) {
+		n = 1;
+	}
+	return n < count ? n : count;
+}
+
+// n要素分の領域の先頭アドレスを返す(RAMの外なら#GP)
+uint32 string_range(CPUx86 *cpu, uint32 addr, uint32 n, int size)
+{
+	uint32 low;
+	low = addr;
+	if (cpu_eflags(cpu, CPU_EFLAGS_DF)) {
+		low = addr - (n - 1) * size;
+	}
+	if (addr < low || cpu->mem_size < (uint64)low + n * size) {
+		cpu_fault(cpu, EXC_GP, 0);
+	}
+	return low;
+}
+
+// REPで残りがあれば命令の先頭に戻して次のループで再開させる
+void string_repeat(CPUx86 *cpu, uint32 count)
+{
+	set_string_count(cpu, count);
+	if (count) {
+		cpu->eip = cpu->opcode_eip;
+	}
+}
+
+
 // opcode
 
 void opcode_aam(CPUx86 *cpu, uintp *val)
@@ -454,223 +597,484 @@ void opcode_aam(CPUx86 *cpu, uintp *val)
 void opcode_adc(CPUx86 *cpu, uintp *dst, uintp *src)
 {
 	uint32 val;
-	uint32 cf;
-	cf = cpu_eflags(cpu, CPU_EFLAGS_CF);
-	val = uintp_val(dst) + uintp_val(src) + cf;
-
-	// OF CF
-	if (uintp_val(dst) != val-uintp_val(src)-cf) {
-		set_cpu_eflags(cpu, CPU_EFLAGS_OF, 1);
-		set_cpu_eflags(cpu, CPU_EFLAGS_CF, 1);
-	} else {
-		set_cpu_eflags(cpu, CPU_EFLAGS_OF, 0);
-		set_cpu_eflags(cpu, CPU_EFLAGS_CF, 0);
-	}
-
+	uint32 src_val;
+	src_val = uintp_val(src);	// srcとdstが同じレジスタのこともある
+	val = uintp_val(dst) + src_val + cpu_eflags(cpu, CPU_EFLAGS_CF);
 	set_uintp_val(dst, val);
 
-	// AF
-	//set_cpu_eflags(cpu, CPU_EFLAGS_AF, )
-
-	// SF ZF PF
-	set_cpu_eflags_sf_zf_pf(cpu, dst);
-
-	// todo set flag: AF
+	// OF SF ZF AF PF CF (遅延評価、入力のCFはeflagsに残っている)
+	set_cpu_cc(cpu, CC_OP_ADC, dst->type, src_val, val);
 }
 
 void opcode_add(CPUx86 *cpu, uintp *dst, uintp *src)
 {
 	uint32 val;
-	val = uintp_val(dst) + uintp_val(src);
-
-	// OF CF
-	if (uintp_val(dst) != val-uintp_val(src)) {
-		set_cpu_eflags(cpu, CPU_EFLAGS_OF, 1);
-		set_cpu_eflags(cpu, CPU_EFLAGS_CF, 1);
-	} else {
-		set_cpu_eflags(cpu, CPU_EFLAGS_OF, 0);
-		set_cpu_eflags(cpu, CPU_EFLAGS_CF, 0);
-	}
-
+	uint32 src_val;
+	src_val = uintp_val(src);	// srcとdstが同じレジスタのこともある
+	val = uintp_val(dst) + src_val;
 	set_uintp_val(dst, val);
 
-	// AF
-	//set_cpu_eflags(cpu, CPU_EFLAGS_AF, )
-
-	// SF ZF PF
-	set_cpu_eflags_sf_zf_pf(cpu, dst);
-
-	// todo set flag: AF
+	// OF SF ZF AF PF CF (遅延評価)
+	set_cpu_cc(cpu, CC_OP_ADD, dst->type, src_val, val);
 }
 
 void opcode_and(CPUx86 *cpu, uintp *dst, uintp *src)
 {
-	set_uintp_val(dst, uintp_val(dst) & uintp_val(src));
-
-	// OF
-	set_cpu_eflags(cpu, CPU_EFLAGS_OF, 0);
-
-	// CF
-	set_cpu_eflags(cpu, CPU_EFLAGS_CF, 0);
+	uint32 val;
+	val = uintp_val(dst) & uintp_val(src);
+	set_uintp_val(dst, val);
 
-	// SF ZF PF
-	set_cpu_eflags_sf_zf_pf(cpu, dst);
+	// OF SF ZF PF CF (遅延評価)
+	set_cpu_cc(cpu, CC_OP_LOGIC, dst->type, 0, val);
 }
 
 void opcode_call(CPUx86 *cpu, uintp *val)
 {
 	uintp eip;
 	eip.ptr.voidp = &(cpu->eip);
-	eip.type = 4;
+	eip.type = cpu_operand_size(cpu);
 
 	opcode_push(cpu, &eip);
 	cpu->eip = cpu->eip + uintp_val(val);
+	if (cpu_operand_size(cpu)==2) {
+		cpu->eip &= 0xFFFF;
+	}
+}
+
+void opcode_call_near(CPUx86 *cpu, uintp *target)
+{
+	uintp eip;
+	uint32 target_val;
+
+	// call [esp]のこともあるのでpushの前に読む
+	target_val = uintp_val_ze(target);
+
+	eip.ptr.voidp = &(cpu->eip);
+	eip.type = cpu_operand_size(cpu);
+	opcode_push(cpu, &eip);
+	cpu->eip = target_val;
 }
 
 void opcode_cli(CPUx86 *cpu)
 {
-	if (!cpu_cr0(cpu, CR0_PE)) {
-		// Reset Interrupt Flag
-		set_cpu_eflags(cpu, CPU_EFLAGS_IF, 0);
-	} else {
-		if (!cpu_eflags(cpu, CPU_EFLAGS_VM)) {
-			// todo
-			// CPL???
-			log_error("todo opcode_cli !vm\n");
-		} else {
-			if (cpu_eflags(cpu, CPU_EFLAGS_IOPL)==3) {
-				// Reset Interrupt Flag
-				set_cpu_eflags(cpu, CPU_EFLAGS_IF, 0);
-			} else {
-				//if (cpu_eflags(cpu, CPU_EFLAGS_IOPL)<3 && VME)
-				// todo
-				log_error("todo opcode_cli\n");
-			}
+	// プロテクトモードはCPL<=IOPL、仮想8086モードはIOPL=3のときだけ(VMEはない)
+	if (cpu_cr0(cpu, CR0_PE)) {
+		if (cpu_eflags(cpu, CPU_EFLAGS_VM) ? cpu_eflags(cpu, CPU_EFLAGS_IOPL)!=3 : cpu_eflags(cpu, CPU_EFLAGS_IOPL) < cpu->cpl) {
+			cpu_fault(cpu, EXC_GP, 0);
+			return;
 		}
 	}
+	// Reset Interrupt Flag
+	set_cpu_eflags(cpu, CPU_EFLAGS_IF, 0);
 }
 
 void opcode_cmp(CPUx86 *cpu, uintp *src1, uintp *src2)
 {
-	uint32 temp_val;
-	uintp temp;
-	temp.ptr.voidp = &temp_val;
-	temp.type = src1->type;
-	uintp_val_copy(&temp, src1);
-
-	opcode_sub(cpu, &temp, src2);
+	// OF SF ZF AF PF CF (遅延評価)
+	set_cpu_cc(cpu, CC_OP_SUB, src1->type, uintp_val(src2), uintp_val(src1) - uintp_val(src2));
 }
 
-void opcode_dec(CPUx86 *cpu, uintp *target)
+// CMP/TESTの直後のJccをEFLAGSを計算せずにその場で実行する
+// remaining: スライスの残り命令数
+// 戻り値: 一緒に実行したJccの命令数(0か1、呼び出し元は命令数に足す)
+int opcode_cmp_jcc(CPUx86 *cpu, int remaining)
 {
-	set_uintp_val(target, uintp_val(target) - 1);
-}
+	uint8 *p;
+	uint32 addr;
+	uintp rel;
 
-void opcode_in(CPUx86 *cpu, uintp *src)
-{
-	// todo
-	//cpu_regist_eax(cpu) = 
-}
+	// シングルステップ中とデバッガをつないでいる間は命令境界を保つ
+	// (gdbのステップとJccのブレークポイントはループの先頭のgdb_checkでしか止まらない)
+	// スライスの最後の命令なら融合しない(JITと同じ命令数でスライスを区切る)
+	if ((cpu->eflags & CPU_EFLAGS_TF) || cpu->gdb || remaining < 1) {
+		return 0;
+	}
 
-void opcode_inc(CPUx86 *cpu, uintp *target)
-{
-	set_uintp_val(target, uintp_val(target) + 1);
+	// 次の命令がRAMの端なら融合しない(フェッチの#GPはその命令で起こす)
+	addr = cpu->segs[SEG_CS].base + cpu->eip;
+	if (cpu->mem_size < (uint64)addr + 2) {
+		return 0;
+	}
+	p = &(cpu->mem[addr]);
+	if ((p[0] & 0xF0)!=0x70 && !(p[0]==0x0F && (p[1] & 0xF0)==0x80)) {
+		return 0;
+	}
+
+	// Jccも1命令と数える(RDTSC、タイマー、リプレイの位置がインタプリタとJITで同じになる)
+	// Jccが例外になったときもその命令までを数えるので先に足す
+	cpu->clock.slice++;
+	cpu_current_reset(cpu);
+	cpu->opcode_eip = cpu->eip;
+	if (p[0]!=0x0F) {
+		// 7x cb : jcc rel8
+		cpu->eip += 1;
+		rel.ptr.voidp = mem_eip_ptr(cpu, 1);
+		rel.type = 1;
+		opcode_jcc(cpu, p[0] & 0x0F, &rel);
+	} else {
+		// 0F 8x cd : jcc rel32
+		cpu->eip += 2;
+		rel.ptr.voidp = mem_eip_ptr(cpu, cpu_operand_size(cpu));
+		rel.type = cpu_operand_size(cpu);
+		opcode_jcc(cpu, p[1] & 0x0F, &rel);
+	}
+	return 1;
 }
 
-void opcode_int(CPUx86 *cpu, uintp *val)
+// CMPXCHG: LOCKがなくてもアトミックに比べて書く(フラグはCMP acc dst、違えばaccに読んだ値)
+void opcode_cmpxchg(CPUx86 *cpu, uintp *dst, uintp *src)
 {
-	// todo
+	uintp acc;
+	uint32 expected;
+	uint32 old;
+	uint8 old8;
+	uint16 old16;
+
+	acc.ptr.voidp = &(cpu->regs[0]);
+	acc.type = dst->type;
+	expected = uintp_val_ze(&acc);
+	switch (dst->type) {
+	case 1:
+		old8 = expected;
+		__atomic_compare_exchange_n(dst->ptr.uint8p, &old8, (uint8)uintp_val(src), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		old = old8;
+		break;
+	case 2:
+		old16 = expected;
+		__atomic_compare_exchange_n(dst->ptr.uint16p, &old16, (uint16)uintp_val(src), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		old = old16;
+		break;
+	default:
+		old = expected;
+		__atomic_compare_exchange_n(dst->ptr.uint32p, &old, uintp_val(src), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		break;
+	}
+	if (old!=expected) {
+		set_uintp_val(&acc, old);
+	}
+
+	// OF SF ZF AF PF CF (遅延評価)
+	set_cpu_cc(cpu, CC_OP_SUB, dst->type, old, expected - old);
 }
 
-void opcode_into(CPUx86 *cpu)
+void opcode_cmps(CPUx86 *cpu, int size)
 {
-	// todo
+	uintp src1;
+	uintp src2;
+	uint32 count;
+	uint32 n;
+	uint32 i;
+
+	src1.type = size;
+	src2.type = size;
+
+	if (!cpu->prefix.rep && !cpu->prefix.repne) {
+		src1.ptr.voidp = &(cpu->mem[string_range(cpu, string_addr(cpu, 6), 1, size)]);
+		src2.ptr.voidp = &(cpu->mem[string_range(cpu, string_addr(cpu, 7), 1, size)]);
+		opcode_cmp(cpu, &src1, &src2);
+		string_advance(cpu, 6, 1, size);
+		string_advance(cpu, 7, 1, size);
+		return;
+	}
+
+	count = string_count(cpu);
+	if (count==0) {
+		return;
+	}
+
+	// ページ境界まで比較して一旦抜ける
+	n = string_chunk(cpu, 6, count, size);
+	n = string_chunk(cpu, 7, n, size);
+	string_range(cpu, string_addr(cpu, 6), n, size);
+	string_range(cpu, string_addr(cpu, 7), n, size);
+	for (i=0; i<n; i++) {
+		src1.ptr.voidp = &(cpu->mem[string_addr(cpu, 6)]);
+		src2.ptr.voidp = &(cpu->mem[string_addr(cpu, 7)]);
+		opcode_cmp(cpu, &src1, &src2);
+		string_advance(cpu, 6, 1, size);
+		string_advance(cpu, 7, 1, size);
+		count--;
+		// REPE: ZF=0で終了 / REPNE: ZF=1で終了
+		if (cpu_eflags(cpu, CPU_EFLAGS_ZF)==cpu->prefix.repne) {
+			set_string_count(cpu, count);
+			return;
+		}
+	}
+	string_repeat(cpu, count);
 }
 
-void opcode_jle_short(CPUx86 *cpu, uintp *rel)
+void opcode_dec(CPUx86 *cpu, uintp *target)
 {
-	if (cpu_eflags(cpu, CPU_EFLAGS_ZF) || cpu_eflags(cpu, CPU_EFLAGS_SF)!=cpu_eflags(cpu, CPU_EFLAGS_OF)) {
-		opcode_jmp_short(cpu, rel);
-	}
+	uint32 val;
+	val = uintp_val(target) - 1;
+	set_uintp_val(target, val);
+
+	// OF SF ZF AF PF (遅延評価、CFは変えない)
+	cpu_eflags_sync(cpu);
+	set_cpu_cc(cpu, CC_OP_DEC, target->type, 1, val);
 }
 
-void opcode_jmp_far(CPUx86 *cpu, uintp *segment, uintp *offset)
+// AX、DX:AX、EDX:EAXをsrcで割る(0除算と商のあふれは#DE)
+void opcode_div(CPUx86 *cpu, uintp *src)
 {
-	uint32 tempEIP = 0;
+	uint64 dividend;
+	uint64 quotient;
+	uint64 remainder;
+	uint32 divisor;
 
-	if (!cpu_cr0(cpu, CR0_PE) || (cpu_cr0(cpu, CR0_PE) && cpu_eflags(cpu, CPU_EFLAGS_VM))) {
-		// real-address or virtual-8086 mode
-		// todo
-	} else if (cpu_cr0(cpu, CR0_PE) && !cpu_eflags(cpu, CPU_EFLAGS_VM)) {
-		// Protected mode, not virtual-8086 mode
+	divisor = uintp_val_ze(src);
+	if (divisor==0) {
+		cpu_fault(cpu, EXC_DE, 0);
+		return;
+	}
+	switch (src->type) {
+	case 1:
+		dividend = cpu_regist_ax(cpu);
+		quotient = dividend / divisor;
+		remainder = dividend % divisor;
+		if (0xFF < quotient) {
+			cpu_fault(cpu, EXC_DE, 0);
+			return;
+		}
+		cpu_regist_eax(cpu) = (cpu_regist_eax(cpu) & 0xFFFF0000) | remainder << 8 | quotient;
+		break;
+	case 2:
+		dividend = cpu_regist_dx(cpu) << 16 | cpu_regist_ax(cpu);
+		quotient = dividend / divisor;
+		remainder = dividend % divisor;
+		if (0xFFFF < quotient) {
+			cpu_fault(cpu, EXC_DE, 0);
+			return;
+		}
+		cpu_regist_eax(cpu) = (cpu_regist_eax(cpu) & 0xFFFF0000) | quotient;
+		cpu_regist_edx(cpu) = (cpu_regist_edx(cpu) & 0xFFFF0000) | remainder;
+		break;
+	default:
+		dividend = (uint64)cpu_regist_edx(cpu) << 32 | cpu_regist_eax(cpu);
+		quotient = dividend / divisor;
+		remainder = dividend % divisor;
+		if (0xFFFFFFFF < quotient) {
+			cpu_fault(cpu, EXC_DE, 0);
+			return;
+		}
+		cpu_regist_eax(cpu) = quotient;
+		cpu_regist_edx(cpu) = remainder;
+		break;
 	}
 }
 
-void opcode_jmp_short(CPUx86 *cpu, uintp *rel)
+// 符号付き(商は0方向に丸め、余りは被除数と同じ符号)
+// 割り込みが来るまで止まる(exec_cpux86がタイマーを進めて起こす)
+void opcode_hlt(CPUx86 *cpu)
 {
-	cpu->eip += (int)uintp_val(rel);
+	if (cpu_cr0(cpu, CR0_PE) && cpu->cpl!=0) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
+	}
+	cpu->halted = 1;
 }
 
-void opcode_jz(CPUx86 *cpu, uintp *rel)
+void opcode_idiv(CPUx86 *cpu, uintp *src)
 {
-	if (cpu_eflags(cpu, CPU_EFLAGS_ZF)) {
-		cpu->eip += uintp_val(rel);
-		if (rel->type==2) {
-			cpu->eip &= 0xFFFF;
-		} else if (rel->type==4) {
-			// todo
-			log_error("todo opcode_jz\n");
+	int64 dividend;
+	int64 quotient;
+	int64 remainder;
+	int32 divisor;
+
+	divisor = uintp_val(src);
+	if (divisor==0) {
+		cpu_fault(cpu, EXC_DE, 0);
+		return;
+	}
+	switch (src->type) {
+	case 1:
+		dividend = (int16)cpu_regist_ax(cpu);
+		quotient = dividend / divisor;
+		remainder = dividend % divisor;
+		if (quotient < -0x80 || 0x7F < quotient) {
+			cpu_fault(cpu, EXC_DE, 0);
+			return;
+		}
+		cpu_regist_eax(cpu) = (cpu_regist_eax(cpu) & 0xFFFF0000) | (remainder & 0xFF) << 8 | (quotient & 0xFF);
+		break;
+	case 2:
+		dividend = (int32)(cpu_regist_dx(cpu) << 16 | cpu_regist_ax(cpu));
+		quotient = dividend / divisor;
+		remainder = dividend % divisor;
+		if (quotient < -0x8000 || 0x7FFF < quotient) {
+			cpu_fault(cpu, EXC_DE, 0);
+			return;
+		}
+		cpu_regist_eax(cpu) = (cpu_regist_eax(cpu) & 0xFFFF0000) | (quotient & 0xFFFF);
+		cpu_regist_edx(cpu) = (cpu_regist_edx(cpu) & 0xFFFF0000) | (remainder & 0xFFFF);
+		break;
+	default:
+		dividend = (int64)((uint64)cpu_regist_edx(cpu) << 32 | cpu_regist_eax(cpu));
+		// INT64_MIN / -1 はホストでも割り算の例外になる
+		if (divisor==-1 && dividend==(int64)0x8000000000000000ULL) {
+			cpu_fault(cpu, EXC_DE, 0);
+			return;
+		}
+		quotient = dividend / divisor;
+		remainder = dividend % divisor;
+		if (quotient < -0x80000000LL || 0x7FFFFFFFLL < quotient) {
+			cpu_fault(cpu, EXC_DE, 0);
+			return;
 		}
+		cpu_regist_eax(cpu) = quotient;
+		cpu_regist_edx(cpu) = remainder;
+		break;
 	}
 }
 
-void opcode_jnz(CPUx86 *cpu, uintp *rel)
+void opcode_in(CPUx86 *cpu, uintp *port, uintp *dst)
 {
-	if (!cpu_eflags(cpu, CPU_EFLAGS_ZF)) {
-		cpu->eip += uintp_val(rel);
-		if (rel->type==2) {
-			cpu->eip &= 0xFFFF;
-		} else if (rel->type==4) {
-			// todo
-			log_error("todo opcode_jnz\n");
-		}
+	if (!io_allowed(cpu)) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
 	}
+	set_uintp_val(dst, io_in(cpu, uintp_val_ze(port), dst->type));
+}
+
+void opcode_inc(CPUx86 *cpu, uintp *target)
+{
+	uint32 val;
+	val = uintp_val(target) + 1;
+	set_uintp_val(target, val);
+
+	// OF SF ZF AF PF (遅延評価、CFは変えない)
+	cpu_eflags_sync(cpu);
+	set_cpu_cc(cpu, CC_OP_INC, target->type, 1, val);
 }
 
-void opcode_js(CPUx86 *cpu, uintp *rel)
+void opcode_jcc(CPUx86 *cpu, int cc, uintp *rel)
 {
-	if (cpu_eflags(cpu, CPU_EFLAGS_SF)) {
+	if (cpu_cond(cpu, cc)) {
 		cpu->eip += uintp_val(rel);
-		if (rel->type==2) {
+		if (cpu_operand_size(cpu)==2) {
 			cpu->eip &= 0xFFFF;
-		} else if (rel->type==4) {
-			// todo
-			log_error("todo opcode_js\n");
 		}
 	}
 }
 
-void opcode_lea(CPUx86 *cpu, uintp *dst, uintp *src)
+void opcode_jmp_near(CPUx86 *cpu, uintp *target)
 {
-	set_uintp_val(dst, uintp_val(src));
+	cpu->eip = uintp_val_ze(target);
 }
 
-void opcode_lgdt(CPUx86 *cpu, uintp *limit, uintp *base)
+void opcode_jmp_short(CPUx86 *cpu, uintp *rel)
 {
+	cpu->eip += (int)uintp_val(rel);
 	if (cpu_operand_size(cpu)==2) {
-		cpu->gdtr.limit = uintp_val(limit);
-		cpu->gdtr.base = uintp_val(base) & 0x00FFFFFF;
-	} else if (cpu_operand_size(cpu)==4) {
-		cpu->gdtr.limit = uintp_val(limit);
-		cpu->gdtr.base = uintp_val(base);
+		cpu->eip &= 0xFFFF;
 	}
 }
 
-void opcode_mov(CPUx86 *cpu, uintp *dst, uintp *src)
+void opcode_lea(CPUx86 *cpu, uintp *dst, uintp *src)
 {
 	set_uintp_val(dst, uintp_val(src));
 }
 
+void opcode_lods(CPUx86 *cpu, int size)
+{
+	uintp dst;
+	uintp src;
+	uint32 count;
+	uint32 n;
+
+	dst.ptr.voidp = &(cpu_regist_eax(cpu));
+	dst.type = size;
+	src.type = size;
+
+	if (!cpu->prefix.rep && !cpu->prefix.repne) {
+		src.ptr.voidp = &(cpu->mem[string_range(cpu, string_addr(cpu, 6), 1, size)]);
+		opcode_mov(cpu, &dst, &src);
+		string_advance(cpu, 6, 1, size);
+		return;
+	}
+
+	count = string_count(cpu);
+	if (count==0) {
+		return;
+	}
+
+	// 途中の値は上書きされるだけなので最後の要素だけ読む
+	n = string_chunk(cpu, 6, count, size);
+	string_range(cpu, string_addr(cpu, 6), n, size);
+	string_advance(cpu, 6, n - 1, size);
+	src.ptr.voidp = &(cpu->mem[string_addr(cpu, 6)]);
+	opcode_mov(cpu, &dst, &src);
+	string_advance(cpu, 6, 1, size);
+	string_repeat(cpu, count - n);
+}
+
+void opcode_mov(CPUx86 *cpu, uintp *dst, uintp *src)
+{
+	set_uintp_val(dst, uintp_val(src));
+}
+
+void opcode_cmov(CPUx86 *cpu, int cc, uintp *dst, uintp *src)
+{
+	if (!cpu_feature(cpu, CPUID_CMOV)) {
+		cpu_fault(cpu, EXC_UD, 0);
+		return;
+	}
+	if (cpu_cond(cpu, cc)) {
+		set_uintp_val(dst, uintp_val(src));
+	}
+}
+
+void opcode_movs(CPUx86 *cpu, int size)
+{
+	uintp dst;
+	uintp src;
+	uint32 count;
+	uint32 n;
+	uint32 src_low;
+	uint32 dst_low;
+	uint32 i;
+
+	dst.type = size;
+	src.type = size;
+
+	if (!cpu->prefix.rep && !cpu->prefix.repne) {
+		dst.ptr.voidp = &(cpu->mem[string_range(cpu, string_addr(cpu, 7), 1, size)]);
+		src.ptr.voidp = &(cpu->mem[string_range(cpu, string_addr(cpu, 6), 1, size)]);
+		opcode_mov(cpu, &dst, &src);
+		string_advance(cpu, 6, 1, size);
+		string_advance(cpu, 7, 1, size);
+		return;
+	}
+
+	count = string_count(cpu);
+	if (count==0) {
+		return;
+	}
+
+	// ページ境界まで転送して一旦抜ける
+	n = string_chunk(cpu, 6, count, size);
+	n = string_chunk(cpu, 7, n, size);
+	src_low = string_range(cpu, string_addr(cpu, 6), n, size);
+	dst_low = string_range(cpu, string_addr(cpu, 7), n, size);
+
+	if (dst_low + n * size <= src_low || src_low + n * size <= dst_low) {
+		// 重なりがなければ一括転送
+		memmove(&(cpu->mem[dst_low]), &(cpu->mem[src_low]), n * size);
+		string_advance(cpu, 6, n, size);
+		string_advance(cpu, 7, n, size);
+	} else {
+		// 重なりがある場合は1要素ずつ(パターン複製の動作を保つ)
+		for (i=0; i<n; i++) {
+			dst.ptr.voidp = &(cpu->mem[string_addr(cpu, 7)]);
+			src.ptr.voidp = &(cpu->mem[string_addr(cpu, 6)]);
+			opcode_mov(cpu, &dst, &src);
+			string_advance(cpu, 6, 1, size);
+			string_advance(cpu, 7, 1, size);
+		}
+	}
+	string_repeat(cpu, count - n);
+}
+
 void opcode_movsx(CPUx86 *cpu, uintp *dst, uintp *src)
 {
 	set_uintp_val(dst, uintp_val(src));
@@ -678,15 +1082,16 @@ void opcode_movsx(CPUx86 *cpu, uintp *dst, uintp *src)
 
 void opcode_movzx(CPUx86 *cpu, uintp *dst, uintp *src)
 {
-	printf("movzx: 0x%X 0x%X\n", uintp_val(src), uintp_val_ze(src));
 	set_uintp_val(dst, uintp_val_ze(src));
 }
 
 void opcode_out(CPUx86 *cpu, uintp *port, uintp *val)
 {
-	// todo
-
-	printf("out: 0x%X\n", uintp_val(val));
+	if (!io_allowed(cpu)) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
+	}
+	io_out(cpu, uintp_val_ze(port), val->type, uintp_val_ze(val));
 }
 
 void opcode_or(CPUx86 *cpu, uintp *dst, uintp *src)
@@ -695,93 +1100,86 @@ void opcode_or(CPUx86 *cpu, uintp *dst, uintp *src)
 	val = uintp_val(dst) | uintp_val(src);
 	set_uintp_val(dst, val);
 
-	// OF
-	set_cpu_eflags(cpu, CPU_EFLAGS_OF, 0);
-
-	// CF
-	set_cpu_eflags(cpu, CPU_EFLAGS_CF, 0);
-
-	// SF ZF PF
-	set_cpu_eflags_sf_zf_pf(cpu, dst);
+	// OF SF ZF PF CF (遅延評価)
+	set_cpu_cc(cpu, CC_OP_LOGIC, dst->type, 0, val);
 }
 
 void opcode_pop(CPUx86 *cpu, uintp *dst)
 {
 	uintp src;
+	Descriptor *ss;
+	uint32 esp;
 
-	// todo
-	// 『IA-32 インテル ® アーキテクチャ・ソフト ウェア・デベロッパーズ・マニュアル、上巻』の第 6 章の「スタックアクセスにお けるアドレスサイズ属性」
-	if (cpu_cr0(cpu, CR0_PE)) {
-		// stack size is 32bit
-		if (dst->type==4) {
-			// operand size is 4byte
-			src.ptr.voidp = &(cpu->mem[cpu_regist_esp(cpu)]);
-			src.type = 4;
-			uintp_val_copy(dst, &src);
-			cpu_regist_esp(cpu) += 4;
-		} else if (dst->type==2) {
-			// operand size is 2byte
-			src.ptr.voidp = &(cpu->mem[cpu_regist_esp(cpu)]);
-			src.type = 2;
-			uintp_val_copy(dst, &src);
-			cpu_regist_esp(cpu) += 2;
-		}
-	} else {
-		// stack size is 16bit
-		if (dst->type==2) {
-			// operand size is 2byte
-			src.ptr.voidp = &(cpu->mem[cpu_regist_esp(cpu)]);
-			src.type = 2;
-			uintp_val_copy(dst, &src);
-			cpu_regist_esp(cpu) += 2;
-		} else if (dst->type==4) {
-			// operand size is 4byte
-			src.ptr.voidp = &(cpu->mem[cpu_regist_esp(cpu)]);
-			src.type = 4;
-			uintp_val_copy(dst, &src);
-			cpu_regist_esp(cpu) += 4;
-		}
-	}
+	// SS:ESP(SSのBビットが0ならSS:SP)から読む
+	ss = &(cpu->segs[SEG_SS]);
+	esp = cpu_regist_esp(cpu);
+	src.ptr.voidp = seg_mem_ptr(cpu, ss->base + (desc_d(ss) ? esp : (esp & 0xFFFF)), dst->type);
+	src.type = dst->type;
+	seg_set_esp(cpu, ss, esp + dst->type);
+	uintp_val_copy(dst, &src);
 }
 
 void opcode_push(CPUx86 *cpu, uintp *val)
 {
 	uintp dst;
+	Descriptor *ss;
+	uint32 esp;
 
-	// todo
-	// 『IA-32 インテル ® アーキテクチャ・ソフト ウェア・デベロッパーズ・マニュアル、上巻』の第 6 章の「スタックアクセスにお けるアドレスサイズ属性」
-	if (cpu_cr0(cpu, CR0_PE)) {
-		// stack size is 32bit
-		if (val->type==4) {
-			// operand size is 4byte
-			cpu_regist_esp(cpu) -= 4;
-			dst.ptr.voidp = &(cpu->mem[cpu_regist_esp(cpu)]);
-			dst.type = 4;
-			uintp_val_copy(&dst, val);
-		} else {
-			// operand size is 2byte
-			dst.ptr.voidp = &(cpu->mem[cpu_regist_esp(cpu)]);
-			dst.type = 2;
-			uintp_val_copy(&dst, val);
-		}
-	} else {
-		// stack size is 16bit
-		if (val->type==2) {
-			// operand size is 2byte
-			cpu_regist_esp(cpu) -= 2;
-			//dst.ptr.voidp = &(cpu->mem[seg_ss(cpu) + cpu_regist_esp(cpu)]);
-			dst.ptr.voidp = &(cpu->mem[cpu_regist_esp(cpu)]);
-			dst.type = 2;
-			uintp_val_copy(&dst, val);
-		} else if (val->type==4) {
-			// operand size is 4byte
-			cpu_regist_esp(cpu) -= 4;
-			//dst.ptr.voidp = &(cpu->mem[seg_ss(cpu) + cpu_regist_esp(cpu)]);
-			dst.ptr.voidp = &(cpu->mem[cpu_regist_esp(cpu)]);
-			dst.type = 4;
-			uintp_val_copy(&dst, val);
-		}
+	// SS:ESP(SSのBビットが0ならSS:SP)に積む
+	ss = &(cpu->segs[SEG_SS]);
+	esp = cpu_regist_esp(cpu) - val->type;
+	dst.ptr.voidp = seg_mem_ptr(cpu, ss->base + (desc_d(ss) ? esp : (esp & 0xFFFF)), val->type);
+	dst.type = val->type;
+	uintp_val_copy(&dst, val);
+	seg_set_esp(cpu, ss, esp);
+}
+
+void opcode_rcl(CPUx86 *cpu, uintp *dst, uintp *count)
+{
+	uint32 bits;
+	uint32 temp_count;
+	uint64 temp_val;
+	uint32 val;
+
+	// CFを含めた(bits+1)ビットでローテートする
+	bits = uintp_bits(dst);
+	temp_count = (uintp_val_ze(count) & 0x1F) % (bits + 1);
+	if (temp_count==0) {
+		return;
+	}
+
+	temp_val = (uint64)cpu_eflags(cpu, CPU_EFLAGS_CF) << bits | uintp_val_ze(dst);
+	temp_val = (temp_val << temp_count | temp_val >> (bits + 1 - temp_count)) & (((uint64)1 << (bits + 1)) - 1);
+	val = (uint32)temp_val & uintp_mask(dst);
+	set_uintp_val(dst, val);
+
+	// CF OF
+	set_cpu_eflags(cpu, CPU_EFLAGS_CF, (uint32)(temp_val >> bits) & 0x01);
+	set_cpu_eflags(cpu, CPU_EFLAGS_OF, (val >> (bits - 1) & 0x01) ^ cpu_eflags(cpu, CPU_EFLAGS_CF));
+}
+
+void opcode_rcr(CPUx86 *cpu, uintp *dst, uintp *count)
+{
+	uint32 bits;
+	uint32 temp_count;
+	uint64 temp_val;
+	uint32 val;
+
+	// CFを含めた(bits+1)ビットでローテートする
+	bits = uintp_bits(dst);
+	temp_count = (uintp_val_ze(count) & 0x1F) % (bits + 1);
+	if (temp_count==0) {
+		return;
 	}
+
+	temp_val = (uint64)cpu_eflags(cpu, CPU_EFLAGS_CF) << bits | uintp_val_ze(dst);
+	temp_val = (temp_val >> temp_count | temp_val << (bits + 1 - temp_count)) & (((uint64)1 << (bits + 1)) - 1);
+	val = (uint32)temp_val & uintp_mask(dst);
+	set_uintp_val(dst, val);
+
+	// CF OF
+	set_cpu_eflags(cpu, CPU_EFLAGS_CF, (uint32)(temp_val >> bits) & 0x01);
+	set_cpu_eflags(cpu, CPU_EFLAGS_OF, (val >> (bits - 1) ^ val >> (bits - 2)) & 0x01);
 }
 
 void opcode_ret_neer(CPUx86 *cpu)
@@ -789,78 +1187,256 @@ void opcode_ret_neer(CPUx86 *cpu)
 	uintp dst;
 	uint32 dst_val;
 	dst.ptr.voidp = &dst_val;
-	dst.type = 4;
+	dst.type = cpu_operand_size(cpu);
 
 	opcode_pop(cpu, &dst);
 	cpu->eip = uintp_val_ze(&dst);
 }
 
-void opcode_sar(CPUx86 *cpu, uintp *dst, uintp *count)
+void opcode_rol(CPUx86 *cpu, uintp *dst, uintp *count)
 {
+	uint32 bits;
 	uint32 temp_count;
-	temp_count = uintp_val(count) & 0x1F;
+	uint32 val;
 
-	while (temp_count) {
-		set_cpu_eflags(cpu, CPU_EFLAGS_CF, uintp_lsb(dst));
-		set_uintp_val(dst, (int32)uintp_val(dst) / 2);
-		temp_count--;
+	if ((uintp_val_ze(count) & 0x1F)==0) {
+		return;
 	}
 
-	if ((uintp_val(count) & 0x1F)==1) {
-		set_cpu_eflags(cpu, CPU_EFLAGS_OF, 0);
+	bits = uintp_bits(dst);
+	temp_count = (uintp_val_ze(count) & 0x1F) & (bits - 1);
+	val = uintp_val_ze(dst);
+	if (temp_count) {
+		val = (val << temp_count | val >> (bits - temp_count)) & uintp_mask(dst);
+		set_uintp_val(dst, val);
 	}
+
+	// CF OF
+	set_cpu_eflags(cpu, CPU_EFLAGS_CF, val & 0x01);
+	set_cpu_eflags(cpu, CPU_EFLAGS_OF, (val >> (bits - 1) ^ val) & 0x01);
 }
 
-void opcode_sal(CPUx86 *cpu, uintp *dst, uintp *count)
+void opcode_ror(CPUx86 *cpu, uintp *dst, uintp *count)
 {
+	uint32 bits;
 	uint32 temp_count;
-	temp_count = uintp_val(count) & 0x1F;
+	uint32 val;
 
-	while (temp_count) {
-		set_cpu_eflags(cpu, CPU_EFLAGS_CF, uintp_msb(dst));
-		set_uintp_val(dst, uintp_val(dst) * 2);
-		temp_count--;
+	if ((uintp_val_ze(count) & 0x1F)==0) {
+		return;
 	}
 
-	if ((uintp_val(count) & 0x1F)==1) {
-		set_cpu_eflags(cpu, CPU_EFLAGS_OF, uintp_msb(dst) ^ cpu_eflags(cpu, CPU_EFLAGS_CF));
+	bits = uintp_bits(dst);
+	temp_count = (uintp_val_ze(count) & 0x1F) & (bits - 1);
+	val = uintp_val_ze(dst);
+	if (temp_count) {
+		val = (val >> temp_count | val << (bits - temp_count)) & uintp_mask(dst);
+		set_uintp_val(dst, val);
 	}
+
+	// CF OF
+	set_cpu_eflags(cpu, CPU_EFLAGS_CF, val >> (bits - 1) & 0x01);
+	set_cpu_eflags(cpu, CPU_EFLAGS_OF, (val >> (bits - 1) ^ val >> (bits - 2)) & 0x01);
 }
 
-void opcode_sbb(CPUx86 *cpu, uintp *dst, uintp *src)
+void opcode_sar(CPUx86 *cpu, uintp *dst, uintp *count)
 {
-	set_uintp_val(dst, uintp_val(dst) - uintp_val(src) - cpu_eflags(cpu, CPU_EFLAGS_CF));
+	uint32 temp_count;
+	int32 val;
+
+	temp_count = uintp_val_ze(count) & 0x1F;
+	if (temp_count==0) {
+		return;
+	}
+
+	// uintp_valは符号拡張済みなので32bitの算術シフトで全幅を扱える
+	val = (int32)uintp_val(dst);
+	set_cpu_eflags(cpu, CPU_EFLAGS_CF, (uint32)(val >> (temp_count - 1)) & 0x01);
+	set_uintp_val(dst, (uint32)(val >> temp_count));
+
+	// OF
+	set_cpu_eflags(cpu, CPU_EFLAGS_OF, 0);
 
-	// todo set flag: OF SF ZF AF PF CF
+	// SF ZF PF
+	set_cpu_eflags_sf_zf_pf(cpu, dst);
 }
 
-void opcode_shr(CPUx86 *cpu, uintp *dst, uintp *count)
+void opcode_sal(CPUx86 *cpu, uintp *dst, uintp *count)
 {
+	uint32 bits;
 	uint32 temp_count;
-	uint32 temp_dest_val;
-	uintp temp_dest;
+	uint32 val;
 
-	temp_count = uintp_val(count) & 0x1F;
+	temp_count = uintp_val_ze(count) & 0x1F;
+	if (temp_count==0) {
+		return;
+	}
 
-	temp_dest.ptr.voidp = &temp_dest_val;
-	temp_dest.type = dst->type;
-	uintp_val_copy(&temp_dest, dst);
+	bits = uintp_bits(dst);
+	val = uintp_val_ze(dst);
 
-	while (temp_count) {
-		set_cpu_eflags(cpu, CPU_EFLAGS_CF, uintp_lsb(dst));
-		set_uintp_val(dst, uintp_val(dst) / 2);
-		temp_count--;
+	// CF: 最後に押し出されたビット
+	if (temp_count<=bits) {
+		set_cpu_eflags(cpu, CPU_EFLAGS_CF, val >> (bits - temp_count) & 0x01);
+	} else {
+		set_cpu_eflags(cpu, CPU_EFLAGS_CF, 0);
 	}
+	set_uintp_val(dst, val << temp_count);
 
 	// OF
-	if ((uintp_val(count) & 0x1F)==1) {
-		set_cpu_eflags(cpu, CPU_EFLAGS_OF, uintp_msb(&temp_dest));
+	set_cpu_eflags(cpu, CPU_EFLAGS_OF, uintp_msb(dst) ^ cpu_eflags(cpu, CPU_EFLAGS_CF));
+
+	// SF ZF PF
+	set_cpu_eflags_sf_zf_pf(cpu, dst);
+}
+
+void opcode_sbb(CPUx86 *cpu, uintp *dst, uintp *src)
+{
+	uint32 val;
+	uint32 src_val;
+	src_val = uintp_val(src);	// srcとdstが同じレジスタのこともある
+	val = uintp_val(dst) - src_val - cpu_eflags(cpu, CPU_EFLAGS_CF);
+	set_uintp_val(dst, val);
+
+	// OF SF ZF AF PF CF (遅延評価、入力のCFはeflagsに残っている)
+	set_cpu_cc(cpu, CC_OP_SBB, dst->type, src_val, val);
+}
+
+void opcode_scas(CPUx86 *cpu, int size)
+{
+	uintp src1;
+	uintp src2;
+	uint32 count;
+	uint32 n;
+	uint32 i;
+	uint8 *found;
+
+	src1.ptr.voidp = &(cpu_regist_eax(cpu));
+	src1.type = size;
+	src2.type = size;
+
+	if (!cpu->prefix.rep && !cpu->prefix.repne) {
+		src2.ptr.voidp = &(cpu->mem[string_range(cpu, string_addr(cpu, 7), 1, size)]);
+		opcode_cmp(cpu, &src1, &src2);
+		string_advance(cpu, 7, 1, size);
+		return;
+	}
+
+	count = string_count(cpu);
+	if (count==0) {
+		return;
+	}
+
+	n = string_chunk(cpu, 7, count, size);
+	string_range(cpu, string_addr(cpu, 7), n, size);
+
+	if (size==1 && cpu->prefix.repne && !cpu_eflags(cpu, CPU_EFLAGS_DF)) {
+		// REPNE SCASB(strlen/memchr)はmemchrで一致位置まで進める
+		found = memchr(&(cpu->mem[string_addr(cpu, 7)]), cpu_regist_al(cpu), n);
+		if (found) {
+			n = found - &(cpu->mem[string_addr(cpu, 7)]) + 1;
+		}
+		string_advance(cpu, 7, n - 1, size);
+		src2.ptr.voidp = &(cpu->mem[string_addr(cpu, 7)]);
+		opcode_cmp(cpu, &src1, &src2);
+		string_advance(cpu, 7, 1, size);
+		count -= n;
+		if (found) {
+			set_string_count(cpu, count);
+		} else {
+			string_repeat(cpu, count);
+		}
+		return;
+	}
+
+	for (i=0; i<n; i++) {
+		src2.ptr.voidp = &(cpu->mem[string_addr(cpu, 7)]);
+		opcode_cmp(cpu, &src1, &src2);
+		string_advance(cpu, 7, 1, size);
+		count--;
+		// REPE: ZF=0で終了 / REPNE: ZF=1で終了
+		if (cpu_eflags(cpu, CPU_EFLAGS_ZF)==cpu->prefix.repne) {
+			set_string_count(cpu, count);
+			return;
+		}
+	}
+	string_repeat(cpu, count);
+}
+
+void opcode_shld(CPUx86 *cpu, uintp *dst, uintp *src, uintp *count)
+{
+	uint32 bits;
+	uint32 temp_count;
+	uint64 temp_val;
+	uint32 val;
+
+	temp_count = uintp_val_ze(count) & 0x1F;
+	if (temp_count==0) {
+		return;
+	}
+
+	// dst:srcを連結した値を左シフトし上位を取り出す
+	bits = uintp_bits(dst);
+	temp_val = (uint64)uintp_val_ze(dst) << bits | uintp_val_ze(src);
+	val = (uint32)(temp_val << temp_count >> bits) & uintp_mask(dst);
+
+	// CF OF
+	set_cpu_eflags(cpu, CPU_EFLAGS_CF, (uint32)(temp_val >> (bits * 2 - temp_count)) & 0x01);
+	set_cpu_eflags(cpu, CPU_EFLAGS_OF, (val ^ uintp_val_ze(dst)) >> (bits - 1) & 0x01);
+
+	set_uintp_val(dst, val);
+
+	// SF ZF PF
+	set_cpu_eflags_sf_zf_pf(cpu, dst);
+}
+
+void opcode_shr(CPUx86 *cpu, uintp *dst, uintp *count)
+{
+	uint32 temp_count;
+	uint32 val;
+
+	temp_count = uintp_val_ze(count) & 0x1F;
+	if (temp_count==0) {
+		return;
 	}
 
+	val = uintp_val_ze(dst);
+
+	// CF OF
+	set_cpu_eflags(cpu, CPU_EFLAGS_CF, val >> (temp_count - 1) & 0x01);
+	set_cpu_eflags(cpu, CPU_EFLAGS_OF, uintp_msb(dst));
+
+	set_uintp_val(dst, val >> temp_count);
+
 	// SF ZF PF
-	if ((uintp_val(count) & 0x1F)!=0) {
-		set_cpu_eflags_sf_zf_pf(cpu, dst);
+	set_cpu_eflags_sf_zf_pf(cpu, dst);
+}
+
+void opcode_shrd(CPUx86 *cpu, uintp *dst, uintp *src, uintp *count)
+{
+	uint32 bits;
+	uint32 temp_count;
+	uint64 temp_val;
+	uint32 val;
+
+	temp_count = uintp_val_ze(count) & 0x1F;
+	if (temp_count==0) {
+		return;
 	}
+
+	// src:dstを連結した値を右シフトし下位を取り出す
+	bits = uintp_bits(dst);
+	temp_val = (uint64)uintp_val_ze(src) << bits | uintp_val_ze(dst);
+	val = (uint32)(temp_val >> temp_count) & uintp_mask(dst);
+
+	// CF OF
+	set_cpu_eflags(cpu, CPU_EFLAGS_CF, (uint32)(temp_val >> (temp_count - 1)) & 0x01);
+	set_cpu_eflags(cpu, CPU_EFLAGS_OF, (val ^ uintp_val_ze(dst)) >> (bits - 1) & 0x01);
+
+	set_uintp_val(dst, val);
+
+	// SF ZF PF
+	set_cpu_eflags_sf_zf_pf(cpu, dst);
 }
 
 void opcode_shl(CPUx86 *cpu, uintp *dst, uintp *count)
@@ -868,40 +1444,165 @@ void opcode_shl(CPUx86 *cpu, uintp *dst, uintp *count)
 	opcode_sal(cpu, dst, count);
 }
 
-void opcode_sub(CPUx86 *cpu, uintp *dst, uintp *src)
+// C0/C1/D0~D3 /reg : シフト/ローテート命令群
+void opcode_shift_rotate(CPUx86 *cpu, uintp *dst, uintp *count)
+{
+	switch (cpu->modrm_reg) {
+	case 0:	// /0 : rol
+		opcode_rol(cpu, dst, count);
+		break;
+	case 1:	// /1 : ror
+		opcode_ror(cpu, dst, count);
+		break;
+	case 2:	// /2 : rcl
+		opcode_rcl(cpu, dst, count);
+		break;
+	case 3:	// /3 : rcr
+		opcode_rcr(cpu, dst, count);
+		break;
+	case 4:	// /4 : sal
+	case 6:	// /6 = salとして動作する
+		opcode_sal(cpu, dst, count);
+		break;
+	case 5:	// /5 : shr
+		opcode_shr(cpu, dst, count);
+		break;
+	case 7:	// /7 : sar
+		opcode_sar(cpu, dst, count);
+		break;
+	}
+}
+
+void opcode_sti(CPUx86 *cpu)
+{
+	// opcode_cliと同じ
+	if (cpu_cr0(cpu, CR0_PE)) {
+		if (cpu_eflags(cpu, CPU_EFLAGS_VM) ? cpu_eflags(cpu, CPU_EFLAGS_IOPL)!=3 : cpu_eflags(cpu, CPU_EFLAGS_IOPL) < cpu->cpl) {
+			cpu_fault(cpu, EXC_GP, 0);
+			return;
+		}
+	}
+	// Set Interrupt Flag(次の1命令は割り込みを受け付けない)
+	if (!cpu_eflags(cpu, CPU_EFLAGS_IF)) {
+		cpu->irq_shadow = 1;
+		cpu->irq_shadow_eip = cpu->eip;
+	}
+	set_cpu_eflags(cpu, CPU_EFLAGS_IF, 1);
+}
+
+void opcode_stos(CPUx86 *cpu, int size)
 {
+	uintp dst;
+	uintp src;
+	uint32 count;
+	uint32 n;
+	uint32 dst_low;
 	uint32 val;
-	val = uintp_val(dst) - uintp_val(src);
+	uint32 i;
+
+	src.ptr.voidp = &(cpu_regist_eax(cpu));
+	src.type = size;
+	dst.type = size;
+
+	if (!cpu->prefix.rep && !cpu->prefix.repne) {
+		dst.ptr.voidp = &(cpu->mem[string_range(cpu, string_addr(cpu, 7), 1, size)]);
+		opcode_mov(cpu, &dst, &src);
+		string_advance(cpu, 7, 1, size);
+		return;
+	}
+
+	count = string_count(cpu);
+	if (count==0) {
+		return;
+	}
 
-	// OF CF
-	if (uintp_val(dst) != val+uintp_val(src)) {
-		set_cpu_eflags(cpu, CPU_EFLAGS_OF, 1);
-		set_cpu_eflags(cpu, CPU_EFLAGS_CF, 1);
+	// ページ境界まで書き込んで一旦抜ける
+	n = string_chunk(cpu, 7, count, size);
+	dst_low = string_range(cpu, string_addr(cpu, 7), n, size);
+
+	val = uintp_val_ze(&src);
+	if (size==1 || val==(val & 0xFF) * (size==2 ? 0x0101 : 0x01010101)) {
+		// 全バイト同じ値ならmemset
+		memset(&(cpu->mem[dst_low]), val & 0xFF, n * size);
 	} else {
-		set_cpu_eflags(cpu, CPU_EFLAGS_OF, 0);
-		set_cpu_eflags(cpu, CPU_EFLAGS_CF, 0);
+		for (i=0; i<n; i++) {
+			dst.ptr.voidp = &(cpu->mem[dst_low + i * size]);
+			set_uintp_val(&dst, val);
+		}
 	}
+	string_advance(cpu, 7, n, size);
+	string_repeat(cpu, count - n);
+}
 
+void opcode_setcc(CPUx86 *cpu, int cc, uintp *dst)
+{
+	set_uintp_val(dst, cpu_cond(cpu, cc));
+}
+
+void opcode_sub(CPUx86 *cpu, uintp *dst, uintp *src)
+{
+	uint32 val;
+	uint32 src_val;
+	src_val = uintp_val(src);	// srcとdstが同じレジスタのこともある
+	val = uintp_val(dst) - src_val;
 	set_uintp_val(dst, val);
 
-	// SF ZF PF
-	set_cpu_eflags_sf_zf_pf(cpu, dst);
+	// OF SF ZF AF PF CF (遅延評価)
+	set_cpu_cc(cpu, CC_OP_SUB, dst->type, src_val, val);
 }
 
 void opcode_test(CPUx86 *cpu, uintp *src1, uintp *src2)
 {
-	uintp temp;
-	uint32 temp_val;
-	temp.ptr.voidp = &temp_val;
-	temp.type = src1->type;
-	set_uintp_val(&temp, uintp_val(src1) & uintp_val(src2));
+	// OF SF ZF PF CF (遅延評価)
+	set_cpu_cc(cpu, CC_OP_LOGIC, src1->type, 0, uintp_val(src1) & uintp_val(src2));
+}
 
-	// OF CF
-	set_cpu_eflags(cpu, CPU_EFLAGS_OF, 0);
-	set_cpu_eflags(cpu, CPU_EFLAGS_CF, 0);
+// XADD: LOCKがなくてもアトミックに足す
+void opcode_xadd(CPUx86 *cpu, uintp *dst, uintp *src)
+{
+	uint32 src_val;
+	uint32 old;
 
-	// SF ZF PF
-	set_cpu_eflags_sf_zf_pf(cpu, &temp);
+	src_val = uintp_val(src);
+	switch (dst->type) {
+	case 1:
+		old = __atomic_fetch_add(dst->ptr.uint8p, (uint8)src_val, __ATOMIC_SEQ_CST);
+		break;
+	case 2:
+		old = __atomic_fetch_add(dst->ptr.uint16p, (uint16)src_val, __ATOMIC_SEQ_CST);
+		break;
+	default:
+		old = __atomic_fetch_add(dst->ptr.uint32p, src_val, __ATOMIC_SEQ_CST);
+		break;
+	}
+	set_uintp_val(src, old);
+	// 同じレジスタなら和が残る
+	if (dst->ptr.voidp==src->ptr.voidp) {
+		set_uintp_val(dst, old + src_val);
+	}
+
+	// OF SF ZF AF PF CF (遅延評価)
+	set_cpu_cc(cpu, CC_OP_ADD, dst->type, src_val, old + src_val);
+}
+
+// XCHG: メモリとの交換はLOCKがなくてもアトミック
+void opcode_xchg(CPUx86 *cpu, uintp *dst, uintp *src)
+{
+	uint32 val;
+
+	val = uintp_val(src);
+	switch (dst->type) {
+	case 1:
+		val = __atomic_exchange_n(dst->ptr.uint8p, (uint8)val, __ATOMIC_SEQ_CST);
+		break;
+	case 2:
+		val = __atomic_exchange_n(dst->ptr.uint16p, (uint16)val, __ATOMIC_SEQ_CST);
+		break;
+	default:
+		val = __atomic_exchange_n(dst->ptr.uint32p, val, __ATOMIC_SEQ_CST);
+		break;
+	}
+	set_uintp_val(src, val);
 }
 
 void opcode_xor(CPUx86 *cpu, uintp *dst, uintp *src)
@@ -910,14 +1611,8 @@ void opcode_xor(CPUx86 *cpu, uintp *dst, uintp *src)
 	val = uintp_val(dst) ^ uintp_val(src);
 	set_uintp_val(dst, val);
 
-	// OF
-	set_cpu_eflags(cpu, CPU_EFLAGS_OF, 0);
-
-	// CF
-	set_cpu_eflags(cpu, CPU_EFLAGS_CF, 0);
-
-	// SF ZF PF
-	set_cpu_eflags_sf_zf_pf(cpu, dst);
+	// OF SF ZF PF CF (遅延評価)
+	set_cpu_cc(cpu, CC_OP_LOGIC, dst->type, 0, val);
 }
 
 
@@ -937,28 +1632,28 @@ void int2bin(char *dest, int val, int bitlen)
 void dump_cpu(CPUx86 *cpu)
 {
 	char b[33];
-	int i;
 	char *regs_arr[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi"};
 	uint8 tmp;
 
-	printf("dump_cpu:\n");
-	printf("  eip: 0x%X\n", cpu->eip);
-
-	for (i=0; i<8; i++) {
-		printf("  %s: 0x%X\n", regs_arr[i], cpu->regs[i]);
-	}
+	// ログは書式ごとに抑えるので、書式の違う数行にまとめる
+	cpu_eflags_sync(cpu);
+	log_debug("dump_cpu: eip: 0x%X eflags: 0x%X\n", cpu->eip, cpu->eflags);
+	log_debug("  %s: 0x%X %s: 0x%X %s: 0x%X %s: 0x%X %s: 0x%X %s: 0x%X %s: 0x%X %s: 0x%X\n",
+		regs_arr[0], cpu->regs[0], regs_arr[1], cpu->regs[1], regs_arr[2], cpu->regs[2], regs_arr[3], cpu->regs[3],
+		regs_arr[4], cpu->regs[4], regs_arr[5], cpu->regs[5], regs_arr[6], cpu->regs[6], regs_arr[7], cpu->regs[7]);
 
-	printf("  eflags: 0x%X\n", cpu->eflags);
+	// segment
+	log_debug("  es: 0x%X cs: 0x%X ss: 0x%X ds: 0x%X fs: 0x%X gs: 0x%X cpl: %d\n", cpu->sregs[SEG_ES], cpu->sregs[SEG_CS], cpu->sregs[SEG_SS], cpu->sregs[SEG_DS], cpu->sregs[SEG_FS], cpu->sregs[SEG_GS], cpu->cpl);
 
 	// modrm
 	tmp = cpu->modrm_mod<<6 | cpu->modrm_reg<<3 | cpu->modrm_rm;
 	int2bin(b, tmp, 8);
-	printf("  modrm: 0x%X mod: %c%c reg: %c%c%c rm: %c%c%c\n", tmp, b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]);
+	log_debug("  modrm: 0x%X mod: %c%c reg: %c%c%c rm: %c%c%c\n", tmp, b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]);
 
 	// sib
 	tmp = cpu->sib_scale<<6 | cpu->sib_index<<3 | cpu->sib_base;
 	int2bin(b, tmp, 8);
-	printf("  sib: 0x%X scale: %c%c index: %c%c%c base: %c%c%c\n", tmp, b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]);
+	log_debug("  sib: 0x%X scale: %c%c index: %c%c%c base: %c%c%c\n", tmp, b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]);
 }
 
 
@@ -966,16 +1661,59 @@ void dump_cpu(CPUx86 *cpu)
 
 CPUx86* new_cpux86(size_t mem_size)
 {
-	CPUx86 *cpu = malloc(sizeof(CPUx86));
-	cpu->eflags = 2;
-	cpu->mem = (uint8*)malloc(mem_size);
+	CPUx86 *cpu = calloc(1, sizeof(CPUx86));
+	cpu_reset(cpu);
+	cpuid_init(cpu);
+	clock_init(cpu);
+	// JITが自己書き換えの検出でページ単位に保護するのでページ境界に置く
+	if (posix_memalign((void**)&(cpu->mem), 4096, mem_size + CPU_MEM_SLACK)) {
+		cpu->mem = NULL;
+	}
 	cpu->mem_size = mem_size;
+	pc_init(cpu);
+	jit_init(cpu);
+	metrics_init(cpu);
 	return cpu;
 }
 
+// 電源投入とINITのときのレジスタ(RAM、デバイス、APIC、時計はそのまま)
+void cpu_reset(CPUx86 *cpu)
+{
+	int i;
+
+	memset(cpu->regs, 0, offsetof(CPUx86, fpu) - offsetof(CPUx86, regs));
+	cpu->eflags = 2;
+	// セグメントはベース0、リミット4GBのフラットモデル
+	for (i=0; i<6; i++) {
+		cpu->segs[i].limit = 0xFFFFFFFF;
+		cpu->segs[i].attribute = i==SEG_CS ? 0xC09B : 0xC093;
+	}
+	// リアルモードの割り込みベクタテーブル
+	cpu->idtr.limit = 0x3FF;
+	cpu->fault_delivering = -1;
+	fpu_init(cpu);
+	memset(cpu->xmm, 0, sizeof(cpu->xmm));
+	cpu->mxcsr = MXCSR_DEFAULT;
+	cpu->halted = 0;
+	cpu->irq_shadow = 0;
+	cpu_update_mode(cpu);
+}
+
+// CR0.PE、CSのDビット、EFLAGS.VMが変わったらデフォルトのオペランドサイズとアドレスサイズを決め直す
+void cpu_update_mode(CPUx86 *cpu)
+{
+	cpu->code32 = cpu_cr0(cpu, CR0_PE) && !(cpu->eflags & CPU_EFLAGS_VM) && desc_d(&(cpu->segs[SEG_CS]));
+}
+
 void delete_cpux86(CPUx86 *cpu)
 {
 	if (cpu) {
+		machine_delete(cpu);
+		metrics_delete(cpu);
+		gdb_delete(cpu);
+		replay_delete(cpu);
+		pc_delete(cpu);
+		jit_delete(cpu);
 		if (cpu->mem) {
 			free(cpu->mem);
 		}
@@ -1008,26 +1746,282 @@ void set_cpu_eflags_sf_zf_pf(CPUx86 *cpu, uintp *target)
 	set_cpu_eflags(cpu, CPU_EFLAGS_SF, uintp_msb(target));
 }
 
-void exec_cpux86(CPUx86 *cpu)
+// 遅延評価中のフラグ(OF SF ZF AF PF CF)をeflagsに反映する
+void cpu_eflags_compute(CPUx86 *cpu)
 {
-	uint8 opcode;
-	int c=0;
-	int i;
-	int is_prefix;
-	uintp operand1;
-	uintp operand2;
-	uint32 offset;
-
-	while (c++<30000) {
-		log_info("[%d]\n", c);
-		dump_cpu(cpu);
-
-		cpu_current_reset(cpu);
-		is_prefix = 1;
+	uint32 bits;
+	uint32 mask;
+	uint32 src1;
+	uint32 src2;
+	uint32 dst;
+	uint32 flags;
+	uint32 cf;
+
+	bits = cpu->cc_size << 3;
+	mask = 0xFFFFFFFF >> (32 - bits);
+	src2 = cpu->cc_src & mask;
+	dst = cpu->cc_dst & mask;
+	flags = 0;
+
+	switch (cpu->cc_op) {
+	case CC_OP_ADD:
+		src1 = (dst - src2) & mask;
+		flags |= dst < src1 ? CPU_EFLAGS_CF : 0;
+		flags |= ((src1 ^ dst) & (src2 ^ dst)) >> (bits - 1) & 0x01 ? CPU_EFLAGS_OF : 0;
+		flags |= (src1 ^ src2 ^ dst) & CPU_EFLAGS_AF;
+		break;
+	case CC_OP_SUB:
+		src1 = (dst + src2) & mask;
+		flags |= src1 < src2 ? CPU_EFLAGS_CF : 0;
+		flags |= ((src1 ^ src2) & (src1 ^ dst)) >> (bits - 1) & 0x01 ? CPU_EFLAGS_OF : 0;
+		flags |= (src1 ^ src2 ^ dst) & CPU_EFLAGS_AF;
+		break;
+	case CC_OP_ADC:
+		cf = cpu->eflags & CPU_EFLAGS_CF;
+		src1 = (dst - src2 - cf) & mask;
+		flags |= (cf ? dst <= src1 : dst < src1) ? CPU_EFLAGS_CF : 0;
+		flags |= ((src1 ^ dst) & (src2 ^ dst)) >> (bits - 1) & 0x01 ? CPU_EFLAGS_OF : 0;
+		flags |= (src1 ^ src2 ^ dst) & CPU_EFLAGS_AF;
+		break;
+	case CC_OP_SBB:
+		cf = cpu->eflags & CPU_EFLAGS_CF;
+		src1 = (dst + src2 + cf) & mask;
+		flags |= (cf ? src1 <= src2 : src1 < src2) ? CPU_EFLAGS_CF : 0;
+		flags |= ((src1 ^ src2) & (src1 ^ dst)) >> (bits - 1) & 0x01 ? CPU_EFLAGS_OF : 0;
+		flags |= (src1 ^ src2 ^ dst) & CPU_EFLAGS_AF;
+		break;
+	case CC_OP_INC:
+		// src2 = 1
+		src1 = (dst - 1) & mask;
+		flags |= cpu->eflags & CPU_EFLAGS_CF;
+		flags |= dst==(uint32)1 << (bits - 1) ? CPU_EFLAGS_OF : 0;
+		flags |= (src1 ^ 1 ^ dst) & CPU_EFLAGS_AF;
+		break;
+	case CC_OP_DEC:
+		src1 = (dst + 1) & mask;
+		flags |= cpu->eflags & CPU_EFLAGS_CF;
+		flags |= src1==(uint32)1 << (bits - 1) ? CPU_EFLAGS_OF : 0;
+		flags |= (src1 ^ 1 ^ dst) & CPU_EFLAGS_AF;
+		break;
+	case CC_OP_LOGIC:
+		break;
+	}
+
+	// SF ZF PF
+	flags |= dst >> (bits - 1) & 0x01 ? CPU_EFLAGS_SF : 0;
+	flags |= dst==0 ? CPU_EFLAGS_ZF : 0;
+	flags |= (bit_count8(dst & 0xFF) & 0x01) ? 0 : CPU_EFLAGS_PF;
+
+	cpu->eflags = (cpu->eflags & ~(CPU_EFLAGS_OF | CPU_EFLAGS_SF | CPU_EFLAGS_ZF | CPU_EFLAGS_AF | CPU_EFLAGS_PF | CPU_EFLAGS_CF)) | flags;
+	cpu->cc_op = CC_OP_EFLAGS;
+}
+
+// 条件コード(Jcc/SETcc/CMOVccの下位4bit)を評価する
+int cpu_cond(CPUx86 *cpu, int cc)
+{
+	uint32 shift;
+	uint32 src1;
+	uint32 src2;
+	uint32 dst;
+	int result;
+
+	result = 0;
+	if (cpu->cc_op==CC_OP_SUB && (cc>>1)!=0 && (cc>>1)!=5) {
+		// CMP/SUBの結果はオペランドから直接評価する(OFとPFを除く)
+		// 上位ビットに詰めると符号付き/符号なしの比較をそのまま使える
+		shift = 32 - (cpu->cc_size << 3);
+		src2 = cpu->cc_src << shift;
+		dst = cpu->cc_dst << shift;
+		src1 = dst + src2;
+		switch (cc>>1) {
+		case 1:	// B
+			result = src1 < src2;
+			break;
+		case 2:	// E
+			result = src1==src2;
+			break;
+		case 3:	// BE
+			result = src1 <= src2;
+			break;
+		case 4:	// S
+			result = (int32)dst < 0;
+			break;
+		case 6:	// L
+			result = (int32)src1 < (int32)src2;
+			break;
+		case 7:	// LE
+			result = (int32)src1 <= (int32)src2;
+			break;
+		}
+		return result ^ (cc & 0x01);
+	}
+
+	switch (cc>>1) {
+	case 0:	// O
+		result = cpu_eflags(cpu, CPU_EFLAGS_OF);
+		break;
+	case 1:	// B
+		result = cpu_eflags(cpu, CPU_EFLAGS_CF);
+		break;
+	case 2:	// E
+		result = cpu_eflags(cpu, CPU_EFLAGS_ZF);
+		break;
+	case 3:	// BE
+		result = cpu_eflags(cpu, CPU_EFLAGS_CF) | cpu_eflags(cpu, CPU_EFLAGS_ZF);
+		break;
+	case 4:	// S
+		result = cpu_eflags(cpu, CPU_EFLAGS_SF);
+		break;
+	case 5:	// P
+		result = cpu_eflags(cpu, CPU_EFLAGS_PF);
+		break;
+	case 6:	// L
+		result = cpu_eflags(cpu, CPU_EFLAGS_SF) ^ cpu_eflags(cpu, CPU_EFLAGS_OF);
+		break;
+	case 7:	// LE
+		result = cpu_eflags(cpu, CPU_EFLAGS_ZF) | (cpu_eflags(cpu, CPU_EFLAGS_SF) ^ cpu_eflags(cpu, CPU_EFLAGS_OF));
+		break;
+	}
+	return result ^ (cc & 0x01);
+}
+
+// LOCKを付けられる命令(0F xxは0x100 | xx)
+// グループのregはそれぞれの命令で、メモリオペランドかどうかはcpu_lock_rmwで確かめる
+static int cpu_lockable(int opcode)
+{
+	switch (opcode) {
+	case 0x00: case 0x01: case 0x08: case 0x09: case 0x10: case 0x11: case 0x18: case 0x19:
+	case 0x20: case 0x21: case 0x28: case 0x29: case 0x30: case 0x31:
+	case 0x80: case 0x81: case 0x82: case 0x83: case 0x86: case 0x87:
+	case 0xF6: case 0xF7: case 0xFE: case 0xFF:
+	case 0x1AB: case 0x1B0: case 0x1B1: case 0x1B3: case 0x1BA: case 0x1BB: case 0x1C0: case 0x1C1: case 0x1C7:
+		return 1;
+	}
+	return 0;
+}
+
+// LOCKを付けられないグループのreg
+#define cpu_lock_check(cpu)		((cpu)->prefix.lock ? cpu_fault(cpu, EXC_UD, 0) : (void)0)
+// LOCKはメモリオペランドだけ
+#define cpu_lock_check_mem(cpu)	((cpu)->prefix.lock && (cpu)->modrm_mod==3 ? cpu_fault(cpu, EXC_UD, 0) : (void)0)
+
+// メモリが読んだときの値のままなら書く
+static int cpu_cas(uintp *dst, uint32 old, uint32 val)
+{
+	uint8 old8;
+	uint16 old16;
+
+	switch (dst->type) {
+	case 1:
+		old8 = old;
+		return __atomic_compare_exchange_n(dst->ptr.uint8p, &old8, (uint8)val, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	case 2:
+		old16 = old;
+		return __atomic_compare_exchange_n(dst->ptr.uint16p, &old16, (uint16)val, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	default:
+		return __atomic_compare_exchange_n(dst->ptr.uint32p, &old, val, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	}
+}
+
+// LOCKを付けた読み書き: コピーで計算し、その間に他のvCPUが書いていたらフラグを戻してやり直す
+static void cpu_lock_rmw(CPUx86 *cpu, void (*op2)(CPUx86*, uintp*, uintp*), void (*op1)(CPUx86*, uintp*), uintp *dst, uintp *src)
+{
+	uintp tmp;
+	uint32 old;
+	uint32 val;
+	uint32 eflags;
+	uint32 cc_src;
+	uint32 cc_dst;
+	uint8 cc_op;
+	uint8 cc_size;
+
+	if (cpu->modrm_mod==3) {
+		cpu_fault(cpu, EXC_UD, 0);
+		return;
+	}
+	eflags = cpu->eflags;
+	cc_op = cpu->cc_op;
+	cc_size = cpu->cc_size;
+	cc_src = cpu->cc_src;
+	cc_dst = cpu->cc_dst;
+	tmp.ptr.voidp = &val;
+	tmp.type = dst->type;
+	for (;;) {
+		old = uintp_val_ze(dst);
+		val = old;
+		if (op2) {
+			op2(cpu, &tmp, src);
+		} else {
+			op1(cpu, &tmp);
+		}
+		if (cpu_cas(dst, old, val)) {
+			break;
+		}
+		cpu->eflags = eflags;
+		cpu->cc_op = cc_op;
+		cpu->cc_size = cc_size;
+		cpu->cc_src = cc_src;
+		cpu->cc_dst = cc_dst;
+	}
+}
+
+// LOCKが付いていればアトミックに読み書きする
+#define opcode_rmw(cpu, op, dst, src)	((cpu)->prefix.lock ? cpu_lock_rmw(cpu, op, NULL, dst, src) : op(cpu, dst, src))
+#define opcode_rmw1(cpu, op, dst)		((cpu)->prefix.lock ? cpu_lock_rmw(cpu, NULL, op, dst, NULL) : op(cpu, dst))
+
+// 実行ループの中ではデフォルトのオペランドサイズ、アドレスサイズを定数にする
+#undef cpu_operand_size
+#undef cpu_address_size
+#define cpu_operand_size(cpu)	((code32==(cpu)->prefix.operand_size) ? 2 : 4)
+#define cpu_address_size(cpu)	((code32==(cpu)->prefix.address_size) ? 2 : 4)
+
+// 最大budget命令を実行して実行した命令数を返す(モードが変わったら抜ける)
+// code32は定数で呼び、モードごとに展開したループにする
+static inline __attribute__((always_inline)) int exec_cpux86_loop(CPUx86 *cpu, int budget, const int code32)
+{
+	uint8 opcode;
+	int c=0;
+	int i;
+	int is_prefix;
+	uintp operand1;
+	uintp operand2;
+	uintp operand3;
+	uint32 offset;
+	uint32 temp_val;
+	int n;
+	int trace = log_enabled(LOG_LEVEL_DEBUG);	// VCPU_LOG_LEVEL=debugなら1命令ずつ出す
+
+	while (c<budget && cpu->code32==code32 && !cpu->halted) {
+		// デバッガ(ブレークポイントのあるページは翻訳しないので、ブロックに入る前に確かめれば足りる)
+		// 止まったらレジスタが書き換わっているかもしれないのでexec_cpux86からやり直す
+		if (cpu->gdb && gdb_check(cpu)) {
+			break;
+		}
+
+		// 翻訳済みのブロックがあればまとめて実行する
+		n = jit_exec(cpu, budget - c);
+		if (0<n) {
+			c += n;
+			continue;
+		}
+
+		c++;
+		cpu->clock.slice = c;	// RDTSC、I/O、例外はスライスの途中の命令数で時刻を読む
+		if (trace) {
+			log_debug("[%d]\n", c);
+			dump_cpu(cpu);
+		}
+
+		cpu_current_reset(cpu);
+		cpu->opcode_eip = cpu->eip;
+		cpu->opcode_esp = cpu_regist_esp(cpu);
+		is_prefix = 1;
 
 		while (is_prefix) {
 			opcode = mem_eip_load8(cpu);
-			log_info("eip: %08X opcode: %X\n", cpu->eip-1, opcode);
+			if (trace) {
+				log_debug("eip: %08X opcode: %X\n", cpu->eip-1, opcode);
+			}
 			//log_info("operand_size: %d\n", cpu_operand_size(cpu));
 
 			// prefix
@@ -1038,18 +2032,18 @@ void exec_cpux86(CPUx86 *cpu)
 			case 0x67:	// アドレスサイズプリフィックス
 				cpu->prefix.address_size = 1;
 				break;
-			case 0x26:	// セグメントオーバーライドプリフィックス(CS)
+			case 0x26:	// セグメントオーバーライドプリフィックス(ES)
+				cpu->prefix.segment_es = 1;
+				break;
+			case 0x2E:	// セグメントオーバーライドプリフィックス(CS)
 				cpu->prefix.segment_cs = 1;
 				break;
-			case 0x2E:	// セグメントオーバーライドプリフィックス(SS)
+			case 0x36:	// セグメントオーバーライドプリフィックス(SS)
 				cpu->prefix.segment_ss = 1;
 				break;
-			case 0x36:	// セグメントオーバーライドプリフィックス(DS)
+			case 0x3E:	// セグメントオーバーライドプリフィックス(DS)
 				cpu->prefix.segment_ds = 1;
 				break;
-			case 0x3E:	// セグメントオーバーライドプリフィックス(ES)
-				cpu->prefix.segment_es = 1;
-				break;
 			case 0x64:	// セグメントオーバーライドプリフィックス(FS)
 				cpu->prefix.segment_fs = 1;
 				break;
@@ -1062,25 +2056,10 @@ void exec_cpux86(CPUx86 *cpu)
 			case 0xF3:	// リピートプリフィックス(REP/REPE/REPZ)
 				cpu->prefix.rep = 1;
 				break;
-
-			case 0x40:	// REXプリフィックス
-			case 0x41:	// REXプリフィックス
-			case 0x42:	// REXプリフィックス
-			case 0x43:	// REXプリフィックス
-			case 0x44:	// REXプリフィックス
-			case 0x45:	// REXプリフィックス
-			case 0x46:	// REXプリフィックス
-			case 0x47:	// REXプリフィックス
-			case 0x48:	// REXプリフィックス
-			case 0x49:	// REXプリフィックス
-			case 0x4A:	// REXプリフィックス
-			case 0x4B:	// REXプリフィックス
-			case 0x4C:	// REXプリフィックス
-			case 0x4D:	// REXプリフィックス
-			case 0x4E:	// REXプリフィックス
-			case 0x4F:	// REXプリフィックス
-				cpu->prefix.rex = opcode;
+			case 0xF0:	// LOCKプリフィックス
+				cpu->prefix.lock = 1;
 				break;
+
 			case 0xC4:	// VEXプリフィックス(3byte)
 				cpu->prefix.vex3 = mem_eip_load24(cpu);
 				break;
@@ -1095,6 +2074,9 @@ void exec_cpux86(CPUx86 *cpu)
 		// opcode
 		if (opcode!=0x0F) {
 			// 1byte opcode
+			if (cpu->prefix.lock && !cpu_lockable(opcode)) {
+				cpu_fault(cpu, EXC_UD, 0);
+			}
 
 			switch (opcode) {
 			// 0x00
@@ -1103,15 +2085,14 @@ void exec_cpux86(CPUx86 *cpu)
 				mem_eip_load_modrm(cpu);
 
 				// dst register/memory
-				cpu_modrm_address(cpu, &operand1);
-				operand1.type = 1;
+				cpu_modrm_address8(cpu, &operand1);
 
 				// src register
-				operand2.ptr.voidp = &(cpu->regs[cpu->modrm_reg]);
+				operand2.ptr.uint8p = cpu_reg8(cpu, cpu->modrm_reg);
 				operand2.type = 1;
 
 				// operation
-				opcode_add(cpu, &operand1, &operand2);
+				opcode_rmw(cpu, opcode_add, &operand1, &operand2);
 				break;
 
 			case 0x01:	// 01 /r sz : add r/m32 r32
@@ -1126,7 +2107,7 @@ void exec_cpux86(CPUx86 *cpu)
 				operand2.type = cpu_operand_size(cpu);
 
 				// operation
-				opcode_add(cpu, &operand1, &operand2);
+				opcode_rmw(cpu, opcode_add, &operand1, &operand2);
 				break;
 
 			case 0x02:	// 02 /r : add r8 r/m8
@@ -1134,12 +2115,11 @@ void exec_cpux86(CPUx86 *cpu)
 				mem_eip_load_modrm(cpu);
 
 				// dst register
-				operand1.ptr.voidp = &(cpu->regs[cpu->modrm_reg]);
+				operand1.ptr.uint8p = cpu_reg8(cpu, cpu->modrm_reg);
 				operand1.type = 1;
 
 				// src register/memory
-				cpu_modrm_address(cpu, &operand2);
-				operand2.type = 1;
+				cpu_modrm_address8(cpu, &operand2);
 
 				// operation
 				opcode_add(cpu, &operand1, &operand2);
@@ -1160,13 +2140,16 @@ void exec_cpux86(CPUx86 *cpu)
 				opcode_add(cpu, &operand1, &operand2);
 				break;
 
+			case 0x06:	// 06 : push es
+				opcode_push_sreg(cpu, SEG_ES);
+				break;
+
 			case 0x07:	// 07 : pop es
-				// dst register
-				operand1.ptr.voidp = &(cpu->es);
-				operand1.type = 2;
+				opcode_pop_sreg(cpu, SEG_ES);
+				break;
 
-				// operation
-				opcode_pop(cpu, &operand1);
+			case 0x0E:	// 0E : push cs
+				opcode_push_sreg(cpu, SEG_CS);
 				break;
 
 			case 0x10:	// 10 /r : adc r/m8 r8
@@ -1174,15 +2157,14 @@ void exec_cpux86(CPUx86 *cpu)
 				mem_eip_load_modrm(cpu);
 
 				// dst register/memory
-				cpu_modrm_address(cpu, &operand1);
-				operand1.type = 1;
+				cpu_modrm_address8(cpu, &operand1);
 
 				// src register
-				operand2.ptr.voidp = &(cpu->regs[cpu->modrm_reg]);
+				operand2.ptr.uint8p = cpu_reg8(cpu, cpu->modrm_reg);
 				operand2.type = 1;
 
 				// operation
-				opcode_adc(cpu, &operand1, &operand2);
+				opcode_rmw(cpu, opcode_adc, &operand1, &operand2);
 				break;
 
 			case 0x11:	// 11 /r sz : adc r/m32 r32
@@ -1197,7 +2179,15 @@ void exec_cpux86(CPUx86 *cpu)
 				operand2.type = cpu_operand_size(cpu);
 
 				// operation
-				opcode_adc(cpu, &operand1, &operand2);
+				opcode_rmw(cpu, opcode_adc, &operand1, &operand2);
+				break;
+
+			case 0x16:	// 16 : push ss
+				opcode_push_sreg(cpu, SEG_SS);
+				break;
+
+			case 0x17:	// 17 : pop ss
+				opcode_pop_sreg(cpu, SEG_SS);
 				break;
 
 			case 0x18:	// 18 /r : sbb r/m8 r8
@@ -1205,15 +2195,22 @@ void exec_cpux86(CPUx86 *cpu)
 				mem_eip_load_modrm(cpu);
 
 				// dst register/memory
-				cpu_modrm_address(cpu, &operand1);
-				operand1.type = 1;
+				cpu_modrm_address8(cpu, &operand1);
 
 				// src register
-				operand2.ptr.voidp = &(cpu->regs[cpu->modrm_reg]);
+				operand2.ptr.uint8p = cpu_reg8(cpu, cpu->modrm_reg);
 				operand2.type = 1;
 
 				// operation
-				opcode_sbb(cpu, &operand1, &operand2);
+				opcode_rmw(cpu, opcode_sbb, &operand1, &operand2);
+				break;
+
+			case 0x1E:	// 1E : push ds
+				opcode_push_sreg(cpu, SEG_DS);
+				break;
+
+			case 0x1F:	// 1F : pop ds
+				opcode_pop_sreg(cpu, SEG_DS);
 				break;
 
 			// 0x20
@@ -1242,7 +2239,7 @@ void exec_cpux86(CPUx86 *cpu)
 				operand2.type = cpu_operand_size(cpu);
 
 				// operation
-				opcode_sub(cpu, &operand1, &operand2);
+				opcode_rmw(cpu, opcode_sub, &operand1, &operand2);
 				break;
 
 			// 0x30
@@ -1258,15 +2255,32 @@ void exec_cpux86(CPUx86 *cpu)
 				operand2.type = cpu_operand_size(cpu);
 
 				// operation
-				opcode_xor(cpu, &operand1, &operand2);
+				opcode_rmw(cpu, opcode_xor, &operand1, &operand2);
+				break;
+
+			case 0x38:	// 38 /r : cmp r/m8 r8
+				// modrm
+				mem_eip_load_modrm(cpu);
+
+				// src1 register/memory
+				cpu_modrm_address8(cpu, &operand1);
+
+				// src2 register
+				operand2.ptr.uint8p = cpu_reg8(cpu, cpu->modrm_reg);
+				operand2.type = 1;
+
+				// operation
+				opcode_cmp(cpu, &operand1, &operand2);
+				c += opcode_cmp_jcc(cpu, budget - c);
 				break;
 
 			case 0x39:	// 39 /r sz : cmp r/m32 r32
 				// modrm
 				mem_eip_load_modrm(cpu);
 
-				// xrc1 register/memory
+				// src1 register/memory
 				cpu_modrm_address(cpu, &operand1);
+				operand1.type = cpu_operand_size(cpu);
 
 				// src2 register
 				operand2.ptr.voidp = &(cpu->regs[cpu->modrm_reg]);
@@ -1274,6 +2288,40 @@ void exec_cpux86(CPUx86 *cpu)
 
 				// operation
 				opcode_cmp(cpu, &operand1, &operand2);
+				c += opcode_cmp_jcc(cpu, budget - c);
+				break;
+
+			case 0x3A:	// 3A /r : cmp r8 r/m8
+				// modrm
+				mem_eip_load_modrm(cpu);
+
+				// src1 register
+				operand1.ptr.uint8p = cpu_reg8(cpu, cpu->modrm_reg);
+				operand1.type = 1;
+
+				// src2 register/memory
+				cpu_modrm_address8(cpu, &operand2);
+
+				// operation
+				opcode_cmp(cpu, &operand1, &operand2);
+				c += opcode_cmp_jcc(cpu, budget - c);
+				break;
+
+			case 0x3B:	// 3B /r sz : cmp r32 r/m32
+				// modrm
+				mem_eip_load_modrm(cpu);
+
+				// src1 register
+				operand1.ptr.voidp = &(cpu->regs[cpu->modrm_reg]);
+				operand1.type = cpu_operand_size(cpu);
+
+				// src2 register/memory
+				cpu_modrm_address(cpu, &operand2);
+				operand2.type = cpu_operand_size(cpu);
+
+				// operation
+				opcode_cmp(cpu, &operand1, &operand2);
+				c += opcode_cmp_jcc(cpu, budget - c);
 				break;
 
 			case 0x3C:	// 3C ib : cmp al imm8
@@ -1287,6 +2335,54 @@ void exec_cpux86(CPUx86 *cpu)
 
 				// operation
 				opcode_cmp(cpu, &operand1, &operand2);
+				c += opcode_cmp_jcc(cpu, budget - c);
+				break;
+
+			case 0x3D:	// 3D id sz : cmp eax imm32
+				// src1 register
+				operand1.ptr.voidp = &(cpu_regist_eax(cpu));
+				operand1.type = cpu_operand_size(cpu);
+
+				// src2 immediate
+				operand2.ptr.voidp = mem_eip_ptr(cpu, cpu_operand_size(cpu));
+				operand2.type = cpu_operand_size(cpu);
+
+				// operation
+				opcode_cmp(cpu, &operand1, &operand2);
+				c += opcode_cmp_jcc(cpu, budget - c);
+				break;
+
+			// 0x40
+			case 0x40:	// 40 sz : inc eax
+			case 0x41:	// 41 sz : inc ecx
+			case 0x42:	// 42 sz : inc edx
+			case 0x43:	// 43 sz : inc ebx
+			case 0x44:	// 44 sz : inc esp
+			case 0x45:	// 45 sz : inc ebp
+			case 0x46:	// 46 sz : inc esi
+			case 0x47:	// 47 sz : inc edi
+				// dst register
+				operand1.ptr.voidp = &(cpu->regs[opcode & 0x07]);
+				operand1.type = cpu_operand_size(cpu);
+
+				// operation
+				opcode_inc(cpu, &operand1);
+				break;
+
+			case 0x48:	// 48 sz : dec eax
+			case 0x49:	// 49 sz : dec ecx
+			case 0x4A:	// 4A sz : dec edx
+			case 0x4B:	// 4B sz : dec ebx
+			case 0x4C:	// 4C sz : dec esp
+			case 0x4D:	// 4D sz : dec ebp
+			case 0x4E:	// 4E sz : dec esi
+			case 0x4F:	// 4F sz : dec edi
+				// dst register
+				operand1.ptr.voidp = &(cpu->regs[opcode & 0x07]);
+				operand1.type = cpu_operand_size(cpu);
+
+				// operation
+				opcode_dec(cpu, &operand1);
 				break;
 
 			// 0x50
@@ -1323,40 +2419,28 @@ void exec_cpux86(CPUx86 *cpu)
 				break;
 
 			// 0x70
+			case 0x70:	// 70 cb : jo rel8
+			case 0x71:	// 71 cb : jno rel8
+			case 0x72:	// 72 cb : jb rel8
+			case 0x73:	// 73 cb : jae rel8
 			case 0x74:	// 74 cb : jz rel8
-				// relative address
-				operand1.ptr.voidp = mem_eip_ptr(cpu, 1);
-				operand1.type = 1;
-
-				// operation
-				opcode_jz(cpu, &operand1);
-				break;
-
 			case 0x75:	// 75 cb : jnz rel8
-				// relative address
-				operand1.ptr.voidp = mem_eip_ptr(cpu, 1);
-				operand1.type = 1;
-
-				// operation
-				opcode_jnz(cpu, &operand1);
-				break;
-
+			case 0x76:	// 76 cb : jbe rel8
+			case 0x77:	// 77 cb : ja rel8
 			case 0x78:	// 78 cb : js rel8
-				// relative address
-				operand1.ptr.voidp = mem_eip_ptr(cpu, 1);
-				operand1.type = 1;
-
-				// operation
-				opcode_js(cpu, &operand1);
-				break;
-
+			case 0x79:	// 79 cb : jns rel8
+			case 0x7A:	// 7A cb : jp rel8
+			case 0x7B:	// 7B cb : jnp rel8
+			case 0x7C:	// 7C cb : jl rel8
+			case 0x7D:	// 7D cb : jge rel8
 			case 0x7E:	// 7E cb : jle rel8
+			case 0x7F:	// 7F cb : jg rel8
 				// relative address
 				operand1.ptr.voidp = mem_eip_ptr(cpu, 1);
 				operand1.type = 1;
 
 				// operation
-				opcode_jle_short(cpu, &operand1);
+				opcode_jcc(cpu, opcode & 0x0F, &operand1);
 				break;
 
 			// 0x80
@@ -1375,8 +2459,7 @@ void exec_cpux86(CPUx86 *cpu)
 				mem_eip_load_modrm(cpu);
 
 				// dst register/memory
-				cpu_modrm_address(cpu, &operand1);
-				operand1.type = 1;
+				cpu_modrm_address8(cpu, &operand1);
 
 				// src immediate
 				operand2.ptr.voidp = mem_eip_ptr(cpu, 1);
@@ -1385,28 +2468,30 @@ void exec_cpux86(CPUx86 *cpu)
 				// operation
 				switch (cpu->modrm_reg) {
 				case 0:
-					opcode_add(cpu, &operand1, &operand2);
+					opcode_rmw(cpu, opcode_add, &operand1, &operand2);
 					break;
 				case 1:
-					opcode_or(cpu, &operand1, &operand2);
+					opcode_rmw(cpu, opcode_or, &operand1, &operand2);
 					break;
 				case 2:
-					opcode_adc(cpu, &operand1, &operand2);
+					opcode_rmw(cpu, opcode_adc, &operand1, &operand2);
 					break;
 				case 3:
-					opcode_sbb(cpu, &operand1, &operand2);
+					opcode_rmw(cpu, opcode_sbb, &operand1, &operand2);
 					break;
 				case 4:
-					opcode_and(cpu, &operand1, &operand2);
+					opcode_rmw(cpu, opcode_and, &operand1, &operand2);
 					break;
 				case 5:
-					opcode_sub(cpu, &operand1, &operand2);
+					opcode_rmw(cpu, opcode_sub, &operand1, &operand2);
 					break;
 				case 6:
-					opcode_xor(cpu, &operand1, &operand2);
+					opcode_rmw(cpu, opcode_xor, &operand1, &operand2);
 					break;
 				case 7:
+					cpu_lock_check(cpu);
 					opcode_cmp(cpu, &operand1, &operand2);
+					c += opcode_cmp_jcc(cpu, budget - c);
 					break;
 				}
 				break;
@@ -1434,28 +2519,30 @@ void exec_cpux86(CPUx86 *cpu)
 				// operation
 				switch (cpu->modrm_reg) {
 				case 0:
-					opcode_add(cpu, &operand1, &operand2);
+					opcode_rmw(cpu, opcode_add, &operand1, &operand2);
 					break;
 				case 1:
-					opcode_or(cpu, &operand1, &operand2);
+					opcode_rmw(cpu, opcode_or, &operand1, &operand2);
 					break;
 				case 2:
-					opcode_adc(cpu, &operand1, &operand2);
+					opcode_rmw(cpu, opcode_adc, &operand1, &operand2);
 					break;
 				case 3:
-					opcode_sbb(cpu, &operand1, &operand2);
+					opcode_rmw(cpu, opcode_sbb, &operand1, &operand2);
 					break;
 				case 4:
-					opcode_and(cpu, &operand1, &operand2);
+					opcode_rmw(cpu, opcode_and, &operand1, &operand2);
 					break;
 				case 5:
-					opcode_sub(cpu, &operand1, &operand2);
+					opcode_rmw(cpu, opcode_sub, &operand1, &operand2);
 					break;
 				case 6:
-					opcode_xor(cpu, &operand1, &operand2);
+					opcode_rmw(cpu, opcode_xor, &operand1, &operand2);
 					break;
 				case 7:
+					cpu_lock_check(cpu);
 					opcode_cmp(cpu, &operand1, &operand2);
+					c += opcode_cmp_jcc(cpu, budget - c);
 					break;
 				}
 				break;
@@ -1465,15 +2552,15 @@ void exec_cpux86(CPUx86 *cpu)
 				mem_eip_load_modrm(cpu);
 
 				// src1 register/memory
-				cpu_modrm_address(cpu, &operand1);
-				operand1.type = 1;
+				cpu_modrm_address8(cpu, &operand1);
 
 				// src2 regisetr
-				operand2.ptr.voidp = &(cpu->regs[cpu->modrm_rm]);
+				operand2.ptr.uint8p = cpu_reg8(cpu, cpu->modrm_reg);
 				operand2.type = 1;
 
 				// operation
 				opcode_test(cpu, &operand1, &operand2);
+				c += opcode_cmp_jcc(cpu, budget - c);
 				break;
 
 			case 0x85:	// 85 /r sz : test r/m32 r32
@@ -1482,25 +2569,58 @@ void exec_cpux86(CPUx86 *cpu)
 
 				// src1 register/memory
 				cpu_modrm_address(cpu, &operand1);
+				operand1.type = cpu_operand_size(cpu);
 
 				// src2 register
-				operand2.ptr.voidp = &(cpu->regs[cpu->modrm_rm]);
-				operand2.type = 4;
+				operand2.ptr.voidp = &(cpu->regs[cpu->modrm_reg]);
+				operand2.type = cpu_operand_size(cpu);
 
 				// operation
 				opcode_test(cpu, &operand1, &operand2);
+				c += opcode_cmp_jcc(cpu, budget - c);
 				break;
 
-			case 0x88:	// 88 /r : mov r/m8 r8
+			case 0x86:	// 86 /r : xchg r/m8 r8
+				// modrm
+				mem_eip_load_modrm(cpu);
+				cpu_lock_check_mem(cpu);
+
+				// dst register/memory
+				cpu_modrm_address8(cpu, &operand1);
+
+				// src register
+				operand2.ptr.uint8p = cpu_reg8(cpu, cpu->modrm_reg);
+				operand2.type = 1;
+
+				// operation
+				opcode_xchg(cpu, &operand1, &operand2);
+				break;
+
+			case 0x87:	// 87 /r sz : xchg r/m32 r32
 				// modrm
 				mem_eip_load_modrm(cpu);
+				cpu_lock_check_mem(cpu);
 
 				// dst register/memory
 				cpu_modrm_address(cpu, &operand1);
-				operand1.type = 1;
 
 				// src register
-				operand2.ptr.voidp = &(cpu->regs[cpu->modrm_rm]);
+				operand2.ptr.voidp = &(cpu->regs[cpu->modrm_reg]);
+				operand2.type = cpu_operand_size(cpu);
+
+				// operation
+				opcode_xchg(cpu, &operand1, &operand2);
+				break;
+
+			case 0x88:	// 88 /r : mov r/m8 r8
+				// modrm
+				mem_eip_load_modrm(cpu);
+
+				// dst register/memory
+				cpu_modrm_address8(cpu, &operand1);
+
+				// src register
+				operand2.ptr.uint8p = cpu_reg8(cpu, cpu->modrm_reg);
 				operand2.type = 1;
 
 				// operation
@@ -1537,6 +2657,26 @@ void exec_cpux86(CPUx86 *cpu)
 				opcode_mov(cpu, &operand1, &operand2);
 				break;
 
+			case 0x8C:	// 8C /r : mov r/m16 Sreg
+				// modrm
+				mem_eip_load_modrm(cpu);
+				if (SEG_GS < cpu->modrm_reg) {
+					cpu_fault(cpu, EXC_UD, 0);
+					break;
+				}
+
+				// dst register/memory (レジスタはオペランドサイズでゼロ拡張)
+				cpu_modrm_address(cpu, &operand1);
+				if (cpu->modrm_mod!=0x03) {
+					operand1.type = 2;
+				} else {
+					operand1.type = cpu_operand_size(cpu);
+				}
+
+				// operation
+				set_uintp_val_ze(&operand1, cpu->sregs[cpu->modrm_reg]);
+				break;
+
 			case 0x8D:	// 8D /r sz : lea r32 m
 				// modrm
 				mem_eip_load_modrm(cpu);
@@ -1558,22 +2698,127 @@ void exec_cpux86(CPUx86 *cpu)
 				opcode_lea(cpu, &operand1, &operand2);
 				break;
 
+			case 0x8E:	// 8E /r : mov Sreg r/m16
+				// modrm
+				mem_eip_load_modrm(cpu);
+
+				// src register/memory
+				cpu_modrm_address(cpu, &operand1);
+				operand1.type = 2;
+
+				// operation
+				opcode_mov_sreg(cpu, cpu->modrm_reg, &operand1);
+				break;
+
 			// 0x90
 			case 0x90:	// nop
 				break;
 
-			// 0xA0
+			case 0x91:	// 91 sz : xchg eax ecx
+			case 0x92:	// 92 sz : xchg eax edx
+			case 0x93:	// 93 sz : xchg eax ebx
+			case 0x94:	// 94 sz : xchg eax esp
+			case 0x95:	// 95 sz : xchg eax ebp
+			case 0x96:	// 96 sz : xchg eax esi
+			case 0x97:	// 97 sz : xchg eax edi
+				operand1.ptr.voidp = &(cpu->regs[0]);
+				operand1.type = cpu_operand_size(cpu);
+				operand2.ptr.voidp = &(cpu->regs[opcode - 0x90]);
+				operand2.type = cpu_operand_size(cpu);
+				opcode_xchg(cpu, &operand1, &operand2);
+				break;
+
+			case 0x9A:	// 9A cp sz : call ptr16:32
+				// src offset
+				operand1.ptr.voidp = mem_eip_ptr(cpu, cpu_operand_size(cpu));
+				operand1.type = cpu_operand_size(cpu);
+
+				// src segment
+				operand2.ptr.voidp = mem_eip_ptr(cpu, 2);
+				operand2.type = 2;
+
+				// operation
+				opcode_call_far(cpu, &operand2, &operand1);
+				break;
+
+			case 0x9B:	// 9B : fwait
+				opcode_fwait(cpu);
+				break;
+
+			// 0xA0
+			case 0xA0:	// A0 : mov al moffs8
+			case 0xA1:	// A1 sz : mov eax moffs32
+			case 0xA2:	// A2 : mov moffs8 al
 			case 0xA3:	// A3 sz : mov moffs32 eax
-				// dst memory
-				operand1.ptr.voidp = mem_eip_ptr(cpu, 4);	// todo アドレスサイズ
-				operand1.type = 4;
+				// memory
+				cpu_moffs_address(cpu, &operand1);
+				if (!(opcode & 0x01)) {
+					operand1.type = 1;
+				}
 
-				// src register
+				// register
 				operand2.ptr.voidp = &(cpu_regist_eax(cpu));
-				operand1.type = 4;
+				operand2.type = operand1.type;
 
 				// operation
-				opcode_mov(cpu, &operand1, &operand2);
+				if (opcode & 0x02) {
+					opcode_mov(cpu, &operand1, &operand2);
+				} else {
+					opcode_mov(cpu, &operand2, &operand1);
+				}
+				break;
+
+			case 0xA4:	// A4 : movs m8 m8
+			case 0xA5:	// A5 sz : movs m32 m32
+				opcode_movs(cpu, opcode==0xA4 ? 1 : cpu_operand_size(cpu));
+				break;
+
+			case 0xA6:	// A6 : cmps m8 m8
+			case 0xA7:	// A7 sz : cmps m32 m32
+				opcode_cmps(cpu, opcode==0xA6 ? 1 : cpu_operand_size(cpu));
+				break;
+
+			case 0xA8:	// A8 ib : test al imm8
+				// src1 register
+				operand1.ptr.voidp = &(cpu_regist_eax(cpu));
+				operand1.type = 1;
+
+				// src2 immediate
+				operand2.ptr.voidp = mem_eip_ptr(cpu, 1);
+				operand2.type = 1;
+
+				// operation
+				opcode_test(cpu, &operand1, &operand2);
+				c += opcode_cmp_jcc(cpu, budget - c);
+				break;
+
+			case 0xA9:	// A9 id sz : test eax imm32
+				// src1 register
+				operand1.ptr.voidp = &(cpu_regist_eax(cpu));
+				operand1.type = cpu_operand_size(cpu);
+
+				// src2 immediate
+				operand2.ptr.voidp = mem_eip_ptr(cpu, cpu_operand_size(cpu));
+				operand2.type = cpu_operand_size(cpu);
+
+				// operation
+				opcode_test(cpu, &operand1, &operand2);
+				c += opcode_cmp_jcc(cpu, budget - c);
+				break;
+
+			case 0xAA:	// AA : stos m8
+			case 0xAB:	// AB sz : stos m32
+				opcode_stos(cpu, opcode==0xAA ? 1 : cpu_operand_size(cpu));
+				break;
+
+			case 0xAC:	// AC : lods m8
+			case 0xAD:	// AD sz : lods m32
+				opcode_lods(cpu, opcode==0xAC ? 1 : cpu_operand_size(cpu));
+				break;
+
+			case 0xAE:	// AE : scas m8
+			case 0xAF:	// AF sz : scas m32
+				opcode_scas(cpu, opcode==0xAE ? 1 : cpu_operand_size(cpu));
 				break;
 
 			// 0xB0
@@ -1610,11 +2855,11 @@ void exec_cpux86(CPUx86 *cpu)
 			case 0xBF:	// BF sz : mov edi imm32
 				// dst register
 				operand1.ptr.voidp = &(cpu->regs[opcode & 0x07]);
-				operand1.type = 4;
+				operand1.type = cpu_operand_size(cpu);
 
 				// src immediate
-				operand2.ptr.voidp = mem_eip_ptr(cpu, 4);
-				operand2.type = 4;
+				operand2.ptr.voidp = mem_eip_ptr(cpu, cpu_operand_size(cpu));
+				operand2.type = cpu_operand_size(cpu);
 
 				// operation
 				opcode_mov(cpu, &operand1, &operand2);
@@ -1622,53 +2867,39 @@ void exec_cpux86(CPUx86 *cpu)
 
 			// 0xC0
 			case 0xC0:
+				// C0 /0 ib : rol r/m8 imm8
+				// C0 /1 ib : ror r/m8 imm8
+				// C0 /2 ib : rcl r/m8 imm8
+				// C0 /3 ib : rcr r/m8 imm8
+				// C0 /4 ib : sal r/m8 imm8
+				// C0 /5 ib : shr r/m8 imm8
+				// C0 /6 ib = salとして動作する
+				// C0 /7 ib : sar r/m8 imm8
+
 				// modrm
 				mem_eip_load_modrm(cpu);
 
 				// dst register/memory
-				cpu_modrm_address(cpu, &operand1);
-				operand1.type = 1;
+				cpu_modrm_address8(cpu, &operand1);
 
 				// src immediate
 				operand2.ptr.voidp = mem_eip_ptr(cpu, 1);
 				operand2.type = 1;
 
 				// operation
-				switch (cpu->modrm_reg) {
-				case 0:	// C0 /0 ib : rol r/m8 imm8
-					//opcode_rol(cpu, &operand1, &operand2);
-					log_error("todo 0xC0 /0\n");
-					exit(1);
-					break;
-				case 1:	// C0 /1 ib : ror r/m8 imm8
-					//opcode_ror(cpu, &operand1, &operand2);
-					log_error("todo 0xC0 /1\n");
-					exit(1);
-					break;
-				case 2:	// C0 /2 ib : rcl r/m8 imm8
-					//opcode_rcl(cpu, &operand1, &operand2);
-					log_error("todo 0xC0 /2\n");
-					exit(1);
-					break;
-				case 3:	// C0 /3 ib : rcr r/m8 imm8
-					//opcode_rcr(cpu, &operand1, &operand2);
-					log_error("todo 0xC0 /3\n");
-					exit(1);
-					break;
-				case 4:	// C0 /4 ib : sal r/m8 imm8
-				case 6:	// C0 /6 ib = salとして動作する
-					opcode_sal(cpu, &operand1, &operand2);
-					break;
-				case 5:	// C0 /5 ib : shr r/m8 imm8
-					opcode_shr(cpu, &operand1, &operand2);
-					break;
-				case 7:	// C0 /7 ib : sar r/m8 imm8
-					opcode_sar(cpu, &operand1, &operand2);
-					break;
-				}
+				opcode_shift_rotate(cpu, &operand1, &operand2);
 				break;
 
 			case 0xC1:
+				// C1 /0 ib sz : rol r/m32 imm8
+				// C1 /1 ib sz : ror r/m32 imm8
+				// C1 /2 ib sz : rcl r/m32 imm8
+				// C1 /3 ib sz : rcr r/m32 imm8
+				// C1 /4 ib sz : sal r/m32 imm8
+				// C1 /5 ib sz : shr r/m32 imm8
+				// C1 /6 ib sz = salとして動作する
+				// C1 /7 ib sz : sar r/m32 imm8
+
 				// modrm
 				mem_eip_load_modrm(cpu);
 
@@ -1681,38 +2912,7 @@ void exec_cpux86(CPUx86 *cpu)
 				operand2.type = 1;
 
 				// operation
-				switch (cpu->modrm_reg) {
-				case 0:	// C1 /0 ib sz : rol r/m32 imm8
-					//opcode_rol(cpu, &operand1, &operand2);
-					log_error("todo 0xC1 /0\n");
-					exit(1);
-					break;
-				case 1:	// C1 /1 ib sz : ror r/m32 imm8
-					//opcode_ror(cpu, &operand1, &operand2);
-					log_error("todo 0xC1 /1\n");
-					exit(1);
-					break;
-				case 2:	// C1 /2 ib sz : rcl r/m32 imm8
-					//opcode_rcl(cpu, &operand1, &operand2);
-					log_error("todo 0xC1 /2\n");
-					exit(1);
-					break;
-				case 3:	// C1 /3 ib sz : rcr r/m32 imm8
-					//opcode_rcr(cpu, &operand1, &operand2);
-					log_error("todo 0xC1 /3\n");
-					exit(1);
-					break;
-				case 4:	// C1 /4 ib sz : sal r/m32 imm8
-				case 6:	// C1 /6 ib sz = salとして動作する
-					opcode_sal(cpu, &operand1, &operand2);
-					break;
-				case 5:	// C1 /5 ib sz : shr r/m32 imm8
-					opcode_shr(cpu, &operand1, &operand2);
-					break;
-				case 7:	// C1 /7 ib sz : sar r/m32 imm8
-					opcode_sar(cpu, &operand1, &operand2);
-					break;
-				}
+				opcode_shift_rotate(cpu, &operand1, &operand2);
 				break;
 
 			case 0xC3:	// C3 : ret
@@ -1727,8 +2927,7 @@ void exec_cpux86(CPUx86 *cpu)
 				switch (cpu->modrm_reg) {
 				case 0:
 					// dst register/memory
-					cpu_modrm_address(cpu, &operand1);
-					operand1.type = 1;
+					cpu_modrm_address8(cpu, &operand1);
 
 					// src immediate
 					operand2.ptr.voidp = mem_eip_ptr(cpu, 1);
@@ -1738,7 +2937,8 @@ void exec_cpux86(CPUx86 *cpu)
 					opcode_mov(cpu, &operand1, &operand2);
 					break;
 				default:
-					log_error("not mapped opcode: 0xC6 reg %d\n", cpu->modrm_reg);
+					log_warning("not mapped opcode: 0xC6 reg %d\n", cpu->modrm_reg);
+					cpu_fault(cpu, EXC_UD, 0);
 					break;
 				}
 				break;
@@ -1761,11 +2961,29 @@ void exec_cpux86(CPUx86 *cpu)
 					opcode_mov(cpu, &operand1, &operand2);
 					break;
 				default:
-					log_error("not mapped opcode: 0xC7 reg %d\n", cpu->modrm_reg);
+					log_warning("not mapped opcode: 0xC7 reg %d\n", cpu->modrm_reg);
+					cpu_fault(cpu, EXC_UD, 0);
 					break;
 				}
 				break;
 
+			case 0xCA:	// CA iw : ret far imm16
+				// src immediate
+				operand1.ptr.voidp = mem_eip_ptr(cpu, 2);
+				operand1.type = 2;
+
+				// operation
+				opcode_ret_far(cpu, &operand1);
+				break;
+
+			case 0xCB:	// CB : ret far
+				opcode_ret_far(cpu, NULL);
+				break;
+
+			case 0xCC:	// CC : int3
+				cpu_interrupt(cpu, EXC_BP, 1, 0, 0);
+				break;
+
 			case 0xCD:	// CD ib : int imm8
 				// src immediate
 				operand1.ptr.voidp = mem_eip_ptr(cpu, 1);
@@ -1779,7 +2997,54 @@ void exec_cpux86(CPUx86 *cpu)
 				opcode_into(cpu);
 				break;
 
+			case 0xCF:	// CF sz : iret
+				opcode_iret(cpu);
+				break;
+
 			// 0xD0
+			case 0xD0:	// D0 /r : rol/ror/rcl/rcr/sal/shr/sar r/m8 1
+			case 0xD2:	// D2 /r : rol/ror/rcl/rcr/sal/shr/sar r/m8 cl
+				// modrm
+				mem_eip_load_modrm(cpu);
+
+				// dst register/memory
+				cpu_modrm_address8(cpu, &operand1);
+
+				// src count
+				if (opcode==0xD0) {
+					temp_val = 1;
+					operand2.ptr.voidp = &temp_val;
+				} else {
+					operand2.ptr.voidp = &(cpu_regist_ecx(cpu));
+				}
+				operand2.type = 1;
+
+				// operation
+				opcode_shift_rotate(cpu, &operand1, &operand2);
+				break;
+
+			case 0xD1:	// D1 /r sz : rol/ror/rcl/rcr/sal/shr/sar r/m32 1
+			case 0xD3:	// D3 /r sz : rol/ror/rcl/rcr/sal/shr/sar r/m32 cl
+				// modrm
+				mem_eip_load_modrm(cpu);
+
+				// dst register/memory
+				cpu_modrm_address(cpu, &operand1);
+				operand1.type = cpu_operand_size(cpu);
+
+				// src count
+				if (opcode==0xD1) {
+					temp_val = 1;
+					operand2.ptr.voidp = &temp_val;
+				} else {
+					operand2.ptr.voidp = &(cpu_regist_ecx(cpu));
+				}
+				operand2.type = 1;
+
+				// operation
+				opcode_shift_rotate(cpu, &operand1, &operand2);
+				break;
+
 			case 0xD4:	// D4 ib : aam imm8
 				// src immediate
 				operand1.ptr.voidp = mem_eip_ptr(cpu, 1);
@@ -1789,16 +3054,68 @@ void exec_cpux86(CPUx86 *cpu)
 				opcode_aam(cpu, &operand1);
 				break;
 
+			case 0xD8:	// D8~DF : x87 FPU
+			case 0xD9:
+			case 0xDA:
+			case 0xDB:
+			case 0xDC:
+			case 0xDD:
+			case 0xDE:
+			case 0xDF:
+				// modrm
+				mem_eip_load_modrm(cpu);
+
+				// operation
+				opcode_fpu(cpu, opcode);
+				break;
+
 			// 0xE0
+			case 0xE4:	// E4 ib : in al imm8
+			case 0xE5:	// E5 ib sz : in eax imm8
+				// input port
+				operand1.ptr.voidp = mem_eip_ptr(cpu, 1);
+				operand1.type = 1;
+
+				// dst
+				operand2.ptr.voidp = &(cpu_regist_eax(cpu));
+				operand2.type = opcode==0xE4 ? 1 : cpu_operand_size(cpu);
+
+				// operation
+				opcode_in(cpu, &operand1, &operand2);
+				break;
+
+			case 0xE6:	// E6 ib : out imm8 al
+			case 0xE7:	// E7 ib sz : out imm8 eax
+				// output port
+				operand1.ptr.voidp = mem_eip_ptr(cpu, 1);
+				operand1.type = 1;
+
+				// output data
+				operand2.ptr.voidp = &(cpu_regist_eax(cpu));
+				operand2.type = opcode==0xE6 ? 1 : cpu_operand_size(cpu);
+
+				// operation
+				opcode_out(cpu, &operand1, &operand2);
+				break;
+
 			case 0xE8:	// E8 cd sz : call rel32
 				// src relative address
-				operand1.ptr.voidp = mem_eip_ptr(cpu, 4);
-				operand1.type = 4;
+				operand1.ptr.voidp = mem_eip_ptr(cpu, cpu_operand_size(cpu));
+				operand1.type = cpu_operand_size(cpu);
 
 				// operation
 				opcode_call(cpu, &operand1);
 				break;
 
+			case 0xE9:	// E9 cd sz : jmp rel32
+				// src relative address
+				operand1.ptr.voidp = mem_eip_ptr(cpu, cpu_operand_size(cpu));
+				operand1.type = cpu_operand_size(cpu);
+
+				// operation
+				opcode_jmp_short(cpu, &operand1);
+				break;
+
 			case 0xEA:	// EA cp sz : jmp ptr16:32
 				// src offset
 				operand1.ptr.voidp = mem_eip_ptr(cpu, cpu_operand_size(cpu));
@@ -1821,32 +3138,74 @@ void exec_cpux86(CPUx86 *cpu)
 				opcode_jmp_short(cpu, &operand1);
 				break;
 
+			case 0xEC:	// EC : in al dx
 			case 0xED:	// ED sz : in eax dx
-				// src
+				// input port
 				operand1.ptr.voidp = &(cpu_regist_edx(cpu));
-				operand1.type = cpu_operand_size(cpu);
+				operand1.type = 2;
+
+				// dst
+				operand2.ptr.voidp = &(cpu_regist_eax(cpu));
+				operand2.type = opcode==0xEC ? 1 : cpu_operand_size(cpu);
 
 				// operation
-				opcode_in(cpu, &operand1);
+				opcode_in(cpu, &operand1, &operand2);
 				break;
 
 			case 0xEE:	// EE : out dx al
+			case 0xEF:	// EF sz : out dx eax
 				// output port
 				operand1.ptr.voidp = &(cpu_regist_edx(cpu));
 				operand1.type = 2;
 
 				// output data
 				operand2.ptr.voidp = &(cpu_regist_eax(cpu));
-				operand2.type = 1;
+				operand2.type = opcode==0xEE ? 1 : cpu_operand_size(cpu);
 
 				// operation
 				opcode_out(cpu, &operand1, &operand2);
 				break;
 
+			case 0xF4:	// F4 : hlt
+				opcode_hlt(cpu);
+				break;
+
+			case 0xF6:
+			case 0xF7:
+				// modrm
+				mem_eip_load_modrm(cpu);
+
+				// src register/memory
+				if (opcode==0xF6) {
+					cpu_modrm_address8(cpu, &operand1);
+				} else {
+					cpu_modrm_address(cpu, &operand1);
+				}
+
+				switch (cpu->modrm_reg) {
+				case 6:	// F6 /6 : div r/m8		F7 /6 sz : div r/m32
+					cpu_lock_check(cpu);
+					opcode_div(cpu, &operand1);
+					break;
+				case 7:	// F6 /7 : idiv r/m8	F7 /7 sz : idiv r/m32
+					cpu_lock_check(cpu);
+					opcode_idiv(cpu, &operand1);
+					break;
+				default:
+					log_warning("not mapped opcode: 0x%02X reg %d\n", opcode, cpu->modrm_reg);
+					cpu_fault(cpu, EXC_UD, 0);
+					break;
+				}
+				break;
+
 			case 0xFA:	// FA : cli
 				opcode_cli(cpu);
 				break;
 
+			case 0xFB:	// FB : sti
+				opcode_sti(cpu);
+				break;
+
 			case 0xFE:
 				// modrm
 				mem_eip_load_modrm(cpu);
@@ -1854,37 +3213,127 @@ void exec_cpux86(CPUx86 *cpu)
 				switch (cpu->modrm_reg) {
 				case 0:	// FE /0 : inc r/m8
 					// target
-					cpu_modrm_address(cpu, &operand1);
-					operand1.type = 1;
+					cpu_modrm_address8(cpu, &operand1);
 
 					// operation
-					opcode_inc(cpu, &operand1);
+					opcode_rmw1(cpu, opcode_inc, &operand1);
 					break;
 				case 1:	// FE /1 : dec r/m8
 					// target
-					cpu_modrm_address(cpu, &operand1);
-					operand1.type = 1;
+					cpu_modrm_address8(cpu, &operand1);
 
 					// operation
-					opcode_dec(cpu, &operand1);
+					opcode_rmw1(cpu, opcode_dec, &operand1);
 					break;
 				default:
-					log_error("not mapped opcode: 0xFE reg %d\n", cpu->modrm_reg);
+					log_warning("not mapped opcode: 0xFE reg %d\n", cpu->modrm_reg);
+					cpu_fault(cpu, EXC_UD, 0);
+					break;
+				}
+				break;
+
+			case 0xFF:
+				// modrm
+				mem_eip_load_modrm(cpu);
+
+				// target
+				cpu_modrm_address(cpu, &operand1);
+				operand1.type = cpu_operand_size(cpu);
+
+				switch (cpu->modrm_reg) {
+				case 0:	// FF /0 sz : inc r/m32
+					opcode_rmw1(cpu, opcode_inc, &operand1);
+					break;
+				case 1:	// FF /1 sz : dec r/m32
+					opcode_rmw1(cpu, opcode_dec, &operand1);
+					break;
+				case 2:	// FF /2 sz : call r/m32
+					cpu_lock_check(cpu);
+					opcode_call_near(cpu, &operand1);
+					break;
+				case 3:	// FF /3 sz : call m16:32
+				case 5:	// FF /5 sz : jmp m16:32
+					if (cpu->modrm_mod==0x03 || cpu->prefix.lock) {
+						cpu_fault(cpu, EXC_UD, 0);
+						break;
+					}
+
+					// src segment
+					operand2.ptr.voidp = operand1.ptr.uint8p + operand1.type;
+					operand2.type = 2;
+
+					if (cpu->modrm_reg==3) {
+						opcode_call_far(cpu, &operand2, &operand1);
+					} else {
+						opcode_jmp_far(cpu, &operand2, &operand1);
+					}
+					break;
+				case 4:	// FF /4 sz : jmp r/m32
+					cpu_lock_check(cpu);
+					opcode_jmp_near(cpu, &operand1);
+					break;
+				case 6:	// FF /6 sz : push r/m32
+					cpu_lock_check(cpu);
+					opcode_push(cpu, &operand1);
+					break;
+				default:
+					log_warning("not mapped opcode: 0xFF reg %d\n", cpu->modrm_reg);
+					cpu_fault(cpu, EXC_UD, 0);
 					break;
 				}
 				break;
 
 			// not implemented opcode
 			default:
-				log_error("not implemented opcode: 0x%02X\n", opcode);
-				exit(1);
+				log_warning("not implemented opcode: 0x%02X\n", opcode);
+				cpu_fault(cpu, EXC_UD, 0);
 			}
 		} else {
 			opcode = mem_eip_load8(cpu);
-			log_info("opcode: %X\n", opcode);
+			if (trace) {
+				log_debug("opcode: %X\n", opcode);
+			}
+			if (cpu->prefix.lock && !cpu_lockable(0x100 | opcode)) {
+				cpu_fault(cpu, EXC_UD, 0);
+			}
 
 			// 2byte opcode
 			switch (opcode) {
+			case 0x00:
+				// 0F 00 /0 : sldt r/m16
+				// 0F 00 /1 : str r/m16
+				// 0F 00 /2 : lldt r/m16
+				// 0F 00 /3 : ltr r/m16
+
+				// modrm
+				mem_eip_load_modrm(cpu);
+
+				// register/memory
+				cpu_modrm_address(cpu, &operand1);
+				if (cpu->modrm_mod!=0x03 || 2<=cpu->modrm_reg) {
+					operand1.type = 2;
+				}
+
+				switch (cpu->modrm_reg) {
+				case 0:
+					opcode_sldt(cpu, &operand1);
+					break;
+				case 1:
+					opcode_str(cpu, &operand1);
+					break;
+				case 2:
+					opcode_lldt(cpu, &operand1);
+					break;
+				case 3:
+					opcode_ltr(cpu, &operand1);
+					break;
+				default:
+					log_warning("not implemented opcode: 0x0F00 /%d\n", cpu->modrm_reg);
+					cpu_fault(cpu, EXC_UD, 0);
+					break;
+				}
+				break;
+
 			case 0x01:
 				// 0F 01 /0 : sgdt m
 				// 0F 01 /1 : sidt m
@@ -1899,10 +3348,18 @@ void exec_cpux86(CPUx86 *cpu)
 
 				switch (cpu->modrm_reg) {
 				case 0:
-					log_error("not implemented opcode: 0x0F01 /%d\n", cpu->modrm_reg);
+					// dst m16&32
+					cpu_modrm_address_m16_32(cpu, &operand1, &operand2);
+
+					// operation
+					opcode_sgdt(cpu, &operand1, &operand2);
 					break;
 				case 1:
-					log_error("not implemented opcode: 0x0F01 /%d\n", cpu->modrm_reg);
+					// dst m16&32
+					cpu_modrm_address_m16_32(cpu, &operand1, &operand2);
+
+					// operation
+					opcode_sidt(cpu, &operand1, &operand2);
 					break;
 				case 2:
 					// src m16&32
@@ -1912,21 +3369,90 @@ void exec_cpux86(CPUx86 *cpu)
 					opcode_lgdt(cpu, &operand1, &operand2);
 					break;
 				case 3:
-					log_error("not implemented opcode: 0x0F01 /%d\n", cpu->modrm_reg);
+					// src m16&32
+					cpu_modrm_address_m16_32(cpu, &operand1, &operand2);
+
+					// operation
+					opcode_lidt(cpu, &operand1, &operand2);
 					break;
 				case 4:
-					log_error("not implemented opcode: 0x0F01 /%d\n", cpu->modrm_reg);
+					// dst register/memory
+					cpu_modrm_address(cpu, &operand1);
+					if (cpu->modrm_mod!=0x03) {
+						operand1.type = 2;
+					}
+
+					// operation
+					opcode_smsw(cpu, &operand1);
 					break;
 				case 6:
-					log_error("not implemented opcode: 0x0F01 /%d\n", cpu->modrm_reg);
+					// src register/memory
+					cpu_modrm_address(cpu, &operand1);
+					operand1.type = 2;
+
+					// operation
+					opcode_lmsw(cpu, &operand1);
 					break;
 				case 7:
-					log_error("not implemented opcode: 0x0F01 /%d\n", cpu->modrm_reg);
+					log_warning("not implemented opcode: 0x0F01 /%d\n", cpu->modrm_reg);
+					cpu_fault(cpu, EXC_UD, 0);
 					break;
 				}
 				break;
 
-			case 0xB6:	// 0F B6 /r sz : movzx r32 r/m8
+			case 0x06:	// 0F 06 : clts
+				opcode_clts(cpu);
+				break;
+
+			case 0x20:	// 0F 20 /r : mov r32 CRn
+			case 0x22:	// 0F 22 /r : mov CRn r32
+				// modrm(modに関係なくレジスタ)
+				mem_eip_load_modrm(cpu);
+
+				// register
+				operand1.ptr.voidp = &(cpu->regs[cpu->modrm_rm]);
+				operand1.type = 4;
+
+				// operation
+				if (opcode==0x20) {
+					opcode_mov_from_cr(cpu, cpu->modrm_reg, &operand1);
+				} else {
+					opcode_mov_to_cr(cpu, cpu->modrm_reg, &operand1);
+				}
+				break;
+
+			case 0x30:	// 0F 30 : wrmsr
+				opcode_wrmsr(cpu);
+				break;
+
+			case 0x31:	// 0F 31 : rdtsc
+				opcode_rdtsc(cpu);
+				break;
+
+			case 0x32:	// 0F 32 : rdmsr
+				opcode_rdmsr(cpu);
+				break;
+
+			case 0xA2:	// 0F A2 : cpuid
+				opcode_cpuid(cpu);
+				break;
+
+			case 0x40:	// 0F 40 /r sz : cmovo r32 r/m32
+			case 0x41:	// 0F 41 /r sz : cmovno r32 r/m32
+			case 0x42:	// 0F 42 /r sz : cmovb r32 r/m32
+			case 0x43:	// 0F 43 /r sz : cmovae r32 r/m32
+			case 0x44:	// 0F 44 /r sz : cmovz r32 r/m32
+			case 0x45:	// 0F 45 /r sz : cmovnz r32 r/m32
+			case 0x46:	// 0F 46 /r sz : cmovbe r32 r/m32
+			case 0x47:	// 0F 47 /r sz : cmova r32 r/m32
+			case 0x48:	// 0F 48 /r sz : cmovs r32 r/m32
+			case 0x49:	// 0F 49 /r sz : cmovns r32 r/m32
+			case 0x4A:	// 0F 4A /r sz : cmovp r32 r/m32
+			case 0x4B:	// 0F 4B /r sz : cmovnp r32 r/m32
+			case 0x4C:	// 0F 4C /r sz : cmovl r32 r/m32
+			case 0x4D:	// 0F 4D /r sz : cmovge r32 r/m32
+			case 0x4E:	// 0F 4E /r sz : cmovle r32 r/m32
+			case 0x4F:	// 0F 4F /r sz : cmovg r32 r/m32
 				// modrm
 				mem_eip_load_modrm(cpu);
 
@@ -1936,7 +3462,220 @@ void exec_cpux86(CPUx86 *cpu)
 
 				// src register/memory
 				cpu_modrm_address(cpu, &operand2);
-				operand2.type = 1;
+				operand2.type = cpu_operand_size(cpu);
+
+				// operation
+				opcode_cmov(cpu, opcode & 0x0F, &operand1, &operand2);
+				break;
+
+			case 0x80:	// 0F 80 cd sz : jo rel32
+			case 0x81:	// 0F 81 cd sz : jno rel32
+			case 0x82:	// 0F 82 cd sz : jb rel32
+			case 0x83:	// 0F 83 cd sz : jae rel32
+			case 0x84:	// 0F 84 cd sz : jz rel32
+			case 0x85:	// 0F 85 cd sz : jnz rel32
+			case 0x86:	// 0F 86 cd sz : jbe rel32
+			case 0x87:	// 0F 87 cd sz : ja rel32
+			case 0x88:	// 0F 88 cd sz : js rel32
+			case 0x89:	// 0F 89 cd sz : jns rel32
+			case 0x8A:	// 0F 8A cd sz : jp rel32
+			case 0x8B:	// 0F 8B cd sz : jnp rel32
+			case 0x8C:	// 0F 8C cd sz : jl rel32
+			case 0x8D:	// 0F 8D cd sz : jge rel32
+			case 0x8E:	// 0F 8E cd sz : jle rel32
+			case 0x8F:	// 0F 8F cd sz : jg rel32
+				// relative address
+				operand1.ptr.voidp = mem_eip_ptr(cpu, cpu_operand_size(cpu));
+				operand1.type = cpu_operand_size(cpu);
+
+				// operation
+				opcode_jcc(cpu, opcode & 0x0F, &operand1);
+				break;
+
+			case 0x90:	// 0F 90 /0 : seto r/m8
+			case 0x91:	// 0F 91 /0 : setno r/m8
+			case 0x92:	// 0F 92 /0 : setb r/m8
+			case 0x93:	// 0F 93 /0 : setae r/m8
+			case 0x94:	// 0F 94 /0 : setz r/m8
+			case 0x95:	// 0F 95 /0 : setnz r/m8
+			case 0x96:	// 0F 96 /0 : setbe r/m8
+			case 0x97:	// 0F 97 /0 : seta r/m8
+			case 0x98:	// 0F 98 /0 : sets r/m8
+			case 0x99:	// 0F 99 /0 : setns r/m8
+			case 0x9A:	// 0F 9A /0 : setp r/m8
+			case 0x9B:	// 0F 9B /0 : setnp r/m8
+			case 0x9C:	// 0F 9C /0 : setl r/m8
+			case 0x9D:	// 0F 9D /0 : setge r/m8
+			case 0x9E:	// 0F 9E /0 : setle r/m8
+			case 0x9F:	// 0F 9F /0 : setg r/m8
+				// modrm
+				mem_eip_load_modrm(cpu);
+
+				// dst register/memory
+				cpu_modrm_address8(cpu, &operand1);
+
+				// operation
+				opcode_setcc(cpu, opcode & 0x0F, &operand1);
+				break;
+
+			case 0xA0:	// 0F A0 : push fs
+				opcode_push_sreg(cpu, SEG_FS);
+				break;
+
+			case 0xA1:	// 0F A1 : pop fs
+				opcode_pop_sreg(cpu, SEG_FS);
+				break;
+
+			case 0xA4:	// 0F A4 /r ib sz : shld r/m32 r32 imm8
+			case 0xA5:	// 0F A5 /r sz : shld r/m32 r32 cl
+			case 0xAC:	// 0F AC /r ib sz : shrd r/m32 r32 imm8
+			case 0xAD:	// 0F AD /r sz : shrd r/m32 r32 cl
+				// modrm
+				mem_eip_load_modrm(cpu);
+
+				// dst register/memory
+				cpu_modrm_address(cpu, &operand1);
+				operand1.type = cpu_operand_size(cpu);
+
+				// src register
+				operand2.ptr.voidp = &(cpu->regs[cpu->modrm_reg]);
+				operand2.type = cpu_operand_size(cpu);
+
+				// src count
+				if (opcode & 0x01) {
+					operand3.ptr.voidp = &(cpu_regist_ecx(cpu));
+				} else {
+					operand3.ptr.voidp = mem_eip_ptr(cpu, 1);
+				}
+				operand3.type = 1;
+
+				// operation
+				if (opcode<0xA8) {
+					opcode_shld(cpu, &operand1, &operand2, &operand3);
+				} else {
+					opcode_shrd(cpu, &operand1, &operand2, &operand3);
+				}
+				break;
+
+			case 0xA8:	// 0F A8 : push gs
+				opcode_push_sreg(cpu, SEG_GS);
+				break;
+
+			case 0xA9:	// 0F A9 : pop gs
+				opcode_pop_sreg(cpu, SEG_GS);
+				break;
+
+			case 0xAE:
+				// 0F AE /0 : fxsave m512byte
+				// 0F AE /1 : fxrstor m512byte
+
+				// 0F AE /2 : ldmxcsr m32
+				// 0F AE /3 : stmxcsr m32
+				// 0F AE E8 : lfence
+				// 0F AE F0 : mfence
+				// 0F AE F8 : sfence
+
+				// modrm
+				mem_eip_load_modrm(cpu);
+				if (cpu->modrm_mod==3) {
+					// フェンスは逐次実行なので何もしない
+					if (cpu->modrm_reg<5) {
+						log_warning("not implemented opcode: 0x0FAE %02X\n", 0xC0 | cpu->modrm_reg << 3 | cpu->modrm_rm);
+						cpu_fault(cpu, EXC_UD, 0);
+					}
+					break;
+				}
+
+				// register/memory
+				cpu_modrm_address(cpu, &operand1);
+
+				// operation
+				switch (cpu->modrm_reg) {
+				case 0:
+					opcode_fxsave(cpu, &operand1);
+					break;
+				case 1:
+					opcode_fxrstor(cpu, &operand1);
+					break;
+				case 2:
+					operand1.type = 4;
+					opcode_ldmxcsr(cpu, &operand1);
+					break;
+				case 3:
+					operand1.type = 4;
+					opcode_stmxcsr(cpu, &operand1);
+					break;
+				default:
+					log_warning("not implemented opcode: 0x0FAE /%d\n", cpu->modrm_reg);
+					cpu_fault(cpu, EXC_UD, 0);
+					break;
+				}
+				break;
+
+			case 0xB0:	// 0F B0 /r : cmpxchg r/m8 r8
+			case 0xB1:	// 0F B1 /r sz : cmpxchg r/m32 r32
+			case 0xC0:	// 0F C0 /r : xadd r/m8 r8
+			case 0xC1:	// 0F C1 /r sz : xadd r/m32 r32
+				// modrm
+				mem_eip_load_modrm(cpu);
+				cpu_lock_check_mem(cpu);
+
+				// dst register/memory, src register
+				if ((opcode & 1)==0) {
+					cpu_modrm_address8(cpu, &operand1);
+					operand2.ptr.uint8p = cpu_reg8(cpu, cpu->modrm_reg);
+					operand2.type = 1;
+				} else {
+					cpu_modrm_address(cpu, &operand1);
+					operand2.ptr.voidp = &(cpu->regs[cpu->modrm_reg]);
+					operand2.type = cpu_operand_size(cpu);
+				}
+
+				// operation
+				if (opcode < 0xC0) {
+					opcode_cmpxchg(cpu, &operand1, &operand2);
+				} else {
+					opcode_xadd(cpu, &operand1, &operand2);
+				}
+				break;
+
+			case 0xB2:	// 0F B2 /r sz : lss r32 m16:32
+			case 0xB4:	// 0F B4 /r sz : lfs r32 m16:32
+			case 0xB5:	// 0F B5 /r sz : lgs r32 m16:32
+				// modrm
+				mem_eip_load_modrm(cpu);
+				if (cpu->modrm_mod==0x03) {
+					cpu_fault(cpu, EXC_UD, 0);
+					break;
+				}
+
+				// dst register
+				operand1.ptr.voidp = &(cpu->regs[cpu->modrm_reg]);
+				operand1.type = cpu_operand_size(cpu);
+
+				// src memory
+				cpu_modrm_address(cpu, &operand2);
+
+				// operation
+				if (opcode==0xB2) {
+					opcode_lfp(cpu, SEG_SS, &operand1, &operand2);
+				} else if (opcode==0xB4) {
+					opcode_lfp(cpu, SEG_FS, &operand1, &operand2);
+				} else {
+					opcode_lfp(cpu, SEG_GS, &operand1, &operand2);
+				}
+				break;
+
+			case 0xB6:	// 0F B6 /r sz : movzx r32 r/m8
+				// modrm
+				mem_eip_load_modrm(cpu);
+
+				// dst register
+				operand1.ptr.voidp = &(cpu->regs[cpu->modrm_reg]);
+				operand1.type = cpu_operand_size(cpu);
+
+				// src register/memory
+				cpu_modrm_address8(cpu, &operand2);
 
 				// operation
 				opcode_movzx(cpu, &operand1, &operand2);
@@ -1951,26 +3690,197 @@ void exec_cpux86(CPUx86 *cpu)
 				operand1.type = cpu_operand_size(cpu);
 
 				// src register/memory
-				cpu_modrm_address(cpu, &operand2);
-				operand2.type = 1;
+				cpu_modrm_address8(cpu, &operand2);
 
 				// operation
 				opcode_movsx(cpu, &operand1, &operand2);
 				break;
 
+			case 0x10:	// 0F 10 /r : movups xmm xmm/m128
+			case 0x11:	// 0F 11 /r : movups xmm/m128 xmm
+			case 0x28:	// 0F 28 /r : movaps xmm xmm/m128
+			case 0x29:	// 0F 29 /r : movaps xmm/m128 xmm
+			case 0x2B:	// 0F 2B /r : movntps m128 xmm
+			case 0x60:	// 0F 60 /r : punpcklbw mm mm/m32
+			case 0x61:	// 0F 61 /r : punpcklwd mm mm/m32
+			case 0x62:	// 0F 62 /r : punpckldq mm mm/m32
+			case 0x63:	// 0F 63 /r : packsswb mm mm/m64
+			case 0x64:	// 0F 64 /r : pcmpgtb mm mm/m64
+			case 0x65:	// 0F 65 /r : pcmpgtw mm mm/m64
+			case 0x66:	// 0F 66 /r : pcmpgtd mm mm/m64
+			case 0x67:	// 0F 67 /r : packuswb mm mm/m64
+			case 0x68:	// 0F 68 /r : punpckhbw mm mm/m64
+			case 0x69:	// 0F 69 /r : punpckhwd mm mm/m64
+			case 0x6A:	// 0F 6A /r : punpckhdq mm mm/m64
+			case 0x6B:	// 0F 6B /r : packssdw mm mm/m64
+			case 0x6C:	// 66 0F 6C /r : punpcklqdq xmm xmm/m128
+			case 0x6D:	// 66 0F 6D /r : punpckhqdq xmm xmm/m128
+			case 0x6E:	// 0F 6E /r : movd mm r/m32
+			case 0x6F:	// 0F 6F /r : movq mm mm/m64
+			case 0x70:	// 0F 70 /r ib : pshufw mm mm/m64 imm8
+			case 0x71:	// 0F 71 /n ib : psrlw/psraw/psllw mm imm8
+			case 0x72:	// 0F 72 /n ib : psrld/psrad/pslld mm imm8
+			case 0x73:	// 0F 73 /n ib : psrlq/psllq mm imm8
+			case 0x74:	// 0F 74 /r : pcmpeqb mm mm/m64
+			case 0x75:	// 0F 75 /r : pcmpeqw mm mm/m64
+			case 0x76:	// 0F 76 /r : pcmpeqd mm mm/m64
+			case 0x77:	// 0F 77 : emms
+			case 0x7E:	// 0F 7E /r : movd r/m32 mm
+			case 0x7F:	// 0F 7F /r : movq mm/m64 mm
+			case 0xC3:	// 0F C3 /r : movnti m32 r32
+			case 0xD1:	// 0F D1 /r : psrlw mm mm/m64
+			case 0xD2:	// 0F D2 /r : psrld mm mm/m64
+			case 0xD3:	// 0F D3 /r : psrlq mm mm/m64
+			case 0xD4:	// 0F D4 /r : paddq mm mm/m64
+			case 0xD5:	// 0F D5 /r : pmullw mm mm/m64
+			case 0xD6:	// 66 0F D6 /r : movq xmm/m64 xmm
+			case 0xD7:	// 0F D7 /r : pmovmskb r32 mm
+			case 0xD8:	// 0F D8 /r : psubusb mm mm/m64
+			case 0xD9:	// 0F D9 /r : psubusw mm mm/m64
+			case 0xDA:	// 0F DA /r : pminub mm mm/m64
+			case 0xDB:	// 0F DB /r : pand mm mm/m64
+			case 0xDC:	// 0F DC /r : paddusb mm mm/m64
+			case 0xDD:	// 0F DD /r : paddusw mm mm/m64
+			case 0xDE:	// 0F DE /r : pmaxub mm mm/m64
+			case 0xDF:	// 0F DF /r : pandn mm mm/m64
+			case 0xE0:	// 0F E0 /r : pavgb mm mm/m64
+			case 0xE1:	// 0F E1 /r : psraw mm mm/m64
+			case 0xE2:	// 0F E2 /r : psrad mm mm/m64
+			case 0xE3:	// 0F E3 /r : pavgw mm mm/m64
+			case 0xE4:	// 0F E4 /r : pmulhuw mm mm/m64
+			case 0xE5:	// 0F E5 /r : pmulhw mm mm/m64
+			case 0xE7:	// 0F E7 /r : movntq m64 mm
+			case 0xE8:	// 0F E8 /r : psubsb mm mm/m64
+			case 0xE9:	// 0F E9 /r : psubsw mm mm/m64
+			case 0xEA:	// 0F EA /r : pminsw mm mm/m64
+			case 0xEB:	// 0F EB /r : por mm mm/m64
+			case 0xEC:	// 0F EC /r : paddsb mm mm/m64
+			case 0xED:	// 0F ED /r : paddsw mm mm/m64
+			case 0xEE:	// 0F EE /r : pmaxsw mm mm/m64
+			case 0xEF:	// 0F EF /r : pxor mm mm/m64
 			case 0xF1:	// 0F F1 /r : psllw mm mm/m64
-				log_error("not implemented opcode: 0x0FF1\n");
+			case 0xF2:	// 0F F2 /r : pslld mm mm/m64
+			case 0xF3:	// 0F F3 /r : psllq mm mm/m64
+			case 0xF4:	// 0F F4 /r : pmuludq mm mm/m64
+			case 0xF5:	// 0F F5 /r : pmaddwd mm mm/m64
+			case 0xF6:	// 0F F6 /r : psadbw mm mm/m64
+			case 0xF8:	// 0F F8 /r : psubb mm mm/m64
+			case 0xF9:	// 0F F9 /r : psubw mm mm/m64
+			case 0xFA:	// 0F FA /r : psubd mm mm/m64
+			case 0xFB:	// 0F FB /r : psubq mm mm/m64
+			case 0xFC:	// 0F FC /r : paddb mm mm/m64
+			case 0xFD:	// 0F FD /r : paddw mm mm/m64
+			case 0xFE:	// 0F FE /r : paddd mm mm/m64
+				// 66プリフィックスでxmm xmm/m128
+
+				// modrm
+				if (opcode!=0x77) {
+					mem_eip_load_modrm(cpu);
+				}
+
+				// operation
+				opcode_sse(cpu, opcode);
+				break;
+
+			case 0x18:
+				// 0F 18 /0 : prefetchnta m8
+				// 0F 18 /1 : prefetcht0 m8
+				// 0F 18 /2 : prefetcht1 m8
+				// 0F 18 /3 : prefetcht2 m8
+
+				// modrm
+				mem_eip_load_modrm(cpu);
+
+				// address(読み捨て)
+				cpu_modrm_address(cpu, &operand1);
 				break;
 
 			default:
-				log_error("not implemented opcode: 0x0F%02X\n", opcode);
-				exit(1);
+				log_warning("not implemented opcode: 0x0F%02X\n", opcode);
+				cpu_fault(cpu, EXC_UD, 0);
 			}
 		}
 	}
+	return c;
 }
 
+#undef cpu_operand_size
+#undef cpu_address_size
+#define cpu_operand_size(cpu)	(((cpu)->code32==(cpu)->prefix.operand_size) ? 2 : 4)
+#define cpu_address_size(cpu)	(((cpu)->code32==(cpu)->prefix.address_size) ? 2 : 4)
+
+// 16bitコード(リアルモード、仮想8086モード、16bitセグメント)
+int exec_cpux86_16(CPUx86 *cpu, int budget)
+{
+	return exec_cpux86_loop(cpu, budget, 0);
+}
+
+// 32bitコード
+int exec_cpux86_32(CPUx86 *cpu, int budget)
+{
+	return exec_cpux86_loop(cpu, budget, 1);
+}
+
+// CR0.PE、CSのDビット、EFLAGS.VMが変わったときだけループを選び直す
+// 例外はcpu_faultからここに戻り、IDTで配送してから続ける(中断した命令は1命令と数える)
+// スライスの区切りでタイマーを進めて割り込みを受け付け、HLT中は次のタイマーまで待つ
+void exec_cpux86(CPUx86 *cpu)
+{
+	volatile int c=0;
+	int n;
+	int budget;
+	uint64 start;
+
+	log_set_guest(cpu);
+	if (setjmp(cpu->fault_jmp)) {
+		c++;
+		clock_advance(cpu, cpu->clock.slice);
+		if (!cpu->shutdown) {
+			cpu_fault_deliver(cpu);
+		}
+	}
+	while (c<30000 && !cpu->shutdown) {
+		if (cpu->gdb) {
+			gdb_poll(cpu);
+		}
+		pc_update(cpu);
+		pc_interrupt(cpu);
+		if (cpu->halted) {
+			// 起こすものがなければ呼び出し元に戻る
+			if (!clock_idle(cpu)) {
+				break;
+			}
+			c++;
+			continue;
+		}
+
+		budget = clock_budget(cpu, 30000 - c);
+		start = clock_host_ns();
+		if (cpu->code32) {
+			n = exec_cpux86_32(cpu, budget);
+		} else {
+			n = exec_cpux86_16(cpu, budget);
+		}
+		metrics_hist_add(&(cpu->metrics.slice_ns), clock_host_ns() - start);
+		c += n;
+		clock_advance(cpu, n);
+	}
+}
+
+// 1CPUで止まるまでexec_cpux86を繰り返す(machine_run_cpuのBSPと同じ条件)
+//   シャットダウンかIF=0のHLTで戻る、HLTでタイマーもなければデバイスからの割り込みを待つ
 void run_cpux86(CPUx86 *cpu)
 {
-	exec_cpux86(cpu);
+	for (;;) {
+		exec_cpux86(cpu);
+		if (cpu->shutdown) {
+			break;
+		}
+		if (cpu->halted && !cpu_eflags(cpu, CPU_EFLAGS_IF)) {
+			break;
+		}
+		if (cpu->halted && !clock_idle(cpu)) {
+			pc_wait(cpu, -1);
+		}
+	}
 }
@@ -1,6 +1,9 @@
 #ifndef CPU_X86_H
 #define CPU_X86_H
 
+#include <stdio.h>
+#include <setjmp.h>
+
 // int
 
 typedef char int8;
@@ -10,6 +13,8 @@ typedef int int32;
 typedef unsigned char uint8;
 typedef unsigned short uint16;
 typedef unsigned int uint32;
+typedef long long int64;
+typedef unsigned long long uint64;
 
 
 // Descriptor
@@ -17,9 +22,49 @@ typedef unsigned int uint32;
 typedef struct {
 	uint32 limit;
 	uint32 base;
-	uint16 attribute;
+	uint16 attribute;	// ディスクリプタのbit40~55(bit8~11は0)
 } Descriptor;
 
+#define desc_type(desc)	((desc)->attribute & 0x0F)
+#define desc_s(desc)	(((desc)->attribute >> 4) & 0x01)
+#define desc_dpl(desc)	(((desc)->attribute >> 5) & 0x03)
+#define desc_p(desc)	(((desc)->attribute >> 7) & 0x01)
+#define desc_d(desc)	(((desc)->attribute >> 14) & 0x01)
+#define desc_g(desc)	(((desc)->attribute >> 15) & 0x01)
+
+// S=1 のtype
+#define DESC_ACCESSED		0x01
+#define DESC_WRITABLE		0x02	// データ
+#define DESC_READABLE		0x02	// コード
+#define DESC_CONFORMING		0x04	// コード
+#define DESC_CODE			0x08
+
+#define desc_is_code(desc)			(desc_s(desc) && (desc_type(desc) & DESC_CODE))
+#define desc_is_conforming(desc)	(desc_is_code(desc) && (desc_type(desc) & DESC_CONFORMING))
+
+// S=0 のtype
+#define DESC_TSS16			0x01
+#define DESC_LDT			0x02
+#define DESC_TSS16_BUSY		0x03
+#define DESC_CALL_GATE16	0x04
+#define DESC_TASK_GATE		0x05
+#define DESC_INT_GATE16		0x06
+#define DESC_TRAP_GATE16	0x07
+#define DESC_TSS32			0x09
+#define DESC_TSS32_BUSY		0x0B
+#define DESC_CALL_GATE32	0x0C
+#define DESC_INT_GATE32		0x0E
+#define DESC_TRAP_GATE32	0x0F
+
+// ディスクリプタの読み出しキャッシュ(リニアアドレスと8バイトが一致すればデコード済みのものを使う)
+#define CPU_DESC_CACHE	64
+
+typedef struct {
+	uint32 addr;
+	uint64 raw;
+	Descriptor desc;
+} DescCache;
+
 
 // Descriptor Table Register
 
@@ -29,9 +74,265 @@ typedef struct {
 } DescTableReg;
 
 
-// CPUx86
+// FPUx87
+
+typedef struct {
+	long double st[8];	// 物理レジスタ R0~R7 (ST(i) = R[(TOP+i)&7])
+	uint16 control;		// 制御ワード
+	uint16 status;		// ステータスワード (bit11-13: TOP)
+	uint8 tag_empty;	// タグ(bit i: R[i]が空), タグワードは値から求める
+	uint16 opcode;		// 最後に実行した命令(11bit)
+	uint32 ip;			// 最後に実行した命令のアドレス
+	uint16 cs;
+	uint32 dp;			// 最後のオペランドのアドレス
+	uint16 ds;
+	uint8 exact;		// 0: host doubleで計算(高速) 1: 80bit拡張倍精度で計算(厳密、VCPU_FPU=exact)
+} FPUx87;
+
+#define FPU_SW_IE	0x0001
+#define FPU_SW_DE	0x0002
+#define FPU_SW_ZE	0x0004
+#define FPU_SW_OE	0x0008
+#define FPU_SW_UE	0x0010
+#define FPU_SW_PE	0x0020
+#define FPU_SW_SF	0x0040
+#define FPU_SW_ES	0x0080
+#define FPU_SW_C0	0x0100
+#define FPU_SW_C1	0x0200
+#define FPU_SW_C2	0x0400
+#define FPU_SW_TOP	0x3800
+#define FPU_SW_C3	0x4000
+#define FPU_SW_B	0x8000
+
+
+// XMM
+
+typedef union {
+	uint8 b[16];
+	uint16 w[8];
+	uint32 d[4];
+	uint64 q[2];
+} XMMReg;
+
+// mxcsr
+#define MXCSR_DEFAULT	0x1F80
+#define MXCSR_MASK		0x0000FFFF
+
+
+// 仮想クロック
+//   RDTSC、PIT、RTCはすべてこの時刻(TSC)で動く
+//   命令数はスライス(exec_cpux86の1回のループ)ごとにまとめて足す
+
+#define CLOCK_MODE_DETERMINISTIC	0	// 命令数で進む(1命令CLOCK_INSN_CYCLESサイクル)
+#define CLOCK_MODE_REALTIME		1	// ホストのCLOCK_MONOTONICを倍率つきで
+#define CLOCK_MODE_WARP			2	// リアルタイム、HLTで待つときは次のタイマーまで飛ばす
+
+#define CLOCK_TSC_HZ		1000000000ULL	// 仮想TSCの周波数
+#define CLOCK_INSN_CYCLES	1
+#define CLOCK_EPOCH			946684800		// CLOCK_MODE_DETERMINISTICのRTCの初期値(2000-01-01 00:00:00 UTC)
+#define CLOCK_NEVER			0xFFFFFFFFFFFFFFFFULL
+
+typedef struct {
+	int mode;
+	double scale;		// CLOCK_MODE_REALTIME CLOCK_MODE_WARP: ホスト時刻の倍率
+	uint64 icount;		// 実行した命令数(スライスの終わりで足す)
+	uint32 slice;		// 実行中のスライスで実行した命令数(RDTSC、I/Oの前に設定する)
+	uint64 host_start;	// 開始時のホスト時刻(ns)
+	uint64 warp;		// HLTで飛ばしたサイクル
+	uint64 tsc;			// 最後に読んだ時刻(戻らないようにする)
+	uint64 epoch;		// TSC=0のときのRTCの時刻(UNIX時間)
+	uint64 deadline;	// 次のタイマー(TSC、CLOCK_NEVER: なし)
+} Clock;
+
+
+// PC(I/Oポート、PIC、PIT、RTC)
+
+#define IO_PORTS	32		// 登録できるI/Oポートの範囲の数
+
+typedef struct CPUx86 CPUx86;
+
+typedef uint32 (*IoIn)(CPUx86 *cpu, void *opaque, uint16 port, int size);
+typedef void (*IoOut)(CPUx86 *cpu, void *opaque, uint16 port, int size, uint32 val);
+
+typedef struct {
+	uint16 port;
+	uint16 count;
+	IoIn in;
+	IoOut out;
+	void *opaque;
+} IoPort;
+
+// 8259A(マスタとスレーブ、エッジトリガのみ)
+typedef struct {
+	uint8 irr;			// Interrupt Request Register
+	uint8 isr;			// In-Service Register
+	uint8 imr;			// Interrupt Mask Register
+	uint8 base;			// ICW2: ベクタ番号の上位5bit
+	uint8 init;			// 初期化中のICW(0: 通常動作)
+	uint8 icw4;			// 1: ICW4がある
+	uint8 read_isr;		// OCW3: 1ならISRを読む
+	uint8 auto_eoi;
+	uint8 level;		// 入力の現在のレベル(立ち上がりでIRRを立てる)
+} Pic;
+
+// 8254
+typedef struct {
+	uint16 count;		// 設定値(0は65536)
+	uint8 mode;
+	uint8 access;		// 1: 下位 2: 上位 3: 下位、上位
+	uint8 bcd;
+	uint8 write_hi;		// 下位、上位の書き込みで次は上位
+	uint8 read_hi;
+	uint8 latched;		// ラッチした値を読んでいる
+	uint16 latch;
+	uint8 gate;
+	uint64 start;		// カウントを始めたTSC
+	uint64 next_irq;	// チャンネル0の次の割り込み(TSC、CLOCK_NEVER: なし)
+} PitChannel;
+
+typedef struct {
+	PitChannel ch[3];
+	uint8 speaker;		// ポート0x61の書き込み値
+} Pit;
+
+// MC146818
+typedef struct {
+	uint8 index;
+	uint8 cmos[128];
+} Rtc;
+
+// ローカルAPIC(MMIOがないのでx2APICのMSRだけでアクセスする)
+//   irrとpendingは他のvCPUのスレッドからもアトミック命令で立てる、それ以外はそのvCPUだけが触る
+#define APIC_BASE_BSP		0x00000100	// IA32_APIC_BASE
+#define APIC_BASE_EXTD		0x00000400
+#define APIC_BASE_EN		0x00000800
+#define APIC_BASE_ADDR		0xFEE00000
+
+#define APIC_PENDING_INIT	0x01
+#define APIC_PENDING_SIPI	0x02
+
+typedef struct {
+	uint32 id;
+	uint64 base;		// IA32_APIC_BASE
+	uint32 tpr;
+	uint32 svr;
+	uint32 irr[8];		// Interrupt Request Register(256bit)
+	uint32 isr[8];		// In-Service Register
+	uint32 esr;
+	uint64 icr;
+	uint32 lvt[6];		// LVT(0: タイマー、1: 温度、2: 性能カウンタ、3: LINT0、4: LINT1、5: エラー)
+	uint32 timer_initial;
+	uint32 timer_divide;
+	uint64 timer_start;		// カウントを始めたTSC
+	uint64 timer_deadline;	// 次に0になるTSC(CLOCK_NEVER: 止まっている)
+	uint32 pending;			// 届いたINIT、SIPI(APIC_PENDING_*)
+	uint8 sipi_vector;
+	uint8 wait_sipi;		// INITのあとSIPIを待っている
+} Apic;
+
+
+// CPUID
+
+// CPUID.1 EDX
+#define CPUID_FPU		0x00000001
+#define CPUID_TSC		0x00000010
+#define CPUID_MSR		0x00000020
+#define CPUID_CX8		0x00000100
+#define CPUID_APIC		0x00000200
+#define CPUID_CMOV		0x00008000
+#define CPUID_MMX		0x00800000
+#define CPUID_FXSR		0x01000000
+#define CPUID_SSE		0x02000000
+#define CPUID_SSE2		0x04000000
+
+// CPUID.1 ECX
+#define CPUID_ECX_X2APIC	0x00200000
+
+// 実装している機能(これ以外は設定しても見せない)
+#define CPUID_SUPPORTED	(CPUID_FPU | CPUID_TSC | CPUID_MSR | CPUID_APIC | CPUID_CMOV | CPUID_MMX | CPUID_FXSR | CPUID_SSE | CPUID_SSE2)
 
 typedef struct {
+	char vendor[13];
+	char brand[49];
+	uint32 max_leaf;
+	uint32 max_ext_leaf;	// 0: 拡張リーフなし
+	uint32 signature;		// CPUID.1 EAX(ファミリ、モデル、ステッピング)
+	uint32 features;		// CPUID.1 EDX
+	uint32 features_ecx;	// CPUID.1 ECX
+} Cpuid;
+
+#define cpu_feature(cpu, feature)	(((cpu)->cpuid.features & (feature))!=0)
+
+
+// ブロックデバイス(blk.h)
+
+typedef struct VirtioBlk VirtioBlk;
+
+
+// ネットワーク(net.h)
+
+typedef struct VirtioNet VirtioNet;
+
+
+// コンソール(console.c)
+
+typedef struct Console Console;
+
+
+// JIT(jit.h)
+
+typedef struct JitCache JitCache;
+
+
+// SMP(machine.h)
+
+typedef struct Machine Machine;
+
+
+// デバッガ(gdbstub.c)
+
+typedef struct GdbStub GdbStub;
+
+
+// 記録と再生(replay.c)
+
+#define REPLAY_NONE		0
+#define REPLAY_RECORD	1	// 外からの入力をログに書く
+#define REPLAY_PLAY		2	// ログの入力で実行し直す(デバイスは動かさない)
+
+typedef struct Replay Replay;
+
+
+// 統計(metrics.c)
+//   カウンタはそのvCPUのスレッドだけが書き、読むときに集める(ロックもアトミック命令も使わない)
+//   ヒストグラムは2のべきのバケット(bucket[i]: 2^(i-1) <= 値 < 2^i)
+
+#define METRICS_BUCKETS		32
+#define METRICS_VECTORS		32		// 例外のベクタ
+
+typedef struct {
+	uint64 count;
+	uint64 sum;
+	uint64 bucket[METRICS_BUCKETS];
+} MetricsHist;
+
+typedef struct {
+	int id;					// 出力のguestラベル(0: 登録していない)
+	CPUx86 *next;			// 登録しているゲストのリスト
+	uint64 exceptions[METRICS_VECTORS];
+	uint64 io_in[IO_PORTS + 1];		// cpu->ioの添字ごと(IO_PORTS: つながっていないポート)
+	uint64 io_out[IO_PORTS + 1];
+	uint64 desc_hit;		// ディスクリプタキャッシュ
+	uint64 desc_miss;
+	uint64 irq_raised[16];	// IRRを立てた時刻(TSC)
+	MetricsHist irq_latency;	// IRRを立ててから受け付けるまで(ns)
+	MetricsHist slice_ns;		// 1スライスのホスト時間(ns)
+} Metrics;
+
+
+// CPUx86
+
+struct CPUx86 {
 	// 一般レジスタ群
 	// 汎用レジスタ
 	// regs[0]: eax アキュムレータ
@@ -43,15 +344,27 @@ typedef struct {
 	// regs[6]: esi ソース
 	// regs[7]: edi デスティネーション
 	uint32 regs[8];
-	// セグメントレジスタ
-	uint16 ss;	// スタックセグメント
-	uint16 cs;	// コードセグメント
-	uint16 ds;	// データセグメント
-	uint16 es;	// エクストラセグメント
-	uint16 fs;	// Fセグメント
-	uint16 gs;	// Gセグメント
+	// セグメントレジスタ(セレクタ)
+	// sregs[0]: es エクストラセグメント
+	// sregs[1]: cs コードセグメント
+	// sregs[2]: ss スタックセグメント
+	// sregs[3]: ds データセグメント
+	// sregs[4]: fs Fセグメント
+	// sregs[5]: gs Gセグメント
+	uint16 sregs[6];
+	// セグメントディスクリプタキャッシュ(ロードしたときのディスクリプタ)
+	Descriptor segs[6];
+	// 現在の特権レベル
+	uint8 cpl;
+	// 1: デフォルトのオペランドサイズとアドレスサイズが32bit(CR0.PE、CSのDビット、EFLAGS.VMで決まる)
+	uint8 code32;
 	// EFLAGSレジスタ
 	uint32 eflags;
+	// 遅延評価フラグ(cc_op!=CC_OP_EFLAGSの間はeflagsのOF SF ZF AF PF CFが未計算)
+	uint8 cc_op;
+	uint8 cc_size;	// オペランドサイズ
+	uint32 cc_src;	// 第2オペランド
+	uint32 cc_dst;	// 演算結果
 	// 命令ポインタ
 	uint32 eip;
 
@@ -60,17 +373,73 @@ typedef struct {
 	DescTableReg gdtr;	// Global Descriptor Table Register
 	DescTableReg idtr;	// Interrupt Descriptor Table Register
 	uint16 ldtr;		// Local Descriptor Table
-	uint16 tr;
+	Descriptor ldt;
+	uint16 tr;			// Task Register
+	Descriptor tss;
+	DescCache desc_cache[CPU_DESC_CACHE];
 	// コントロールレジスタ
 	uint32 cr0;
 	uint32 cr1;
 	uint32 cr2;
 	uint32 cr3;
-
-	// メモリ
+	uint32 cr4;
+
+	// x87 FPU (MMXレジスタはfpu.stの仮数部と共有)
+	FPUx87 fpu;
+
+	// SSE
+	XMMReg xmm[8];
+	uint32 mxcsr;
+
+	// CPUIDで見せる機能
+	Cpuid cpuid;
+
+	// 仮想クロックとPCのデバイス
+	Clock clock;
+	IoPort io[IO_PORTS];
+	int io_count;
+	Pic pic[2];
+	Pit pit;
+	Rtc rtc;
+	Apic apic;			// SMPのときだけ使う
+	uint8 halted;		// HLTで割り込みを待っている
+	uint8 irq_shadow;	// STIの次の命令までは割り込みを受け付けない
+	uint32 irq_shadow_eip;
+	VirtioBlk *blk;		// NULL: なし
+	VirtioNet *net;		// NULL: なし
+	Console *con;
+	int wake_fd;		// eventfd(I/Oが終わるとHLTで待っているvCPUを起こす)
+
+	// メモリ(mem_sizeの後ろにCPU_MEM_SLACKの余白を確保する)
 	uint8 *mem;
 	size_t mem_size;
 
+	// SMP(NULLなら1CPU、RAMとデバイスはcpu[0]のものを共有する)
+	Machine *machine;
+
+	// 例外
+	jmp_buf fault_jmp;		// cpu_faultで命令を中断して戻る先(exec_cpux86)
+	int fault_vector;		// 起きた例外
+	uint32 fault_code;		// エラーコード
+	int fault_delivering;	// IDTで配送中の例外(-1: なし)
+	uint8 shutdown;			// トリプルフォールトで停止した
+	uint8 failed;			// log_errorで停止した
+
+	// JIT(NULLならインタプリタのみ)
+	JitCache *jit;
+	int32 jit_budget;	// 翻訳済みコードで実行できる残り命令数
+
+	// GDBリモートスタブ(NULLならつないでいない)
+	GdbStub *gdb;
+	uint8 gdb_step;		// 1命令ずつ実行している(翻訳済みコードを使わない)
+
+	// 記録と再生(NULLならどちらもしていない)
+	Replay *replay;
+	uint8 replay_mode;	// REPLAY_NONE REPLAY_RECORD REPLAY_PLAY
+
+	// 統計
+	Metrics metrics;
+
 	// 処理中
 	struct {
 		uint8 operand_size :1;	// 0x66 オペランドサイズプリフィックス
@@ -83,17 +452,19 @@ typedef struct {
 		uint8 segment_gs :1;	// 0x65 セグメントオーバーライドプリフィックス(GS)
 		uint8 repne :1;			// 0xF2 リピートプリフィックス(REPNE/REPZE)
 		uint8 rep :1;			// 0xF3 リピートプリフィックス(REP/REPE/REPZ)
-		uint8 rex :4;			// 0x40~0x4F REXプリフィックス
+		uint8 lock :1;			// 0xF0 LOCKプリフィックス
 		uint32 vex3;			// 0xC4 VEXプリフィックス
 		uint16 vex2;			// 0xC5 VEXプリフィックス
 	} prefix;
+	uint32 opcode_eip;	// 処理中の命令の先頭アドレス
+	uint32 opcode_esp;	// 処理中の命令の先頭のESP(例外で戻す)
 	uint8 modrm_mod;
 	uint8 modrm_reg;
 	uint8 modrm_rm;
 	uint8 sib_scale;
 	uint8 sib_index;
 	uint8 sib_base;
-} CPUx86;
+};
 
 
 // register
@@ -126,6 +497,43 @@ typedef struct {
 #define cpu_regist_dh(cpu)	((cpu)->regs[2]>>8 & 0xFF)
 #define cpu_regist_bh(cpu)	((cpu)->regs[3]>>8 & 0xFF)
 
+// 8bitレジスタ(0~3: AL CL DL BL, 4~7: AH CH DH BH)
+#define cpu_reg8(cpu, reg)	((uint8*)&((cpu)->regs[(reg) & 0x03]) + ((reg) >> 2))
+
+
+// segment register
+
+#define SEG_ES	0
+#define SEG_CS	1
+#define SEG_SS	2
+#define SEG_DS	3
+#define SEG_FS	4
+#define SEG_GS	5
+
+
+// exception
+
+#define EXC_DE	0	// Divide Error
+#define EXC_DB	1	// Debug
+#define EXC_BP	3	// Breakpoint
+#define EXC_OF	4	// Overflow
+#define EXC_BR	5	// BOUND Range Exceeded
+#define EXC_UD	6	// Invalid Opcode
+#define EXC_NM	7	// Device Not Available
+#define EXC_DF	8	// Double Fault
+#define EXC_TS	10	// Invalid TSS
+#define EXC_NP	11	// Segment Not Present
+#define EXC_SS	12	// Stack Fault
+#define EXC_GP	13	// General Protection
+#define EXC_PF	14	// Page Fault
+#define EXC_MF	16	// x87 FPU Floating-Point Error
+#define EXC_AC	17	// Alignment Check
+#define EXC_XM	19	// SIMD Floating-Point
+
+// RAMの後ろの余白
+// オペランドの先頭がRAMにあればFPU/SSEの大きなオペランドがはみ出してもホストのメモリを壊さない
+#define CPU_MEM_SLACK	4096
+
 
 // EFLAGS
 
@@ -165,8 +573,23 @@ typedef struct {
 #define CPU_EFLAGS_VIP_BIT	20
 #define CPU_EFLAGS_ID_BIT	21
 
-#define set_cpu_eflags(cpu, type, val)	(cpu->eflags ^= ((val) << type##_BIT) ^ (type & cpu->eflags))
-#define cpu_eflags(cpu, type)			((cpu->eflags & type) >> type##_BIT)
+#define set_cpu_eflags(cpu, type, val)	(cpu_eflags_sync(cpu), cpu->eflags ^= ((val) << type##_BIT) ^ (type & cpu->eflags))
+#define cpu_eflags(cpu, type)			(cpu_eflags_sync(cpu), (cpu->eflags & type) >> type##_BIT)
+
+
+// 遅延評価フラグ
+
+#define CC_OP_EFLAGS	0	// eflagsに反映済み
+#define CC_OP_ADD		1
+#define CC_OP_SUB		2	// SUB/CMP
+#define CC_OP_LOGIC		3	// AND/OR/XOR/TEST
+#define CC_OP_INC		4	// CFはeflagsのまま(設定する前にcpu_eflags_sync)
+#define CC_OP_DEC		5
+#define CC_OP_ADC		6	// eflagsのCFが桁上がりの入力(設定する前にcpu_eflags_sync)
+#define CC_OP_SBB		7
+
+#define set_cpu_cc(cpu, op, size, src, dst)	((cpu)->cc_op = (op), (cpu)->cc_size = (size), (cpu)->cc_src = (src), (cpu)->cc_dst = (dst))
+#define cpu_eflags_sync(cpu)				((cpu)->cc_op!=CC_OP_EFLAGS ? cpu_eflags_compute(cpu) : (void)0)
 
 
 // cr0
@@ -195,10 +618,24 @@ typedef struct {
 #define CR0_CD_BIT	30
 #define CR0_PG_BIT	31
 
-#define set_cpu_cr0(cpu, type, val)	(cpu->cr0 ^= ((val) << type##_BIT) ^ (type & cpu->cr0))
+#define set_cpu_cr0(cpu, type, val)	(cpu->cr0 ^= ((val) << type##_BIT) ^ (type & cpu->cr0), cpu_update_mode(cpu))
 #define cpu_cr0(cpu, type)			((cpu->cr0 & type) >> type##_BIT)
 
 
+// cr4
+
+#define CR4_VME		0x00000001
+#define CR4_PVI		0x00000002
+#define CR4_TSD		0x00000004
+#define CR4_DE		0x00000008
+#define CR4_OSFXSR		0x00000200
+#define CR4_OSXMMEXCPT	0x00000400
+
+
+#define cpu_operand_size(cpu)	(((cpu)->code32==(cpu)->prefix.operand_size) ? 2 : 4)
+#define cpu_address_size(cpu)	(((cpu)->code32==(cpu)->prefix.address_size) ? 2 : 4)
+
+
 // Segment Descriptor
 
 typedef struct {
@@ -246,6 +683,9 @@ typedef struct {
 #define UINTX_INT32		4
 #define UINTX_UINT32	4
 
+#define uintp_bits(p)	((p)->type << 3)
+#define uintp_mask(p)	(0xFFFFFFFF >> (32 - uintp_bits(p)))
+
 
 // uintp
 extern uint32 uintp_val(uintp *p);
@@ -270,13 +710,28 @@ extern void* mem_eip_ptr(CPUx86 *cpu, int add);
 
 // segment
 extern uint32 seg_ss(CPUx86 *cpu);
+extern int cpu_prefix_segment(CPUx86 *cpu, int seg);
 
 // modrm
 extern void mem_eip_load_modrm(CPUx86 *cpu);
 extern uint32 cpu_sib_offset(CPUx86 *cpu);
+extern uint32 cpu_modrm_offset32(CPUx86 *cpu);
+extern uint32 cpu_modrm_offset16(CPUx86 *cpu);
 extern uint32 cpu_modrm_offset(CPUx86 *cpu);
+extern void cpu_moffs_address(CPUx86 *cpu, uintp *result);
+extern void cpu_modrm_address8(CPUx86 *cpu, uintp *result);
 extern void cpu_modrm_address(CPUx86 *cpu, uintp *result);
 extern void cpu_modrm_address_m16_32(CPUx86 *cpu, uintp *limit, uintp *base);
+extern int cpu_modrm_segment(CPUx86 *cpu);
+
+// string
+extern uint32 string_count(CPUx86 *cpu);
+extern void set_string_count(CPUx86 *cpu, uint32 count);
+extern uint32 string_addr(CPUx86 *cpu, int reg);
+extern void string_advance(CPUx86 *cpu, int reg, uint32 n, int size);
+extern uint32 string_chunk(CPUx86 *cpu, int reg, uint32 count, int size);
+extern uint32 string_range(CPUx86 *cpu, uint32 addr, uint32 n, int size);
+extern void string_repeat(CPUx86 *cpu, uint32 count);
 
 // opcode
 extern void opcode_aam(CPUx86 *cpu, uintp *val);
@@ -284,42 +739,256 @@ extern void opcode_adc(CPUx86 *cpu, uintp *dst, uintp *src);
 extern void opcode_add(CPUx86 *cpu, uintp *dst, uintp *src);
 extern void opcode_and(CPUx86 *cpu, uintp *dst, uintp *src);
 extern void opcode_call(CPUx86 *cpu, uintp *val);
+extern void opcode_call_near(CPUx86 *cpu, uintp *target);
 extern void opcode_cli(CPUx86 *cpu);
+extern void opcode_cmov(CPUx86 *cpu, int cc, uintp *dst, uintp *src);
 extern void opcode_cmp(CPUx86 *cpu, uintp *src1, uintp *src2);
+extern int opcode_cmp_jcc(CPUx86 *cpu, int remaining);
+extern void opcode_cmpxchg(CPUx86 *cpu, uintp *dst, uintp *src);
+extern void opcode_cmps(CPUx86 *cpu, int size);
 extern void opcode_dec(CPUx86 *cpu, uintp *target);
-extern void opcode_in(CPUx86 *cpu, uintp *src);
+extern void opcode_div(CPUx86 *cpu, uintp *src);
+extern void opcode_idiv(CPUx86 *cpu, uintp *src);
+extern void opcode_hlt(CPUx86 *cpu);
+extern void opcode_in(CPUx86 *cpu, uintp *port, uintp *dst);
 extern void opcode_inc(CPUx86 *cpu, uintp *target);
-extern void opcode_int(CPUx86 *cpu, uintp *val);
-extern void opcode_into(CPUx86 *cpu);
+extern void opcode_jcc(CPUx86 *cpu, int cc, uintp *rel);
+extern void opcode_jmp_near(CPUx86 *cpu, uintp *target);
 extern void opcode_jmp_short(CPUx86 *cpu, uintp *rel);
-extern void opcode_jz(CPUx86 *cpu, uintp *rel);
-extern void opcode_jnz(CPUx86 *cpu, uintp *rel);
-extern void opcode_js(CPUx86 *cpu, uintp *rel);
+extern void opcode_lods(CPUx86 *cpu, int size);
 extern void opcode_mov(CPUx86 *cpu, uintp *dst, uintp *src);
+extern void opcode_movs(CPUx86 *cpu, int size);
 extern void opcode_movsx(CPUx86 *cpu, uintp *dst, uintp *src);
 extern void opcode_movzx(CPUx86 *cpu, uintp *dst, uintp *src);
 extern void opcode_out(CPUx86 *cpu, uintp *port, uintp *val);
 extern void opcode_or(CPUx86 *cpu, uintp *dst, uintp *src);
 extern void opcode_pop(CPUx86 *cpu, uintp *dst);
 extern void opcode_push(CPUx86 *cpu, uintp *val);
+extern void opcode_rcl(CPUx86 *cpu, uintp *dst, uintp *count);
+extern void opcode_rcr(CPUx86 *cpu, uintp *dst, uintp *count);
+extern void opcode_rol(CPUx86 *cpu, uintp *dst, uintp *count);
+extern void opcode_ror(CPUx86 *cpu, uintp *dst, uintp *count);
 extern void opcode_sar(CPUx86 *cpu, uintp *dst, uintp *count);
 extern void opcode_sal(CPUx86 *cpu, uintp *dst, uintp *count);
 extern void opcode_sbb(CPUx86 *cpu, uintp *dst, uintp *src);
+extern void opcode_scas(CPUx86 *cpu, int size);
+extern void opcode_setcc(CPUx86 *cpu, int cc, uintp *dst);
+extern void opcode_shld(CPUx86 *cpu, uintp *dst, uintp *src, uintp *count);
 extern void opcode_shr(CPUx86 *cpu, uintp *dst, uintp *count);
+extern void opcode_shrd(CPUx86 *cpu, uintp *dst, uintp *src, uintp *count);
 extern void opcode_shl(CPUx86 *cpu, uintp *dst, uintp *count);
+extern void opcode_shift_rotate(CPUx86 *cpu, uintp *dst, uintp *count);
+extern void opcode_sti(CPUx86 *cpu);
+extern void opcode_stos(CPUx86 *cpu, int size);
 extern void opcode_sub(CPUx86 *cpu, uintp *dst, uintp *src);
 extern void opcode_test(CPUx86 *cpu, uintp *src1, uintp *src2);
+extern void opcode_xadd(CPUx86 *cpu, uintp *dst, uintp *src);
+extern void opcode_xchg(CPUx86 *cpu, uintp *dst, uintp *src);
 extern void opcode_xor(CPUx86 *cpu, uintp *dst, uintp *src);
 
+// fpu
+extern void fpu_init(CPUx86 *cpu);
+extern void fpu_push(CPUx86 *cpu, long double val);
+extern void fpu_pop(CPUx86 *cpu);
+extern long double fpu_get(CPUx86 *cpu, int i);
+extern void fpu_set(CPUx86 *cpu, int i, long double val);
+extern long double fpu_round(CPUx86 *cpu, long double val);
+extern long double fpu_load_f80(uint8 *p);
+extern void fpu_store_f80(uint8 *p, long double val);
+extern uint16 fpu_tag_word(CPUx86 *cpu);
+extern void set_fpu_tag_word(CPUx86 *cpu, uint16 tag);
+extern void fpu_save(CPUx86 *cpu, uint8 *p, int size);
+extern void fpu_restore(CPUx86 *cpu, uint8 *p, int size);
+extern void fpu_fxsave(CPUx86 *cpu, uint8 *p);
+extern void fpu_fxrstor(CPUx86 *cpu, uint8 *p);
+extern int fpu_available(CPUx86 *cpu);
+extern void fpu_device_not_available(CPUx86 *cpu);
+extern void fpu_set_quotient(CPUx86 *cpu, int64 quotient);
+extern void opcode_fpu(CPUx86 *cpu, uint8 opcode);
+extern void opcode_fwait(CPUx86 *cpu);
+extern void opcode_fxsave(CPUx86 *cpu, uintp *dst);
+extern void opcode_fxrstor(CPUx86 *cpu, uintp *src);
+extern void opcode_clts(CPUx86 *cpu);
+
+// sse
+extern void opcode_ldmxcsr(CPUx86 *cpu, uintp *src);
+extern void opcode_sse(CPUx86 *cpu, uint8 opcode);
+extern uint32 sse_feature(CPUx86 *cpu, uint8 opcode);
+extern void opcode_stmxcsr(CPUx86 *cpu, uintp *dst);
+
+// protected mode
+extern void cpu_fault(CPUx86 *cpu, int vector, uint32 error_code);
+extern int cpu_fault_class(int vector);
+extern void cpu_fault_deliver(CPUx86 *cpu);
+extern int cpu_fault_has_error(int vector);
+extern void cpu_interrupt(CPUx86 *cpu, int vector, int soft, int has_error, uint32 error_code);
+extern void desc_decode(uint64 raw, Descriptor *desc);
+extern int desc_fetch(CPUx86 *cpu, uint16 selector, uint32 *addr, uint64 *raw);
+extern int desc_load(CPUx86 *cpu, uint16 selector, Descriptor *desc, uint32 *addr);
+extern void desc_set_accessed(CPUx86 *cpu, uint32 addr, Descriptor *desc);
+extern void opcode_call_far(CPUx86 *cpu, uintp *segment, uintp *offset);
+extern void opcode_int(CPUx86 *cpu, uintp *val);
+extern void opcode_into(CPUx86 *cpu);
+extern void opcode_iret(CPUx86 *cpu);
+extern void opcode_jmp_far(CPUx86 *cpu, uintp *segment, uintp *offset);
+extern void opcode_lfp(CPUx86 *cpu, int seg, uintp *dst, uintp *src);
+extern void opcode_lgdt(CPUx86 *cpu, uintp *limit, uintp *base);
+extern void opcode_lidt(CPUx86 *cpu, uintp *limit, uintp *base);
+extern void opcode_lldt(CPUx86 *cpu, uintp *src);
+extern void opcode_lmsw(CPUx86 *cpu, uintp *src);
+extern void opcode_ltr(CPUx86 *cpu, uintp *src);
+extern void opcode_mov_from_cr(CPUx86 *cpu, int cr, uintp *dst);
+extern void opcode_mov_sreg(CPUx86 *cpu, int seg, uintp *src);
+extern void opcode_mov_to_cr(CPUx86 *cpu, int cr, uintp *src);
+extern void opcode_pop_sreg(CPUx86 *cpu, int seg);
+extern void opcode_push_sreg(CPUx86 *cpu, int seg);
+extern void opcode_ret_far(CPUx86 *cpu, uintp *imm);
+extern void opcode_sgdt(CPUx86 *cpu, uintp *limit, uintp *base);
+extern void opcode_sidt(CPUx86 *cpu, uintp *limit, uintp *base);
+extern void opcode_sldt(CPUx86 *cpu, uintp *dst);
+extern void opcode_smsw(CPUx86 *cpu, uintp *dst);
+extern void opcode_str(CPUx86 *cpu, uintp *dst);
+extern int seg_check_code(CPUx86 *cpu, uint16 selector, Descriptor *desc);
+extern void seg_check_outer(CPUx86 *cpu);
+extern int seg_check_stack(CPUx86 *cpu, uint16 selector, Descriptor *desc, int cpl, int vector);
+extern void seg_load(CPUx86 *cpu, int seg, uint16 selector);
+extern void seg_load_cs(CPUx86 *cpu, uint16 selector, Descriptor *desc, int cpl);
+extern void seg_load_real(CPUx86 *cpu, int seg, uint16 selector);
+extern uint32 seg_mem_load(CPUx86 *cpu, uint32 addr, int size);
+extern uint8* seg_mem_ptr(CPUx86 *cpu, uint32 addr, int size);
+extern void seg_mem_store(CPUx86 *cpu, uint32 addr, int size, uint32 val);
+extern uint32 seg_pop(CPUx86 *cpu, Descriptor *ss, uint32 *esp, int size);
+extern void seg_push(CPUx86 *cpu, Descriptor *ss, uint32 *esp, int size, uint32 val);
+extern void seg_set_eflags(CPUx86 *cpu, uint32 val, uint32 mask);
+extern void seg_set_esp(CPUx86 *cpu, Descriptor *ss, uint32 esp);
+extern int seg_tss_stack(CPUx86 *cpu, int dpl, uint16 *ss, uint32 *esp);
+
+// clock
+extern uint64 clock_host_ns(void);
+extern uint64 clock_convert(uint64 val, uint64 from_hz, uint64 to_hz);
+extern void clock_init(CPUx86 *cpu);
+extern void clock_set_mode(CPUx86 *cpu, int mode, double scale);
+extern uint64 clock_tsc(CPUx86 *cpu);
+extern void clock_advance(CPUx86 *cpu, uint32 n);
+extern int clock_budget(CPUx86 *cpu, int budget);
+extern int clock_idle(CPUx86 *cpu);
+extern void opcode_rdtsc(CPUx86 *cpu);
+
+// cpuid
+extern int cpuid_set_profile(CPUx86 *cpu, const char *name);
+extern int cpuid_load(CPUx86 *cpu, char *fname);
+extern void cpuid_init(CPUx86 *cpu);
+extern uint32 cpuid_cr4_mask(CPUx86 *cpu);
+extern void opcode_cpuid(CPUx86 *cpu);
+
+// pc
+extern void io_register(CPUx86 *cpu, uint16 port, uint16 count, IoIn in, IoOut out, void *opaque);
+extern uint32 io_in(CPUx86 *cpu, uint16 port, int size);
+extern void io_out(CPUx86 *cpu, uint16 port, int size, uint32 val);
+extern int io_allowed(CPUx86 *cpu);
+extern void pic_set_irq(CPUx86 *cpu, int irq, int level);
+extern int pic_pending(CPUx86 *cpu);
+extern int pic_ack(CPUx86 *cpu);
+extern void pc_init(CPUx86 *cpu);
+extern void pc_delete(CPUx86 *cpu);
+extern void pc_update(CPUx86 *cpu);
+extern int pc_interrupt(CPUx86 *cpu);
+extern int pc_busy(CPUx86 *cpu);
+extern int pc_wait(CPUx86 *cpu, int64 ns);
+extern void pc_kick(CPUx86 *cpu);
+
+// apic
+extern void apic_init(CPUx86 *cpu, uint32 id);
+extern void apic_reset(CPUx86 *cpu);
+extern void apic_set_irq(CPUx86 *cpu, int vector);
+extern uint64 apic_update(CPUx86 *cpu);
+extern int apic_interrupt(CPUx86 *cpu);
+extern void apic_startup(CPUx86 *cpu);
+extern void ioapic_init(CPUx86 *cpu);
+extern void ioapic_set_irq(CPUx86 *cpu, int irq, int level);
+extern void opcode_rdmsr(CPUx86 *cpu);
+extern void opcode_wrmsr(CPUx86 *cpu);
+
+// machine
+extern CPUx86* new_machine(size_t mem_size, int count);
+extern void machine_delete(CPUx86 *cpu);
+extern void run_machine(CPUx86 *cpu);
+
+// net
+extern int vnet_attach(CPUx86 *cpu);
+extern void vnet_delete(CPUx86 *cpu);
+extern void vnet_poll(CPUx86 *cpu);
+extern int vnet_busy(CPUx86 *cpu);
+
+// console
+extern void con_init(CPUx86 *cpu);
+extern void con_delete(CPUx86 *cpu);
+
+// blk
+extern int vblk_attach(CPUx86 *cpu, const char *fname, int readonly);
+extern void vblk_delete(CPUx86 *cpu);
+extern void vblk_poll(CPUx86 *cpu);
+extern int vblk_busy(CPUx86 *cpu);
+
+// jit
+extern void dump_jit(CPUx86 *cpu);
+extern void jit_delete(CPUx86 *cpu);
+extern int jit_exec(CPUx86 *cpu, int budget);
+extern void jit_flush(CPUx86 *cpu);
+extern void jit_init(CPUx86 *cpu);
+extern void jit_set_enabled(CPUx86 *cpu, int enabled);
+extern void jit_dma_write(CPUx86 *cpu, uint32 addr, uint32 len);
+extern void jit_dma_begin(CPUx86 *cpu, uint32 addr, uint32 len);
+extern void jit_dma_end(CPUx86 *cpu, uint32 addr, uint32 len);
+extern void jit_set_break(CPUx86 *cpu, uint32 addr, int on);
+extern void jit_set_watch(CPUx86 *cpu, uint32 addr, int on);
+
+// gdb
+extern int gdb_listen(CPUx86 *cpu, const char *addr);
+extern void gdb_delete(CPUx86 *cpu);
+extern int gdb_check(CPUx86 *cpu);
+extern void gdb_poll(CPUx86 *cpu);
+
+// replay
+extern int replay_record(CPUx86 *cpu, const char *fname);
+extern int replay_play(CPUx86 *cpu, const char *fname);
+extern void replay_delete(CPUx86 *cpu);
+extern uint32 replay_in(CPUx86 *cpu, uint16 port, uint32 val);
+extern uint64 replay_tsc(CPUx86 *cpu, uint64 tsc);
+extern int replay_interrupt(CPUx86 *cpu, int vector);
+extern void replay_dma(CPUx86 *cpu, uint32 addr, uint32 len);
+extern void replay_sync(CPUx86 *cpu);
+extern int replay_budget(CPUx86 *cpu, int budget);
+extern int replay_idle(CPUx86 *cpu);
+
+// log
+extern void log_set_guest(CPUx86 *cpu);
+extern int log_enabled(int level);
+extern void log_flush(void);
+
+// metrics
+extern void metrics_init(CPUx86 *cpu);
+extern void metrics_delete(CPUx86 *cpu);
+extern void metrics_hist_add(MetricsHist *hist, uint64 val);
+extern int metrics_dump(FILE *fp);
+extern int metrics_write(const char *fname);
+extern int metrics_listen(const char *path);
+
 // dump
 extern void int2bin(char *dest, int val, int bitlen);
 extern void dump_cpu(CPUx86 *cpu);
 
 // cpu
 extern CPUx86* new_cpux86(size_t mem_size);
+extern void cpu_reset(CPUx86 *cpu);
+extern void cpu_update_mode(CPUx86 *cpu);
 extern void delete_cpux86(CPUx86 *cpu);
 extern void cpu_current_reset(CPUx86 *cpu);
 extern void set_cpu_eflags_sf_zf_pf(CPUx86 *cpu, uintp *target);
+extern void cpu_eflags_compute(CPUx86 *cpu);
+extern int cpu_cond(CPUx86 *cpu, int cc);
+extern int exec_cpux86_16(CPUx86 *cpu, int budget);
+extern int exec_cpux86_32(CPUx86 *cpu, int budget);
 extern void exec_cpux86(CPUx86 *cpu);
 extern void run_cpux86(CPUx86 *cpu);
 
@@ -0,0 +1,1332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fenv.h>
+#include "cpux86.h"
+#include "log.h"
+
+
+// register stack
+
+#define fpu_top(cpu)		(((cpu)->fpu.status >> 11) & 0x07)
+#define fpu_phys(cpu, i)	((fpu_top(cpu) + (i)) & 0x07)
+#define fpu_st(cpu, i)		((cpu)->fpu.st[fpu_phys(cpu, i)])
+#define fpu_empty(cpu, i)	(((cpu)->fpu.tag_empty >> fpu_phys(cpu, i)) & 0x01)
+
+void set_fpu_top(CPUx86 *cpu, int top)
+{
+	cpu->fpu.status = (cpu->fpu.status & ~FPU_SW_TOP) | ((top & 0x07) << 11);
+}
+
+// スタックオーバーフロー/アンダーフロー(IE SF, C1で方向)
+void fpu_stack_fault(CPUx86 *cpu, int overflow)
+{
+	cpu->fpu.status |= FPU_SW_IE | FPU_SW_SF;
+	if (overflow) {
+		cpu->fpu.status |= FPU_SW_C1;
+	} else {
+		cpu->fpu.status &= ~FPU_SW_C1;
+	}
+}
+
+void fpu_push(CPUx86 *cpu, long double val)
+{
+	int top;
+	top = (fpu_top(cpu) - 1) & 0x07;
+	if (!((cpu->fpu.tag_empty >> top) & 0x01)) {
+		// マスク時は不定値(QNaN)を積む
+		fpu_stack_fault(cpu, 1);
+		val = NAN;
+	}
+	set_fpu_top(cpu, top);
+	cpu->fpu.st[top] = val;
+	cpu->fpu.tag_empty &= ~(1 << top);
+}
+
+void fpu_pop(CPUx86 *cpu)
+{
+	int top;
+	top = fpu_top(cpu);
+	cpu->fpu.tag_empty |= 1 << top;
+	set_fpu_top(cpu, top + 1);
+}
+
+// ST(i)を読む(空ならアンダーフロー)
+long double fpu_get(CPUx86 *cpu, int i)
+{
+	if (fpu_empty(cpu, i)) {
+		fpu_stack_fault(cpu, 0);
+		return NAN;
+	}
+	return fpu_st(cpu, i);
+}
+
+void fpu_set(CPUx86 *cpu, int i, long double val)
+{
+	fpu_st(cpu, i) = val;
+	cpu->fpu.tag_empty &= ~(1 << fpu_phys(cpu, i));
+}
+
+
+// rounding
+
+// 厳密モードはホストのx87の制御ワードにゲストの丸め制御(RC)と精度制御(PC)を入れて計算する
+//   ホストの1命令で1回だけ丸める(80bitで丸めてからdoubleやfloatにすると2回丸めになる)
+//   指数部は実機と同じく拡張倍精度の範囲のまま
+//   間の計算は呼び出し側でvolatileを通し、制御ワードの切り替えをまたいで動かないようにする
+#if defined(__x86_64__) || defined(__i386__)
+static uint16 fpu_host_enter(CPUx86 *cpu)
+{
+	uint16 host;
+	uint16 cw;
+
+	__asm__ __volatile__ ("fnstcw %0" : "=m" (host));
+	cw = (host & ~0x0F00) | (cpu->fpu.control & 0x0F00);
+	__asm__ __volatile__ ("fldcw %0" : : "m" (cw) : "memory");
+	return host;
+}
+
+static void fpu_host_leave(uint16 host)
+{
+	__asm__ __volatile__ ("fldcw %0" : : "m" (host) : "memory");
+}
+#else
+// x87のないホストはRCだけ合わせる(PCはfpu_roundで丸め直す)
+static uint16 fpu_host_enter(CPUx86 *cpu)
+{
+	static const int rc[4] = {FE_TONEAREST, FE_DOWNWARD, FE_UPWARD, FE_TOWARDZERO};
+	uint16 host;
+
+	host = fegetround();
+	fesetround(rc[(cpu->fpu.control >> 10) & 0x03]);
+	__asm__ __volatile__ ("" : : : "memory");
+	return host;
+}
+
+static void fpu_host_leave(uint16 host)
+{
+	__asm__ __volatile__ ("" : : : "memory");
+	fesetround(host);
+}
+#endif
+
+// 演算結果を動作モードに合わせて丸める
+// 高速モード: host doubleで計算する(精度差は許容)
+// 厳密モード: RCに従ってPCの精度に1回だけ丸める(libmの結果などホストの拡張倍精度の値に使う)
+long double fpu_round(CPUx86 *cpu, long double val)
+{
+	volatile long double a;
+	volatile long double one = 1.0L;
+	volatile long double r;
+	uint16 host;
+
+	if (!cpu->fpu.exact) {
+		return (double)val;
+	}
+	a = val;
+	host = fpu_host_enter(cpu);
+#if defined(__x86_64__) || defined(__i386__)
+	r = a * one;
+#else
+	switch ((cpu->fpu.control >> 8) & 0x03) {
+	case 0:	// 単精度
+		r = (float)a;
+		break;
+	case 2:	// 倍精度
+		r = (double)a;
+		break;
+	default:
+		r = a * one;
+	}
+#endif
+	fpu_host_leave(host);
+	return r;
+}
+
+// 厳密モードのFSQRT(RCとPCで1回だけ丸める)
+static long double fpu_sqrt(CPUx86 *cpu, long double val)
+{
+	volatile long double a;
+	volatile long double r;
+	uint16 host;
+
+	a = val;
+	host = fpu_host_enter(cpu);
+	r = sqrtl(a);
+	fpu_host_leave(host);
+#if !defined(__x86_64__) && !defined(__i386__)
+	r = fpu_round(cpu, r);
+#endif
+	return r;
+}
+
+// 厳密モードのFST m32fp/m64fp(RCで丸める)
+static void fpu_store_f32(CPUx86 *cpu, uint8 *p, long double val)
+{
+	volatile long double a;
+	uint16 host;
+
+	a = val;
+	host = fpu_host_enter(cpu);
+	*(volatile float*)p = (float)a;
+	fpu_host_leave(host);
+}
+
+static void fpu_store_f64(CPUx86 *cpu, uint8 *p, long double val)
+{
+	volatile long double a;
+	uint16 host;
+
+	a = val;
+	host = fpu_host_enter(cpu);
+	*(volatile double*)p = (double)a;
+	fpu_host_leave(host);
+}
+
+// 丸め制御(RC)に従って整数に丸める
+long double fpu_rint(CPUx86 *cpu, long double val)
+{
+	switch ((cpu->fpu.control >> 10) & 0x03) {
+	case 1:	// 切り下げ
+		return floorl(val);
+	case 2:	// 切り上げ
+		return ceill(val);
+	case 3:	// 切り捨て
+		return truncl(val);
+	}
+	// 最近接偶数丸め
+	return nearbyintl(val);
+}
+
+long double fpu_arith(CPUx86 *cpu, int op, long double dst, long double src)
+{
+	volatile long double a;
+	volatile long double b;
+	volatile long double val;
+	uint16 host;
+	double d;
+	double s;
+
+	if (isnan(dst) || isnan(src)) {
+		cpu->fpu.status |= FPU_SW_IE;
+	}
+
+	if (!cpu->fpu.exact) {
+		// 高速モード: host doubleでそのまま計算する
+		d = dst;
+		s = src;
+		switch (op) {
+		case 0:	// fadd
+			return d + s;
+		case 1:	// fmul
+			return d * s;
+		case 4:	// fsub
+			return d - s;
+		case 5:	// fsubr
+			return s - d;
+		case 6:	// fdiv
+			if (s==0.0 && !isnan(d)) {
+				cpu->fpu.status |= FPU_SW_ZE;
+			}
+			return d / s;
+		case 7:	// fdivr
+			if (d==0.0 && !isnan(s)) {
+				cpu->fpu.status |= FPU_SW_ZE;
+			}
+			return s / d;
+		}
+		return d;
+	}
+
+	if ((op==6 && src==0.0L && !isnan(dst)) || (op==7 && dst==0.0L && !isnan(src))) {
+		cpu->fpu.status |= FPU_SW_ZE;
+	}
+	a = dst;
+	b = src;
+	host = fpu_host_enter(cpu);
+	switch (op) {
+	case 0:	// fadd
+		val = a + b;
+		break;
+	case 1:	// fmul
+		val = a * b;
+		break;
+	case 4:	// fsub
+		val = a - b;
+		break;
+	case 5:	// fsubr
+		val = b - a;
+		break;
+	case 6:	// fdiv
+		val = a / b;
+		break;
+	case 7:	// fdivr
+		val = b / a;
+		break;
+	default:
+		val = a;
+	}
+	fpu_host_leave(host);
+#if !defined(__x86_64__) && !defined(__i386__)
+	return fpu_round(cpu, val);
+#endif
+	return val;
+}
+
+
+// compare
+
+// C3 C2 C0 を設定する(unordered: 全て1)
+void fpu_compare(CPUx86 *cpu, long double src1, long double src2, int quiet)
+{
+	cpu->fpu.status &= ~(FPU_SW_C0 | FPU_SW_C1 | FPU_SW_C2 | FPU_SW_C3);
+	if (isnan(src1) || isnan(src2)) {
+		if (!quiet) {
+			cpu->fpu.status |= FPU_SW_IE;
+		}
+		cpu->fpu.status |= FPU_SW_C0 | FPU_SW_C2 | FPU_SW_C3;
+	} else if (src1 < src2) {
+		cpu->fpu.status |= FPU_SW_C0;
+	} else if (src1==src2) {
+		cpu->fpu.status |= FPU_SW_C3;
+	}
+}
+
+// FCOMI/FUCOMI: ZF PF CFを設定する
+void fpu_compare_eflags(CPUx86 *cpu, long double src1, long double src2, int quiet)
+{
+	int zf;
+	int pf;
+	int cf;
+
+	zf = pf = cf = 0;
+	if (isnan(src1) || isnan(src2)) {
+		if (!quiet) {
+			cpu->fpu.status |= FPU_SW_IE;
+		}
+		zf = pf = cf = 1;
+	} else if (src1 < src2) {
+		cf = 1;
+	} else if (src1==src2) {
+		zf = 1;
+	}
+	cpu->fpu.status &= ~FPU_SW_C1;
+	set_cpu_eflags(cpu, CPU_EFLAGS_ZF, zf);
+	set_cpu_eflags(cpu, CPU_EFLAGS_PF, pf);
+	set_cpu_eflags(cpu, CPU_EFLAGS_CF, cf);
+	set_cpu_eflags(cpu, CPU_EFLAGS_OF, 0);
+	set_cpu_eflags(cpu, CPU_EFLAGS_SF, 0);
+	set_cpu_eflags(cpu, CPU_EFLAGS_AF, 0);
+}
+
+
+// memory format
+
+float fpu_load_f32(uint8 *p)
+{
+	float val;
+	memcpy(&val, p, 4);
+	return val;
+}
+
+double fpu_load_f64(uint8 *p)
+{
+	double val;
+	memcpy(&val, p, 8);
+	return val;
+}
+
+// 80bit拡張倍精度 → long double
+long double fpu_load_f80(uint8 *p)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	// hostのlong doubleが同じ形式
+	long double val;
+	memset(&val, 0, sizeof(val));
+	memcpy(&val, p, 10);
+	return val;
+#else
+	uint64 mant;
+	int exp;
+	long double val;
+	memcpy(&mant, p, 8);
+	exp = (p[8] | p[9] << 8) & 0x7FFF;
+	if (exp==0x7FFF) {
+		val = (mant << 1) ? NAN : INFINITY;
+	} else {
+		val = ldexpl((long double)mant, (exp ? exp : 1) - 16383 - 63);
+	}
+	return (p[9] & 0x80) ? -val : val;
+#endif
+}
+
+void fpu_store_f80(uint8 *p, long double val)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	memcpy(p, &val, 10);
+#else
+	uint64 mant;
+	int exp;
+	int sign;
+	sign = signbit(val) ? 0x8000 : 0;
+	if (isnan(val)) {
+		mant = 0xC000000000000000ULL;
+		exp = 0x7FFF;
+	} else if (isinf(val)) {
+		mant = 0x8000000000000000ULL;
+		exp = 0x7FFF;
+	} else if (val==0.0L) {
+		mant = 0;
+		exp = 0;
+	} else {
+		val = frexpl(fabsl(val), &exp);
+		mant = (uint64)ldexpl(val, 64);
+		exp += 16382;
+	}
+	memcpy(p, &mant, 8);
+	exp |= sign;
+	p[8] = exp & 0xFF;
+	p[9] = exp >> 8;
+#endif
+}
+
+// 整数変換(範囲外は整数不定値)
+int64 fpu_to_int(CPUx86 *cpu, long double val, int size, int truncate)
+{
+	int64 limit;
+	limit = (int64)1 << (size * 8 - 1);
+	val = truncate ? truncl(val) : fpu_rint(cpu, val);
+	if (isnan(val) || val < -(long double)limit || (long double)limit <= val) {
+		cpu->fpu.status |= FPU_SW_IE;
+		return -limit;
+	}
+	if (cpu->fpu.exact) {
+		return (int64)val;
+	}
+	return (int64)(double)val;
+}
+
+void fpu_store_int(uint8 *p, int64 val, int size)
+{
+	memcpy(p, &val, size);
+}
+
+int64 fpu_load_int(uint8 *p, int size)
+{
+	int16 val16;
+	int32 val32;
+	int64 val64;
+	switch (size) {
+	case 2:
+		memcpy(&val16, p, 2);
+		return val16;
+	case 4:
+		memcpy(&val32, p, 4);
+		return val32;
+	}
+	memcpy(&val64, p, 8);
+	return val64;
+}
+
+// 18桁パックBCD
+long double fpu_load_bcd(uint8 *p)
+{
+	long double val;
+	int i;
+	val = 0;
+	for (i=8; 0<=i; i--) {
+		val = val * 100 + (p[i] >> 4) * 10 + (p[i] & 0x0F);
+	}
+	return (p[9] & 0x80) ? -val : val;
+}
+
+void fpu_store_bcd(CPUx86 *cpu, uint8 *p, long double val)
+{
+	uint64 digits;
+	int i;
+	val = fpu_rint(cpu, val);
+	if (isnan(val) || 1e18L <= fabsl(val)) {
+		// 不定値
+		cpu->fpu.status |= FPU_SW_IE;
+		memset(p, 0, 7);
+		p[7] = 0xC0;
+		p[8] = 0xFF;
+		p[9] = 0xFF;
+		return;
+	}
+	digits = (uint64)fabsl(val);
+	for (i=0; i<9; i++) {
+		p[i] = digits % 10;
+		digits /= 10;
+		p[i] |= (digits % 10) << 4;
+		digits /= 10;
+	}
+	p[9] = signbit(val) ? 0x80 : 0x00;
+}
+
+
+// tag word
+
+// 値からタグ(00: 有効 01: ゼロ 10: 特殊 11: 空)を求める
+int fpu_tag(CPUx86 *cpu, int phys)
+{
+	long double val;
+	if ((cpu->fpu.tag_empty >> phys) & 0x01) {
+		return 3;
+	}
+	val = cpu->fpu.st[phys];
+	if (val==0.0L) {
+		return 1;
+	}
+	if (isnan(val) || isinf(val) || fpclassify(val)==FP_SUBNORMAL) {
+		return 2;
+	}
+	return 0;
+}
+
+uint16 fpu_tag_word(CPUx86 *cpu)
+{
+	uint16 tag;
+	int i;
+	tag = 0;
+	for (i=0; i<8; i++) {
+		tag |= fpu_tag(cpu, i) << (i * 2);
+	}
+	return tag;
+}
+
+void set_fpu_tag_word(CPUx86 *cpu, uint16 tag)
+{
+	int i;
+	cpu->fpu.tag_empty = 0;
+	for (i=0; i<8; i++) {
+		if (((tag >> (i * 2)) & 0x03)==3) {
+			cpu->fpu.tag_empty |= 1 << i;
+		}
+	}
+}
+
+// ES(例外サマリ)とB(ビジー)をマスクされていない例外から更新する
+void fpu_update_es(CPUx86 *cpu)
+{
+	if (cpu->fpu.status & ~cpu->fpu.control & 0x3F) {
+		cpu->fpu.status |= FPU_SW_ES | FPU_SW_B;
+	} else {
+		cpu->fpu.status &= ~(FPU_SW_ES | FPU_SW_B);
+	}
+}
+
+
+// state
+
+// VCPU_FPU=exact: 80bit拡張倍精度でRCとPCに従って計算する(既定はhost doubleの高速モード)
+void fpu_init(CPUx86 *cpu)
+{
+	char *env;
+
+	env = getenv("VCPU_FPU");
+	cpu->fpu.exact = env && strcmp(env, "exact")==0;
+	cpu->fpu.control = 0x037F;
+	cpu->fpu.status = 0;
+	cpu->fpu.tag_empty = 0xFF;
+	cpu->fpu.opcode = 0;
+	cpu->fpu.ip = 0;
+	cpu->fpu.cs = 0;
+	cpu->fpu.dp = 0;
+	cpu->fpu.ds = 0;
+}
+
+// FSTENV/FSAVEの環境部分(32bit: 28byte / 16bit: 14byte)
+int fpu_store_env(CPUx86 *cpu, uint8 *p, int size)
+{
+	uint32 env[7];
+	uint16 env16[7];
+	int i;
+
+	env[0] = 0xFFFF0000 | cpu->fpu.control;
+	env[1] = 0xFFFF0000 | cpu->fpu.status;
+	env[2] = 0xFFFF0000 | fpu_tag_word(cpu);
+	env[3] = cpu->fpu.ip;
+	env[4] = (uint32)(cpu->fpu.opcode & 0x07FF) << 16 | cpu->fpu.cs;
+	env[5] = cpu->fpu.dp;
+	env[6] = 0xFFFF0000 | cpu->fpu.ds;
+	if (size==2) {
+		for (i=0; i<7; i++) {
+			env16[i] = env[i] & 0xFFFF;
+		}
+		memcpy(p, env16, 14);
+		return 14;
+	}
+	memcpy(p, env, 28);
+	return 28;
+}
+
+int fpu_load_env(CPUx86 *cpu, uint8 *p, int size)
+{
+	uint32 env[7];
+	uint16 env16[7];
+	int i;
+
+	if (size==2) {
+		memcpy(env16, p, 14);
+		for (i=0; i<7; i++) {
+			env[i] = env16[i];
+		}
+	} else {
+		memcpy(env, p, 28);
+	}
+	cpu->fpu.control = env[0] & 0xFFFF;
+	cpu->fpu.status = env[1] & 0xFFFF;
+	set_fpu_tag_word(cpu, env[2] & 0xFFFF);
+	cpu->fpu.ip = env[3];
+	cpu->fpu.cs = env[4] & 0xFFFF;
+	cpu->fpu.opcode = (env[4] >> 16) & 0x07FF;
+	cpu->fpu.dp = env[5];
+	cpu->fpu.ds = env[6] & 0xFFFF;
+	return size==2 ? 14 : 28;
+}
+
+// FSAVE: 環境 + ST(0)~ST(7) (108/94byte) の後FNINIT
+void fpu_save(CPUx86 *cpu, uint8 *p, int size)
+{
+	int i;
+	p += fpu_store_env(cpu, p, size);
+	for (i=0; i<8; i++) {
+		fpu_store_f80(p + i * 10, fpu_st(cpu, i));
+	}
+	fpu_init(cpu);
+}
+
+void fpu_restore(CPUx86 *cpu, uint8 *p, int size)
+{
+	int i;
+	p += fpu_load_env(cpu, p, size);
+	for (i=0; i<8; i++) {
+		fpu_st(cpu, i) = fpu_load_f80(p + i * 10);
+	}
+}
+
+// FXSAVE: 512byteの領域(x87/MXCSR/XMM)
+void fpu_fxsave(CPUx86 *cpu, uint8 *p)
+{
+	uint16 val16;
+	uint32 val32;
+	int i;
+
+	memset(p, 0, 160);
+	memcpy(p + 0, &(cpu->fpu.control), 2);
+	memcpy(p + 2, &(cpu->fpu.status), 2);
+	p[4] = ~cpu->fpu.tag_empty;	// 簡略タグ(1: 有効)
+	val16 = cpu->fpu.opcode & 0x07FF;
+	memcpy(p + 6, &val16, 2);
+	memcpy(p + 8, &(cpu->fpu.ip), 4);
+	memcpy(p + 12, &(cpu->fpu.cs), 2);
+	memcpy(p + 16, &(cpu->fpu.dp), 4);
+	memcpy(p + 20, &(cpu->fpu.ds), 2);
+	memcpy(p + 24, &(cpu->mxcsr), 4);
+	val32 = MXCSR_MASK;
+	memcpy(p + 28, &val32, 4);
+	for (i=0; i<8; i++) {
+		fpu_store_f80(p + 32 + i * 16, fpu_st(cpu, i));
+	}
+	memcpy(p + 160, cpu->xmm, sizeof(cpu->xmm));
+}
+
+void fpu_fxrstor(CPUx86 *cpu, uint8 *p)
+{
+	uint16 val16;
+	int i;
+
+	memcpy(&(cpu->fpu.control), p + 0, 2);
+	memcpy(&(cpu->fpu.status), p + 2, 2);
+	cpu->fpu.tag_empty = ~p[4];
+	memcpy(&val16, p + 6, 2);
+	cpu->fpu.opcode = val16 & 0x07FF;
+	memcpy(&(cpu->fpu.ip), p + 8, 4);
+	memcpy(&(cpu->fpu.cs), p + 12, 2);
+	memcpy(&(cpu->fpu.dp), p + 16, 4);
+	memcpy(&(cpu->fpu.ds), p + 20, 2);
+	memcpy(&(cpu->mxcsr), p + 24, 4);
+	cpu->mxcsr &= MXCSR_MASK;
+	for (i=0; i<8; i++) {
+		fpu_st(cpu, i) = fpu_load_f80(p + 32 + i * 16);
+	}
+	memcpy(cpu->xmm, p + 160, sizeof(cpu->xmm));
+}
+
+
+// CR0.EM/CR0.TS
+
+// x87命令を実行できるか(できなければ#NM)
+// CR0.TSはタスク切り替え時にセットされるだけで、FPUの状態は
+// 最初にFPU命令を使ったタスクの#NMハンドラで保存/復元される(遅延切り替え)
+int fpu_available(CPUx86 *cpu)
+{
+	if (cpu->cr0 & (CR0_EM | CR0_TS)) {
+		fpu_device_not_available(cpu);
+		return 0;
+	}
+	return 1;
+}
+
+void fpu_device_not_available(CPUx86 *cpu)
+{
+	cpu_fault(cpu, EXC_NM, 0);
+}
+
+
+// opcode
+
+// FLDENV FLDCW FNSTENV FNSTCW FNCLEX FNINIT FRSTOR FNSAVE FNSTSW
+int fpu_is_control(uint8 opcode, int mem, int reg)
+{
+	switch (opcode) {
+	case 0xD9:
+	case 0xDD:
+		return mem && 4<=reg;
+	case 0xDB:
+	case 0xDF:
+		return !mem && reg==4;
+	}
+	return 0;
+}
+
+// D8~DF: x87 FPU命令(modrmは読み込み済み)
+void opcode_fpu(CPUx86 *cpu, uint8 opcode)
+{
+	uintp operand;
+	uint8 *p;
+	int reg;
+	int rm;
+	int op;
+	long double val;
+	long double val2;
+	int64 ival;
+	uint16 val16;
+	// FCMOVcc: B E BE U に対応する条件コード
+	static const uint8 fcmov_cc[] = {0x02, 0x04, 0x06, 0x0A};
+
+	if (!fpu_available(cpu)) {
+		return;
+	}
+
+	reg = cpu->modrm_reg;
+	rm = cpu->modrm_rm;
+	p = NULL;
+	if (cpu->modrm_mod!=3) {
+		cpu_modrm_address(cpu, &operand);
+		p = operand.ptr.uint8p;
+		cpu->fpu.dp = p - cpu->mem;
+		cpu->fpu.ds = cpu->sregs[SEG_DS];
+	}
+
+	// 制御命令以外は最後の命令を記録する
+	if (!fpu_is_control(opcode, p!=NULL, reg)) {
+		cpu->fpu.opcode = (opcode & 0x07) << 8 | cpu->modrm_mod << 6 | reg << 3 | rm;
+		cpu->fpu.ip = cpu->opcode_eip;
+		cpu->fpu.cs = cpu->sregs[SEG_CS];
+	}
+
+	switch (opcode) {
+	case 0xD8:
+		if (p) {
+			// D8 /r : fadd/fmul/fcom/fcomp/fsub/fsubr/fdiv/fdivr m32fp
+			val = fpu_load_f32(p);
+		} else {
+			// D8 /r : ... st(0) st(i)
+			val = fpu_get(cpu, rm);
+		}
+		if (reg==2 || reg==3) {
+			fpu_compare(cpu, fpu_get(cpu, 0), val, 0);
+			if (reg==3) {
+				fpu_pop(cpu);
+			}
+		} else {
+			fpu_set(cpu, 0, fpu_arith(cpu, reg, fpu_get(cpu, 0), val));
+		}
+		break;
+
+	case 0xDC:
+		if (p) {
+			// DC /r : fadd/fmul/fcom/fcomp/fsub/fsubr/fdiv/fdivr m64fp
+			val = fpu_load_f64(p);
+			if (reg==2 || reg==3) {
+				fpu_compare(cpu, fpu_get(cpu, 0), val, 0);
+				if (reg==3) {
+					fpu_pop(cpu);
+				}
+			} else {
+				fpu_set(cpu, 0, fpu_arith(cpu, reg, fpu_get(cpu, 0), val));
+			}
+		} else {
+			// DC C0+i : fadd st(i) st(0)
+			// DC C8+i : fmul st(i) st(0)
+			// DC E0+i : fsubr st(i) st(0)
+			// DC E8+i : fsub st(i) st(0)
+			// DC F0+i : fdivr st(i) st(0)
+			// DC F8+i : fdiv st(i) st(0)
+			if (reg==2 || reg==3) {
+				// DC D0/D8: fcom/fcompの別名
+				fpu_compare(cpu, fpu_get(cpu, 0), fpu_get(cpu, rm), 0);
+				if (reg==3) {
+					fpu_pop(cpu);
+				}
+				break;
+			}
+			op = (reg<4) ? reg : (reg ^ 0x01);
+			fpu_set(cpu, rm, fpu_arith(cpu, op, fpu_get(cpu, rm), fpu_get(cpu, 0)));
+		}
+		break;
+
+	case 0xDE:
+		if (p) {
+			// DE /r : fiadd/fimul/ficom/ficomp/fisub/fisubr/fidiv/fidivr m16int
+			val = fpu_load_int(p, 2);
+			if (reg==2 || reg==3) {
+				fpu_compare(cpu, fpu_get(cpu, 0), val, 0);
+				if (reg==3) {
+					fpu_pop(cpu);
+				}
+			} else {
+				fpu_set(cpu, 0, fpu_arith(cpu, reg, fpu_get(cpu, 0), val));
+			}
+		} else {
+			// DE C0+i : faddp st(i) st(0)
+			// DE C8+i : fmulp st(i) st(0)
+			// DE D9 : fcompp
+			// DE E0+i : fsubrp st(i) st(0)
+			// DE E8+i : fsubp st(i) st(0)
+			// DE F0+i : fdivrp st(i) st(0)
+			// DE F8+i : fdivp st(i) st(0)
+			if (reg==3 && rm==1) {
+				fpu_compare(cpu, fpu_get(cpu, 0), fpu_get(cpu, 1), 0);
+				fpu_pop(cpu);
+				fpu_pop(cpu);
+				break;
+			}
+			if (reg==2 || reg==3) {
+				log_warning("not implemented opcode: 0xDE %02X\n", 0xC0 | reg << 3 | rm);
+				cpu_fault(cpu, EXC_UD, 0);
+				break;
+			}
+			op = (reg<4) ? reg : (reg ^ 0x01);
+			fpu_set(cpu, rm, fpu_arith(cpu, op, fpu_get(cpu, rm), fpu_get(cpu, 0)));
+			fpu_pop(cpu);
+		}
+		break;
+
+	case 0xDA:
+		if (p) {
+			// DA /r : fiadd/fimul/ficom/ficomp/fisub/fisubr/fidiv/fidivr m32int
+			val = fpu_load_int(p, 4);
+			if (reg==2 || reg==3) {
+				fpu_compare(cpu, fpu_get(cpu, 0), val, 0);
+				if (reg==3) {
+					fpu_pop(cpu);
+				}
+			} else {
+				fpu_set(cpu, 0, fpu_arith(cpu, reg, fpu_get(cpu, 0), val));
+			}
+		} else if (reg<4) {
+			// DA C0+i : fcmovb st(0) st(i)
+			// DA C8+i : fcmove st(0) st(i)
+			// DA D0+i : fcmovbe st(0) st(i)
+			// DA D8+i : fcmovu st(0) st(i)
+			if (!cpu_feature(cpu, CPUID_CMOV)) {
+				cpu_fault(cpu, EXC_UD, 0);
+				return;
+			}
+			if (cpu_cond(cpu, fcmov_cc[reg])) {
+				fpu_set(cpu, 0, fpu_get(cpu, rm));
+			}
+		} else if (reg==5 && rm==1) {
+			// DA E9 : fucompp
+			fpu_compare(cpu, fpu_get(cpu, 0), fpu_get(cpu, 1), 1);
+			fpu_pop(cpu);
+			fpu_pop(cpu);
+		} else {
+			log_warning("not implemented opcode: 0xDA %02X\n", 0xC0 | reg << 3 | rm);
+			cpu_fault(cpu, EXC_UD, 0);
+		}
+		break;
+
+	case 0xD9:
+		if (p) {
+			switch (reg) {
+			case 0:	// D9 /0 : fld m32fp
+				fpu_push(cpu, fpu_load_f32(p));
+				break;
+			case 2:	// D9 /2 : fst m32fp
+			case 3:	// D9 /3 : fstp m32fp
+				val = fpu_get(cpu, 0);
+				if (cpu->fpu.exact) {
+					fpu_store_f32(cpu, p, val);
+				} else {
+					*(float*)p = (float)val;
+				}
+				if (reg==3) {
+					fpu_pop(cpu);
+				}
+				break;
+			case 4:	// D9 /4 : fldenv m14/28byte
+				fpu_load_env(cpu, p, cpu_operand_size(cpu));
+				break;
+			case 5:	// D9 /5 : fldcw m2byte
+				memcpy(&(cpu->fpu.control), p, 2);
+				fpu_update_es(cpu);
+				break;
+			case 6:	// D9 /6 : fnstenv m14/28byte
+				fpu_store_env(cpu, p, cpu_operand_size(cpu));
+				cpu->fpu.control |= 0x3F;
+				break;
+			case 7:	// D9 /7 : fnstcw m2byte
+				memcpy(p, &(cpu->fpu.control), 2);
+				break;
+			default:
+				log_warning("not implemented opcode: 0xD9 /%d\n", reg);
+				cpu_fault(cpu, EXC_UD, 0);
+			}
+			break;
+		}
+
+		switch (reg) {
+		case 0:	// D9 C0+i : fld st(i)
+			fpu_push(cpu, fpu_get(cpu, rm));
+			break;
+		case 1:	// D9 C8+i : fxch st(i)
+			val = fpu_get(cpu, 0);
+			val2 = fpu_get(cpu, rm);
+			fpu_set(cpu, 0, val2);
+			fpu_set(cpu, rm, val);
+			cpu->fpu.status &= ~FPU_SW_C1;
+			break;
+		case 2:	// D9 D0 : fnop
+			break;
+		case 4:
+			switch (rm) {
+			case 0:	// D9 E0 : fchs
+				fpu_set(cpu, 0, -fpu_get(cpu, 0));
+				break;
+			case 1:	// D9 E1 : fabs
+				fpu_set(cpu, 0, fabsl(fpu_get(cpu, 0)));
+				break;
+			case 4:	// D9 E4 : ftst
+				fpu_compare(cpu, fpu_get(cpu, 0), 0.0L, 0);
+				break;
+			case 5:	// D9 E5 : fxam
+				cpu->fpu.status &= ~(FPU_SW_C0 | FPU_SW_C1 | FPU_SW_C2 | FPU_SW_C3);
+				if (signbit(fpu_st(cpu, 0))) {
+					cpu->fpu.status |= FPU_SW_C1;
+				}
+				if (fpu_empty(cpu, 0)) {
+					cpu->fpu.status |= FPU_SW_C3 | FPU_SW_C0;
+				} else {
+					switch (fpclassify(fpu_st(cpu, 0))) {
+					case FP_NAN:
+						cpu->fpu.status |= FPU_SW_C0;
+						break;
+					case FP_INFINITE:
+						cpu->fpu.status |= FPU_SW_C2 | FPU_SW_C0;
+						break;
+					case FP_ZERO:
+						cpu->fpu.status |= FPU_SW_C3;
+						break;
+					case FP_SUBNORMAL:
+						cpu->fpu.status |= FPU_SW_C3 | FPU_SW_C2;
+						break;
+					default:
+						cpu->fpu.status |= FPU_SW_C2;
+					}
+				}
+				break;
+			default:
+				log_warning("not implemented opcode: 0xD9 %02X\n", 0xC0 | reg << 3 | rm);
+				cpu_fault(cpu, EXC_UD, 0);
+			}
+			break;
+		case 5:
+			switch (rm) {
+			case 0:	// D9 E8 : fld1
+				fpu_push(cpu, 1.0L);
+				break;
+			case 1:	// D9 E9 : fldl2t
+				fpu_push(cpu, 3.321928094887362347870319429489390175864831393L);
+				break;
+			case 2:	// D9 EA : fldl2e
+				fpu_push(cpu, 1.442695040888963407359924681001892137426645954L);
+				break;
+			case 3:	// D9 EB : fldpi
+				fpu_push(cpu, 3.141592653589793238462643383279502884197169399L);
+				break;
+			case 4:	// D9 EC : fldlg2
+				fpu_push(cpu, 0.301029995663981195213738894724493026768189881L);
+				break;
+			case 5:	// D9 ED : fldln2
+				fpu_push(cpu, 0.693147180559945309417232121458176568075500134L);
+				break;
+			case 6:	// D9 EE : fldz
+				fpu_push(cpu, 0.0L);
+				break;
+			default:
+				log_warning("not implemented opcode: 0xD9 %02X\n", 0xC0 | reg << 3 | rm);
+				cpu_fault(cpu, EXC_UD, 0);
+			}
+			break;
+		case 6:
+			switch (rm) {
+			case 0:	// D9 F0 : f2xm1
+				fpu_set(cpu, 0, fpu_round(cpu, exp2l(fpu_get(cpu, 0)) - 1.0L));
+				break;
+			case 1:	// D9 F1 : fyl2x
+				val = fpu_get(cpu, 1) * log2l(fpu_get(cpu, 0));
+				fpu_pop(cpu);
+				fpu_set(cpu, 0, fpu_round(cpu, val));
+				break;
+			case 2:	// D9 F2 : fptan
+				fpu_set(cpu, 0, fpu_round(cpu, tanl(fpu_get(cpu, 0))));
+				fpu_push(cpu, 1.0L);
+				cpu->fpu.status &= ~FPU_SW_C2;
+				break;
+			case 3:	// D9 F3 : fpatan
+				val = atan2l(fpu_get(cpu, 1), fpu_get(cpu, 0));
+				fpu_pop(cpu);
+				fpu_set(cpu, 0, fpu_round(cpu, val));
+				break;
+			case 4:	// D9 F4 : fxtract
+				val = fpu_get(cpu, 0);
+				if (val==0.0L) {
+					cpu->fpu.status |= FPU_SW_ZE;
+					fpu_set(cpu, 0, -INFINITY);
+					fpu_push(cpu, val);
+				} else {
+					fpu_set(cpu, 0, logbl(val));
+					fpu_push(cpu, scalbnl(val, -ilogbl(val)));
+				}
+				break;
+			case 5:	// D9 F5 : fprem1
+				val = fpu_get(cpu, 0);
+				val2 = fpu_get(cpu, 1);
+				ival = (int64)nearbyintl(val / val2);
+				fpu_set(cpu, 0, remainderl(val, val2));
+				fpu_set_quotient(cpu, ival);
+				break;
+			case 6:	// D9 F6 : fdecstp
+				set_fpu_top(cpu, fpu_top(cpu) - 1);
+				cpu->fpu.status &= ~FPU_SW_C1;
+				break;
+			case 7:	// D9 F7 : fincstp
+				set_fpu_top(cpu, fpu_top(cpu) + 1);
+				cpu->fpu.status &= ~FPU_SW_C1;
+				break;
+			}
+			break;
+		case 7:
+			switch (rm) {
+			case 0:	// D9 F8 : fprem
+				val = fpu_get(cpu, 0);
+				val2 = fpu_get(cpu, 1);
+				ival = (int64)truncl(val / val2);
+				fpu_set(cpu, 0, fmodl(val, val2));
+				fpu_set_quotient(cpu, ival);
+				break;
+			case 1:	// D9 F9 : fyl2xp1
+				val = fpu_get(cpu, 1) * log2l(fpu_get(cpu, 0) + 1.0L);
+				fpu_pop(cpu);
+				fpu_set(cpu, 0, fpu_round(cpu, val));
+				break;
+			case 2:	// D9 FA : fsqrt
+				val = fpu_get(cpu, 0);
+				if (val < 0) {
+					cpu->fpu.status |= FPU_SW_IE;
+				}
+				fpu_set(cpu, 0, cpu->fpu.exact ? fpu_sqrt(cpu, val) : sqrt((double)val));
+				break;
+			case 3:	// D9 FB : fsincos
+				val = fpu_get(cpu, 0);
+				fpu_set(cpu, 0, fpu_round(cpu, sinl(val)));
+				fpu_push(cpu, fpu_round(cpu, cosl(val)));
+				cpu->fpu.status &= ~FPU_SW_C2;
+				break;
+			case 4:	// D9 FC : frndint
+				fpu_set(cpu, 0, fpu_rint(cpu, fpu_get(cpu, 0)));
+				break;
+			case 5:	// D9 FD : fscale
+				fpu_set(cpu, 0, fpu_round(cpu, scalbnl(fpu_get(cpu, 0), (int)truncl(fpu_get(cpu, 1)))));
+				break;
+			case 6:	// D9 FE : fsin
+				fpu_set(cpu, 0, fpu_round(cpu, sinl(fpu_get(cpu, 0))));
+				cpu->fpu.status &= ~FPU_SW_C2;
+				break;
+			case 7:	// D9 FF : fcos
+				fpu_set(cpu, 0, fpu_round(cpu, cosl(fpu_get(cpu, 0))));
+				cpu->fpu.status &= ~FPU_SW_C2;
+				break;
+			}
+			break;
+		default:
+			log_warning("not implemented opcode: 0xD9 %02X\n", 0xC0 | reg << 3 | rm);
+			cpu_fault(cpu, EXC_UD, 0);
+		}
+		break;
+
+	case 0xDB:
+		if (p) {
+			switch (reg) {
+			case 0:	// DB /0 : fild m32int
+				fpu_push(cpu, fpu_load_int(p, 4));
+				break;
+			case 1:	// DB /1 : fisttp m32int
+				fpu_store_int(p, fpu_to_int(cpu, fpu_get(cpu, 0), 4, 1), 4);
+				fpu_pop(cpu);
+				break;
+			case 2:	// DB /2 : fist m32int
+			case 3:	// DB /3 : fistp m32int
+				fpu_store_int(p, fpu_to_int(cpu, fpu_get(cpu, 0), 4, 0), 4);
+				if (reg==3) {
+					fpu_pop(cpu);
+				}
+				break;
+			case 5:	// DB /5 : fld m80fp
+				fpu_push(cpu, fpu_load_f80(p));
+				break;
+			case 7:	// DB /7 : fstp m80fp
+				fpu_store_f80(p, fpu_get(cpu, 0));
+				fpu_pop(cpu);
+				break;
+			default:
+				log_warning("not implemented opcode: 0xDB /%d\n", reg);
+				cpu_fault(cpu, EXC_UD, 0);
+			}
+			break;
+		}
+
+		switch (reg) {
+		case 0:	// DB C0+i : fcmovnb st(0) st(i)
+		case 1:	// DB C8+i : fcmovne st(0) st(i)
+		case 2:	// DB D0+i : fcmovnbe st(0) st(i)
+		case 3:	// DB D8+i : fcmovnu st(0) st(i)
+			if (!cpu_feature(cpu, CPUID_CMOV)) {
+				cpu_fault(cpu, EXC_UD, 0);
+				return;
+			}
+			if (cpu_cond(cpu, fcmov_cc[reg] ^ 0x01)) {
+				fpu_set(cpu, 0, fpu_get(cpu, rm));
+			}
+			break;
+		case 4:
+			switch (rm) {
+			case 0:	// DB E0 : fneni (8087のみ, 無視)
+			case 1:	// DB E1 : fndisi (8087のみ, 無視)
+			case 4:	// DB E4 : fnsetpm (287のみ, 無視)
+				break;
+			case 2:	// DB E2 : fnclex
+				cpu->fpu.status &= ~(0x3F | FPU_SW_SF | FPU_SW_ES | FPU_SW_B);
+				break;
+			case 3:	// DB E3 : fninit
+				fpu_init(cpu);
+				break;
+			default:
+				log_warning("not implemented opcode: 0xDB %02X\n", 0xC0 | reg << 3 | rm);
+				cpu_fault(cpu, EXC_UD, 0);
+			}
+			break;
+		case 5:	// DB E8+i : fucomi st(0) st(i)
+		case 6:	// DB F0+i : fcomi st(0) st(i)
+			if (!cpu_feature(cpu, CPUID_CMOV)) {
+				cpu_fault(cpu, EXC_UD, 0);
+				return;
+			}
+			fpu_compare_eflags(cpu, fpu_get(cpu, 0), fpu_get(cpu, rm), reg==5);
+			break;
+		default:
+			log_warning("not implemented opcode: 0xDB %02X\n", 0xC0 | reg << 3 | rm);
+			cpu_fault(cpu, EXC_UD, 0);
+		}
+		break;
+
+	case 0xDD:
+		if (p) {
+			switch (reg) {
+			case 0:	// DD /0 : fld m64fp
+				fpu_push(cpu, fpu_load_f64(p));
+				break;
+			case 1:	// DD /1 : fisttp m64int
+				fpu_store_int(p, fpu_to_int(cpu, fpu_get(cpu, 0), 8, 1), 8);
+				fpu_pop(cpu);
+				break;
+			case 2:	// DD /2 : fst m64fp
+			case 3:	// DD /3 : fstp m64fp
+				val = fpu_get(cpu, 0);
+				if (cpu->fpu.exact) {
+					fpu_store_f64(cpu, p, val);
+				} else {
+					*(double*)p = (double)val;
+				}
+				if (reg==3) {
+					fpu_pop(cpu);
+				}
+				break;
+			case 4:	// DD /4 : frstor m94/108byte
+				fpu_restore(cpu, p, cpu_operand_size(cpu));
+				break;
+			case 6:	// DD /6 : fnsave m94/108byte
+				fpu_save(cpu, p, cpu_operand_size(cpu));
+				break;
+			case 7:	// DD /7 : fnstsw m2byte
+				memcpy(p, &(cpu->fpu.status), 2);
+				break;
+			default:
+				log_warning("not implemented opcode: 0xDD /%d\n", reg);
+				cpu_fault(cpu, EXC_UD, 0);
+			}
+			break;
+		}
+
+		switch (reg) {
+		case 0:	// DD C0+i : ffree st(i)
+			cpu->fpu.tag_empty |= 1 << fpu_phys(cpu, rm);
+			break;
+		case 2:	// DD D0+i : fst st(i)
+		case 3:	// DD D8+i : fstp st(i)
+			fpu_set(cpu, rm, fpu_get(cpu, 0));
+			if (reg==3) {
+				fpu_pop(cpu);
+			}
+			break;
+		case 4:	// DD E0+i : fucom st(i)
+		case 5:	// DD E8+i : fucomp st(i)
+			fpu_compare(cpu, fpu_get(cpu, 0), fpu_get(cpu, rm), 1);
+			if (reg==5) {
+				fpu_pop(cpu);
+			}
+			break;
+		default:
+			log_warning("not implemented opcode: 0xDD %02X\n", 0xC0 | reg << 3 | rm);
+			cpu_fault(cpu, EXC_UD, 0);
+		}
+		break;
+
+	case 0xDF:
+		if (p) {
+			switch (reg) {
+			case 0:	// DF /0 : fild m16int
+				fpu_push(cpu, fpu_load_int(p, 2));
+				break;
+			case 1:	// DF /1 : fisttp m16int
+				fpu_store_int(p, fpu_to_int(cpu, fpu_get(cpu, 0), 2, 1), 2);
+				fpu_pop(cpu);
+				break;
+			case 2:	// DF /2 : fist m16int
+			case 3:	// DF /3 : fistp m16int
+				fpu_store_int(p, fpu_to_int(cpu, fpu_get(cpu, 0), 2, 0), 2);
+				if (reg==3) {
+					fpu_pop(cpu);
+				}
+				break;
+			case 4:	// DF /4 : fbld m80bcd
+				fpu_push(cpu, fpu_load_bcd(p));
+				break;
+			case 5:	// DF /5 : fild m64int
+				fpu_push(cpu, fpu_load_int(p, 8));
+				break;
+			case 6:	// DF /6 : fbstp m80bcd
+				fpu_store_bcd(cpu, p, fpu_get(cpu, 0));
+				fpu_pop(cpu);
+				break;
+			case 7:	// DF /7 : fistp m64int
+				fpu_store_int(p, fpu_to_int(cpu, fpu_get(cpu, 0), 8, 0), 8);
+				fpu_pop(cpu);
+				break;
+			}
+			break;
+		}
+
+		switch (reg) {
+		case 4:	// DF E0 : fnstsw ax
+			if (rm==0) {
+				val16 = cpu->fpu.status;
+				cpu_regist_eax(cpu) = (cpu_regist_eax(cpu) & 0xFFFF0000) | val16;
+			} else {
+				log_warning("not implemented opcode: 0xDF %02X\n", 0xC0 | reg << 3 | rm);
+				cpu_fault(cpu, EXC_UD, 0);
+			}
+			break;
+		case 5:	// DF E8+i : fucomip st(0) st(i)
+		case 6:	// DF F0+i : fcomip st(0) st(i)
+			if (!cpu_feature(cpu, CPUID_CMOV)) {
+				cpu_fault(cpu, EXC_UD, 0);
+				return;
+			}
+			fpu_compare_eflags(cpu, fpu_get(cpu, 0), fpu_get(cpu, rm), reg==5);
+			fpu_pop(cpu);
+			break;
+		default:
+			log_warning("not implemented opcode: 0xDF %02X\n", 0xC0 | reg << 3 | rm);
+			cpu_fault(cpu, EXC_UD, 0);
+		}
+		break;
+	}
+
+	fpu_update_es(cpu);
+}
+
+// FPREM/FPREM1: 商の下位3bitをC0 C3 C1に設定する
+void fpu_set_quotient(CPUx86 *cpu, int64 quotient)
+{
+	if (quotient < 0) {
+		quotient = -quotient;
+	}
+	cpu->fpu.status &= ~(FPU_SW_C0 | FPU_SW_C1 | FPU_SW_C2 | FPU_SW_C3);
+	if (quotient & 0x01) {
+		cpu->fpu.status |= FPU_SW_C1;
+	}
+	if (quotient & 0x02) {
+		cpu->fpu.status |= FPU_SW_C3;
+	}
+	if (quotient & 0x04) {
+		cpu->fpu.status |= FPU_SW_C0;
+	}
+}
+
+// 9B : fwait
+void opcode_fwait(CPUx86 *cpu)
+{
+	if (cpu_cr0(cpu, CR0_TS) && cpu_cr0(cpu, CR0_MP)) {
+		fpu_device_not_available(cpu);
+	}
+}
+
+// 0F AE /0 : fxsave m512byte
+void opcode_fxsave(CPUx86 *cpu, uintp *dst)
+{
+	if (!cpu_feature(cpu, CPUID_FXSR)) {
+		cpu_fault(cpu, EXC_UD, 0);
+		return;
+	}
+	if (fpu_available(cpu)) {
+		fpu_fxsave(cpu, dst->ptr.uint8p);
+	}
+}
+
+// 0F AE /1 : fxrstor m512byte
+void opcode_fxrstor(CPUx86 *cpu, uintp *src)
+{
+	if (!cpu_feature(cpu, CPUID_FXSR)) {
+		cpu_fault(cpu, EXC_UD, 0);
+		return;
+	}
+	if (fpu_available(cpu)) {
+		fpu_fxrstor(cpu, src->ptr.uint8p);
+	}
+}
+
+// 0F 06 : clts
+void opcode_clts(CPUx86 *cpu)
+{
+	if (cpu_cr0(cpu, CR0_PE) && cpu->cpl!=0) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
+	}
+	set_cpu_cr0(cpu, CR0_TS, 0);
+}
@@ -0,0 +1,943 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "cpux86.h"
+#include "log.h"
+
+
+// GDBリモートスタブ(GDB Remote Serial Protocol、TCPかUNIXソケット)
+//   パケットはvCPUのスレッドで処理する(止まっている間はvCPUの中でパケットを待つ)
+//   アドレスはリニアアドレス(ページングはないので物理アドレスと同じ)、PCはCSのベース+EIP
+//
+//   ブレークポイントはページ単位のビットマップで引く
+//     置いたページは翻訳を捨てて翻訳しなくなるので、翻訳済みコードは何も確かめない
+//     確かめるのはブロックに入る前とインタプリタの命令の前だけで、置いていなければ何もしない
+//   ウォッチポイントは書き込み(Z2)のみで、x86のデバッグレジスタと同じく書いた命令の後で止まる
+//     置いたページへのストアは翻訳済みコードから抜けるので、値の変化は命令ごとに比べれば見つかる
+
+#define GDB_PACKET		4096
+#define GDB_BREAKPOINTS	256
+#define GDB_WATCHPOINTS	4		// DR0~DR3
+#define GDB_WATCH_MAX	8		// 1つのウォッチポイントの大きさ
+
+#define GDB_SIGINT		2
+#define GDB_SIGTRAP		5
+
+// i386のレジスタ番号(gdbのi386/32bit-core.xml、32bit-sse.xml)
+#define GDB_REG_EIP		8
+#define GDB_REG_EFLAGS	9
+#define GDB_REG_CS		10		// cs ss ds es fs gs
+#define GDB_REG_ST0		16		// st0~st7(10バイト)
+#define GDB_REG_FCTRL	24		// fctrl fstat ftag fiseg fioff foseg fooff fop
+#define GDB_REG_XMM0	32		// xmm0~xmm7(16バイト)
+#define GDB_REG_MXCSR	40
+#define GDB_REGS		41
+
+// gdbの番号順のセグメントレジスタ
+static const int gdb_sregs[6] = {SEG_CS, SEG_SS, SEG_DS, SEG_ES, SEG_FS, SEG_GS};
+
+typedef struct {
+	uint32 addr;
+	uint32 len;
+	uint8 val[GDB_WATCH_MAX];	// 最後に見た値
+} GdbWatch;
+
+struct GdbStub {
+	int fd;
+	int listen_fd;
+	int no_ack;			// QStartNoAckMode
+	int attached;
+
+	uint8 resume;		// 再開した最初の命令は止めない
+	uint8 interrupt;	// Ctrl-C(0x03)を受け取った
+
+	// 受信バッファ
+	uint8 in[GDB_PACKET];
+	int in_len;
+	int in_pos;
+	char packet[GDB_PACKET];
+	char reply[GDB_PACKET];
+
+	uint32 bp[GDB_BREAKPOINTS];
+	int bp_count;
+	uint16 *bp_pages;	// ページごとのブレークポイントの数
+	uint32 pages;
+
+	GdbWatch watch[GDB_WATCHPOINTS];
+	int watch_count;
+
+	// 統計
+	uint64 stat_stops;
+	uint64 stat_packets;
+};
+
+
+// socket
+
+// 読めるまで待つ(block: 0なら読めなければ-1を返す)
+static int gdb_getc(GdbStub *gdb, int block)
+{
+	struct pollfd pfd;
+	ssize_t ret;
+
+	if (gdb->in_pos==gdb->in_len) {
+		if (gdb->fd < 0) {
+			return -1;
+		}
+		if (!block) {
+			pfd.fd = gdb->fd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, 0) <= 0) {
+				return -1;
+			}
+		}
+		do {
+			ret = read(gdb->fd, gdb->in, sizeof(gdb->in));
+		} while (ret < 0 && errno==EINTR);
+		if (ret <= 0) {
+			// gdbが切った
+			close(gdb->fd);
+			gdb->fd = -1;
+			return -1;
+		}
+		gdb->in_len = ret;
+		gdb->in_pos = 0;
+	}
+	return gdb->in[gdb->in_pos++];
+}
+
+static void gdb_write(GdbStub *gdb, const char *buf, int len)
+{
+	ssize_t ret;
+
+	while (0 < len && 0 <= gdb->fd) {
+		ret = write(gdb->fd, buf, len);
+		if (ret < 0) {
+			if (errno==EINTR) {
+				continue;
+			}
+			close(gdb->fd);
+			gdb->fd = -1;
+			return;
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+
+// packet
+
+static const char gdb_hex[] = "0123456789abcdef";
+
+static int gdb_hexval(int c)
+{
+	if ('0'<=c && c<='9') {
+		return c - '0';
+	}
+	if ('a'<=c && c<='f') {
+		return c - 'a' + 10;
+	}
+	if ('A'<=c && c<='F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+// 16進数を読んでpを進める
+static uint32 gdb_parse_hex(const char **p)
+{
+	uint32 val = 0;
+	int d;
+
+	while (0 <= (d = gdb_hexval(**p))) {
+		val = val << 4 | d;
+		(*p)++;
+	}
+	return val;
+}
+
+static char* gdb_put_hex(char *p, const uint8 *buf, int len)
+{
+	int i;
+
+	for (i=0; i<len; i++) {
+		*p++ = gdb_hex[buf[i] >> 4];
+		*p++ = gdb_hex[buf[i] & 0x0F];
+	}
+	*p = '\0';
+	return p;
+}
+
+// 16進数の列をバイト列にする(読めたバイト数を返す)
+static int gdb_get_hex(const char *p, uint8 *buf, int len)
+{
+	int i;
+	int hi;
+	int lo;
+
+	for (i=0; i<len; i++) {
+		hi = gdb_hexval(p[i * 2]);
+		lo = hi < 0 ? -1 : gdb_hexval(p[i * 2 + 1]);
+		if (lo < 0) {
+			break;
+		}
+		buf[i] = hi << 4 | lo;
+	}
+	return i;
+}
+
+static void gdb_send(GdbStub *gdb, const char *data)
+{
+	char head[1] = {'$'};
+	char tail[3];
+	uint8 sum = 0;
+	const char *p;
+	int c;
+
+	for (p=data; *p; p++) {
+		sum += (uint8)*p;
+	}
+	tail[0] = '#';
+	tail[1] = gdb_hex[sum >> 4];
+	tail[2] = gdb_hex[sum & 0x0F];
+	for (;;) {
+		gdb_write(gdb, head, 1);
+		gdb_write(gdb, data, strlen(data));
+		gdb_write(gdb, tail, 3);
+		if (gdb->no_ack) {
+			return;
+		}
+		// '-'なら送り直す
+		do {
+			c = gdb_getc(gdb, 1);
+		} while (c!='+' && c!='-' && 0 <= c);
+		if (c!='-') {
+			return;
+		}
+	}
+}
+
+// パケットを1つ受け取る(切られたら-1、パケットの外のCtrl-Cは0x03を返す)
+static int gdb_recv(GdbStub *gdb)
+{
+	uint8 sum;
+	int len;
+	int c;
+	int cs;
+
+	for (;;) {
+		do {
+			c = gdb_getc(gdb, 1);
+			if (c==0x03) {
+				return c;
+			}
+		} while (c!='$' && 0 <= c);
+		if (c < 0) {
+			return -1;
+		}
+		sum = 0;
+		len = 0;
+		while (0 <= (c = gdb_getc(gdb, 1)) && c!='#') {
+			sum += c;
+			if (len < GDB_PACKET - 1) {
+				gdb->packet[len++] = c;
+			}
+		}
+		if (c < 0) {
+			return -1;
+		}
+		gdb->packet[len] = '\0';
+		cs = gdb_hexval(gdb_getc(gdb, 1)) << 4;
+		cs |= gdb_hexval(gdb_getc(gdb, 1));
+		if (gdb->no_ack) {
+			break;
+		}
+		if (cs==sum) {
+			gdb_write(gdb, "+", 1);
+			break;
+		}
+		gdb_write(gdb, "-", 1);
+	}
+	gdb->stat_packets++;
+	return '$';
+}
+
+
+// register
+
+// レジスタnの値をbufに書いて大きさを返す(0: ない)
+static int gdb_read_reg(CPUx86 *cpu, int n, uint8 *buf)
+{
+	uint32 val;
+	int top;
+
+	if (n < GDB_REG_ST0) {
+		if (n < 8) {
+			val = cpu->regs[n];
+		} else if (n==GDB_REG_EIP) {
+			val = cpu->eip;
+		} else if (n==GDB_REG_EFLAGS) {
+			cpu_eflags_sync(cpu);
+			val = cpu->eflags;
+		} else {
+			val = cpu->sregs[gdb_sregs[n - GDB_REG_CS]];
+		}
+	} else if (n < GDB_REG_FCTRL) {
+		top = (cpu->fpu.status >> 11) & 0x07;
+		fpu_store_f80(buf, cpu->fpu.st[(top + n - GDB_REG_ST0) & 0x07]);
+		return 10;
+	} else if (n < GDB_REG_XMM0) {
+		switch (n - GDB_REG_FCTRL) {
+		case 0: val = cpu->fpu.control; break;
+		case 1: val = cpu->fpu.status; break;
+		case 2: val = fpu_tag_word(cpu); break;
+		case 3: val = cpu->fpu.cs; break;
+		case 4: val = cpu->fpu.ip; break;
+		case 5: val = cpu->fpu.ds; break;
+		case 6: val = cpu->fpu.dp; break;
+		default: val = cpu->fpu.opcode; break;
+		}
+	} else if (n < GDB_REG_MXCSR) {
+		memcpy(buf, cpu->xmm[n - GDB_REG_XMM0].b, 16);
+		return 16;
+	} else if (n==GDB_REG_MXCSR) {
+		val = cpu->mxcsr;
+	} else {
+		return 0;
+	}
+	buf[0] = val;
+	buf[1] = val >> 8;
+	buf[2] = val >> 16;
+	buf[3] = val >> 24;
+	return 4;
+}
+
+// セグメントレジスタは書き換えない(ディスクリプタを読み直すとモードが変わる)
+static int gdb_write_reg(CPUx86 *cpu, int n, const uint8 *buf)
+{
+	uint32 val;
+	int top;
+
+	val = buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32)buf[3] << 24;
+	if (n < 8) {
+		cpu->regs[n] = val;
+	} else if (n==GDB_REG_EIP) {
+		cpu->eip = val;
+	} else if (n==GDB_REG_EFLAGS) {
+		cpu_eflags_sync(cpu);
+		cpu->eflags = val | 0x02;
+		cpu_update_mode(cpu);
+	} else if (n < GDB_REG_ST0) {
+		return 4;
+	} else if (n < GDB_REG_FCTRL) {
+		top = (cpu->fpu.status >> 11) & 0x07;
+		cpu->fpu.st[(top + n - GDB_REG_ST0) & 0x07] = fpu_load_f80((uint8*)buf);
+		return 10;
+	} else if (n < GDB_REG_XMM0) {
+		switch (n - GDB_REG_FCTRL) {
+		case 0: cpu->fpu.control = val; break;
+		case 1: cpu->fpu.status = val; break;
+		case 2: set_fpu_tag_word(cpu, val); break;
+		case 3: cpu->fpu.cs = val; break;
+		case 4: cpu->fpu.ip = val; break;
+		case 5: cpu->fpu.ds = val; break;
+		case 6: cpu->fpu.dp = val; break;
+		default: cpu->fpu.opcode = val & 0x7FF; break;
+		}
+	} else if (n < GDB_REG_MXCSR) {
+		memcpy(cpu->xmm[n - GDB_REG_XMM0].b, buf, 16);
+		return 16;
+	} else if (n==GDB_REG_MXCSR) {
+		cpu->mxcsr = val;
+	} else {
+		return 0;
+	}
+	return 4;
+}
+
+
+// breakpoint
+
+static int gdb_find_bp(GdbStub *gdb, uint32 addr)
+{
+	int i;
+
+	for (i=0; i<gdb->bp_count; i++) {
+		if (gdb->bp[i]==addr) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int gdb_insert_bp(CPUx86 *cpu, GdbStub *gdb, uint32 addr)
+{
+	uint32 page = addr >> 12;
+
+	if (0 <= gdb_find_bp(gdb, addr)) {
+		return 0;
+	}
+	if (gdb->bp_count==GDB_BREAKPOINTS || gdb->pages <= page) {
+		return -1;
+	}
+	gdb->bp[gdb->bp_count++] = addr;
+	if (gdb->bp_pages[page]++==0) {
+		jit_set_break(cpu, addr, 1);
+	}
+	return 0;
+}
+
+static int gdb_remove_bp(CPUx86 *cpu, GdbStub *gdb, uint32 addr)
+{
+	uint32 page = addr >> 12;
+	int i;
+
+	i = gdb_find_bp(gdb, addr);
+	if (i < 0) {
+		return -1;
+	}
+	gdb->bp[i] = gdb->bp[--(gdb->bp_count)];
+	if (--(gdb->bp_pages[page])==0) {
+		jit_set_break(cpu, addr, 0);
+	}
+	return 0;
+}
+
+// ウォッチポイントのページ(ほかのウォッチポイントと同じページなら外さない)
+static void gdb_watch_pages(CPUx86 *cpu, GdbStub *gdb, GdbWatch *w, int on)
+{
+	uint32 page;
+	int i;
+
+	for (page=w->addr >> 12; page<=(w->addr + w->len - 1) >> 12; page++) {
+		if (!on) {
+			for (i=0; i<gdb->watch_count; i++) {
+				if (gdb->watch[i].addr >> 12<=page && page<=(gdb->watch[i].addr + gdb->watch[i].len - 1) >> 12) {
+					break;
+				}
+			}
+			if (i<gdb->watch_count) {
+				continue;
+			}
+		}
+		jit_set_watch(cpu, page << 12, on);
+	}
+}
+
+static int gdb_insert_watch(CPUx86 *cpu, GdbStub *gdb, uint32 addr, uint32 len)
+{
+	GdbWatch *w;
+
+	if (gdb->watch_count==GDB_WATCHPOINTS || len==0 || GDB_WATCH_MAX < len || cpu->mem_size < (uint64)addr + len) {
+		return -1;
+	}
+	w = &(gdb->watch[gdb->watch_count++]);
+	w->addr = addr;
+	w->len = len;
+	memcpy(w->val, cpu->mem + addr, len);
+	gdb_watch_pages(cpu, gdb, w, 1);
+	return 0;
+}
+
+static int gdb_remove_watch(CPUx86 *cpu, GdbStub *gdb, uint32 addr, uint32 len)
+{
+	GdbWatch w;
+	int i;
+
+	for (i=0; i<gdb->watch_count; i++) {
+		if (gdb->watch[i].addr==addr && gdb->watch[i].len==len) {
+			w = gdb->watch[i];
+			gdb->watch[i] = gdb->watch[--(gdb->watch_count)];
+			gdb_watch_pages(cpu, gdb, &w, 0);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// 値の変わったウォッチポイント(なければNULL)
+static GdbWatch* gdb_watch_hit(CPUx86 *cpu, GdbStub *gdb)
+{
+	GdbWatch *w;
+	int i;
+
+	for (i=0; i<gdb->watch_count; i++) {
+		w = &(gdb->watch[i]);
+		if (memcmp(w->val, cpu->mem + w->addr, w->len)) {
+			memcpy(w->val, cpu->mem + w->addr, w->len);
+			return w;
+		}
+	}
+	return NULL;
+}
+
+// gdbの書き込みで変わった値は止めない
+static void gdb_watch_update(CPUx86 *cpu, GdbStub *gdb)
+{
+	int i;
+
+	for (i=0; i<gdb->watch_count; i++) {
+		memcpy(gdb->watch[i].val, cpu->mem + gdb->watch[i].addr, gdb->watch[i].len);
+	}
+}
+
+static void gdb_clear(CPUx86 *cpu, GdbStub *gdb)
+{
+	while (gdb->bp_count) {
+		gdb_remove_bp(cpu, gdb, gdb->bp[0]);
+	}
+	while (gdb->watch_count) {
+		gdb_remove_watch(cpu, gdb, gdb->watch[0].addr, gdb->watch[0].len);
+	}
+}
+
+
+// command
+
+// Z/zパケット(0: 成功 -1: エラー 1: 対応していない)
+static int gdb_cmd_point(CPUx86 *cpu, GdbStub *gdb, const char *p, int insert)
+{
+	uint32 type;
+	uint32 addr;
+	uint32 len;
+
+	type = gdb_parse_hex(&p);
+	if (*p++!=',') {
+		return -1;
+	}
+	addr = gdb_parse_hex(&p);
+	if (*p++!=',') {
+		return -1;
+	}
+	len = gdb_parse_hex(&p);
+
+	switch (type) {
+	case 0:		// ソフトウェアブレークポイント
+	case 1:		// ハードウェアブレークポイント(どちらもメモリを書き換えない)
+		return insert ? gdb_insert_bp(cpu, gdb, addr) : gdb_remove_bp(cpu, gdb, addr);
+	case 2:		// 書き込みウォッチポイント
+		return insert ? gdb_insert_watch(cpu, gdb, addr, len) : gdb_remove_watch(cpu, gdb, addr, len);
+	}
+	return 1;
+}
+
+static void gdb_cmd_read_mem(CPUx86 *cpu, GdbStub *gdb, const char *p)
+{
+	uint32 addr;
+	uint32 len;
+
+	addr = gdb_parse_hex(&p);
+	if (*p++!=',') {
+		strcpy(gdb->reply, "E01");
+		return;
+	}
+	len = gdb_parse_hex(&p);
+	if ((GDB_PACKET - 1) / 2 < len) {
+		len = (GDB_PACKET - 1) / 2;
+	}
+	if (cpu->mem_size < (uint64)addr + len) {
+		strcpy(gdb->reply, "E14");
+		return;
+	}
+	gdb_put_hex(gdb->reply, cpu->mem + addr, len);
+}
+
+static void gdb_cmd_write_mem(CPUx86 *cpu, GdbStub *gdb, const char *p)
+{
+	uint32 addr;
+	uint32 len;
+
+	addr = gdb_parse_hex(&p);
+	if (*p++!=',') {
+		strcpy(gdb->reply, "E01");
+		return;
+	}
+	len = gdb_parse_hex(&p);
+	if (*p++!=':' || strlen(p) < len * 2) {
+		strcpy(gdb->reply, "E01");
+		return;
+	}
+	if (cpu->mem_size < (uint64)addr + len) {
+		strcpy(gdb->reply, "E14");
+		return;
+	}
+	// 翻訳済みのページなら先に捨てる
+	jit_dma_write(cpu, addr, len);
+	gdb_get_hex(p, cpu->mem + addr, len);
+	gdb_watch_update(cpu, gdb);
+	strcpy(gdb->reply, "OK");
+}
+
+static void gdb_cmd_read_regs(CPUx86 *cpu, GdbStub *gdb)
+{
+	uint8 buf[16];
+	char *p = gdb->reply;
+	int n;
+
+	for (n=0; n<GDB_REGS; n++) {
+		p = gdb_put_hex(p, buf, gdb_read_reg(cpu, n, buf));
+	}
+}
+
+static void gdb_cmd_write_regs(CPUx86 *cpu, GdbStub *gdb, const char *p)
+{
+	uint8 buf[16];
+	uint8 tmp[16];
+	int len;
+	int n;
+
+	for (n=0; n<GDB_REGS && *p; n++) {
+		len = gdb_read_reg(cpu, n, tmp);
+		if (gdb_get_hex(p, buf, len)!=len) {
+			break;
+		}
+		gdb_write_reg(cpu, n, buf);
+		p += len * 2;
+	}
+	strcpy(gdb->reply, "OK");
+}
+
+static void gdb_cmd_read_reg(CPUx86 *cpu, GdbStub *gdb, const char *p)
+{
+	uint8 buf[16];
+	int len;
+
+	len = gdb_read_reg(cpu, gdb_parse_hex(&p), buf);
+	if (len==0) {
+		strcpy(gdb->reply, "E01");
+		return;
+	}
+	gdb_put_hex(gdb->reply, buf, len);
+}
+
+static void gdb_cmd_write_reg(CPUx86 *cpu, GdbStub *gdb, const char *p)
+{
+	uint8 buf[16];
+	int len;
+	int n;
+
+	n = gdb_parse_hex(&p);
+	len = gdb_read_reg(cpu, n, buf);
+	if (*p++!='=' || len==0 || gdb_get_hex(p, buf, len)!=len) {
+		strcpy(gdb->reply, "E01");
+		return;
+	}
+	gdb_write_reg(cpu, n, buf);
+	strcpy(gdb->reply, "OK");
+}
+
+static void gdb_cmd_query(CPUx86 *cpu, GdbStub *gdb, const char *p)
+{
+	if (strncmp(p, "qSupported", 10)==0) {
+		sprintf(gdb->reply, "PacketSize=%X;QStartNoAckMode+", GDB_PACKET - 1);
+	} else if (strcmp(p, "qAttached")==0) {
+		strcpy(gdb->reply, "1");
+	} else if (strcmp(p, "qC")==0) {
+		strcpy(gdb->reply, "QC1");
+	} else if (strcmp(p, "qfThreadInfo")==0) {
+		strcpy(gdb->reply, "m1");
+	} else if (strcmp(p, "qsThreadInfo")==0) {
+		strcpy(gdb->reply, "l");
+	} else if (strcmp(p, "QStartNoAckMode")==0) {
+		strcpy(gdb->reply, "OK");
+		gdb_send(gdb, gdb->reply);
+		gdb->no_ack = 1;
+		gdb->reply[0] = '\0';
+		return;
+	}
+}
+
+// つなぎを外して走らせ続ける
+static void gdb_detach(CPUx86 *cpu, GdbStub *gdb)
+{
+	gdb_clear(cpu, gdb);
+	cpu->gdb_step = 0;
+	if (0 <= gdb->fd) {
+		close(gdb->fd);
+		gdb->fd = -1;
+	}
+	gdb->attached = 0;
+	log_warning("gdb: detached\n");
+}
+
+// 止まったことを伝えて、再開するまでパケットを処理する
+static void gdb_stop(CPUx86 *cpu, GdbStub *gdb, int sig, GdbWatch *w)
+{
+	const char *p;
+	int c;
+
+	gdb->stat_stops++;
+	gdb->interrupt = 0;
+	cpu->gdb_step = 0;
+	if (w) {
+		sprintf(gdb->reply, "T%02Xwatch:%x;", sig, w->addr);
+	} else {
+		sprintf(gdb->reply, "T%02X", sig);
+	}
+	gdb_send(gdb, gdb->reply);
+
+	for (;;) {
+		c = gdb_recv(gdb);
+		if (c < 0) {
+			gdb_detach(cpu, gdb);
+			return;
+		}
+		if (c==0x03) {
+			sprintf(gdb->reply, "T%02X", GDB_SIGINT);
+			gdb_send(gdb, gdb->reply);
+			continue;
+		}
+		p = gdb->packet;
+		gdb->reply[0] = '\0';
+		switch (*p++) {
+		case '?':
+			sprintf(gdb->reply, "T%02X", sig);
+			break;
+		case 'g':
+			gdb_cmd_read_regs(cpu, gdb);
+			break;
+		case 'G':
+			gdb_cmd_write_regs(cpu, gdb, p);
+			break;
+		case 'p':
+			gdb_cmd_read_reg(cpu, gdb, p);
+			break;
+		case 'P':
+			gdb_cmd_write_reg(cpu, gdb, p);
+			break;
+		case 'm':
+			gdb_cmd_read_mem(cpu, gdb, p);
+			break;
+		case 'M':
+			gdb_cmd_write_mem(cpu, gdb, p);
+			break;
+		case 'c':
+		case 's':
+			// c [addr]、s [addr]
+			if (*p) {
+				cpu->eip = gdb_parse_hex(&p);
+			}
+			cpu->gdb_step = gdb->packet[0]=='s';
+			gdb->resume = 1;
+			return;
+		case 'C':
+		case 'S':
+			// シグナルは渡さない
+			cpu->gdb_step = gdb->packet[0]=='S';
+			gdb->resume = 1;
+			return;
+		case 'Z':
+		case 'z':
+			switch (gdb_cmd_point(cpu, gdb, p, gdb->packet[0]=='Z')) {
+			case 0:
+				strcpy(gdb->reply, "OK");
+				break;
+			case -1:
+				strcpy(gdb->reply, "E01");
+				break;
+			}
+			break;
+		case 'H':
+		case 'T':
+			strcpy(gdb->reply, "OK");
+			break;
+		case 'q':
+		case 'Q':
+			gdb_cmd_query(cpu, gdb, gdb->packet);
+			break;
+		case 'D':
+			gdb_send(gdb, "OK");
+			gdb_detach(cpu, gdb);
+			return;
+		case 'k':
+			// ゲストを止める
+			gdb_detach(cpu, gdb);
+			cpu->shutdown = 1;
+			return;
+		}
+		gdb_send(gdb, gdb->reply);
+	}
+}
+
+
+// gdb
+
+// ブロックに入る前とインタプリタの命令の前に呼ぶ(cpu->gdbがあるときだけ)
+// 止まったら1を返す(レジスタが書き換わっているかもしれないので呼び出し元はループを回り直す)
+int gdb_check(CPUx86 *cpu)
+{
+	GdbStub *gdb = cpu->gdb;
+	GdbWatch *w;
+	uint32 addr;
+
+	if (!gdb->attached) {
+		return 0;
+	}
+	if (gdb->resume) {
+		gdb->resume = 0;
+		return 0;
+	}
+	if (cpu->gdb_step || gdb->interrupt) {
+		gdb_stop(cpu, gdb, gdb->interrupt ? GDB_SIGINT : GDB_SIGTRAP, NULL);
+		return 1;
+	}
+	if (gdb->watch_count && (w = gdb_watch_hit(cpu, gdb))) {
+		gdb_stop(cpu, gdb, GDB_SIGTRAP, w);
+		return 1;
+	}
+	if (gdb->bp_count) {
+		addr = cpu->segs[SEG_CS].base + cpu->eip;
+		if ((addr >> 12) < gdb->pages && gdb->bp_pages[addr >> 12] && 0 <= gdb_find_bp(gdb, addr)) {
+			gdb_stop(cpu, gdb, GDB_SIGTRAP, NULL);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// スライスの区切りで呼ぶ(走っている間のCtrl-C)
+void gdb_poll(CPUx86 *cpu)
+{
+	GdbStub *gdb = cpu->gdb;
+	int c;
+
+	if (!gdb->attached) {
+		return;
+	}
+	while (0 <= (c = gdb_getc(gdb, 0))) {
+		if (c==0x03) {
+			gdb->interrupt = 1;
+		}
+	}
+	if (gdb->fd < 0) {
+		gdb_detach(cpu, gdb);
+	}
+}
+
+static int gdb_open(const char *addr)
+{
+	struct sockaddr_un sun;
+	struct addrinfo hints;
+	struct addrinfo *res;
+	char host[256];
+	const char *port;
+	const char *colon;
+	int one = 1;
+	int fd;
+
+	// UNIXソケット(/を含むパス)
+	if (strchr(addr, '/')) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (sizeof(sun.sun_path) <= strlen(addr)) {
+			return -1;
+		}
+		strcpy(sun.sun_path, addr);
+		unlink(addr);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr*)&sun, sizeof(sun)) < 0 || listen(fd, 1) < 0) {
+			if (0 <= fd) {
+				close(fd);
+			}
+			return -1;
+		}
+		return fd;
+	}
+
+	// TCP([host:]port、hostがなければlocalhost)
+	colon = strrchr(addr, ':');
+	strcpy(host, "127.0.0.1");
+	port = addr;
+	if (colon) {
+		if (sizeof(host) <= (size_t)(colon - addr)) {
+			return -1;
+		}
+		memcpy(host, addr, colon - addr);
+		host[colon - addr] = '\0';
+		port = colon + 1;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res)) {
+		return -1;
+	}
+	fd = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (0 <= fd) {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, 1) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+// addr([host:]port か UNIXソケットのパス)でgdbがつなぐのを待ち、最初の命令の前で止める
+int gdb_listen(CPUx86 *cpu, const char *addr)
+{
+	GdbStub *gdb;
+	int one = 1;
+	int fd;
+
+	if (cpu->gdb) {
+		log_warning("gdb: already listening\n");
+		return -1;
+	}
+	fd = gdb_open(addr);
+	if (fd < 0) {
+		log_warning("gdb: cannot listen on %s: %s\n", addr, strerror(errno));
+		return -1;
+	}
+	log_warning("gdb: waiting for connection on %s\n", addr);
+	gdb = calloc(1, sizeof(GdbStub));
+	gdb->listen_fd = fd;
+	do {
+		gdb->fd = accept(fd, NULL, NULL);
+	} while (gdb->fd < 0 && errno==EINTR);
+	if (gdb->fd < 0) {
+		log_warning("gdb: accept: %s\n", strerror(errno));
+		close(fd);
+		free(gdb);
+		return -1;
+	}
+	setsockopt(gdb->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	gdb->pages = cpu->mem_size >> 12;
+	gdb->bp_pages = calloc(gdb->pages, sizeof(uint16));
+	gdb->attached = 1;
+	cpu->gdb = gdb;
+	cpu->gdb_step = 1;
+	return 0;
+}
+
+// ゲストが終わったことを伝えて切る
+void gdb_delete(CPUx86 *cpu)
+{
+	GdbStub *gdb = cpu->gdb;
+	char buf[8];
+
+	if (gdb==NULL) {
+		return;
+	}
+	if (0 <= gdb->fd) {
+		sprintf(buf, "W%02X", cpu->shutdown ? 1 : 0);
+		gdb_send(gdb, buf);
+		close(gdb->fd);
+	}
+	gdb_clear(cpu, gdb);
+	close(gdb->listen_fd);
+	free(gdb->bp_pages);
+	free(gdb);
+	cpu->gdb = NULL;
+	cpu->gdb_step = 0;
+}
@@ -0,0 +1,914 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpux86.h"
+#include "ir.h"
+#include "jit.h"
+#include "log.h"
+
+
+// ALU(modrmのregフィールドの番号)
+#define IR_ALU_ADD		0
+#define IR_ALU_OR		1
+#define IR_ALU_AND		4
+#define IR_ALU_SUB		5
+#define IR_ALU_XOR		6
+#define IR_ALU_CMP		7
+#define IR_ALU_TEST		8
+
+
+// emit
+
+IrArg ir_none(void)
+{
+	IrArg arg;
+	arg.kind = IR_ARG_NONE;
+	arg.val = 0;
+	return arg;
+}
+
+IrArg ir_temp(int index)
+{
+	IrArg arg;
+	arg.kind = IR_ARG_TEMP;
+	arg.val = index;
+	return arg;
+}
+
+IrArg ir_const(uint32 val)
+{
+	IrArg arg;
+	arg.kind = IR_ARG_CONST;
+	arg.val = val;
+	return arg;
+}
+
+// 命令を追加して一時値を返す(eipは処理中のゲスト命令)
+IrArg ir_emit(IrBlock *block, uint8 op, IrArg a, IrArg b)
+{
+	IrInsn *insn;
+	insn = &(block->insn[block->count]);
+	memset(insn, 0, sizeof(IrInsn));
+	insn->op = op;
+	insn->size = 4;
+	insn->a = a;
+	insn->b = b;
+	insn->eip = block->end;
+	insn->remaining = block->guest_insns;	// デコードの最後に残り命令数に直す
+	return ir_temp(block->count++);
+}
+
+IrArg ir_emit_const(IrBlock *block, uint32 val)
+{
+	IrArg t;
+	t = ir_emit(block, IR_CONST, ir_none(), ir_none());
+	block->insn[t.val].imm = val;
+	return t;
+}
+
+IrArg ir_emit_getreg(IrBlock *block, int reg)
+{
+	IrArg t;
+	t = ir_emit(block, IR_GETREG, ir_none(), ir_none());
+	block->insn[t.val].reg = reg;
+	return t;
+}
+
+void ir_emit_setreg(IrBlock *block, int reg, IrArg val)
+{
+	IrArg t;
+	t = ir_emit(block, IR_SETREG, val, ir_none());
+	block->insn[t.val].reg = reg;
+}
+
+IrArg ir_emit_load(IrBlock *block, IrArg addr)
+{
+	return ir_emit(block, IR_LOAD, addr, ir_none());
+}
+
+void ir_emit_store(IrBlock *block, IrArg addr, IrArg val)
+{
+	IrArg t;
+	t = ir_emit(block, IR_STORE, addr, ir_none());
+	block->insn[t.val].c = val;
+}
+
+void ir_emit_flags(IrBlock *block, uint8 cc_op, IrArg src, IrArg dst)
+{
+	IrArg t;
+	t = ir_emit(block, IR_FLAGS, src, dst);
+	block->insn[t.val].cc = cc_op;
+}
+
+// ALU演算: dst = dst op src, フラグ
+void ir_emit_alu(IrBlock *block, int alu, IrArg dst, IrArg src, int dst_mem, IrArg addr, int reg)
+{
+	IrArg result;
+	uint8 op;
+	uint8 cc_op;
+
+	switch (alu) {
+	case IR_ALU_ADD:
+		op = IR_ADD;
+		cc_op = CC_OP_ADD;
+		break;
+	case IR_ALU_OR:
+		op = IR_OR;
+		cc_op = CC_OP_LOGIC;
+		break;
+	case IR_ALU_AND:
+	case IR_ALU_TEST:
+		op = IR_AND;
+		cc_op = CC_OP_LOGIC;
+		break;
+	case IR_ALU_SUB:
+	case IR_ALU_CMP:
+		op = IR_SUB;
+		cc_op = CC_OP_SUB;
+		break;
+	case IR_ALU_XOR:
+	default:
+		op = IR_XOR;
+		cc_op = CC_OP_LOGIC;
+		break;
+	}
+	result = ir_emit(block, op, dst, src);
+
+	// 書き込みはフラグより先(途中で抜けたときにフラグを変えないため)
+	if (alu!=IR_ALU_CMP && alu!=IR_ALU_TEST) {
+		if (dst_mem) {
+			ir_emit_store(block, addr, result);
+		} else {
+			ir_emit_setreg(block, reg, result);
+		}
+	}
+	ir_emit_flags(block, cc_op, cc_op==CC_OP_LOGIC ? ir_emit_const(block, 0) : src, result);
+}
+
+
+// decode
+
+// modrm(32bitアドレス)を読む。メモリならアドレスを計算してaddrに入れる。regフィールドを返す
+int ir_decode_modrm(CPUx86 *cpu, uint32 *pos, IrBlock *block, int *mem, uint8 *rm, IrArg *addr)
+{
+	uint8 modrm;
+	uint8 sib;
+	int mod;
+	int base;
+	int index;
+	int scale;
+	uint32 disp;
+	IrArg t;
+
+	modrm = cpu->mem[(*pos)++];
+	mod = modrm >> 6;
+	*rm = modrm & 0x07;
+	*mem = mod!=3;
+	if (mod==3) {
+		return modrm >> 3 & 0x07;
+	}
+
+	base = *rm;
+	index = -1;
+	scale = 0;
+	disp = 0;
+	if (*rm==4) {
+		sib = cpu->mem[(*pos)++];
+		scale = sib >> 6;
+		index = sib >> 3 & 0x07;
+		base = sib & 0x07;
+		if (index==4) {
+			index = -1;
+		}
+		if (mod==0 && base==5) {
+			base = -1;
+			memcpy(&disp, &(cpu->mem[*pos]), 4);
+			*pos += 4;
+		}
+	} else if (mod==0 && *rm==5) {
+		base = -1;
+		memcpy(&disp, &(cpu->mem[*pos]), 4);
+		*pos += 4;
+	}
+	if (mod==1) {
+		disp = (int8)cpu->mem[(*pos)++];
+	} else if (mod==2) {
+		memcpy(&disp, &(cpu->mem[*pos]), 4);
+		*pos += 4;
+	}
+
+	t = ir_emit(block, IR_ADDR, base<0 ? ir_none() : ir_emit_getreg(block, base), index<0 ? ir_none() : ir_emit_getreg(block, index));
+	block->insn[t.val].scale = scale;
+	block->insn[t.val].imm = disp;
+	*addr = t;
+	return modrm >> 3 & 0x07;
+}
+
+uint32 ir_fetch32(CPUx86 *cpu, uint32 *pos)
+{
+	uint32 val;
+	memcpy(&val, &(cpu->mem[*pos]), 4);
+	*pos += 4;
+	return val;
+}
+
+// push val (書き込んでからespを更新する)
+void ir_emit_push(IrBlock *block, IrArg val)
+{
+	IrArg sp;
+	sp = ir_emit(block, IR_SUB, ir_emit_getreg(block, 4), ir_emit_const(block, 4));
+	ir_emit_store(block, sp, val);
+	ir_emit_setreg(block, 4, sp);
+}
+
+// 1命令をIRにする。翻訳できなければ0
+int ir_decode(CPUx86 *cpu, uint32 eip, IrBlock *block, uint32 *next)
+{
+	uint32 pos;
+	uint8 opcode;
+	uint8 rm;
+	int mem;
+	int reg;
+	IrArg addr;
+	IrArg src;
+	IrArg dst;
+	IrArg sp;
+	IrArg t;
+	uint32 imm;
+
+	pos = eip;
+	opcode = cpu->mem[pos++];
+	addr = ir_none();
+
+	switch (opcode) {
+	case 0x01:	// add r/m32 r32
+	case 0x29:	// sub r/m32 r32
+	case 0x31:	// xor r/m32 r32
+	case 0x39:	// cmp r/m32 r32
+	case 0x85:	// test r/m32 r32
+		reg = ir_decode_modrm(cpu, &pos, block, &mem, &rm, &addr);
+		dst = mem ? ir_emit_load(block, addr) : ir_emit_getreg(block, rm);
+		ir_emit_alu(block, opcode==0x85 ? IR_ALU_TEST : opcode >> 3, dst, ir_emit_getreg(block, reg), mem, addr, rm);
+		break;
+	case 0x03:	// add r32 r/m32
+	case 0x3B:	// cmp r32 r/m32
+		reg = ir_decode_modrm(cpu, &pos, block, &mem, &rm, &addr);
+		src = mem ? ir_emit_load(block, addr) : ir_emit_getreg(block, rm);
+		ir_emit_alu(block, opcode >> 3, ir_emit_getreg(block, reg), src, 0, addr, reg);
+		break;
+	case 0x89:	// mov r/m32 r32
+		reg = ir_decode_modrm(cpu, &pos, block, &mem, &rm, &addr);
+		src = ir_emit_getreg(block, reg);
+		if (mem) {
+			ir_emit_store(block, addr, src);
+		} else {
+			ir_emit_setreg(block, rm, src);
+		}
+		break;
+	case 0x8B:	// mov r32 r/m32
+		reg = ir_decode_modrm(cpu, &pos, block, &mem, &rm, &addr);
+		ir_emit_setreg(block, reg, mem ? ir_emit_load(block, addr) : ir_emit_getreg(block, rm));
+		break;
+	case 0x2D:	// sub eax imm32
+	case 0x3D:	// cmp eax imm32
+	case 0xA9:	// test eax imm32
+		src = ir_emit_const(block, ir_fetch32(cpu, &pos));
+		ir_emit_alu(block, opcode==0xA9 ? IR_ALU_TEST : opcode >> 3, ir_emit_getreg(block, 0), src, 0, addr, 0);
+		break;
+	case 0x83:	// add/or/and/sub/xor/cmp r/m32 imm8
+		reg = ir_decode_modrm(cpu, &pos, block, &mem, &rm, &addr);
+		if (reg==2 || reg==3) {
+			// adc/sbbはCFを読むので対象外
+			return 0;
+		}
+		dst = mem ? ir_emit_load(block, addr) : ir_emit_getreg(block, rm);
+		src = ir_emit_const(block, (int8)cpu->mem[pos++]);
+		ir_emit_alu(block, reg, dst, src, mem, addr, rm);
+		break;
+	case 0x8D:	// lea r32 m
+		reg = ir_decode_modrm(cpu, &pos, block, &mem, &rm, &addr);
+		if (!mem) {
+			return 0;
+		}
+		ir_emit_setreg(block, reg, addr);
+		break;
+	case 0xC7:	// mov r/m32 imm32
+		reg = ir_decode_modrm(cpu, &pos, block, &mem, &rm, &addr);
+		if (reg!=0) {
+			return 0;
+		}
+		src = ir_emit_const(block, ir_fetch32(cpu, &pos));
+		if (mem) {
+			ir_emit_store(block, addr, src);
+		} else {
+			ir_emit_setreg(block, rm, src);
+		}
+		break;
+	case 0xB8:	// mov r32 imm32
+	case 0xB9:
+	case 0xBA:
+	case 0xBB:
+	case 0xBC:
+	case 0xBD:
+	case 0xBE:
+	case 0xBF:
+		ir_emit_setreg(block, opcode & 0x07, ir_emit_const(block, ir_fetch32(cpu, &pos)));
+		break;
+	case 0x50:	// push r32 (push espを除く)
+	case 0x51:
+	case 0x52:
+	case 0x53:
+	case 0x55:
+	case 0x56:
+	case 0x57:
+		ir_emit_push(block, ir_emit_getreg(block, opcode & 0x07));
+		break;
+	case 0x58:	// pop r32 (pop espを除く)
+	case 0x59:
+	case 0x5A:
+	case 0x5B:
+	case 0x5D:
+	case 0x5E:
+	case 0x5F:
+		sp = ir_emit_getreg(block, 4);
+		src = ir_emit_load(block, sp);
+		ir_emit_setreg(block, opcode & 0x07, src);
+		ir_emit_setreg(block, 4, ir_emit(block, IR_ADD, sp, ir_emit_const(block, 4)));
+		break;
+	case 0x90:	// nop
+		break;
+	case 0x70:	// jcc rel8
+	case 0x71:
+	case 0x72:
+	case 0x73:
+	case 0x74:
+	case 0x75:
+	case 0x76:
+	case 0x77:
+	case 0x78:
+	case 0x79:
+	case 0x7A:
+	case 0x7B:
+	case 0x7C:
+	case 0x7D:
+	case 0x7E:
+	case 0x7F:
+		imm = (int8)cpu->mem[pos++];
+		t = ir_emit(block, IR_JCC, ir_none(), ir_none());
+		block->insn[t.val].cc = opcode & 0x0F;
+		block->insn[t.val].imm = pos + imm;
+		block->insn[t.val].next = pos;
+		break;
+	case 0x0F:
+		opcode = cpu->mem[pos++];
+		if ((opcode & 0xF0)!=0x80) {
+			return 0;
+		}
+		// jcc rel32
+		imm = ir_fetch32(cpu, &pos);
+		t = ir_emit(block, IR_JCC, ir_none(), ir_none());
+		block->insn[t.val].cc = opcode & 0x0F;
+		block->insn[t.val].imm = pos + imm;
+		block->insn[t.val].next = pos;
+		break;
+	case 0xEB:	// jmp rel8
+		imm = (int8)cpu->mem[pos++];
+		t = ir_emit(block, IR_JMP, ir_none(), ir_none());
+		block->insn[t.val].imm = pos + imm;
+		break;
+	case 0xE8:	// call rel32
+		imm = ir_fetch32(cpu, &pos);
+		ir_emit_push(block, ir_emit_const(block, pos));
+		t = ir_emit(block, IR_JMP, ir_none(), ir_none());
+		block->insn[t.val].cc = IR_BR_CALL;
+		block->insn[t.val].imm = pos + imm;
+		block->insn[t.val].next = pos;
+		break;
+	case 0xC3:	// ret
+		sp = ir_emit_getreg(block, 4);
+		src = ir_emit_load(block, sp);
+		ir_emit_setreg(block, 4, ir_emit(block, IR_ADD, sp, ir_emit_const(block, 4)));
+		t = ir_emit(block, IR_JMPR, src, ir_none());
+		block->insn[t.val].cc = IR_BR_RET;
+		break;
+	case 0xFF:	// call/jmp r/m32
+		reg = ir_decode_modrm(cpu, &pos, block, &mem, &rm, &addr);
+		if (reg!=2 && reg!=4) {
+			return 0;
+		}
+		src = mem ? ir_emit_load(block, addr) : ir_emit_getreg(block, rm);
+		if (reg==2) {
+			ir_emit_push(block, ir_emit_const(block, pos));
+		}
+		t = ir_emit(block, IR_JMPR, src, ir_none());
+		block->insn[t.val].cc = reg==2 ? IR_BR_CALL : IR_BR_JMP;
+		block->insn[t.val].next = pos;
+		break;
+	default:
+		return 0;
+	}
+
+	*next = pos;
+	return 1;
+}
+
+// ブロックをIRにする。ゲスト命令数を返す
+int ir_decode_block(CPUx86 *cpu, uint32 eip, IrBlock *block)
+{
+	uint32 page_end;
+	uint32 next;
+	int count;
+	int producer;
+	int i;
+	IrArg t;
+
+	page_end = (eip & ~(JIT_PAGE_SIZE - 1)) + JIT_PAGE_SIZE;
+	block->eip = eip;
+	block->end = eip;
+	block->guest_insns = 0;
+	block->count = 0;
+	producer = 0;
+
+	while (block->guest_insns<IR_BLOCK_INSNS && block->count + 16<=IR_MAX_INSNS) {
+		if (cpu->mem_size < (uint64)block->end + 16) {
+			break;
+		}
+		count = block->count;
+		if (!ir_decode(cpu, block->end, block, &next)) {
+			block->count = count;
+			break;
+		}
+		// ページをまたぐ命令は含めない(SMCの管理をページ単位にするため)
+		// フラグを設定した命令がブロック内にないJccはインタプリタに任せる
+		// (nopのようにIRを出さない命令もあるので、この命令が出したIRだけを見る)
+		if (page_end < next || (count < block->count && block->insn[block->count - 1].op==IR_JCC && !producer)) {
+			block->count = count;
+			break;
+		}
+		for (i=count; i<block->count; i++) {
+			if (block->insn[i].op==IR_FLAGS) {
+				producer = 1;
+			}
+		}
+		block->end = next;
+		block->guest_insns++;
+		if (count < block->count && ir_is_exit(block->insn[block->count - 1].op)) {
+			break;
+		}
+	}
+
+	if (block->guest_insns==0) {
+		return 0;
+	}
+	if (block->count==0 || !ir_is_exit(block->insn[block->count - 1].op)) {
+		// 翻訳できない命令の手前で終わった
+		t = ir_emit(block, IR_JMP, ir_none(), ir_none());
+		block->insn[t.val].imm = block->end;
+	}
+	for (i=0; i<block->count; i++) {
+		block->insn[i].remaining = block->guest_insns - block->insn[i].remaining;
+	}
+	return block->guest_insns;
+}
+
+
+// optimize
+
+// 一時値を定数で置き換える
+int ir_const_arg(IrBlock *block, IrArg *arg)
+{
+	if (arg->kind==IR_ARG_TEMP && block->insn[arg->val].op==IR_CONST) {
+		*arg = ir_const(block->insn[arg->val].imm);
+		return 1;
+	}
+	return 0;
+}
+
+void ir_rename(IrInsn *insn, IrArg *repl)
+{
+	if (insn->a.kind==IR_ARG_TEMP && repl[insn->a.val].kind!=IR_ARG_NONE) {
+		insn->a = repl[insn->a.val];
+	}
+	if (insn->b.kind==IR_ARG_TEMP && repl[insn->b.val].kind!=IR_ARG_NONE) {
+		insn->b = repl[insn->b.val];
+	}
+	if (insn->c.kind==IR_ARG_TEMP && repl[insn->c.val].kind!=IR_ARG_NONE) {
+		insn->c = repl[insn->c.val];
+	}
+}
+
+// ゲストレジスタの読み書きを減らす
+//   読み: 直前に読み書きした値をそのまま使う
+//   書き: ブロックから抜ける(LOADとSTOREで抜ける場合を含む)までに上書きされるなら省く
+void ir_opt_regs(IrBlock *block, IrStats *stats)
+{
+	IrArg repl[IR_MAX_INSNS];
+	IrArg cur[8];
+	int pending[8];
+	IrInsn *insn;
+	int i;
+
+	for (i=0; i<8; i++) {
+		cur[i] = ir_none();
+		pending[i] = 0;
+	}
+	for (i=0; i<block->count; i++) {
+		insn = &(block->insn[i]);
+		repl[i] = ir_none();
+		ir_rename(insn, repl);
+		if (insn->op==IR_GETREG) {
+			if (cur[insn->reg].kind!=IR_ARG_NONE) {
+				repl[i] = cur[insn->reg];
+				insn->op = IR_NOP;
+				stats->reg_loads++;
+			} else {
+				cur[insn->reg] = ir_temp(i);
+			}
+		} else if (insn->op==IR_SETREG) {
+			cur[insn->reg] = insn->a;
+		}
+	}
+
+	for (i=block->count-1; 0<=i; i--) {
+		insn = &(block->insn[i]);
+		if (insn->op==IR_SETREG) {
+			if (pending[insn->reg]) {
+				insn->op = IR_NOP;
+				stats->reg_stores++;
+			}
+			pending[insn->reg] = 1;
+		} else if (insn->op==IR_LOAD || insn->op==IR_STORE || ir_is_exit(insn->op)) {
+			memset(pending, 0, sizeof(pending));
+		}
+	}
+}
+
+// 即値の伝播と畳み込み
+void ir_opt_const(IrBlock *block, IrStats *stats)
+{
+	IrInsn *insn;
+	uint32 a;
+	uint32 b;
+	int i;
+
+	for (i=0; i<block->count; i++) {
+		insn = &(block->insn[i]);
+		if (insn->op==IR_NOP || insn->op==IR_GETREG || insn->op==IR_CONST) {
+			continue;
+		}
+		stats->const_args += ir_const_arg(block, &(insn->a));
+		stats->const_args += ir_const_arg(block, &(insn->b));
+		stats->const_args += ir_const_arg(block, &(insn->c));
+
+		if (ir_is_alu(insn->op) && insn->a.kind==IR_ARG_CONST && insn->b.kind==IR_ARG_CONST) {
+			a = insn->a.val;
+			b = insn->b.val;
+			switch (insn->op) {
+			case IR_ADD:
+				insn->imm = a + b;
+				break;
+			case IR_SUB:
+				insn->imm = a - b;
+				break;
+			case IR_AND:
+				insn->imm = a & b;
+				break;
+			case IR_OR:
+				insn->imm = a | b;
+				break;
+			case IR_XOR:
+				insn->imm = a ^ b;
+				break;
+			}
+			insn->op = IR_CONST;
+			insn->a = ir_none();
+			insn->b = ir_none();
+			stats->const_folded++;
+		} else if (insn->op==IR_ADDR && insn->a.kind!=IR_ARG_TEMP && insn->b.kind!=IR_ARG_TEMP) {
+			insn->imm += (insn->a.kind==IR_ARG_CONST ? insn->a.val : 0) + (insn->b.kind==IR_ARG_CONST ? insn->b.val << insn->scale : 0);
+			insn->op = IR_CONST;
+			insn->a = ir_none();
+			insn->b = ir_none();
+			stats->const_folded++;
+		}
+	}
+}
+
+// アドレス計算をLOAD/STORE/ADDRのオペランドに畳み込む
+void ir_opt_addr(IrBlock *block, IrStats *stats)
+{
+	IrInsn *insn;
+	IrInsn *def;
+	int changed;
+	int i;
+
+	for (i=0; i<block->count; i++) {
+		insn = &(block->insn[i]);
+		if (insn->op!=IR_ADDR && insn->op!=IR_LOAD && insn->op!=IR_STORE) {
+			continue;
+		}
+		do {
+			changed = 0;
+
+			// 定数はdispへ
+			if (insn->a.kind==IR_ARG_CONST) {
+				insn->imm += insn->a.val;
+				insn->a = ir_none();
+				changed = 1;
+			}
+			if (insn->b.kind==IR_ARG_CONST) {
+				insn->imm += insn->b.val << insn->scale;
+				insn->b = ir_none();
+				changed = 1;
+			}
+			if (insn->a.kind==IR_ARG_NONE && insn->b.kind==IR_ARG_TEMP && insn->scale==0) {
+				insn->a = insn->b;
+				insn->b = ir_none();
+				changed = 1;
+			}
+
+			// base: [ADDR + disp] [x + imm + disp]
+			if (insn->a.kind==IR_ARG_TEMP) {
+				def = &(block->insn[insn->a.val]);
+				if (def->op==IR_ADDR && (insn->b.kind==IR_ARG_NONE || def->b.kind==IR_ARG_NONE)) {
+					insn->imm += def->imm;
+					insn->a = def->a;
+					if (def->b.kind!=IR_ARG_NONE) {
+						insn->b = def->b;
+						insn->scale = def->scale;
+					}
+					stats->addr_folded++;
+					changed = 1;
+				} else if ((def->op==IR_ADD || def->op==IR_SUB) && def->b.kind==IR_ARG_CONST) {
+					insn->imm += def->op==IR_ADD ? def->b.val : -def->b.val;
+					insn->a = def->a;
+					stats->addr_folded++;
+					changed = 1;
+				}
+			}
+
+			// index: [(x + imm) << scale]
+			if (insn->b.kind==IR_ARG_TEMP) {
+				def = &(block->insn[insn->b.val]);
+				if ((def->op==IR_ADD || def->op==IR_SUB) && def->b.kind==IR_ARG_CONST) {
+					insn->imm += (def->op==IR_ADD ? def->b.val : -def->b.val) << insn->scale;
+					insn->b = def->a;
+					stats->addr_folded++;
+					changed = 1;
+				}
+			}
+		} while (changed);
+	}
+}
+
+// ブロックから抜けるまでに上書きされるフラグは書き出さない
+void ir_opt_flags(IrBlock *block, IrStats *stats)
+{
+	IrInsn *insn;
+	int need;
+	int i;
+
+	need = 1;
+	for (i=block->count-1; 0<=i; i--) {
+		insn = &(block->insn[i]);
+		if (insn->op==IR_FLAGS) {
+			if (!need) {
+				insn->op = IR_NOP;
+				stats->dead_flags++;
+			}
+			need = 0;
+		} else if (insn->op==IR_LOAD || insn->op==IR_STORE || ir_is_exit(insn->op)) {
+			need = 1;
+		}
+	}
+}
+
+// 使われない値を消す
+void ir_opt_dead(IrBlock *block, IrStats *stats)
+{
+	uint8 used[IR_MAX_INSNS];
+	IrInsn *insn;
+	int i;
+
+	memset(used, 0, sizeof(used));
+	for (i=block->count-1; 0<=i; i--) {
+		insn = &(block->insn[i]);
+		switch (insn->op) {
+		case IR_GETREG:
+		case IR_CONST:
+		case IR_ADDR:
+		case IR_LOAD:
+		case IR_ADD:
+		case IR_SUB:
+		case IR_AND:
+		case IR_OR:
+		case IR_XOR:
+			if (!used[i]) {
+				insn->op = IR_NOP;
+				stats->dead_code++;
+				continue;
+			}
+			break;
+		case IR_NOP:
+			continue;
+		}
+		if (insn->a.kind==IR_ARG_TEMP) {
+			used[insn->a.val] = 1;
+		}
+		if (insn->b.kind==IR_ARG_TEMP) {
+			used[insn->b.val] = 1;
+		}
+		if (insn->c.kind==IR_ARG_TEMP) {
+			used[insn->c.val] = 1;
+		}
+	}
+}
+
+// IR_NOPを詰める
+void ir_compact(IrBlock *block)
+{
+	IrArg repl[IR_MAX_INSNS];
+	int count;
+	int i;
+
+	count = 0;
+	for (i=0; i<block->count; i++) {
+		if (block->insn[i].op==IR_NOP) {
+			continue;
+		}
+		repl[i] = ir_temp(count);
+		block->insn[count] = block->insn[i];
+		ir_rename(&(block->insn[count]), repl);
+		count++;
+	}
+	block->count = count;
+}
+
+void ir_optimize(IrBlock *block, IrStats *stats)
+{
+	stats->blocks++;
+	stats->insns += block->count;
+	ir_opt_regs(block, stats);
+	ir_opt_const(block, stats);
+	ir_opt_addr(block, stats);
+	ir_opt_flags(block, stats);
+	ir_opt_dead(block, stats);
+	ir_compact(block);
+	stats->insns_opt += block->count;
+}
+
+
+// exec
+
+uint32 ir_value(uint32 *val, IrArg *arg)
+{
+	switch (arg->kind) {
+	case IR_ARG_TEMP:
+		return val[arg->val];
+	case IR_ARG_CONST:
+		return arg->val;
+	}
+	return 0;
+}
+
+uint32 ir_address(uint32 *val, IrInsn *insn)
+{
+	return ir_value(val, &(insn->a)) + (ir_value(val, &(insn->b)) << insn->scale) + insn->imm;
+}
+
+// IRを解釈実行する
+// 戻り値: 実行したゲスト命令数(自己書き換えで途中から抜けたときはblockの命令数より少ない)
+int ir_exec(CPUx86 *cpu, IrInsn *insn, int count, int guest_insns, uint8 *page_code)
+{
+	uint32 val[IR_MAX_INSNS];
+	uint32 addr;
+	uint32 data;
+	IrInsn *in;
+	int i;
+
+	for (i=0; i<count; i++) {
+		in = &(insn[i]);
+		switch (in->op) {
+		case IR_GETREG:
+			val[i] = cpu->regs[in->reg];
+			break;
+		case IR_SETREG:
+			cpu->regs[in->reg] = ir_value(val, &(in->a));
+			break;
+		case IR_CONST:
+			val[i] = in->imm;
+			break;
+		case IR_ADDR:
+			val[i] = ir_address(val, in);
+			break;
+		case IR_LOAD:
+			addr = ir_address(val, in);
+			// RAMの外ならこの命令からインタプリタに任せる(#GPになる)
+			if (cpu->mem_size < (uint64)addr + in->size) {
+				cpu->eip = in->eip;
+				return guest_insns - in->remaining;
+			}
+			data = 0;
+			memcpy(&data, &(cpu->mem[addr]), in->size);
+			val[i] = data;
+			break;
+		case IR_STORE:
+			addr = ir_address(val, in);
+			// RAMの外か翻訳済みのページならこの命令からインタプリタに任せる
+			if (cpu->mem_size < (uint64)addr + in->size || (page_code && page_code[addr >> JIT_PAGE_SHIFT])) {
+				cpu->eip = in->eip;
+				return guest_insns - in->remaining;
+			}
+			data = ir_value(val, &(in->c));
+			memcpy(&(cpu->mem[addr]), &data, in->size);
+			break;
+		case IR_ADD:
+			val[i] = ir_value(val, &(in->a)) + ir_value(val, &(in->b));
+			break;
+		case IR_SUB:
+			val[i] = ir_value(val, &(in->a)) - ir_value(val, &(in->b));
+			break;
+		case IR_AND:
+			val[i] = ir_value(val, &(in->a)) & ir_value(val, &(in->b));
+			break;
+		case IR_OR:
+			val[i] = ir_value(val, &(in->a)) | ir_value(val, &(in->b));
+			break;
+		case IR_XOR:
+			val[i] = ir_value(val, &(in->a)) ^ ir_value(val, &(in->b));
+			break;
+		case IR_FLAGS:
+			set_cpu_cc(cpu, in->cc, in->size, ir_value(val, &(in->a)), ir_value(val, &(in->b)));
+			break;
+		case IR_JCC:
+			cpu->eip = cpu_cond(cpu, in->cc) ? in->imm : in->next;
+			return guest_insns;
+		case IR_JMP:
+			cpu->eip = in->imm;
+			return guest_insns;
+		case IR_JMPR:
+			cpu->eip = ir_value(val, &(in->a));
+			return guest_insns;
+		}
+	}
+	return guest_insns;
+}
+
+
+// dump
+
+void dump_ir_arg(IrArg *arg)
+{
+	switch (arg->kind) {
+	case IR_ARG_TEMP:
+		printf(" t%u", arg->val);
+		break;
+	case IR_ARG_CONST:
+		printf(" $0x%X", arg->val);
+		break;
+	}
+}
+
+void dump_ir(IrBlock *block)
+{
+	char *names[] = {"nop", "getreg", "setreg", "const", "addr", "load", "store", "add", "sub", "and", "or", "xor", "flags", "jcc", "jmp", "jmpr"};
+	IrInsn *insn;
+	int i;
+
+	printf("dump_ir: eip: 0x%X end: 0x%X guest: %d ir: %d\n", block->eip, block->end, block->guest_insns, block->count);
+	for (i=0; i<block->count; i++) {
+		insn = &(block->insn[i]);
+		printf("  t%d = %s", i, names[insn->op]);
+		switch (insn->op) {
+		case IR_GETREG:
+		case IR_SETREG:
+			printf(" r%d", insn->reg);
+			break;
+		case IR_CONST:
+			printf(" 0x%X", insn->imm);
+			break;
+		case IR_JMP:
+			printf(" %s 0x%X", insn->cc==IR_BR_CALL ? "call" : "jmp", insn->imm);
+			break;
+		case IR_ADDR:
+		case IR_LOAD:
+		case IR_STORE:
+			printf(" [0x%X<<%d]", insn->imm, insn->scale);
+			break;
+		case IR_FLAGS:
+		case IR_JCC:
+			printf(" cc%d", insn->cc);
+			break;
+		case IR_JMPR:
+			printf(" %s", insn->cc==IR_BR_CALL ? "call" : insn->cc==IR_BR_RET ? "ret" : "jmp");
+			break;
+		}
+		dump_ir_arg(&(insn->a));
+		dump_ir_arg(&(insn->b));
+		dump_ir_arg(&(insn->c));
+		if (insn->op==IR_JCC) {
+			printf(" 0x%X 0x%X", insn->imm, insn->next);
+		}
+		printf("  (eip 0x%X)\n", insn->eip);
+	}
+}
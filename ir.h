@@ -0,0 +1,96 @@
+#ifndef IR_H
+#define IR_H
+
+#include "cpux86.h"
+
+
+// 中間表現(IR)
+//   デコーダがブロック単位で生成し、最適化してからバックエンド(IRインタプリタ/ネイティブ)に渡す
+//   一時値はSSA: 値を定義した命令の番号がそのまま一時値の番号になる
+
+#define IR_BLOCK_INSNS		64					// 1ブロックのゲスト命令数の上限
+#define IR_MAX_INSNS		(IR_BLOCK_INSNS * 8)	// 1ブロックのIR命令数の上限
+
+
+// 命令
+#define IR_NOP		0	// (最適化で消えた命令)
+#define IR_GETREG	1	// t = regs[reg]
+#define IR_SETREG	2	// regs[reg] = a
+#define IR_CONST	3	// t = imm
+#define IR_ADDR		4	// t = a + (b << scale) + imm
+#define IR_LOAD		5	// t = mem[a + (b << scale) + imm]
+#define IR_STORE	6	// mem[a + (b << scale) + imm] = c
+#define IR_ADD		7	// t = a + b
+#define IR_SUB		8	// t = a - b
+#define IR_AND		9	// t = a & b
+#define IR_OR		10	// t = a | b
+#define IR_XOR		11	// t = a ^ b
+#define IR_FLAGS	12	// cc_op = cc, cc_src = a, cc_dst = b (遅延評価フラグ)
+#define IR_JCC		13	// 条件ccが成立すればimm、しなければnextへ(ブロックの終端)
+#define IR_JMP		14	// immへ(ブロックの終端)
+#define IR_JMPR		15	// aへ(ブロックの終端)
+
+// IR_JMP IR_JMPRの種類(cc)
+#define IR_BR_JMP	0
+#define IR_BR_CALL	1	// nextが戻り先
+#define IR_BR_RET	2
+
+#define ir_is_alu(op)	(IR_ADD<=(op) && (op)<=IR_XOR)
+#define ir_is_exit(op)	(IR_JCC<=(op))
+
+// オペランド
+#define IR_ARG_NONE		0
+#define IR_ARG_TEMP		1	// val: 一時値(定義した命令の番号)
+#define IR_ARG_CONST	2	// val: 即値
+
+typedef struct {
+	uint8 kind;
+	uint32 val;
+} IrArg;
+
+typedef struct {
+	uint8 op;
+	uint8 size;			// オペランドサイズ(1, 2, 4)
+	uint8 cc;			// IR_FLAGS: CC_OP_* / IR_JCC: 条件 / IR_JMP IR_JMPR: IR_BR_*
+	uint8 scale;
+	uint8 reg;			// IR_GETREG IR_SETREG: ゲストレジスタ
+	IrArg a;
+	IrArg b;
+	IrArg c;
+	uint32 imm;			// IR_CONST: 値 / メモリ: disp / IR_JCC IR_JMP: 分岐先
+	uint32 next;		// IR_JCC: 不成立時の分岐先 / IR_BR_CALL: 戻り先
+	uint32 eip;			// この命令を生成したゲスト命令
+	uint16 remaining;	// ゲスト命令を含めたブロックの残り命令数(途中で抜けるときに使う)
+} IrInsn;
+
+typedef struct {
+	uint32 eip;
+	uint32 end;			// 最後のゲスト命令の次
+	int guest_insns;
+	int count;
+	IrInsn insn[IR_MAX_INSNS];
+} IrBlock;
+
+// 最適化の統計
+typedef struct {
+	uint64 blocks;
+	uint64 insns;			// デコーダが生成した命令数
+	uint64 insns_opt;		// 最適化後の命令数
+	uint64 dead_flags;		// cc_*の書き出しを省いたIR_FLAGS
+	uint64 const_args;		// 即値にしたオペランド
+	uint64 const_folded;	// 畳み込んだ演算
+	uint64 reg_loads;		// 省いたIR_GETREG
+	uint64 reg_stores;		// 省いたIR_SETREG
+	uint64 addr_folded;		// メモリオペランドに畳み込んだアドレス計算
+	uint64 dead_code;		// 使われない値を消した命令
+} IrStats;
+
+
+// ir
+extern void dump_ir(IrBlock *block);
+extern int ir_decode_block(CPUx86 *cpu, uint32 eip, IrBlock *block);
+extern int ir_exec(CPUx86 *cpu, IrInsn *insn, int count, int guest_insns, uint8 *page_code);
+extern void ir_optimize(IrBlock *block, IrStats *stats);
+
+
+#endif
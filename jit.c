@@ -0,0 +1,1858 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "cpux86.h"
+#include "jit.h"
+#include "log.h"
+
+#if defined(__linux__)
+
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+
+JitCache *jit_list = NULL;
+struct sigaction jit_old_action;
+
+// jmp/jcc rel32の飛び先を書き換える
+void jit_patch(uint8 *jump, uint8 *dest)
+{
+	int32 rel;
+	rel = (int32)(dest - (jump + 4));
+	memcpy(jump, &rel, 4);
+}
+
+
+#ifdef JIT_NATIVE
+
+// ホストレジスタ(x86-64)
+//   r15: CPUx86*  r14: ゲストメモリ  rbx: page_code
+//   rcx: アドレス計算、自己書き換えの検査、フラグの再計算
+//   rax rdx rbp: IRの一時値
+#define H_RAX	0
+#define H_RCX	1
+#define H_RDX	2
+#define H_RBX	3
+#define H_RBP	5
+#define H_CPU	15
+#define H_MEM	14
+
+// ゲストレジスタ(eax ecx edx ebx esp ebp esi edi)の割り当て
+int jit_host_reg[8] = {8, 9, 10, 11, 12, 13, 6, 7};
+#define jit_host(r)	(jit_host_reg[r])
+
+// 一時値に使うレジスタ
+int jit_scratch_reg[3] = {H_RAX, H_RDX, H_RBP};
+#define JIT_SCRATCH	3
+#define jit_is_scratch(reg)	((reg)==H_RAX || (reg)==H_RDX || (reg)==H_RBP)
+
+#define JIT_NONE	0xFF
+
+#define jit_cpu_offset(field)	((uint32)offsetof(CPUx86, field))
+
+// コード生成
+typedef struct {
+	uint32 eip;
+	uint32 remaining;	// SMCで抜けるときに返す命令数
+	uint8 *jump;		// rel32
+	JitExit *exit;
+} JitStub;
+
+typedef struct {
+	JitCache *jit;
+	IrBlock *ir;
+	uint8 *p;
+	JitStub stubs[IR_MAX_INSNS + 4];
+	int stub_count;
+	int flags_host;		// 1: ホストのEFLAGSがゲストのフラグと一致している
+	int flags_temp;		// ホストのEFLAGSを最後に変えた演算(-1: 演算以外)
+	int flags_op;		// 最後にフラグを設定した演算
+	uint8 loc[IR_MAX_INSNS];		// 一時値のあるホストレジスタ(JIT_NONE: なし)
+	int16 last[IR_MAX_INSNS];		// 一時値を最後に使う命令
+	uint8 has_flags[IR_MAX_INSNS];	// 1: IR_FLAGSが演算結果を使う
+} JitEmit;
+
+
+// emit
+
+void jit_emit8(JitEmit *e, uint8 val)
+{
+	*(e->p++) = val;
+}
+
+void jit_emit32(JitEmit *e, uint32 val)
+{
+	memcpy(e->p, &val, 4);
+	e->p += 4;
+}
+
+void jit_emit64(JitEmit *e, uint64 val)
+{
+	memcpy(e->p, &val, 8);
+	e->p += 8;
+}
+
+void jit_emit_rex(JitEmit *e, int w, int reg, int index, int base)
+{
+	uint8 rex;
+	rex = 0x40 | w << 3 | (reg & 8) >> 1 | (index & 8) >> 2 | (base & 8) >> 3;
+	if (rex!=0x40) {
+		jit_emit8(e, rex);
+	}
+}
+
+// op r/m32 r32 (レジスタ同士)
+void jit_emit_rr(JitEmit *e, uint8 op, int reg, int rm)
+{
+	jit_emit_rex(e, 0, reg, 0, rm);
+	jit_emit8(e, op);
+	jit_emit8(e, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// 81 /n id : op r/m32 imm32
+void jit_emit_ri(JitEmit *e, int n, int rm, uint32 imm)
+{
+	jit_emit_rex(e, 0, 0, 0, rm);
+	jit_emit8(e, 0x81);
+	jit_emit8(e, 0xC0 | n << 3 | (rm & 7));
+	jit_emit32(e, imm);
+}
+
+// mov r32 imm32
+void jit_emit_mov_ri(JitEmit *e, int reg, uint32 imm)
+{
+	jit_emit_rex(e, 0, 0, 0, reg);
+	jit_emit8(e, 0xB8 | (reg & 7));
+	jit_emit32(e, imm);
+}
+
+// op reg [base + disp32]
+void jit_emit_mem(JitEmit *e, int w, uint8 op, int reg, int base, uint32 disp)
+{
+	jit_emit_rex(e, w, reg, 0, base);
+	jit_emit8(e, op);
+	jit_emit8(e, 0x80 | (reg & 7) << 3 | (base & 7));
+	if ((base & 7)==4) {
+		jit_emit8(e, 0x24);
+	}
+	jit_emit32(e, disp);
+}
+
+// op reg [r14 + addr] (ゲストメモリ)
+void jit_emit_guest(JitEmit *e, uint8 op, int reg, int addr)
+{
+	jit_emit_rex(e, 0, reg, addr, H_MEM);
+	jit_emit8(e, op);
+	jit_emit8(e, 0x04 | (reg & 7) << 3);
+	jit_emit8(e, 0x00 << 6 | (addr & 7) << 3 | (H_MEM & 7));
+}
+
+// lea reg [base + index*scale + disp32] (JIT_NONE: なし)
+void jit_emit_lea(JitEmit *e, int reg, int base, int index, int scale, uint32 disp)
+{
+	if (base==JIT_NONE && index==JIT_NONE) {
+		jit_emit_mov_ri(e, reg, disp);
+		return;
+	}
+	if (index==JIT_NONE) {
+		jit_emit_mem(e, 0, 0x8D, reg, base, disp);
+		return;
+	}
+	if (base==JIT_NONE) {
+		jit_emit_rex(e, 0, reg, index, 0);
+		jit_emit8(e, 0x8D);
+		jit_emit8(e, 0x04 | (reg & 7) << 3);
+		jit_emit8(e, scale << 6 | (index & 7) << 3 | 5);
+	} else {
+		jit_emit_rex(e, 0, reg, index, base);
+		jit_emit8(e, 0x8D);
+		jit_emit8(e, 0x84 | (reg & 7) << 3);
+		jit_emit8(e, scale << 6 | (index & 7) << 3 | (base & 7));
+	}
+	jit_emit32(e, disp);
+}
+
+// 出口スタブへのjmp/jcc(rel32は後で埋める)
+void jit_emit_stub_jump(JitEmit *e, uint8 cc, uint32 eip, uint32 remaining, JitExit *exit)
+{
+	JitStub *stub;
+	if (cc==JIT_NONE) {
+		jit_emit8(e, 0xE9);
+	} else {
+		jit_emit8(e, 0x0F);
+		jit_emit8(e, 0x80 | cc);
+	}
+	stub = &(e->stubs[e->stub_count++]);
+	stub->eip = eip;
+	stub->remaining = remaining;
+	stub->jump = e->p;
+	stub->exit = exit;
+	jit_emit32(e, 0);
+}
+
+// 出口スタブ: eipを設定してleaveへ
+void jit_emit_stub(JitEmit *e, JitStub *stub)
+{
+	jit_patch(stub->jump, e->p);
+	if (stub->exit) {
+		stub->exit->stub = e->p;
+	}
+
+	// mov dword [r15 + eip], imm32
+	jit_emit_mem(e, 0, 0xC7, 0, H_CPU, jit_cpu_offset(eip));
+	jit_emit32(e, stub->eip);
+
+	// add dword [r15 + jit_budget], imm32 (実行しなかった分を戻す)
+	if (stub->remaining) {
+		jit_emit_mem(e, 0, 0x81, 0, H_CPU, jit_cpu_offset(jit_budget));
+		jit_emit32(e, stub->remaining);
+	}
+
+	if (stub->exit) {
+		// mov rax, exit
+		jit_emit8(e, 0x48);
+		jit_emit8(e, 0xB8);
+		jit_emit64(e, (uint64)stub->exit);
+	} else {
+		// xor eax, eax
+		jit_emit_rr(e, 0x31, H_RAX, H_RAX);
+	}
+
+	// jmp leave
+	jit_emit8(e, 0xE9);
+	jit_emit32(e, 0);
+	jit_patch(e->p - 4, e->jit->leave);
+}
+
+
+
+// native: IRからホストコードを生成する
+
+// 命令iの時点でregを使っている一時値があるか
+int jit_reg_busy(JitEmit *e, int i, int reg)
+{
+	int t;
+	for (t=0; t<i; t++) {
+		if (e->loc[t]==reg && i<=e->last[t]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// 空いている一時値用のレジスタ(JIT_NONE: 空きなし)
+int jit_alloc(JitEmit *e, int i, int except)
+{
+	int n;
+	for (n=0; n<JIT_SCRATCH; n++) {
+		if (jit_scratch_reg[n]!=except && !jit_reg_busy(e, i, jit_scratch_reg[n])) {
+			return jit_scratch_reg[n];
+		}
+	}
+	return JIT_NONE;
+}
+
+// regを書き換える前に、まだ使う一時値(keepを除く)を空いているレジスタへ移す
+int jit_evacuate(JitEmit *e, int i, int reg, int keep)
+{
+	int t;
+	int dst;
+	for (t=0; t<i; t++) {
+		if (t!=keep && e->loc[t]==reg && i<=e->last[t]) {
+			dst = jit_alloc(e, i, reg);
+			if (dst==JIT_NONE) {
+				return 0;
+			}
+			jit_emit_rr(e, 0x89, reg, dst);
+			e->loc[t] = dst;
+		}
+	}
+	return 1;
+}
+
+// 命令iの結果を置くレジスタ
+// 直後(IR_FLAGSを除く)のIR_SETREGが結果を書くならゲストレジスタに直接置く
+// それ以外はpreferか空いているレジスタ
+int jit_result_reg(JitEmit *e, int i, int keep, int prefer)
+{
+	IrInsn *insn;
+	int reg;
+	int j;
+
+	for (j=i+1; j<e->ir->count && e->ir->insn[j].op==IR_FLAGS; j++) {
+	}
+	insn = &(e->ir->insn[j]);
+	if (j<e->ir->count && insn->op==IR_SETREG && insn->a.kind==IR_ARG_TEMP && insn->a.val==i) {
+		reg = jit_host(insn->reg);
+		if (!jit_evacuate(e, i, reg, keep)) {
+			return JIT_NONE;
+		}
+		return reg;
+	}
+	if (prefer!=JIT_NONE) {
+		return prefer;
+	}
+	return jit_alloc(e, i, JIT_NONE);
+}
+
+// メモリオペランドのアドレス(32bit)を求めてレジスタを返す
+int jit_emit_address(JitEmit *e, IrInsn *insn)
+{
+	int base;
+	int index;
+	uint32 disp;
+
+	base = JIT_NONE;
+	index = JIT_NONE;
+	disp = insn->imm;
+	if (insn->a.kind==IR_ARG_TEMP) {
+		base = e->loc[insn->a.val];
+	} else if (insn->a.kind==IR_ARG_CONST) {
+		disp += insn->a.val;
+	}
+	if (insn->b.kind==IR_ARG_TEMP) {
+		index = e->loc[insn->b.val];
+	} else if (insn->b.kind==IR_ARG_CONST) {
+		disp += insn->b.val << insn->scale;
+	}
+	if (index==JIT_NONE && disp==0 && base!=JIT_NONE) {
+		return base;
+	}
+	jit_emit_lea(e, H_RCX, base, index, insn->scale, disp);
+	return H_RCX;
+}
+
+// addrが翻訳済みのページなら書き込む前に抜ける(ecxを壊す)
+void jit_emit_smc_check(JitEmit *e, IrInsn *insn, int addr)
+{
+	// mov ecx, addr
+	if (addr!=H_RCX) {
+		jit_emit_rr(e, 0x89, addr, H_RCX);
+	}
+	// shr ecx, 12
+	jit_emit8(e, 0xC1);
+	jit_emit8(e, 0xE9);
+	jit_emit8(e, JIT_PAGE_SHIFT);
+	// cmp byte [rbx + rcx], 0
+	jit_emit8(e, 0x80);
+	jit_emit8(e, 0x3C);
+	jit_emit8(e, 0x0B);
+	jit_emit8(e, 0x00);
+	// jne stub
+	jit_emit_stub_jump(e, 0x05, insn->eip, insn->remaining, NULL);
+	e->flags_host = 0;
+	e->flags_temp = -1;
+}
+
+// addrからsizeバイトがRAMの外なら命令の前で抜ける(インタプリタが#GPにする)
+void jit_emit_range_check(JitEmit *e, IrInsn *insn, int addr)
+{
+	if (0xFFFFFFFFULL < e->jit->mem_size) {
+		return;
+	}
+	// cmp addr, mem_size - size
+	jit_emit_ri(e, 7, addr, e->jit->mem_size - insn->size);
+	// ja stub
+	jit_emit_stub_jump(e, 0x07, insn->eip, insn->remaining, NULL);
+	e->flags_host = 0;
+	e->flags_temp = -1;
+}
+
+// reg = arg
+void jit_emit_arg(JitEmit *e, int reg, IrArg *arg)
+{
+	if (arg->kind==IR_ARG_CONST) {
+		jit_emit_mov_ri(e, reg, arg->val);
+	} else if (e->loc[arg->val]!=reg) {
+		jit_emit_rr(e, 0x89, e->loc[arg->val], reg);
+	}
+}
+
+// mov dword [r15 + offset], arg
+void jit_emit_store_cpu(JitEmit *e, uint32 offset, IrArg *arg)
+{
+	if (arg->kind==IR_ARG_CONST) {
+		jit_emit_mem(e, 0, 0xC7, 0, H_CPU, offset);
+		jit_emit32(e, arg->val);
+	} else {
+		jit_emit_mem(e, 0, 0x89, e->loc[arg->val], H_CPU, offset);
+	}
+}
+
+// ALU演算
+int jit_emit_alu(JitEmit *e, int i)
+{
+	IrInsn *insn;
+	int keep;
+	int prefer;
+	int reg;
+	int n;
+
+	insn = &(e->ir->insn[i]);
+	keep = -1;
+	if (insn->a.kind==IR_ARG_TEMP && e->last[insn->a.val]==i) {
+		keep = insn->a.val;
+	}
+
+	// フラグを使わない加減算はleaにする(ホストのEFLAGSを壊さない)
+	if (!e->has_flags[i] && (insn->op==IR_ADD || insn->op==IR_SUB) && insn->a.kind==IR_ARG_TEMP && insn->b.kind==IR_ARG_CONST) {
+		reg = jit_result_reg(e, i, keep, 0<=keep && jit_is_scratch(e->loc[keep]) ? e->loc[keep] : JIT_NONE);
+		if (reg==JIT_NONE) {
+			return 0;
+		}
+		jit_emit_mem(e, 0, 0x8D, reg, e->loc[insn->a.val], insn->op==IR_ADD ? insn->b.val : -insn->b.val);
+		e->loc[i] = reg;
+		return 1;
+	}
+
+	// 使い終わるaのレジスタに結果を置く(bが同じレジスタにあるときを除く)
+	prefer = JIT_NONE;
+	if (0<=keep && jit_is_scratch(e->loc[keep]) && !(insn->b.kind==IR_ARG_TEMP && insn->b.val!=keep && e->loc[insn->b.val]==e->loc[keep])) {
+		prefer = e->loc[keep];
+	}
+	reg = jit_result_reg(e, i, keep, prefer);
+	if (reg==JIT_NONE) {
+		return 0;
+	}
+	jit_emit_arg(e, reg, &(insn->a));
+
+	switch (insn->op) {
+	case IR_ADD:
+		n = 0;
+		break;
+	case IR_OR:
+		n = 1;
+		break;
+	case IR_AND:
+		n = 4;
+		break;
+	case IR_SUB:
+		n = 5;
+		break;
+	case IR_XOR:
+	default:
+		n = 6;
+		break;
+	}
+	if (insn->b.kind==IR_ARG_CONST) {
+		jit_emit_ri(e, n, reg, insn->b.val);
+	} else {
+		jit_emit_rr(e, n << 3 | 0x01, e->loc[insn->b.val], reg);
+	}
+	e->loc[i] = reg;
+	e->flags_host = 0;
+	e->flags_temp = i;
+	return 1;
+}
+
+// cc_*からホストのEFLAGSを作り直す
+void jit_emit_flags(JitEmit *e)
+{
+	if (e->flags_host) {
+		return;
+	}
+	jit_emit_mem(e, 0, 0x8B, H_RCX, H_CPU, jit_cpu_offset(cc_dst));
+	switch (e->flags_op) {
+	case CC_OP_ADD:
+		// (dst - src) + src
+		jit_emit_mem(e, 0, 0x2B, H_RCX, H_CPU, jit_cpu_offset(cc_src));
+		jit_emit_mem(e, 0, 0x03, H_RCX, H_CPU, jit_cpu_offset(cc_src));
+		break;
+	case CC_OP_SUB:
+		// cmp (dst + src), src
+		jit_emit_mem(e, 0, 0x03, H_RCX, H_CPU, jit_cpu_offset(cc_src));
+		jit_emit_mem(e, 0, 0x3B, H_RCX, H_CPU, jit_cpu_offset(cc_src));
+		break;
+	default:
+		// test dst, dst
+		jit_emit_rr(e, 0x85, H_RCX, H_RCX);
+		break;
+	}
+	e->flags_host = 1;
+}
+
+JitExit* jit_new_exit(JitBlock *block, uint32 target)
+{
+	JitExit *exit;
+	exit = &(block->exits[block->exit_count++]);
+	memset(exit, 0, sizeof(JitExit));
+	exit->target = target;
+	exit->from = block;
+	return exit;
+}
+
+// 分岐先が確定している出口
+void jit_emit_exit(JitEmit *e, JitBlock *block, uint8 cc, uint32 target)
+{
+	JitExit *exit;
+	exit = jit_new_exit(block, target);
+	jit_emit_stub_jump(e, cc, target, 0, exit);
+	exit->jump = e->p - 4;
+}
+
+// jcc rel8 (飛び先は後でjit_emit_label)
+uint8* jit_emit_jcc8(JitEmit *e, uint8 cc)
+{
+	jit_emit8(e, 0x70 | cc);
+	jit_emit8(e, 0);
+	return e->p - 1;
+}
+
+void jit_emit_label(JitEmit *e, uint8 *rel)
+{
+	*rel = (uint8)(e->p - (rel + 1));
+}
+
+// rax = jit, ecx = ras_top
+void jit_emit_ras_top(JitEmit *e)
+{
+	jit_emit8(e, 0x48);
+	jit_emit8(e, 0xB8);
+	jit_emit64(e, (uint64)e->jit);
+	jit_emit_mem(e, 0, 0x8B, H_RCX, H_RAX, (uint32)offsetof(JitCache, ras_top));
+}
+
+// callの戻り先をリターンアドレススタックに積む(rax rcx rdxを壊す)
+void jit_emit_ras_push(JitEmit *e, JitBlock *block, uint32 target)
+{
+	JitExit *exit;
+	exit = jit_new_exit(block, target);
+	jit_emit_ras_top(e);
+	// add ecx, 1 / and ecx, JIT_RAS_SIZE-1 / mov [rax + ras_top], ecx
+	jit_emit8(e, 0x83);
+	jit_emit8(e, 0xC1);
+	jit_emit8(e, 0x01);
+	jit_emit8(e, 0x83);
+	jit_emit8(e, 0xE1);
+	jit_emit8(e, JIT_RAS_SIZE - 1);
+	jit_emit_mem(e, 0, 0x89, H_RCX, H_RAX, (uint32)offsetof(JitCache, ras_top));
+	// mov rdx, exit / mov [rax + rcx*8 + ras], rdx
+	jit_emit8(e, 0x48);
+	jit_emit8(e, 0xBA);
+	jit_emit64(e, (uint64)exit);
+	jit_emit8(e, 0x48);
+	jit_emit8(e, 0x89);
+	jit_emit8(e, 0x94);
+	jit_emit8(e, 0xC8);
+	jit_emit32(e, (uint32)offsetof(JitCache, ras));
+	e->flags_host = 0;
+	e->flags_temp = -1;
+}
+
+// retの予測: スタックから出口を取り出し、戻り先が一致すれば連結先へ直接飛ぶ
+// 連結先がなければ出口を返して連結させる。外れたらそのまま続ける
+void jit_emit_ras_pop(JitEmit *e)
+{
+	uint8 *empty;
+	uint8 *miss;
+	uint8 *unlinked;
+
+	jit_emit_ras_top(e);
+	// mov rdx, [rax + rcx*8 + ras]
+	jit_emit8(e, 0x48);
+	jit_emit8(e, 0x8B);
+	jit_emit8(e, 0x94);
+	jit_emit8(e, 0xC8);
+	jit_emit32(e, (uint32)offsetof(JitCache, ras));
+	// sub ecx, 1 / and ecx, JIT_RAS_SIZE-1 / mov [rax + ras_top], ecx
+	jit_emit8(e, 0x83);
+	jit_emit8(e, 0xE9);
+	jit_emit8(e, 0x01);
+	jit_emit8(e, 0x83);
+	jit_emit8(e, 0xE1);
+	jit_emit8(e, JIT_RAS_SIZE - 1);
+	jit_emit_mem(e, 0, 0x89, H_RCX, H_RAX, (uint32)offsetof(JitCache, ras_top));
+	// test rdx, rdx / jz miss
+	jit_emit8(e, 0x48);
+	jit_emit_rr(e, 0x85, H_RDX, H_RDX);
+	empty = jit_emit_jcc8(e, 0x04);
+	// mov ecx, [r15 + eip] / cmp ecx, [rdx + target] / jne miss
+	jit_emit_mem(e, 0, 0x8B, H_RCX, H_CPU, jit_cpu_offset(eip));
+	jit_emit_mem(e, 0, 0x3B, H_RCX, H_RDX, (uint32)offsetof(JitExit, target));
+	miss = jit_emit_jcc8(e, 0x05);
+	// mov rcx, [rdx + to] / test rcx, rcx / jz unlinked / jmp [rcx + code]
+	jit_emit_mem(e, 1, 0x8B, H_RCX, H_RDX, (uint32)offsetof(JitExit, to));
+	jit_emit8(e, 0x48);
+	jit_emit_rr(e, 0x85, H_RCX, H_RCX);
+	unlinked = jit_emit_jcc8(e, 0x04);
+	jit_emit_mem(e, 0, 0xFF, 4, H_RCX, (uint32)offsetof(JitBlock, code));
+	// unlinked: mov rax, rdx / jmp leave
+	jit_emit_label(e, unlinked);
+	jit_emit8(e, 0x48);
+	jit_emit_rr(e, 0x89, H_RDX, H_RAX);
+	jit_emit8(e, 0xE9);
+	jit_emit32(e, 0);
+	jit_patch(e->p - 4, e->jit->leave);
+	jit_emit_label(e, empty);
+	jit_emit_label(e, miss);
+	e->flags_host = 0;
+	e->flags_temp = -1;
+}
+
+// 間接分岐の出口: 最後に飛んだ先と一致すれば連結先へ(eipは設定済み)
+//   mov ecx, [r15 + eip] / cmp ecx, imm32 / jne stub / jmp rel32
+//   stub: mov rax, exit / jmp leave
+void jit_emit_indirect_exit(JitEmit *e, JitBlock *block)
+{
+	JitExit *exit;
+	uint8 *miss;
+
+	exit = jit_new_exit(block, 0);
+	jit_emit_mem(e, 0, 0x8B, H_RCX, H_CPU, jit_cpu_offset(eip));
+	jit_emit_ri(e, 7, H_RCX, 0);
+	exit->check = e->p - 4;
+	miss = jit_emit_jcc8(e, 0x05);
+	jit_emit8(e, 0xE9);
+	jit_emit32(e, 0);
+	exit->jump = e->p - 4;
+
+	jit_emit_label(e, miss);
+	exit->stub = e->p;
+	jit_patch(exit->jump, exit->stub);
+	jit_emit8(e, 0x48);
+	jit_emit8(e, 0xB8);
+	jit_emit64(e, (uint64)exit);
+	jit_emit8(e, 0xE9);
+	jit_emit32(e, 0);
+	jit_patch(e->p - 4, e->jit->leave);
+	e->flags_host = 0;
+	e->flags_temp = -1;
+}
+
+// 1命令。生成できなければ0
+int jit_emit_insn(JitEmit *e, JitBlock *block, int i)
+{
+	IrInsn *insn;
+	int keep;
+	int reg;
+	int addr;
+
+	insn = &(e->ir->insn[i]);
+	if (insn->size!=4) {
+		return 0;
+	}
+
+	switch (insn->op) {
+	case IR_GETREG:
+		e->loc[i] = jit_host(insn->reg);
+		break;
+
+	case IR_SETREG:
+		reg = jit_host(insn->reg);
+		if (insn->a.kind==IR_ARG_TEMP && e->loc[insn->a.val]==reg) {
+			break;
+		}
+		if (!jit_evacuate(e, i, reg, -1)) {
+			return 0;
+		}
+		jit_emit_arg(e, reg, &(insn->a));
+		if (insn->a.kind==IR_ARG_TEMP) {
+			// 以降はゲストレジスタから読む(一時値のレジスタを空ける)
+			e->loc[insn->a.val] = reg;
+		}
+		break;
+
+	case IR_CONST:
+		reg = jit_result_reg(e, i, -1, JIT_NONE);
+		if (reg==JIT_NONE) {
+			return 0;
+		}
+		jit_emit_mov_ri(e, reg, insn->imm);
+		e->loc[i] = reg;
+		break;
+
+	case IR_ADDR:
+	case IR_LOAD:
+		// アドレスを読んでから書くので使い終わるアドレスのレジスタはそのままでよい
+		keep = -1;
+		if (insn->a.kind==IR_ARG_TEMP && e->last[insn->a.val]==i) {
+			keep = insn->a.val;
+		}
+		reg = jit_result_reg(e, i, keep, JIT_NONE);
+		if (reg==JIT_NONE) {
+			return 0;
+		}
+		if (insn->op==IR_ADDR) {
+			jit_emit_lea(e, reg, insn->a.kind==IR_ARG_TEMP ? e->loc[insn->a.val] : JIT_NONE,
+					insn->b.kind==IR_ARG_TEMP ? e->loc[insn->b.val] : JIT_NONE, insn->scale,
+					insn->imm + (insn->a.kind==IR_ARG_CONST ? insn->a.val : 0));
+		} else {
+			addr = jit_emit_address(e, insn);
+			jit_emit_range_check(e, insn, addr);
+			jit_emit_guest(e, 0x8B, reg, addr);
+		}
+		e->loc[i] = reg;
+		break;
+
+	case IR_STORE:
+		addr = jit_emit_address(e, insn);
+		jit_emit_range_check(e, insn, addr);
+		jit_emit_smc_check(e, insn, addr);
+		if (addr==H_RCX) {
+			addr = jit_emit_address(e, insn);
+		}
+		if (insn->c.kind==IR_ARG_CONST) {
+			jit_emit_guest(e, 0xC7, 0, addr);
+			jit_emit32(e, insn->c.val);
+		} else {
+			jit_emit_guest(e, 0x89, e->loc[insn->c.val], addr);
+		}
+		break;
+
+	case IR_ADD:
+	case IR_SUB:
+	case IR_AND:
+	case IR_OR:
+	case IR_XOR:
+		return jit_emit_alu(e, i);
+
+	case IR_FLAGS:
+		jit_emit_mem(e, 0, 0xC6, 0, H_CPU, jit_cpu_offset(cc_op));
+		jit_emit8(e, insn->cc);
+		jit_emit_mem(e, 0, 0xC6, 0, H_CPU, jit_cpu_offset(cc_size));
+		jit_emit8(e, insn->size);
+		jit_emit_store_cpu(e, jit_cpu_offset(cc_src), &(insn->a));
+		jit_emit_store_cpu(e, jit_cpu_offset(cc_dst), &(insn->b));
+		e->flags_op = insn->cc;
+		e->flags_host = insn->b.kind==IR_ARG_TEMP && insn->b.val==e->flags_temp;
+		break;
+
+	case IR_JCC:
+		jit_emit_flags(e);
+		jit_emit_exit(e, block, insn->cc, insn->imm);
+		jit_emit_exit(e, block, JIT_NONE, insn->next);
+		break;
+
+	case IR_JMP:
+		if (insn->cc==IR_BR_CALL) {
+			jit_emit_ras_push(e, block, insn->next);
+		}
+		jit_emit_exit(e, block, JIT_NONE, insn->imm);
+		break;
+
+	case IR_JMPR:
+		// 分岐先は実行時に決まる: retはリターンアドレススタック、それ以外は出口ごとのキャッシュで予測する
+		jit_emit_store_cpu(e, jit_cpu_offset(eip), &(insn->a));
+		if (insn->cc==IR_BR_RET) {
+			jit_emit_ras_pop(e);
+		} else if (insn->cc==IR_BR_CALL) {
+			jit_emit_ras_push(e, block, insn->next);
+		}
+		jit_emit_indirect_exit(e, block);
+		break;
+
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+// IRブロックをホストコードにする。一時値のレジスタが足りなければ0
+int jit_native(JitCache *jit, JitBlock *block, IrBlock *ir)
+{
+	JitEmit *e;
+	IrInsn *insn;
+	int i;
+
+	e = (JitEmit*)malloc(sizeof(JitEmit));
+	e->jit = jit;
+	e->ir = ir;
+	e->p = block->code;
+	e->stub_count = 0;
+	e->flags_host = 0;
+	e->flags_temp = -1;
+	e->flags_op = CC_OP_EFLAGS;
+	memset(e->loc, JIT_NONE, sizeof(e->loc));
+	memset(e->has_flags, 0, sizeof(e->has_flags));
+	for (i=0; i<ir->count; i++) {
+		insn = &(ir->insn[i]);
+		e->last[i] = -1;
+		if (insn->a.kind==IR_ARG_TEMP) {
+			e->last[insn->a.val] = i;
+		}
+		if (insn->b.kind==IR_ARG_TEMP) {
+			e->last[insn->b.val] = i;
+		}
+		if (insn->c.kind==IR_ARG_TEMP) {
+			e->last[insn->c.val] = i;
+		}
+		if (insn->op==IR_FLAGS && insn->b.kind==IR_ARG_TEMP) {
+			e->has_flags[insn->b.val] = 1;
+		}
+	}
+
+	// ブロック全体を実行できるだけ残っていなければ抜ける
+	// cmp dword [r15 + jit_budget], count
+	jit_emit_mem(e, 0, 0x83, 7, H_CPU, jit_cpu_offset(jit_budget));
+	jit_emit8(e, block->insns);
+	// jl stub
+	jit_emit_stub_jump(e, 0x0C, block->eip, 0, NULL);
+	// sub dword [r15 + jit_budget], count
+	jit_emit_mem(e, 0, 0x81, 5, H_CPU, jit_cpu_offset(jit_budget));
+	jit_emit32(e, block->insns);
+
+	for (i=0; i<ir->count; i++) {
+		if (!jit_emit_insn(e, block, i)) {
+			block->exit_count = 0;
+			free(e);
+			return 0;
+		}
+	}
+
+	for (i=0; i<e->stub_count; i++) {
+		jit_emit_stub(e, &(e->stubs[i]));
+	}
+	block->code_size = e->p - block->code;
+	free(e);
+	return 1;
+}
+
+// enter/leave
+void jit_emit_trampoline(JitCache *jit)
+{
+	JitEmit e;
+	int i;
+
+	e.jit = jit;
+	e.p = jit->code;
+
+	// enter(cpu, code)
+	jit->enter = (JitEnter)e.p;
+	jit_emit8(&e, 0x53);	// push rbx
+	jit_emit8(&e, 0x55);	// push rbp
+	jit_emit8(&e, 0x41);	// push r12
+	jit_emit8(&e, 0x54);
+	jit_emit8(&e, 0x41);	// push r13
+	jit_emit8(&e, 0x55);
+	jit_emit8(&e, 0x41);	// push r14
+	jit_emit8(&e, 0x56);
+	jit_emit8(&e, 0x41);	// push r15
+	jit_emit8(&e, 0x57);
+	jit_emit8(&e, 0x48);	// sub rsp, 8
+	jit_emit8(&e, 0x83);
+	jit_emit8(&e, 0xEC);
+	jit_emit8(&e, 0x08);
+	jit_emit8(&e, 0x49);	// mov r15, rdi
+	jit_emit8(&e, 0x89);
+	jit_emit8(&e, 0xFF);
+	jit_emit8(&e, 0x48);	// mov rax, rsi
+	jit_emit8(&e, 0x89);
+	jit_emit8(&e, 0xF0);
+	jit_emit_mem(&e, 1, 0x8B, H_MEM, H_CPU, jit_cpu_offset(mem));	// mov r14, [r15 + mem]
+	jit_emit8(&e, 0x48);	// mov rbx, page_code
+	jit_emit8(&e, 0xBB);
+	jit_emit64(&e, (uint64)jit->page_code);
+	for (i=0; i<8; i++) {
+		jit_emit_mem(&e, 0, 0x8B, jit_host(i), H_CPU, jit_cpu_offset(regs) + i * 4);
+	}
+	jit_emit8(&e, 0xFF);	// jmp rax
+	jit_emit8(&e, 0xE0);
+
+	// leave (raxは出口)
+	e.p = jit->code + ((e.p - jit->code + 15) & ~15);
+	jit->leave = e.p;
+	for (i=0; i<8; i++) {
+		jit_emit_mem(&e, 0, 0x89, jit_host(i), H_CPU, jit_cpu_offset(regs) + i * 4);
+	}
+	jit_emit8(&e, 0x48);	// add rsp, 8
+	jit_emit8(&e, 0x83);
+	jit_emit8(&e, 0xC4);
+	jit_emit8(&e, 0x08);
+	jit_emit8(&e, 0x41);	// pop r15
+	jit_emit8(&e, 0x5F);
+	jit_emit8(&e, 0x41);	// pop r14
+	jit_emit8(&e, 0x5E);
+	jit_emit8(&e, 0x41);	// pop r13
+	jit_emit8(&e, 0x5D);
+	jit_emit8(&e, 0x41);	// pop r12
+	jit_emit8(&e, 0x5C);
+	jit_emit8(&e, 0x5D);	// pop rbp
+	jit_emit8(&e, 0x5B);	// pop rbx
+	jit_emit8(&e, 0xC3);	// ret
+
+	jit->code_start = ((e.p - jit->code) + 15) & ~15;
+	jit->code_used = jit->code_start;
+}
+
+
+#endif
+
+
+// cache
+
+uint32 jit_hash(uint32 eip)
+{
+	return (eip ^ eip >> 12) & (JIT_HASH_SIZE - 1);
+}
+
+JitBlock* jit_lookup(JitCache *jit, uint32 eip)
+{
+	JitBlock *block;
+	for (block=jit->hash[jit_hash(eip)]; block; block=block->hash_next) {
+		if (block->eip==eip) {
+			return block;
+		}
+	}
+	return NULL;
+}
+
+// 出口を連結する(callの戻り先はjmpがないのでtoだけ設定する)
+void jit_link(JitCache *jit, JitExit *exit, JitBlock *to)
+{
+	if (exit->jump) {
+		jit_patch(exit->jump, to->code);
+	}
+	exit->to = to;
+	exit->next = to->in;
+	to->in = exit;
+	if (exit->check) {
+		jit->stat_indirect_linked++;
+	} else if (exit->jump) {
+		jit->stat_chained++;
+	} else {
+		jit->stat_ras_linked++;
+	}
+}
+
+void jit_unlink(JitExit *exit)
+{
+	JitExit **p;
+	for (p=&(exit->to->in); *p; p=&((*p)->next)) {
+		if (*p==exit) {
+			*p = exit->next;
+			break;
+		}
+	}
+	if (exit->jump) {
+		jit_patch(exit->jump, exit->stub);
+	}
+	exit->to = NULL;
+	exit->next = NULL;
+}
+
+// 出口を分岐先eipのブロックへ連結する
+// 間接分岐は最後に飛んだ先だけを覚えているので、違う先へ飛んだら付け替える
+void jit_link_exit(JitCache *jit, JitExit *exit, uint32 eip)
+{
+	JitBlock *target;
+
+	if (exit->to) {
+		if (!exit->check || exit->target==eip) {
+			return;
+		}
+		jit_unlink(exit);
+	}
+	target = jit_lookup(jit, eip);
+	if (!target || !target->code) {
+		return;
+	}
+	if (exit->check) {
+		exit->target = eip;
+		memcpy(exit->check, &eip, 4);
+	}
+	jit_link(jit, exit, target);
+}
+
+
+// shared
+
+// 共有キャッシュ
+//   読む側(jit_shared_find)はロックを取らず、shared_readingにエポックを示してからリストを辿る
+//   登録と回収はjit_shared_lockを取り、回収はリストから外してから古いエポックで読んでいるゲストを待って解放する
+//   jit_listもjit_shared_lockで守る(回収するときに読んでいるゲストを数える)
+static pthread_mutex_t jit_shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static JitShared *jit_shared_hash[JIT_SHARED_HASH];
+static size_t jit_shared_bytes;
+static uint32 jit_shared_epoch = 1;
+
+// デコーダが前提にしているモード
+uint32 jit_mode(CPUx86 *cpu)
+{
+	return cpu->code32 | desc_d(&(cpu->segs[SEG_SS])) << 1;
+}
+
+// ページの内容のハッシュ(0は求めていない印なので使わない)
+uint64 jit_page_hash(JitCache *jit, uint32 page)
+{
+	uint64 *p;
+	uint64 hash;
+	int i;
+
+	p = (uint64*)(jit->mem + ((size_t)page << JIT_PAGE_SHIFT));
+	hash = 0xCBF29CE484222325ULL;
+	for (i=0; i<JIT_PAGE_SIZE / 8; i++) {
+		hash = (hash ^ p[i]) * 0x100000001B3ULL;
+		hash ^= hash >> 29;
+	}
+	return hash ? hash : 1;
+}
+
+// ページの翻訳を共有できるか(デコーダはRAMの最後の16バイトの手前で止まるので、そこを含むページは共有しない)
+int jit_page_shareable(JitCache *jit, uint32 page)
+{
+	return jit->share && ((size_t)(page + 1) << JIT_PAGE_SHIFT) + 16 <= jit->mem_size;
+}
+
+uint32 jit_shared_slot(uint64 page_hash, uint32 eip, uint32 mode)
+{
+	uint64 h;
+	h = (page_hash ^ eip ^ (uint64)mode << 32) * 0x9E3779B97F4A7C15ULL;
+	return (h >> 32) & (JIT_SHARED_HASH - 1);
+}
+
+// ハッシュが偶然一致しても違うコードを使わないようにゲストコードを比べる
+int jit_shared_match(JitCache *jit, JitShared *shared, uint64 page_hash, uint32 eip, uint32 mode)
+{
+	return shared->page_hash==page_hash && shared->eip==eip && shared->mode==mode
+		&& memcmp(shared->guest, jit->mem + eip, shared->end - eip)==0;
+}
+
+// 参照を取る(捨てている途中なら0)
+int jit_shared_get(JitShared *shared)
+{
+	int ref;
+
+	ref = __atomic_load_n(&(shared->ref), __ATOMIC_ACQUIRE);
+	while (0 <= ref) {
+		if (__atomic_compare_exchange_n(&(shared->ref), &ref, ref + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// 参照を返す(0になっても次のゲストのために残し、容量が足りなくなったら回収する)
+void jit_shared_put(JitShared *shared)
+{
+	__atomic_sub_fetch(&(shared->ref), 1, __ATOMIC_RELEASE);
+}
+
+// 同じページ、EIP、モードのIRを探して参照を取る
+JitShared* jit_shared_find(JitCache *jit, uint64 page_hash, uint32 eip, uint32 mode)
+{
+	JitShared *shared;
+
+	__atomic_store_n(&(jit->shared_reading), __atomic_load_n(&jit_shared_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	shared = __atomic_load_n(&(jit_shared_hash[jit_shared_slot(page_hash, eip, mode)]), __ATOMIC_SEQ_CST);
+	while (shared) {
+		if (jit_shared_match(jit, shared, page_hash, eip, mode) && jit_shared_get(shared)) {
+			break;
+		}
+		shared = __atomic_load_n(&(shared->next), __ATOMIC_SEQ_CST);
+	}
+	__atomic_store_n(&(jit->shared_reading), 0, __ATOMIC_RELEASE);
+	return shared;
+}
+
+// どのブロックも使っていないIRを捨てる(jit_shared_lockを取って呼ぶ)
+void jit_shared_reclaim(void)
+{
+	JitShared **p;
+	JitShared *shared;
+	JitShared *dead;
+	JitCache *jit;
+	uint32 epoch;
+	uint32 reading;
+	int ref;
+	int i;
+
+	dead = NULL;
+	for (i=0; i<JIT_SHARED_HASH; i++) {
+		p = &(jit_shared_hash[i]);
+		while ((shared = *p)) {
+			ref = 0;
+			if (__atomic_compare_exchange_n(&(shared->ref), &ref, -1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+				// nextは辿っている途中のゲストのために残す
+				__atomic_store_n(p, shared->next, __ATOMIC_SEQ_CST);
+				jit_shared_bytes -= shared->size;
+				shared->dead = dead;
+				dead = shared;
+			} else {
+				p = &(shared->next);
+			}
+		}
+	}
+	if (!dead) {
+		return;
+	}
+
+	// 外す前のエポックで読んでいるゲストが抜けるのを待つ
+	epoch = jit_shared_epoch + 1;
+	if (epoch==0) {
+		epoch = 1;
+	}
+	__atomic_store_n(&jit_shared_epoch, epoch, __ATOMIC_SEQ_CST);
+	for (jit=jit_list; jit; jit=jit->next) {
+		for (;;) {
+			reading = __atomic_load_n(&(jit->shared_reading), __ATOMIC_SEQ_CST);
+			if (reading==0 || reading==epoch) {
+				break;
+			}
+			sched_yield();
+		}
+	}
+	while (dead) {
+		shared = dead;
+		dead = shared->dead;
+		free(shared);
+	}
+}
+
+// 翻訳したIRを登録して参照を取る(他のゲストが先に登録していればそれを使う)
+// 容量が足りなければNULL
+JitShared* jit_shared_publish(JitCache *jit, uint64 page_hash, uint32 eip, uint32 mode, IrBlock *ir)
+{
+	JitShared *shared;
+	uint32 slot;
+	size_t size;
+
+	slot = jit_shared_slot(page_hash, eip, mode);
+	size = sizeof(JitShared) + sizeof(IrInsn) * ir->count + (ir->end - eip);
+	pthread_mutex_lock(&jit_shared_lock);
+	for (shared=jit_shared_hash[slot]; shared; shared=shared->next) {
+		if (jit_shared_match(jit, shared, page_hash, eip, mode) && jit_shared_get(shared)) {
+			pthread_mutex_unlock(&jit_shared_lock);
+			return shared;
+		}
+	}
+	if (JIT_SHARED_SIZE < jit_shared_bytes + size) {
+		jit_shared_reclaim();
+	}
+	if (JIT_SHARED_SIZE < jit_shared_bytes + size) {
+		pthread_mutex_unlock(&jit_shared_lock);
+		return NULL;
+	}
+
+	shared = (JitShared*)malloc(size);
+	shared->page_hash = page_hash;
+	shared->eip = eip;
+	shared->end = ir->end;
+	shared->insns = ir->guest_insns;
+	shared->mode = mode;
+	shared->ref = 1;
+	shared->ir_count = ir->count;
+	shared->ir = (IrInsn*)(shared + 1);
+	shared->guest = (uint8*)(shared->ir + ir->count);
+	shared->size = size;
+	shared->dead = NULL;
+	memcpy(shared->ir, ir->insn, sizeof(IrInsn) * ir->count);
+	memcpy(shared->guest, jit->mem + eip, ir->end - eip);
+	shared->next = jit_shared_hash[slot];
+	// 中身を書いてから見えるようにする
+	__atomic_store_n(&(jit_shared_hash[slot]), shared, __ATOMIC_SEQ_CST);
+	jit_shared_bytes += size;
+	pthread_mutex_unlock(&jit_shared_lock);
+
+	jit->stat_shared_published++;
+	return shared;
+}
+
+
+// ブロックを無効にする(コード領域はフラッシュまで再利用しない)
+void jit_invalidate_block(JitCache *jit, JitBlock *block)
+{
+	JitBlock **p;
+	JitExit *exit;
+	JitExit *next;
+	int i;
+
+	for (p=&(jit->hash[jit_hash(block->eip)]); *p; p=&((*p)->hash_next)) {
+		if (*p==block) {
+			*p = block->hash_next;
+			break;
+		}
+	}
+
+	// 入ってくる連結を出口スタブに戻す
+	for (exit=block->in; exit; exit=next) {
+		next = exit->next;
+		if (exit->jump) {
+			jit_patch(exit->jump, exit->stub);
+		}
+		exit->to = NULL;
+		exit->next = NULL;
+	}
+	block->in = NULL;
+
+	// 出ていく連結を外す
+	for (i=0; i<block->exit_count; i++) {
+		if (block->exits[i].to) {
+			jit_unlink(&(block->exits[i]));
+		}
+	}
+
+	if (block->shared) {
+		jit_shared_put(block->shared);
+		block->shared = NULL;
+	}
+	block->valid = 0;
+	jit->stat_invalidated++;
+}
+
+// ブロックが含まれるチャンク
+uint64 jit_block_mask(JitBlock *block)
+{
+	uint32 first;
+	uint32 last;
+	first = (block->eip & (JIT_PAGE_SIZE - 1)) >> JIT_CHUNK_SHIFT;
+	last = ((block->end - 1) & (JIT_PAGE_SIZE - 1)) >> JIT_CHUNK_SHIFT;
+	return (~(uint64)0 >> (63 - last)) & (~(uint64)0 << first);
+}
+
+// ブロックのゲストコードのハッシュ(FNV-1a)
+uint32 jit_code_hash(JitCache *jit, JitBlock *block)
+{
+	uint32 hash;
+	uint32 addr;
+	hash = 2166136261u;
+	for (addr=block->eip; addr<block->end; addr++) {
+		hash = (hash ^ jit->mem[addr]) * 16777619u;
+	}
+	return hash;
+}
+
+// ページのブロックのうち、maskのチャンクを含むもの(all: すべて、check: コードが変わったもの)を捨てる
+int jit_invalidate_blocks(JitCache *jit, uint32 page, uint64 mask, int check)
+{
+	JitBlock **p;
+	JitBlock *block;
+	int n;
+
+	n = 0;
+	jit->page_mask[page] = 0;
+	p = &(jit->page_blocks[page]);
+	while (*p) {
+		block = *p;
+		if ((jit_block_mask(block) & mask) && (!check || jit_code_hash(jit, block)!=block->hash)) {
+			*p = block->page_next;
+			jit_invalidate_block(jit, block);
+			n++;
+		} else {
+			jit->page_mask[page] |= jit_block_mask(block);
+			p = &(block->page_next);
+		}
+	}
+	return n;
+}
+
+// ページのブロックをすべて捨てて書き込みを許可する
+void jit_invalidate_page(JitCache *jit, uint32 page)
+{
+	jit_invalidate_blocks(jit, page, ~(uint64)0, 0);
+	jit->page_code[page] &= ~JIT_PAGE_CODE;
+	jit->page_hash[page] = 0;
+	mprotect(jit->mem + ((size_t)page << JIT_PAGE_SHIFT), JIT_PAGE_SIZE, PROT_READ | PROT_WRITE);
+}
+
+// 翻訳済みのページへ書き込もうとした
+//   書き込んだチャンクのブロックだけを捨て、ページは命令を実行し終わるまで書き込みを許可する
+//   何度も書き込まれるページは翻訳をやめてインタプリタで実行する
+void jit_smc_fault(JitCache *jit, uint32 addr)
+{
+	uint32 page;
+	uint32 offset;
+	uint64 mask;
+
+	page = addr >> JIT_PAGE_SHIFT;
+	jit->stat_smc_faults++;
+	// 内容が変わるのでこのゲストのページのハッシュは捨てる(共有のIRはそのまま)
+	jit->page_hash[page] = 0;
+	if (JIT_SMC_THRASH<=++(jit->page_faults[page])) {
+		jit_invalidate_page(jit, page);
+		jit->page_thrash[page] = 1;
+		jit->stat_thrash_pages++;
+		return;
+	}
+
+	// 1回の書き込みは16バイトまでとしてチャンクを求める(それ以上は後で確かめる)
+	offset = addr & (JIT_PAGE_SIZE - 1);
+	mask = (uint64)1 << (offset >> JIT_CHUNK_SHIFT);
+	if (offset + 15 < JIT_PAGE_SIZE) {
+		mask |= (uint64)1 << ((offset + 15) >> JIT_CHUNK_SHIFT);
+	}
+	if (jit->page_mask[page] & mask) {
+		jit_invalidate_blocks(jit, page, mask, 0);
+	} else {
+		jit->stat_smc_data++;
+	}
+
+	if (!jit->page_blocks[page] || jit->smc_pending_count==JIT_SMC_PENDING) {
+		jit_invalidate_page(jit, page);
+		return;
+	}
+	mprotect(jit->mem + ((size_t)page << JIT_PAGE_SHIFT), JIT_PAGE_SIZE, PROT_READ | PROT_WRITE);
+	jit->smc_pending[jit->smc_pending_count++] = page;
+}
+
+// 書き込みを許可したページのブロックを確かめて書き込み禁止に戻す
+void jit_smc_protect(JitCache *jit)
+{
+	uint32 page;
+	int i;
+
+	for (i=0; i<jit->smc_pending_count; i++) {
+		page = jit->smc_pending[i];
+		jit->stat_smc_rechecked += jit_invalidate_blocks(jit, page, ~(uint64)0, 1);
+		if (jit->page_blocks[page]) {
+			mprotect(jit->mem + ((size_t)page << JIT_PAGE_SHIFT), JIT_PAGE_SIZE, PROT_READ);
+		} else {
+			jit->page_code[page] &= ~JIT_PAGE_CODE;
+		}
+	}
+	jit->smc_pending_count = 0;
+}
+
+// 全ブロックを捨てる
+void jit_flush_cache(JitCache *jit)
+{
+	uint32 page;
+	uint32 pages;
+	int i;
+
+	for (i=0; i<jit->block_count; i++) {
+		if (jit->blocks[i].shared) {
+			jit_shared_put(jit->blocks[i].shared);
+		}
+	}
+	pages = jit->mem_size >> JIT_PAGE_SHIFT;
+	for (page=0; page<pages; page++) {
+		if (jit->page_code[page] & JIT_PAGE_CODE) {
+			mprotect(jit->mem + ((size_t)page << JIT_PAGE_SHIFT), JIT_PAGE_SIZE, PROT_READ | PROT_WRITE);
+			jit->page_code[page] &= ~JIT_PAGE_CODE;
+		}
+		jit->page_blocks[page] = NULL;
+	}
+	memset(jit->page_mask, 0, sizeof(uint64) * pages);
+	memset(jit->page_faults, 0, sizeof(uint16) * pages);
+	memset(jit->page_thrash, 0, pages);
+	memset(jit->page_hash, 0, sizeof(uint64) * pages);
+	jit->smc_pending_count = 0;
+	memset(jit->hash, 0, sizeof(jit->hash));
+	memset(jit->ras, 0, sizeof(jit->ras));
+	jit->block_count = 0;
+	jit->code_used = jit->code_start;
+	jit->ir_used = 0;
+	jit->stat_flushes++;
+}
+
+void jit_segv_handler(int sig, siginfo_t *info, void *context)
+{
+	JitCache *jit;
+	uint8 *addr;
+	uint32 page;
+
+	addr = (uint8*)info->si_addr;
+	for (jit=jit_list; jit; jit=jit->next) {
+		if (jit->mem<=addr && addr<jit->mem + jit->mem_size) {
+			page = (addr - jit->mem) >> JIT_PAGE_SHIFT;
+			if (jit->page_code[page] & JIT_PAGE_CODE) {
+				jit_smc_fault(jit, addr - jit->mem);
+				return;
+			}
+		}
+	}
+
+	// 翻訳とは関係ない: 元のハンドラに戻して再実行させる
+	sigaction(SIGSEGV, &jit_old_action, NULL);
+}
+
+// hot: 実行回数が閾値を超えた(0なら共有キャッシュにあるときだけ翻訳する)
+JitBlock* jit_translate(CPUx86 *cpu, JitCache *jit, uint32 eip, int hot)
+{
+	IrBlock *ir;
+	JitBlock *block;
+	JitShared *shared;
+	uint64 hash;
+	uint32 mode;
+	uint32 page;
+	int native;
+
+	// RAMの外はインタプリタに任せる(フェッチで#GPになる)
+	if (jit->mem_size <= eip) {
+		return NULL;
+	}
+	page = eip >> JIT_PAGE_SHIFT;
+	hash = jit->page_hash[page];
+	if (!hot) {
+		// 翻訳済みで書き込み禁止にしているページだけ(ハッシュを求め直さない)
+		if (!hash) {
+			return NULL;
+		}
+	} else {
+		// 何度も書き込まれたページはインタプリタで実行する
+		if (jit->page_thrash[page]) {
+			jit->stat_thrash_refused++;
+			return NULL;
+		}
+		// ブレークポイントのあるページはインタプリタで実行する
+		if (jit->page_break[page]) {
+			jit->stat_break_refused++;
+			return NULL;
+		}
+		// デバイスが書くバッファのあるページはインタプリタで実行する
+		if (jit->page_dma[page]) {
+			jit->stat_dma_refused++;
+			return NULL;
+		}
+		if (!hash && jit_page_shareable(jit, page)) {
+			hash = jit_page_hash(jit, page);
+		}
+	}
+
+	// 同じイメージの他のゲストが翻訳していればデコードと最適化を省く
+	mode = jit_mode(cpu);
+	shared = hash ? jit_shared_find(jit, hash, eip, mode) : NULL;
+	ir = jit->ir_block;
+	if (shared) {
+		ir->eip = eip;
+		ir->end = shared->end;
+		ir->guest_insns = shared->insns;
+		ir->count = shared->ir_count;
+		memcpy(ir->insn, shared->ir, sizeof(IrInsn) * shared->ir_count);
+		jit->stat_shared_hit++;
+	} else {
+		if (!hot) {
+			return NULL;
+		}
+		if (ir_decode_block(cpu, eip, ir)==0) {
+			jit->stat_failed++;
+			return NULL;
+		}
+		ir_optimize(ir, &(jit->ir_stats));
+		if (hash) {
+			shared = jit_shared_publish(jit, hash, eip, mode, ir);
+		}
+	}
+
+	// 空きがなければ全部捨てる
+	if (JIT_CODE_SIZE < jit->code_used + JIT_BLOCK_CODE || JIT_IR_POOL < jit->ir_used + ir->count || jit->block_count==JIT_MAX_BLOCKS) {
+		jit_flush_cache(jit);
+	}
+
+	block = &(jit->blocks[jit->block_count++]);
+	memset(block, 0, sizeof(JitBlock));
+	block->eip = eip;
+	block->end = ir->end;
+	block->insns = ir->guest_insns;
+	block->hash = jit_code_hash(jit, block);
+	block->shared = shared;
+	block->valid = 1;
+
+	native = 0;
+#ifdef JIT_NATIVE
+	if (jit->native) {
+		block->code = jit->code + jit->code_used;
+		native = jit_native(jit, block, ir);
+	}
+#endif
+	if (native) {
+		jit->code_used += (block->code_size + 15) & ~15;
+		jit->stat_native++;
+	} else {
+		// ホストコードにできなければIRインタプリタで実行する(共有のIRはそのまま使う)
+		block->code = NULL;
+		block->ir_count = ir->count;
+		if (shared) {
+			block->ir = shared->ir;
+		} else {
+			block->ir = jit->ir_pool + jit->ir_used;
+			memcpy(block->ir, ir->insn, sizeof(IrInsn) * ir->count);
+			jit->ir_used += ir->count;
+		}
+		jit->stat_interp++;
+	}
+
+	// 登録
+	block->hash_next = jit->hash[jit_hash(eip)];
+	jit->hash[jit_hash(eip)] = block;
+	block->page_next = jit->page_blocks[page];
+	jit->page_blocks[page] = block;
+	jit->page_mask[page] |= jit_block_mask(block);
+	if (!(jit->page_code[page] & JIT_PAGE_CODE)) {
+		jit->page_code[page] |= JIT_PAGE_CODE;
+		mprotect(jit->mem + ((size_t)page << JIT_PAGE_SHIFT), JIT_PAGE_SIZE, PROT_READ);
+	}
+	// 書き込み禁止にしたので書き込まれるまでハッシュを覚えておく
+	jit->page_hash[page] = hash;
+
+	jit->stat_translated++;
+	return block;
+}
+
+// api
+
+void jit_init(CPUx86 *cpu)
+{
+	JitCache *jit;
+	struct sigaction action;
+	char *env;
+
+	cpu->jit = NULL;
+	if (((size_t)cpu->mem & (JIT_PAGE_SIZE - 1)) || (cpu->mem_size & (JIT_PAGE_SIZE - 1))) {
+		log_warning("jit disabled: guest memory is not page aligned\n");
+		return;
+	}
+
+	jit = (JitCache*)calloc(1, sizeof(JitCache));
+#ifdef JIT_NATIVE
+	jit->code = (uint8*)mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->code==MAP_FAILED) {
+		log_warning("jit disabled: mmap failed\n");
+		free(jit);
+		return;
+	}
+	jit->native = 1;
+#endif
+	jit->blocks = (JitBlock*)calloc(JIT_MAX_BLOCKS, sizeof(JitBlock));
+	jit->ir_block = (IrBlock*)malloc(sizeof(IrBlock));
+	jit->ir_pool = (IrInsn*)calloc(JIT_IR_POOL, sizeof(IrInsn));
+	jit->mem = cpu->mem;
+	jit->mem_size = cpu->mem_size;
+	jit->page_blocks = (JitBlock**)calloc(cpu->mem_size >> JIT_PAGE_SHIFT, sizeof(JitBlock*));
+	jit->page_code = (uint8*)calloc(JIT_PAGES, 1);
+	jit->page_mask = (uint64*)calloc(cpu->mem_size >> JIT_PAGE_SHIFT, sizeof(uint64));
+	jit->page_faults = (uint16*)calloc(cpu->mem_size >> JIT_PAGE_SHIFT, sizeof(uint16));
+	jit->page_thrash = (uint8*)calloc(cpu->mem_size >> JIT_PAGE_SHIFT, 1);
+	jit->page_break = (uint8*)calloc(cpu->mem_size >> JIT_PAGE_SHIFT, 1);
+	jit->page_hash = (uint64*)calloc(cpu->mem_size >> JIT_PAGE_SHIFT, sizeof(uint64));
+	jit->page_dma = (uint16*)calloc(cpu->mem_size >> JIT_PAGE_SHIFT, sizeof(uint16));
+#ifdef JIT_NATIVE
+	jit_emit_trampoline(jit);
+#endif
+
+	// VCPU_JIT=0 でインタプリタのみ、VCPU_JIT=ir でIRインタプリタのみ
+	env = getenv("VCPU_JIT");
+	jit->enabled = !(env && strcmp(env, "0")==0);
+	if (env && strcmp(env, "ir")==0) {
+		jit->native = 0;
+	}
+	// VCPU_JIT_SHARED=0 で同じイメージのゲストとIRを共有しない
+	env = getenv("VCPU_JIT_SHARED");
+	jit->share = !(env && strcmp(env, "0")==0);
+
+	pthread_mutex_lock(&jit_shared_lock);
+	if (!jit_list) {
+		memset(&action, 0, sizeof(action));
+		action.sa_sigaction = jit_segv_handler;
+		action.sa_flags = SA_SIGINFO;
+		sigemptyset(&(action.sa_mask));
+		sigaction(SIGSEGV, &action, &jit_old_action);
+	}
+	jit->next = jit_list;
+	jit_list = jit;
+	pthread_mutex_unlock(&jit_shared_lock);
+	cpu->jit = jit;
+}
+
+void jit_delete(CPUx86 *cpu)
+{
+	JitCache *jit;
+	JitCache **p;
+
+	jit = cpu->jit;
+	if (!jit) {
+		return;
+	}
+	jit_flush_cache(jit);
+	pthread_mutex_lock(&jit_shared_lock);
+	for (p=&jit_list; *p; p=&((*p)->next)) {
+		if (*p==jit) {
+			*p = jit->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&jit_shared_lock);
+#ifdef JIT_NATIVE
+	munmap(jit->code, JIT_CODE_SIZE);
+#endif
+	free(jit->blocks);
+	free(jit->ir_block);
+	free(jit->ir_pool);
+	free(jit->page_blocks);
+	free(jit->page_code);
+	free(jit->page_mask);
+	free(jit->page_faults);
+	free(jit->page_thrash);
+	free(jit->page_break);
+	free(jit->page_hash);
+	free(jit->page_dma);
+	free(jit);
+	cpu->jit = NULL;
+}
+
+void jit_flush(CPUx86 *cpu)
+{
+	if (cpu->jit) {
+		jit_flush_cache(cpu->jit);
+	}
+}
+
+void jit_set_enabled(CPUx86 *cpu, int enabled)
+{
+	if (cpu->jit) {
+		cpu->jit->enabled = enabled;
+	}
+}
+
+// vCPUのスレッドでゲストのRAMへ直接書く前に呼ぶ(gdb、リプレイ)
+//   翻訳済みのページは書き込みを許可して翻訳を捨てる
+void jit_dma_write(CPUx86 *cpu, uint32 addr, uint32 len)
+{
+	JitCache *jit = cpu->jit;
+	uint32 page;
+
+	if (jit==NULL || len==0) {
+		return;
+	}
+	for (page=addr >> JIT_PAGE_SHIFT; page<=(addr + len - 1) >> JIT_PAGE_SHIFT; page++) {
+		if (jit->page_code[page] & JIT_PAGE_CODE) {
+			jit_invalidate_page(jit, page);
+		}
+	}
+}
+
+// デバイスのスレッド(スイッチ、blkのワーカー、コンソールのI/O)が書くバッファをvCPUのスレッドで渡すときに呼ぶ
+//   翻訳を捨てて書き込みを許可し、jit_dma_endまでそのページは翻訳しない
+//   (渡してから書かれるまでに翻訳して書き込み禁止に戻すと、デバイスのスレッドでSIGSEGVになる)
+void jit_dma_begin(CPUx86 *cpu, uint32 addr, uint32 len)
+{
+	JitCache *jit = cpu->jit;
+	uint32 page;
+
+	if (jit==NULL || len==0 || jit->mem_size < (uint64)addr + len) {
+		return;
+	}
+	for (page=addr >> JIT_PAGE_SHIFT; page<=(addr + len - 1) >> JIT_PAGE_SHIFT; page++) {
+		jit->page_dma[page]++;
+		if (jit->page_code[page] & JIT_PAGE_CODE) {
+			jit_invalidate_page(jit, page);
+		}
+	}
+}
+
+// デバイスが書き終えたバッファを受け取ったときに呼ぶ(vCPUのスレッド)
+void jit_dma_end(CPUx86 *cpu, uint32 addr, uint32 len)
+{
+	JitCache *jit = cpu->jit;
+	uint32 page;
+
+	if (jit==NULL || len==0 || jit->mem_size < (uint64)addr + len) {
+		return;
+	}
+	for (page=addr >> JIT_PAGE_SHIFT; page<=(addr + len - 1) >> JIT_PAGE_SHIFT; page++) {
+		if (jit->page_dma[page]) {
+			jit->page_dma[page]--;
+		}
+	}
+}
+
+// ブレークポイントを置いたページの翻訳を捨て、外すまで翻訳しない
+//   ほかのブロックからの連結も外れるので、翻訳済みコードは何も確かめずに走れる
+void jit_set_break(CPUx86 *cpu, uint32 addr, int on)
+{
+	JitCache *jit = cpu->jit;
+	uint32 page;
+
+	if (jit==NULL || jit->mem_size <= addr) {
+		return;
+	}
+	page = addr >> JIT_PAGE_SHIFT;
+	jit->page_break[page] = on;
+	if (on && (jit->page_code[page] & JIT_PAGE_CODE)) {
+		jit_invalidate_page(jit, page);
+	}
+}
+
+// ウォッチポイントのページへのストアは翻訳済みコードから抜けてインタプリタで実行する
+void jit_set_watch(CPUx86 *cpu, uint32 addr, int on)
+{
+	JitCache *jit = cpu->jit;
+	uint32 page;
+
+	if (jit==NULL || jit->mem_size <= addr) {
+		return;
+	}
+	page = addr >> JIT_PAGE_SHIFT;
+	if (on) {
+		jit->page_code[page] |= JIT_PAGE_WATCH;
+	} else {
+		jit->page_code[page] &= ~JIT_PAGE_WATCH;
+	}
+}
+
+// 翻訳済みのブロックを続けて実行する
+// 戻り値: 実行した命令数(0ならインタプリタで1命令実行する)
+int jit_exec(CPUx86 *cpu, int budget)
+{
+	JitCache *jit;
+	JitBlock *block;
+	JitBlock *from;
+	JitBlock *next;
+	JitExit *exit;
+	uint32 slot;
+	int32 before;
+
+	jit = cpu->jit;
+	if (!jit) {
+		return 0;
+	}
+	// 前の命令が翻訳済みのページに書き込んだ
+	if (jit->smc_pending_count) {
+		jit_smc_protect(jit);
+	}
+	if (!jit->enabled) {
+		return 0;
+	}
+	// 32bitプロテクトモードのみ(シングルステップ中は命令単位で実行する)
+	if (!cpu->code32 || (cpu->eflags & CPU_EFLAGS_TF) || cpu->gdb_step || !desc_d(&(cpu->segs[SEG_SS]))) {
+		return 0;
+	}
+	// ベース0のセグメントのみ(ブロックはEIPで引き、メモリオペランドにベースを足さない)
+	if (cpu->segs[SEG_CS].base | cpu->segs[SEG_SS].base | cpu->segs[SEG_DS].base | cpu->segs[SEG_ES].base) {
+		return 0;
+	}
+
+	block = jit_lookup(jit, cpu->eip);
+	if (block) {
+		jit->stat_lookup_hit++;
+	} else {
+		jit->stat_lookup_miss++;
+		// 共有キャッシュにあれば閾値を待たない
+		block = jit->share ? jit_translate(cpu, jit, cpu->eip, 0) : NULL;
+		if (!block) {
+			slot = jit_hash(cpu->eip) & (JIT_COUNTER_SIZE - 1);
+			if (++(jit->counter[slot])<JIT_THRESHOLD) {
+				return 0;
+			}
+			jit->counter[slot] = 0;
+			block = jit_translate(cpu, jit, cpu->eip, 1);
+			if (!block) {
+				return 0;
+			}
+		}
+	}
+
+	cpu->jit_budget = budget;
+	while (block) {
+		before = cpu->jit_budget;
+		from = block;
+		if (block->code) {
+#ifdef JIT_NATIVE
+			exit = jit->enter(cpu, block->code);
+
+			// 分岐先がホストコードなら直接飛ぶように書き換える
+			if (exit && exit->from->valid) {
+				jit_link_exit(jit, exit, exit->check ? cpu->eip : exit->target);
+				from = exit->from;
+			}
+#endif
+		} else {
+			if (cpu->jit_budget < (int32)block->insns) {
+				break;
+			}
+			cpu->jit_budget -= ir_exec(cpu, block->ir, block->ir_count, block->insns, jit->page_code);
+		}
+		jit->stat_exec++;
+
+		// 進まなかった(残りが足りない、自己書き換え)ときはインタプリタへ
+		if (cpu->jit_budget==before || cpu->jit_budget<=0) {
+			break;
+		}
+
+		// 前回と同じ先ならハッシュを引かない
+		next = from->succ;
+		if (next && next->valid && next->eip==cpu->eip) {
+			jit->stat_dispatch_hit++;
+		} else {
+			next = jit_lookup(jit, cpu->eip);
+			from->succ = next;
+			jit->stat_dispatch_miss++;
+		}
+		block = next;
+	}
+	jit->stat_insns += budget - cpu->jit_budget;
+	return budget - cpu->jit_budget;
+}
+
+void dump_jit(CPUx86 *cpu)
+{
+	JitCache *jit;
+	IrStats *ir;
+
+	jit = cpu->jit;
+	if (!jit) {
+		printf("dump_jit: disabled\n");
+		return;
+	}
+	ir = &(jit->ir_stats);
+	printf("dump_jit:\n");
+	printf("  enabled: %d native: %d\n", jit->enabled, jit->native);
+	printf("  blocks: %d code: %u/%u ir: %u/%u\n", jit->block_count, jit->code_used, JIT_CODE_SIZE, jit->ir_used, JIT_IR_POOL);
+	printf("  exec: %llu insns: %llu\n", jit->stat_exec, jit->stat_insns);
+	printf("  translated: %llu (native: %llu interp: %llu) failed: %llu chained: %llu\n", jit->stat_translated, jit->stat_native, jit->stat_interp, jit->stat_failed, jit->stat_chained);
+	printf("  ras_linked: %llu indirect_linked: %llu dispatch: hit: %llu miss: %llu\n", jit->stat_ras_linked, jit->stat_indirect_linked, jit->stat_dispatch_hit, jit->stat_dispatch_miss);
+	printf("  lookup: hit: %llu miss: %llu\n", jit->stat_lookup_hit, jit->stat_lookup_miss);
+	printf("  invalidated: %llu flushes: %llu\n", jit->stat_invalidated, jit->stat_flushes);
+	printf("  smc: faults: %llu data: %llu rechecked: %llu thrash: pages: %llu refused: %llu\n", jit->stat_smc_faults, jit->stat_smc_data, jit->stat_smc_rechecked, jit->stat_thrash_pages, jit->stat_thrash_refused);
+	printf("  break: refused: %llu dma: refused: %llu\n", jit->stat_break_refused, jit->stat_dma_refused);
+	printf("  shared: %d hit: %llu published: %llu\n", jit->share, jit->stat_shared_hit, jit->stat_shared_published);
+	printf("  ir: blocks: %llu insns: %llu -> %llu\n", ir->blocks, ir->insns, ir->insns_opt);
+	printf("  ir opt: dead_flags: %llu const_args: %llu const_folded: %llu reg_loads: %llu reg_stores: %llu addr_folded: %llu dead_code: %llu\n",
+			ir->dead_flags, ir->const_args, ir->const_folded, ir->reg_loads, ir->reg_stores, ir->addr_folded, ir->dead_code);
+}
+
+#else
+
+// Linux以外はインタプリタのみ
+
+void jit_init(CPUx86 *cpu)
+{
+	cpu->jit = NULL;
+}
+
+void jit_delete(CPUx86 *cpu)
+{
+}
+
+void jit_flush(CPUx86 *cpu)
+{
+}
+
+void jit_set_enabled(CPUx86 *cpu, int enabled)
+{
+}
+
+void jit_dma_write(CPUx86 *cpu, uint32 addr, uint32 len)
+{
+}
+
+void jit_dma_begin(CPUx86 *cpu, uint32 addr, uint32 len)
+{
+}
+
+void jit_dma_end(CPUx86 *cpu, uint32 addr, uint32 len)
+{
+}
+
+void jit_set_break(CPUx86 *cpu, uint32 addr, int on)
+{
+}
+
+void jit_set_watch(CPUx86 *cpu, uint32 addr, int on)
+{
+}
+
+int jit_exec(CPUx86 *cpu, int budget)
+{
+	return 0;
+}
+
+void dump_jit(CPUx86 *cpu)
+{
+	printf("dump_jit: not supported\n");
+}
+
+#endif
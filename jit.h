@@ -0,0 +1,178 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "cpux86.h"
+#include "ir.h"
+
+
+// 設定
+
+#define JIT_CODE_SIZE		(16*1024*1024)	// コードキャッシュ
+#define JIT_MAX_BLOCKS		16384
+#define JIT_HASH_SIZE		4096
+#define JIT_COUNTER_SIZE	4096
+#define JIT_THRESHOLD		50				// 翻訳するまでの実行回数
+#define JIT_RAS_SIZE		16				// リターンアドレススタック(2のべき乗)
+#define JIT_BLOCK_INSNS		IR_BLOCK_INSNS	// 1ブロックの最大命令数
+#define JIT_BLOCK_CODE		(IR_MAX_INSNS * 64 + 1024)	// 1ブロックのホストコード上限
+#define JIT_IR_POOL			(256*1024)		// IRインタプリタで実行するブロックのIR命令数
+
+#define JIT_PAGE_SHIFT		12
+#define JIT_PAGE_SIZE		(1 << JIT_PAGE_SHIFT)
+#define JIT_PAGES			(1 << (32 - JIT_PAGE_SHIFT))	// 4GB分
+#define JIT_CHUNK_SHIFT		6				// 自己書き換えを検出する単位(64バイト、1ページで64個)
+#define JIT_SMC_THRASH		16				// これだけ書き込まれたページはインタプリタで実行する
+#define JIT_SMC_PENDING		4				// 書き込み禁止を戻すのを待つページ数
+#define JIT_SHARED_HASH		65536			// ゲスト間で共有するIRのハッシュ表
+#define JIT_SHARED_SIZE		(64*1024*1024)	// 共有するIRの上限(超えたら使われていないものを捨てる)
+
+// page_code
+#define JIT_PAGE_CODE		0x01			// 翻訳済みコードを含む(書き込み禁止にしている)
+#define JIT_PAGE_WATCH		0x02			// ウォッチポイントを含む(ストアはインタプリタで実行する)
+
+// ネイティブバックエンド(これ以外のホストはIRインタプリタで実行する)
+#if defined(__x86_64__)
+#define JIT_NATIVE
+#endif
+
+
+// ブロック
+
+typedef struct JitBlock JitBlock;
+typedef struct JitExit JitExit;
+typedef struct JitShared JitShared;
+
+// ブロックの出口(連結するとjmp先を書き換える)
+//   直接分岐: targetは固定
+//   間接分岐: 分岐先のキャッシュ。checkのcmp imm32とjumpを最後に飛んだ先に書き換える
+//   call: 戻り先(jumpなし)。リターンアドレススタックに積み、retで一致すれば直接飛ぶ
+struct JitExit {
+	uint32 target;		// 分岐先EIP
+	uint8 *jump;		// jmp/jcc rel32の書き換え位置(NULL: なし)
+	uint8 *stub;		// 未連結時の飛び先
+	uint8 *check;		// 間接分岐: cmp ecx, imm32 のimm32(NULL: 直接分岐)
+	JitBlock *from;
+	JitBlock *to;		// 連結先(NULL: 未連結)
+	JitExit *next;		// 連結先ブロックへ入ってくる出口のリスト
+};
+
+struct JitBlock {
+	uint32 eip;			// 先頭EIP
+	uint32 end;			// 最後の命令の次
+	uint32 insns;		// 命令数
+	uint32 hash;		// ゲストのコードのハッシュ(書き込まれたページで変わっていないか確かめる)
+	uint8 *code;		// ホストコード(NULL: IRインタプリタで実行する)
+	uint32 code_size;
+	IrInsn *ir;			// IRインタプリタで実行するIR
+	int ir_count;
+	JitExit exits[2];
+	int exit_count;
+	JitExit *in;		// このブロックへ連結している出口
+	JitBlock *succ;		// 最後に実行した次のブロック(ディスパッチ用のキャッシュ)
+	JitBlock *hash_next;
+	JitBlock *page_next;
+	JitShared *shared;	// 共有キャッシュのIR(参照を1つ持つ)
+	uint8 valid;
+};
+
+// ゲスト間で共有するIR(同じイメージを動かすゲストはデコードと最適化をやり直さない)
+//   ページの内容のハッシュ、EIP、モードで引き、ブロックのゲストコードを比べて確かめる
+//   登録したら書き換えない(読む側はロックを取らない)
+//   ゲストがページに書き込んでもそのゲストのブロックとページのハッシュを捨てるだけで、共有のIRはそのまま
+struct JitShared {
+	uint64 page_hash;
+	uint32 eip;
+	uint32 end;
+	uint32 insns;
+	uint32 mode;
+	int ref;			// 使っているブロックの数(-1: 捨てている途中)
+	int ir_count;
+	IrInsn *ir;
+	uint8 *guest;		// ゲストコード(eipからend)
+	size_t size;
+	JitShared *next;
+	JitShared *dead;	// 回収するときのリスト(nextは辿っている途中の読む側のために残す)
+};
+
+
+// コードキャッシュ
+
+typedef JitExit* (*JitEnter)(CPUx86 *cpu, uint8 *code);
+
+struct JitCache {
+	int enabled;
+	int native;			// 0: ネイティブコードを生成せずIRインタプリタで実行する
+
+	// ホストコード
+	uint8 *code;
+	uint32 code_start;	// enter/leaveの後ろ
+	uint32 code_used;
+	JitEnter enter;		// ゲストレジスタをロードしてブロックへ飛ぶ
+	uint8 *leave;		// ゲストレジスタを書き戻して戻る
+
+	// ブロック
+	JitBlock *blocks;
+	int block_count;
+	JitBlock *hash[JIT_HASH_SIZE];
+	uint16 counter[JIT_COUNTER_SIZE];
+
+	// リターンアドレススタック(callの戻り先の出口)
+	JitExit *ras[JIT_RAS_SIZE];
+	uint32 ras_top;
+
+	// IR
+	IrBlock *ir_block;	// 翻訳中のブロック
+	IrInsn *ir_pool;
+	uint32 ir_used;
+	IrStats ir_stats;
+
+	// 自己書き換え検出(翻訳済みのページは書き込み禁止にする)
+	//   書き込まれたらそのチャンクのブロックだけを捨て、命令の実行後にほかのブロックを確かめて書き込み禁止に戻す
+	uint8 *mem;
+	size_t mem_size;
+	JitBlock **page_blocks;
+	uint8 *page_code;	// JIT_PAGE_CODE、JIT_PAGE_WATCH(ストアは0でなければ抜ける)
+	uint64 *page_mask;	// 翻訳済みコードを含むチャンク
+	uint16 *page_faults;	// 書き込みを検出した回数
+	uint8 *page_thrash;	// 1: 書き込みが多いので翻訳しない
+	uint8 *page_break;	// 1: ブレークポイントがあるので翻訳しない(インタプリタが1命令ずつ確かめる)
+	uint16 *page_dma;	// デバイスのスレッドに渡しているバッファの数(0でなければ翻訳しない)
+	uint32 smc_pending[JIT_SMC_PENDING];	// 書き込みを許可しているページ
+	int smc_pending_count;
+
+	// 共有キャッシュ
+	int share;			// 0: 共有キャッシュを使わない
+	uint64 *page_hash;	// 書き込み禁止にしているページの内容のハッシュ(0: まだ求めていない)
+	uint32 shared_reading;	// 共有キャッシュを読んでいる間のエポック(0: 読んでいない)
+
+	// 統計
+	uint64 stat_exec;
+	uint64 stat_insns;
+	uint64 stat_translated;
+	uint64 stat_failed;
+	uint64 stat_native;		// ネイティブコードにしたブロック
+	uint64 stat_interp;		// IRインタプリタで実行するブロック
+	uint64 stat_chained;
+	uint64 stat_ras_linked;		// 戻り先を連結した
+	uint64 stat_indirect_linked;	// 間接分岐のキャッシュを書き換えた
+	uint64 stat_dispatch_hit;	// ハッシュを引かずに次のブロックが見つかった
+	uint64 stat_dispatch_miss;
+	uint64 stat_lookup_hit;		// インタプリタから入るときに翻訳済みのブロックがあった
+	uint64 stat_lookup_miss;
+	uint64 stat_invalidated;
+	uint64 stat_flushes;
+	uint64 stat_smc_faults;		// 翻訳済みのページへの書き込み
+	uint64 stat_smc_data;		// コードのないチャンクへの書き込み(ブロックを捨てなかった)
+	uint64 stat_smc_rechecked;	// 書き込みの後で確かめて捨てたブロック
+	uint64 stat_thrash_pages;	// 翻訳をやめたページ
+	uint64 stat_thrash_refused;	// 翻訳しなかったブロック
+	uint64 stat_break_refused;	// ブレークポイントのあるページなので翻訳しなかった
+	uint64 stat_dma_refused;	// デバイスが書くバッファのあるページなので翻訳しなかった
+	uint64 stat_shared_hit;		// 共有キャッシュのIRを使った
+	uint64 stat_shared_published;	// 共有キャッシュに登録した
+
+	JitCache *next;
+};
+
+
+#endif
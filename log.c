@@ -1,26 +1,365 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include "cpux86.h"
+#include "log.h"
 
-void _vlog_write(char *prefix, const char *format, va_list arg)
+
+// ログ
+//   呼んだスレッドで1行に整形してロックのないキューに入れ、書き出しはバックグラウンドのスレッドで行う
+//   (vCPUのスレッドはstdioのロックもwriteも待たない、キューがいっぱいなら捨てて数える)
+//   同じ書式のメッセージはスレッドごとに1秒LOG_BURST回までにして、抑えた数を後で出す
+//   log_errorは終了せず、そのスレッドで実行しているゲストを止める
+//
+//   VCPU_LOG=ファイル(なければ標準出力)、VCPU_LOG_LEVEL=error|warning|info(既定)|debug
+//   debugは実行ループが1命令ずつレジスタを出すので遅い
+
+#define LOG_LINE		256			// 1メッセージ(長ければ切る)
+#define LOG_QUEUE		1024		// 2のべき
+#define LOG_BATCH		64			// 1回のwritevで書くメッセージ数
+#define LOG_IDLE_MS		100
+#define LOG_BURST		10			// 同じ書式を1秒に出す数
+#define LOG_LIMITS		64			// スレッドごとの抑制の表(2のべき)
+#define LOG_TAG			16
+
+typedef struct {
+	uint32 seq;			// 入れた側はpos + 1、取り出した側はpos + LOG_QUEUEにする
+	uint16 len;
+	char text[LOG_LINE];
+} LogSlot;
+
+// 書き手が複数、読み手が1つの有限キュー(スロットの番号で空きを判断する)
+typedef struct {
+	LogSlot slot[LOG_QUEUE];
+	uint32 tail;		// 書き手が進める
+	uint32 head;		// 書き出すスレッドだけが進める
+	uint64 dropped;
+	int fd;
+	int kick_fd;		// eventfd(寝ている書き出しスレッドを起こす)
+	int idle;
+	int level;
+	int started;		// 0: まだ 1: スレッドあり -1: スレッドなし(その場で書く)
+	int stop;
+	pthread_t thread;
+} LogQueue;
+
+typedef struct {
+	const char *format;
+	uint64 window;		// 数え始めた時刻(秒)
+	uint32 count;
+	uint32 suppressed;
+} LogLimit;
+
+static LogQueue log_queue = {.fd = -1, .kick_fd = -1, .level = -1};
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+// スレッドごと
+static __thread CPUx86 *log_guest;
+static __thread char log_tag[LOG_TAG];
+static __thread LogLimit log_limits[LOG_LIMITS];
+
+
+// queue
+
+static void log_write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno==EINTR) {
+				continue;
+			}
+			return;
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+static int log_push(LogQueue *q, const char *text, int len)
+{
+	LogSlot *slot;
+	uint32 pos;
+	uint32 seq;
+	uint64 one = 1;
+
+	pos = __atomic_load_n(&(q->tail), __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &(q->slot[pos & (LOG_QUEUE - 1)]);
+		seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+		if (seq==pos) {
+			if (__atomic_compare_exchange_n(&(q->tail), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if ((int32)(seq - pos) < 0) {
+			// いっぱい
+			__atomic_fetch_add(&(q->dropped), 1, __ATOMIC_RELAXED);
+			return 0;
+		} else {
+			pos = __atomic_load_n(&(q->tail), __ATOMIC_RELAXED);
+		}
+	}
+	memcpy(slot->text, text, len);
+	slot->len = len;
+	__atomic_store_n(&(slot->seq), pos + 1, __ATOMIC_RELEASE);
+
+	if (__atomic_load_n(&(q->idle), __ATOMIC_SEQ_CST)) {
+		if (write(q->kick_fd, &one, sizeof(one)) < 0) {
+			// LOG_IDLE_MSで起きる
+		}
+	}
+	return 1;
+}
+
+// たまっている分を書き出す(書き出した数を返す)
+static int log_drain(LogQueue *q)
+{
+	struct iovec iov[LOG_BATCH];
+	LogSlot *slot[LOG_BATCH];
+	char note[64];
+	uint64 dropped;
+	int n;
+	int i;
+
+	for (n=0; n<LOG_BATCH; n++) {
+		slot[n] = &(q->slot[(q->head + n) & (LOG_QUEUE - 1)]);
+		if (__atomic_load_n(&(slot[n]->seq), __ATOMIC_ACQUIRE)!=q->head + n + 1) {
+			break;
+		}
+		iov[n].iov_base = slot[n]->text;
+		iov[n].iov_len = slot[n]->len;
+	}
+	if (n) {
+		if (writev(q->fd, iov, n) < 0) {
+			// 書けなければ捨てる
+		}
+		for (i=0; i<n; i++) {
+			__atomic_store_n(&(slot[i]->seq), q->head + i + LOG_QUEUE, __ATOMIC_RELEASE);
+		}
+		// log_flushが他のスレッドで読む
+		__atomic_store_n(&(q->head), q->head + n, __ATOMIC_RELEASE);
+	}
+	dropped = __atomic_exchange_n(&(q->dropped), 0, __ATOMIC_RELAXED);
+	if (dropped) {
+		log_write_all(q->fd, note, snprintf(note, sizeof(note), "warning: log: %llu messages dropped\n", dropped));
+	}
+	return n;
+}
+
+static void* log_thread(void *arg)
+{
+	LogQueue *q = arg;
+	struct pollfd pfd;
+	uint64 val;
+
+	for (;;) {
+		if (log_drain(q)) {
+			continue;
+		}
+		if (__atomic_load_n(&(q->stop), __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		// 寝る前に起こしてもらうよう頼み、その間に入っていないか確かめる
+		__atomic_store_n(&(q->idle), 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&(q->slot[q->head & (LOG_QUEUE - 1)].seq), __ATOMIC_SEQ_CST)!=q->head + 1) {
+			pfd.fd = q->kick_fd;
+			pfd.events = POLLIN;
+			if (0 < poll(&pfd, 1, LOG_IDLE_MS) && read(q->kick_fd, &val, sizeof(val)) < 0) {
+				// 他で読まれた
+			}
+		}
+		__atomic_store_n(&(q->idle), 0, __ATOMIC_SEQ_CST);
+	}
+	return NULL;
+}
+
+// 終了時に残りを書き出す
+static void log_exit(void)
+{
+	LogQueue *q = &log_queue;
+
+	if (q->started==1) {
+		__atomic_store_n(&(q->stop), 1, __ATOMIC_RELEASE);
+		if (write(q->kick_fd, &(uint64){1}, sizeof(uint64)) < 0) {
+			// LOG_IDLE_MSで起きる
+		}
+		pthread_join(q->thread, NULL);
+		q->started = -1;
+	}
+	log_drain(q);
+}
+
+static void log_start(void)
+{
+	LogQueue *q = &log_queue;
+	char *env;
+	uint32 i;
+
+	for (i=0; i<LOG_QUEUE; i++) {
+		q->slot[i].seq = i;
+	}
+	q->fd = STDOUT_FILENO;
+	env = getenv("VCPU_LOG");
+	if (env) {
+		q->fd = open(env, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (q->fd < 0) {
+			q->fd = STDOUT_FILENO;
+		}
+	}
+	q->level = LOG_LEVEL_INFO;
+	env = getenv("VCPU_LOG_LEVEL");
+	if (env) {
+		if (strcmp(env, "error")==0) {
+			q->level = LOG_LEVEL_ERROR;
+		} else if (strcmp(env, "warning")==0) {
+			q->level = LOG_LEVEL_WARNING;
+		} else if (strcmp(env, "debug")==0) {
+			q->level = LOG_LEVEL_DEBUG;
+		}
+	}
+	// スレッドが作れなければ呼んだスレッドで書く
+	q->started = -1;
+	q->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (0 <= q->kick_fd && pthread_create(&(q->thread), NULL, log_thread, q)==0) {
+		q->started = 1;
+	}
+	atexit(log_exit);
+}
+
+
+// write
+
+// 同じ書式が続けば抑える(0: 出さない)
+// 抑えた後の最初の1つでは抑えた数をnoteに入れる
+static int log_limit(const char *format, uint32 *note)
+{
+	struct timespec ts;
+	LogLimit *limit;
+	uint64 now;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	now = ts.tv_sec;
+	limit = &(log_limits[((uintptr_t)format >> 3) & (LOG_LIMITS - 1)]);
+	*note = 0;
+	if (limit->format!=format || limit->window!=now) {
+		if (limit->format==format) {
+			*note = limit->suppressed;
+		}
+		limit->format = format;
+		limit->window = now;
+		limit->count = 0;
+		limit->suppressed = 0;
+	}
+	if (LOG_BURST <= limit->count) {
+		limit->suppressed++;
+		return 0;
+	}
+	limit->count++;
+	return 1;
+}
+
+static void _vlog_write(int level, char *prefix, const char *format, va_list arg)
 {
-	printf("%s", prefix);
-	vprintf(format, arg);
+	LogQueue *q = &log_queue;
+	char buf[LOG_LINE];
+	uint32 note;
+	int len;
+	int n;
+
+	pthread_once(&log_once, log_start);
+	if (q->level < level || !log_limit(format, &note)) {
+		return;
+	}
+	if (note) {
+		len = snprintf(buf, sizeof(buf), "%s%s%s(%u similar messages suppressed)\n", prefix, log_tag, log_tag[0] ? " " : "", note);
+		if (q->started==1) {
+			log_push(q, buf, len);
+		} else {
+			log_write_all(q->fd, buf, len);
+		}
+	}
+	len = snprintf(buf, sizeof(buf), "%s%s%s", prefix, log_tag, log_tag[0] ? " " : "");
+	n = vsnprintf(buf + len, sizeof(buf) - len, format, arg);
+	if (n < 0) {
+		return;
+	}
+	len += n;
+	if (sizeof(buf) <= (size_t)len) {
+		// 切った行も改行で終える
+		len = sizeof(buf) - 1;
+		buf[len - 1] = '\n';
+	}
+	if (q->started==1) {
+		log_push(q, buf, len);
+	} else {
+		log_write_all(q->fd, buf, len);
+	}
+}
+
+// このスレッドで実行するゲスト(ログにタグをつけ、log_errorで止める)
+void log_set_guest(CPUx86 *cpu)
+{
+	log_guest = cpu;
+	log_tag[0] = '\0';
+	if (cpu && cpu->metrics.id) {
+		snprintf(log_tag, sizeof(log_tag), "[vcpu%d]", cpu->metrics.id);
+	}
+}
+
+// そのレベルのログを出すか(出さないなら書式を整える前に省ける)
+int log_enabled(int level)
+{
+	pthread_once(&log_once, log_start);
+	return level <= log_queue.level;
+}
+
+// 残りを書き出すまで待つ
+void log_flush(void)
+{
+	LogQueue *q = &log_queue;
+	struct timespec ts = {0, 1000000};
+
+	if (q->started!=1) {
+		return;
+	}
+	while (__atomic_load_n(&(q->tail), __ATOMIC_ACQUIRE)!=__atomic_load_n(&(q->head), __ATOMIC_ACQUIRE)) {
+		if (write(q->kick_fd, &(uint64){1}, sizeof(uint64)) < 0) {
+			// LOG_IDLE_MSで起きる
+		}
+		nanosleep(&ts, NULL);
+	}
 }
 
 void _log_error(const char* format, ...)
 {
 	va_list arg;
 	va_start(arg, format);
-	_vlog_write("error: ", format, arg);
+	_vlog_write(LOG_LEVEL_ERROR, "error: ", format, arg);
 	va_end(arg);
-	exit(1);
+	// プロセスは終了せず、実行中のゲストだけを止める
+	if (log_guest) {
+		log_guest->failed = 1;
+		log_guest->shutdown = 1;
+		log_guest->halted = 1;
+	}
 }
 
 void _log_warning(const char* format, ...)
 {
 	va_list arg;
 	va_start(arg, format);
-	_vlog_write("warning: ", format, arg);
+	_vlog_write(LOG_LEVEL_WARNING, "warning: ", format, arg);
 	va_end(arg);
 }
 
@@ -28,7 +367,7 @@ void _log_debug(const char* format, ...)
 {
 	va_list arg;
 	va_start(arg, format);
-	_vlog_write("debug: ", format, arg);
+	_vlog_write(LOG_LEVEL_DEBUG, "debug: ", format, arg);
 	va_end(arg);
 }
 
@@ -36,6 +375,6 @@ void _log_info(const char* format, ...)
 {
 	va_list arg;
 	va_start(arg, format);
-	_vlog_write("info: ", format, arg);
+	_vlog_write(LOG_LEVEL_INFO, "info: ", format, arg);
 	va_end(arg);
 }
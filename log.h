@@ -1,6 +1,12 @@
 #ifndef LOG_H
 #define LOG_H
 
+// VCPU_LOG_LEVEL(log_enabledで確かめる)
+#define LOG_LEVEL_ERROR		0
+#define LOG_LEVEL_WARNING	1
+#define LOG_LEVEL_INFO		2
+#define LOG_LEVEL_DEBUG		3
+
 // 出力する
 #define log_error _log_error
 #define log_warning _log_warning
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "cpux86.h"
+#include "machine.h"
+#include "log.h"
+
+
+// SMP: vCPUをMACHINE_CPUS個まで作り、それぞれのスレッドで実行する
+//   APはBSPとRAM、CPUID、時計の起点を共有し、デバイスは持たない(ポートI/OはBSPのデバイスに回る)
+//   共有したRAMの書き込み保護ではどのvCPUのSIGSEGVか区別できないので、JITは使わずにインタプリタで実行する
+//   PIT、RTCの時刻はBSPの時計で数える
+
+
+// mp table
+
+static uint8 mp_checksum(uint8 *p, int len)
+{
+	uint8 sum = 0;
+	int i;
+
+	for (i=0; i<len; i++) {
+		sum += p[i];
+	}
+	return -sum;
+}
+
+static void mp_put16(uint8 *p, uint16 val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+}
+
+static void mp_put32(uint8 *p, uint32 val)
+{
+	mp_put16(p, val);
+	mp_put16(p + 2, val >> 16);
+}
+
+// 8バイトのエントリ(バス、I/O APIC、割り込みの割り当て)
+static uint8* mp_entry(uint8 *p, uint8 type, uint8 a, uint8 b, uint8 c, uint8 d, uint8 e, uint8 f, uint8 g)
+{
+	p[0] = type;
+	p[1] = a;
+	p[2] = b;
+	p[3] = c;
+	p[4] = d;
+	p[5] = e;
+	p[6] = f;
+	p[7] = g;
+	return p + 8;
+}
+
+// MPフローティングポインタと構成テーブル(MP仕様1.4)
+//   I/O APICのアドレスにはポート番号(IOAPIC_PORT)を書く
+//   ISAのIRQnはI/O APICのピンn、LINT0はExtINT(PIC)、LINT1はNMI
+static void machine_mp_table(Machine *m)
+{
+	CPUx86 *bsp = m->cpu[0];
+	uint8 *mp;
+	uint8 *table;
+	uint8 *p;
+	int count;
+	int i;
+
+	if (bsp->mem_size < MP_TABLE_ADDR + 1024) {
+		return;
+	}
+	mp = bsp->mem + MP_TABLE_ADDR;
+	table = mp + 16;
+	memset(mp, 0, 1024);
+
+	// エントリ(ヘッダは最後に書く)
+	p = table + 44;
+	count = 0;
+	for (i=0; i<m->cpu_count; i++) {
+		p[0] = 0;	// プロセッサ
+		p[1] = m->cpu[i]->apic.id;
+		p[2] = 0x14;	// ローカルAPICのバージョン
+		p[3] = 0x01 | (i==0 ? 0x02 : 0);	// EN BP
+		mp_put32(p + 4, bsp->cpuid.signature);
+		mp_put32(p + 8, bsp->cpuid.features);
+		p += 20;
+		count++;
+	}
+	p = mp_entry(p, 1, 0, 'I', 'S', 'A', ' ', ' ', ' ');
+	count++;
+	p = mp_entry(p, 2, m->ioapic.id, IOAPIC_VERSION, 0x01, 0, 0, 0, 0);
+	mp_put32(p - 4, IOAPIC_PORT);
+	count++;
+	// IRQ2はカスケードなので割り当てない
+	for (i=0; i<16; i++) {
+		if (i!=2) {
+			p = mp_entry(p, 3, 0, 0, 0, 0, i, m->ioapic.id, i);
+			count++;
+		}
+	}
+	p = mp_entry(p, 4, 3, 0, 0, 0, 0, 0xFF, 0);
+	p = mp_entry(p, 4, 1, 0, 0, 0, 0, 0xFF, 1);
+	count += 2;
+
+	// 構成テーブルのヘッダ
+	memcpy(table, "PCMP", 4);
+	mp_put16(table + 4, p - table);
+	table[6] = 4;
+	memcpy(table + 8, "VCPU    ", 8);
+	memcpy(table + 16, "X86 EMULATOR", 12);
+	mp_put16(table + 34, count);
+	mp_put32(table + 36, APIC_BASE_ADDR);
+	table[7] = mp_checksum(table, p - table);
+
+	// フローティングポインタ
+	memcpy(mp, "_MP_", 4);
+	mp_put32(mp + 4, MP_TABLE_ADDR + 16);
+	mp[8] = 1;	// 16バイト単位の長さ
+	mp[9] = 4;
+	mp[10] = mp_checksum(mp, 16);
+}
+
+
+// machine
+
+// APはデバイスを持たず、RAMとCPUIDと時計の起点をBSPからもらう
+static CPUx86* machine_new_ap(CPUx86 *bsp)
+{
+	CPUx86 *cpu = calloc(1, sizeof(CPUx86));
+
+	cpu_reset(cpu);
+	cpu->cpuid = bsp->cpuid;
+	cpu->clock = bsp->clock;
+	cpu->mem = bsp->mem;
+	cpu->mem_size = bsp->mem_size;
+	cpu->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (cpu->wake_fd < 0) {
+		log_error("machine: eventfd: %s\n", strerror(errno));
+	}
+	metrics_init(cpu);
+	return cpu;
+}
+
+// countが1以下ならnew_cpux86と同じ(Machineを作らない)
+// BSPを返す(APはBSPのcpu->machineから辿る)
+CPUx86* new_machine(size_t mem_size, int count)
+{
+	Machine *m;
+	CPUx86 *cpu;
+	int i;
+
+	cpu = new_cpux86(mem_size);
+	if (count <= 1) {
+		return cpu;
+	}
+	if (MACHINE_CPUS < count) {
+		log_warning("machine: up to %d CPUs\n", MACHINE_CPUS);
+		count = MACHINE_CPUS;
+	}
+	m = calloc(1, sizeof(Machine));
+	pthread_mutex_init(&(m->io_lock), NULL);
+	m->cpu_count = count;
+
+	jit_delete(cpu);
+	cpu->cpuid.features |= CPUID_MSR | CPUID_APIC;
+	cpu->cpuid.features_ecx |= CPUID_ECX_X2APIC;
+	for (i=0; i<count; i++) {
+		m->cpu[i] = i==0 ? cpu : machine_new_ap(cpu);
+		m->cpu[i]->machine = m;
+		apic_init(m->cpu[i], i);
+	}
+	ioapic_init(cpu);
+	machine_mp_table(m);
+	return cpu;
+}
+
+// BSPを消すときにAPとMachineも消す(RAMはBSPが解放する)
+void machine_delete(CPUx86 *cpu)
+{
+	Machine *m = cpu->machine;
+	CPUx86 *ap;
+	int i;
+
+	if (m==NULL || m->cpu[0]!=cpu) {
+		return;
+	}
+	for (i=1; i<m->cpu_count; i++) {
+		ap = m->cpu[i];
+		ap->machine = NULL;
+		ap->mem = NULL;
+		delete_cpux86(ap);
+	}
+	pthread_mutex_destroy(&(m->io_lock));
+	free(m);
+	cpu->machine = NULL;
+}
+
+// 止まるまで実行する
+//   BSP: トリプルフォールト、log_error、割り込みを受け付けないHLTで止まる
+//   AP: BSPが止まるまで(INIT、SIPIを待っているときはHLTと同じ)
+static void machine_run_cpu(CPUx86 *cpu)
+{
+	Machine *m = cpu->machine;
+
+	while (!__atomic_load_n(&(m->stop), __ATOMIC_ACQUIRE)) {
+		exec_cpux86(cpu);
+		if (cpu->shutdown) {
+			break;
+		}
+		if (m->cpu[0]==cpu && cpu->halted && !cpu_eflags(cpu, CPU_EFLAGS_IF)) {
+			break;
+		}
+		// タイマーもI/Oもなければ他のvCPUからの割り込みを待つ
+		if (cpu->halted && !clock_idle(cpu)) {
+			pc_wait(cpu, -1);
+		}
+	}
+}
+
+static void* machine_thread(void *arg)
+{
+	machine_run_cpu(arg);
+	return NULL;
+}
+
+// APをスレッドで動かし、BSPは呼び出したスレッドで動かす
+// BSPが止まったらAPも止めて待つ
+void run_machine(CPUx86 *cpu)
+{
+	Machine *m = cpu->machine;
+	int started;
+	int i;
+
+	if (m==NULL) {
+		run_cpux86(cpu);
+		return;
+	}
+	for (started=1; started<m->cpu_count; started++) {
+		if (pthread_create(&(m->thread[started]), NULL, machine_thread, m->cpu[started])) {
+			log_warning("machine: cannot create thread for cpu %d\n", started);
+			break;
+		}
+	}
+	machine_run_cpu(cpu);
+	__atomic_store_n(&(m->stop), 1, __ATOMIC_RELEASE);
+	for (i=1; i<started; i++) {
+		pc_kick(m->cpu[i]);
+		pthread_join(m->thread[i], NULL);
+	}
+}
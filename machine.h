@@ -0,0 +1,42 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include <pthread.h>
+#include "cpux86.h"
+
+
+// SMP: RAMとデバイスを共有する複数のvCPU
+//   cpu[0]がBSPで、デバイス(PIC、PIT、RTC、virtio、コンソール)はBSPのものだけを使う
+//   どのvCPUのポートI/OもBSPのデバイスにio_lockを取って回す
+//   vCPUはそれぞれのスレッドで実行し、割り込みは相手のローカルAPICのIRRを立てて起こす
+
+#define MACHINE_CPUS	16
+
+// I/O APIC(MMIOがないのでポートに置く、MPテーブルのアドレスにはポート番号を書く)
+#define IOAPIC_PORT		0xC0A0	// +0: IOREGSEL +4: IOWIN
+#define IOAPIC_PORTS	8
+#define IOAPIC_PINS		24		// ピンnはISAのIRQn(エッジトリガのみ)
+#define IOAPIC_VERSION	0x11
+
+#define IOAPIC_MASKED	0x10000		// リダイレクションテーブルのbit16
+
+// MPテーブル(基本メモリの最後の1KB)
+#define MP_TABLE_ADDR	0x9FC00
+
+typedef struct {
+	uint8 index;		// IOREGSEL
+	uint8 id;
+	uint64 redir[IOAPIC_PINS];
+	uint32 level;		// 入力の現在のレベル(立ち上がりで送る)
+} IoApic;
+
+struct Machine {
+	CPUx86 *cpu[MACHINE_CPUS];		// cpu[0]: BSP
+	int cpu_count;
+	pthread_mutex_t io_lock;		// BSPのデバイス(ポートI/O、デバイスのポーリング、PIC、I/O APIC)
+	IoApic ioapic;
+	pthread_t thread[MACHINE_CPUS];	// APのスレッド
+	int stop;						// BSPが止まったのでAPも止める
+};
+
+#endif
@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "cpux86.h"
+#include "jit.h"
+#include "machine.h"
+#include "log.h"
+
+
+// 統計の出力(Prometheusのテキスト形式)
+//   カウンタはCPUx86の中にあり、そのvCPUのスレッドだけが書く
+//   出力するときに登録しているゲストをすべて読む(書いている途中の値でも壊れない64bitの読み出し)
+//
+//   VCPU_METRICS=ファイル: ゲストを消すときに書き出す
+//   VCPU_METRICS_SOCKET=UNIXソケットのパス: つなぐたびに書き出す(curl --unix-socketなどで読む)
+
+#define metrics_load(val)	__atomic_load_n(&(val), __ATOMIC_RELAXED)
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static CPUx86 *metrics_guests;		// 登録しているゲスト(metrics.nextでつなぐ)
+static int metrics_next_id = 1;
+static int metrics_listen_fd = -1;
+
+
+// histogram
+
+void metrics_hist_add(MetricsHist *hist, uint64 val)
+{
+	int i;
+
+	i = val ? 64 - __builtin_clzll(val) : 0;
+	if (METRICS_BUCKETS <= i) {
+		i = METRICS_BUCKETS - 1;
+	}
+	hist->bucket[i]++;
+	hist->count++;
+	hist->sum += val;
+}
+
+
+// dump
+
+static void metrics_header(FILE *fp, const char *name, const char *type, const char *help)
+{
+	fprintf(fp, "# HELP %s %s\n", name, help);
+	fprintf(fp, "# TYPE %s %s\n", name, type);
+}
+
+// ナノ秒のヒストグラムを秒で出す
+static void metrics_put_hist(FILE *fp, const char *name, int id, MetricsHist *hist)
+{
+	uint64 total = 0;
+	int i;
+
+	for (i=0; i<METRICS_BUCKETS - 1; i++) {
+		total += metrics_load(hist->bucket[i]);
+		fprintf(fp, "%s_bucket{guest=\"%d\",le=\"%g\"} %llu\n", name, id, (double)(1ULL << i) / 1e9, total);
+	}
+	total += metrics_load(hist->bucket[METRICS_BUCKETS - 1]);
+	fprintf(fp, "%s_bucket{guest=\"%d\",le=\"+Inf\"} %llu\n", name, id, total);
+	fprintf(fp, "%s_sum{guest=\"%d\"} %g\n", name, id, (double)metrics_load(hist->sum) / 1e9);
+	fprintf(fp, "%s_count{guest=\"%d\"} %llu\n", name, id, total);
+}
+
+static void metrics_put_io(FILE *fp, CPUx86 *cpu, const char *dir, uint64 *count)
+{
+	IoPort *io;
+	uint64 val;
+	int i;
+
+	// SMPのAPもBSPのデバイスを使うので、添字はBSPのcpu->io
+	io = cpu->machine ? cpu->machine->cpu[0]->io : cpu->io;
+
+	for (i=0; i<=IO_PORTS; i++) {
+		val = metrics_load(count[i]);
+		if (val==0) {
+			continue;
+		}
+		if (i==IO_PORTS) {
+			fprintf(fp, "vcpu_io_exits_total{guest=\"%d\",dir=\"%s\",port=\"unmapped\"} %llu\n", cpu->metrics.id, dir, val);
+		} else {
+			fprintf(fp, "vcpu_io_exits_total{guest=\"%d\",dir=\"%s\",port=\"0x%04X\"} %llu\n", cpu->metrics.id, dir, io[i].port, val);
+		}
+	}
+}
+
+// 登録しているゲストすべてを書き出す
+int metrics_dump(FILE *fp)
+{
+	CPUx86 *cpu;
+	JitCache *jit;
+	Metrics *m;
+	uint64 val;
+	int i;
+
+	pthread_mutex_lock(&metrics_lock);
+
+	metrics_header(fp, "vcpu_instructions_total", "counter", "Guest instructions retired.");
+	for (cpu=metrics_guests; cpu; cpu=cpu->metrics.next) {
+		fprintf(fp, "vcpu_instructions_total{guest=\"%d\"} %llu\n", cpu->metrics.id, metrics_load(cpu->clock.icount));
+	}
+
+	metrics_header(fp, "vcpu_block_cache_lookups_total", "counter", "Translated block lookups on entry from the interpreter.");
+	for (cpu=metrics_guests; cpu; cpu=cpu->metrics.next) {
+		jit = cpu->jit;
+		if (jit) {
+			fprintf(fp, "vcpu_block_cache_lookups_total{guest=\"%d\",result=\"hit\"} %llu\n", cpu->metrics.id, metrics_load(jit->stat_lookup_hit));
+			fprintf(fp, "vcpu_block_cache_lookups_total{guest=\"%d\",result=\"miss\"} %llu\n", cpu->metrics.id, metrics_load(jit->stat_lookup_miss));
+		}
+	}
+	metrics_header(fp, "vcpu_block_dispatch_total", "counter", "Block-to-block dispatches that did or did not need a hash lookup.");
+	for (cpu=metrics_guests; cpu; cpu=cpu->metrics.next) {
+		jit = cpu->jit;
+		if (jit) {
+			fprintf(fp, "vcpu_block_dispatch_total{guest=\"%d\",result=\"hit\"} %llu\n", cpu->metrics.id, metrics_load(jit->stat_dispatch_hit));
+			fprintf(fp, "vcpu_block_dispatch_total{guest=\"%d\",result=\"miss\"} %llu\n", cpu->metrics.id, metrics_load(jit->stat_dispatch_miss));
+		}
+	}
+	metrics_header(fp, "vcpu_block_cache_events_total", "counter", "Translation cache fills, invalidations, flushes and cross-guest shared cache use.");
+	for (cpu=metrics_guests; cpu; cpu=cpu->metrics.next) {
+		jit = cpu->jit;
+		if (jit) {
+			fprintf(fp, "vcpu_block_cache_events_total{guest=\"%d\",event=\"translated\"} %llu\n", cpu->metrics.id, metrics_load(jit->stat_translated));
+			fprintf(fp, "vcpu_block_cache_events_total{guest=\"%d\",event=\"invalidated\"} %llu\n", cpu->metrics.id, metrics_load(jit->stat_invalidated));
+			fprintf(fp, "vcpu_block_cache_events_total{guest=\"%d\",event=\"flush\"} %llu\n", cpu->metrics.id, metrics_load(jit->stat_flushes));
+			fprintf(fp, "vcpu_block_cache_events_total{guest=\"%d\",event=\"shared_hit\"} %llu\n", cpu->metrics.id, metrics_load(jit->stat_shared_hit));
+			fprintf(fp, "vcpu_block_cache_events_total{guest=\"%d\",event=\"shared_published\"} %llu\n", cpu->metrics.id, metrics_load(jit->stat_shared_published));
+		}
+	}
+
+	metrics_header(fp, "vcpu_desc_cache_lookups_total", "counter", "Segment descriptor cache lookups.");
+	for (cpu=metrics_guests; cpu; cpu=cpu->metrics.next) {
+		m = &(cpu->metrics);
+		fprintf(fp, "vcpu_desc_cache_lookups_total{guest=\"%d\",result=\"hit\"} %llu\n", m->id, metrics_load(m->desc_hit));
+		fprintf(fp, "vcpu_desc_cache_lookups_total{guest=\"%d\",result=\"miss\"} %llu\n", m->id, metrics_load(m->desc_miss));
+	}
+
+	metrics_header(fp, "vcpu_exceptions_total", "counter", "Exceptions delivered, by vector.");
+	for (cpu=metrics_guests; cpu; cpu=cpu->metrics.next) {
+		m = &(cpu->metrics);
+		for (i=0; i<METRICS_VECTORS; i++) {
+			val = metrics_load(m->exceptions[i]);
+			if (val) {
+				fprintf(fp, "vcpu_exceptions_total{guest=\"%d\",vector=\"%d\"} %llu\n", m->id, i, val);
+			}
+		}
+	}
+
+	metrics_header(fp, "vcpu_io_exits_total", "counter", "Port I/O accesses, by registered port range.");
+	for (cpu=metrics_guests; cpu; cpu=cpu->metrics.next) {
+		metrics_put_io(fp, cpu, "in", cpu->metrics.io_in);
+		metrics_put_io(fp, cpu, "out", cpu->metrics.io_out);
+	}
+
+	metrics_header(fp, "vcpu_interrupt_latency_seconds", "histogram", "Guest time from IRR set to interrupt acknowledge.");
+	for (cpu=metrics_guests; cpu; cpu=cpu->metrics.next) {
+		metrics_put_hist(fp, "vcpu_interrupt_latency_seconds", cpu->metrics.id, &(cpu->metrics.irq_latency));
+	}
+	metrics_header(fp, "vcpu_slice_seconds", "histogram", "Host time spent executing one slice.");
+	for (cpu=metrics_guests; cpu; cpu=cpu->metrics.next) {
+		metrics_put_hist(fp, "vcpu_slice_seconds", cpu->metrics.id, &(cpu->metrics.slice_ns));
+	}
+
+	pthread_mutex_unlock(&metrics_lock);
+	return ferror(fp) ? -1 : 0;
+}
+
+// 一時ファイルに書いてから置き換える(読む側が書きかけを見ない)
+int metrics_write(const char *fname)
+{
+	char tmp[4096];
+	FILE *fp;
+
+	if (sizeof(tmp) <= (size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", fname)) {
+		return -1;
+	}
+	fp = fopen(tmp, "w");
+	if (fp==NULL) {
+		log_warning("metrics: cannot open %s\n", tmp);
+		return -1;
+	}
+	if (metrics_dump(fp) < 0 || fclose(fp)!=0 || rename(tmp, fname) < 0) {
+		log_warning("metrics: cannot write %s\n", fname);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+
+// socket
+
+static void* metrics_thread(void *arg)
+{
+	FILE *fp;
+	int fd;
+
+	for (;;) {
+		fd = accept(metrics_listen_fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		fp = fdopen(fd, "w");
+		if (fp==NULL) {
+			close(fd);
+			continue;
+		}
+		metrics_dump(fp);
+		fclose(fp);
+	}
+	return NULL;
+}
+
+// UNIXソケットで待ち受ける(プロセスで1つ)
+int metrics_listen(const char *path)
+{
+	struct sockaddr_un sun;
+	pthread_t thread;
+	int fd;
+
+	if (0 <= metrics_listen_fd) {
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (sizeof(sun.sun_path) <= strlen(path)) {
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+	unlink(path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr*)&sun, sizeof(sun)) < 0 || listen(fd, 4) < 0) {
+		log_warning("metrics: cannot listen on %s\n", path);
+		if (0 <= fd) {
+			close(fd);
+		}
+		return -1;
+	}
+	metrics_listen_fd = fd;
+	if (pthread_create(&thread, NULL, metrics_thread, NULL)) {
+		log_warning("metrics: cannot create thread\n");
+		close(fd);
+		metrics_listen_fd = -1;
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+
+// metrics
+
+void metrics_init(CPUx86 *cpu)
+{
+	char *env;
+
+	pthread_mutex_lock(&metrics_lock);
+	cpu->metrics.id = metrics_next_id++;
+	cpu->metrics.next = metrics_guests;
+	metrics_guests = cpu;
+	env = getenv("VCPU_METRICS_SOCKET");
+	if (env && metrics_listen_fd < 0) {
+		metrics_listen(env);
+	}
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+// VCPU_METRICSがあれば消す前の値を書き出してから外す
+void metrics_delete(CPUx86 *cpu)
+{
+	CPUx86 **p;
+	char *env;
+
+	if (cpu->metrics.id==0) {
+		return;
+	}
+	env = getenv("VCPU_METRICS");
+	if (env) {
+		metrics_write(env);
+	}
+	pthread_mutex_lock(&metrics_lock);
+	for (p=&metrics_guests; *p; p=&((*p)->metrics.next)) {
+		if (*p==cpu) {
+			*p = cpu->metrics.next;
+			break;
+		}
+	}
+	cpu->metrics.id = 0;
+	pthread_mutex_unlock(&metrics_lock);
+}
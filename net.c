@@ -0,0 +1,793 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include "cpux86.h"
+#include "net.h"
+#include "log.h"
+
+
+// スイッチはプロセスに1つ(最初のvnet_attachで作り、最後のvnet_deleteで止める)
+static NetSwitch *net_switch = NULL;
+static pthread_mutex_t net_switch_create = PTHREAD_MUTEX_INITIALIZER;
+
+
+// queue
+
+static NetBuf* netq_back(NetQueue *q)
+{
+	if (q->head - __atomic_load_n(&(q->tail), __ATOMIC_ACQUIRE)==NET_QUEUE) {
+		return NULL;
+	}
+	return &(q->buf[q->head % NET_QUEUE]);
+}
+
+static void netq_push(NetQueue *q)
+{
+	__atomic_store_n(&(q->head), q->head + 1, __ATOMIC_RELEASE);
+}
+
+static NetBuf* netq_front(NetQueue *q)
+{
+	if (__atomic_load_n(&(q->head), __ATOMIC_ACQUIRE)==q->tail) {
+		return NULL;
+	}
+	return &(q->buf[q->tail % NET_QUEUE]);
+}
+
+static void netq_pop(NetQueue *q)
+{
+	__atomic_store_n(&(q->tail), q->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void netq_reset(NetQueue *q)
+{
+	q->head = 0;
+	q->tail = 0;
+}
+
+
+// iovec
+
+// iovの先頭からlenバイトをbufに読む
+static void net_peek(const struct iovec *iov, int iovcnt, uint8 *buf, uint32 len)
+{
+	uint32 n;
+	int i;
+
+	for (i=0; i<iovcnt && len; i++) {
+		n = iov[i].iov_len < len ? iov[i].iov_len : len;
+		memcpy(buf, iov[i].iov_base, n);
+		buf += n;
+		len -= n;
+	}
+}
+
+// virtio_net_hdr(0)とフレームを受信バッファに書く
+static void net_copy(NetBuf *dst, const struct iovec *iov, int iovcnt)
+{
+	const uint8 *src;
+	uint8 *out;
+	uint32 src_left;
+	uint32 out_left;
+	uint32 skip = NET_HDR;
+	uint32 n;
+	int i = 0;
+	int j = 0;
+
+	src = iov[0].iov_base;
+	src_left = iov[0].iov_len;
+	out = dst->iov[0].iov_base;
+	out_left = dst->iov[0].iov_len;
+	for (;;) {
+		while (out_left==0) {
+			if (dst->iovcnt <= ++j) {
+				return;
+			}
+			out = dst->iov[j].iov_base;
+			out_left = dst->iov[j].iov_len;
+		}
+		if (skip) {
+			n = skip < out_left ? skip : out_left;
+			memset(out, 0, n);
+			out += n;
+			out_left -= n;
+			skip -= n;
+			continue;
+		}
+		while (src_left==0) {
+			if (iovcnt <= ++i) {
+				return;
+			}
+			src = iov[i].iov_base;
+			src_left = iov[i].iov_len;
+		}
+		n = src_left < out_left ? src_left : out_left;
+		memcpy(out, src, n);
+		out += n;
+		out_left -= n;
+		src += n;
+		src_left -= n;
+	}
+}
+
+
+// pcap
+
+#define PCAP_MAGIC		0xA1B2C3D4
+#define PCAP_ETHERNET	1
+
+static void net_pcap_open(NetSwitch *sw, const char *fname)
+{
+	uint32 header[6];
+
+	sw->pcap_fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (sw->pcap_fd < 0) {
+		log_warning("net: cannot open %s: %s\n", fname, strerror(errno));
+		return;
+	}
+	header[0] = PCAP_MAGIC;
+	header[1] = 2 | 4 << 16;	// 2.4
+	header[2] = 0;
+	header[3] = 0;
+	header[4] = NET_FRAME_MAX;
+	header[5] = PCAP_ETHERNET;
+	if (write(sw->pcap_fd, header, sizeof(header))!=sizeof(header)) {
+		log_warning("net: pcap: %s\n", strerror(errno));
+	}
+}
+
+// スイッチを通るフレームを書く(ゲストのRAMから直接)
+static void net_pcap_write(NetSwitch *sw, const struct iovec *iov, int iovcnt, uint32 len)
+{
+	struct iovec rec[NET_SEG_MAX + 1];
+	struct timeval tv;
+	uint32 header[4];
+
+	gettimeofday(&tv, NULL);
+	header[0] = tv.tv_sec;
+	header[1] = tv.tv_usec;
+	header[2] = len;
+	header[3] = len;
+	rec[0].iov_base = header;
+	rec[0].iov_len = sizeof(header);
+	memcpy(&(rec[1]), iov, sizeof(struct iovec) * iovcnt);
+	if (writev(sw->pcap_fd, rec, iovcnt + 1) < 0) {
+		log_warning("net: pcap: %s\n", strerror(errno));
+		close(sw->pcap_fd);
+		sw->pcap_fd = -1;
+	}
+}
+
+
+// tap
+
+static int net_tap_open(NetSwitch *sw, const char *ifname)
+{
+	NetSwitchPort *port;
+	struct ifreq ifr;
+	int fd;
+
+	fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		log_warning("net: cannot open /dev/net/tun: %s\n", strerror(errno));
+		return 0;
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	snprintf(ifr.ifr_name, IFNAMSIZ, "%s", ifname);
+	if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+		log_warning("net: TUNSETIFF %s: %s\n", ifname, strerror(errno));
+		close(fd);
+		return 0;
+	}
+	port = &(sw->port[NET_SWITCH_PORTS - 1]);
+	memset(port, 0, sizeof(NetSwitchPort));
+	port->type = NET_PORT_TAP;
+	port->fd = fd;
+	port->wake_fd = -1;
+	port->active = 1;
+	return 1;
+}
+
+
+// switch
+
+static int net_mac_hash(const uint8 *mac)
+{
+	return (mac[3] ^ mac[4] * 7 ^ mac[5] * 31) % NET_MAC_TABLE;
+}
+
+static void net_learn(NetSwitch *sw, const uint8 *mac, int port)
+{
+	int h;
+
+	// マルチキャストの送信元は覚えない
+	if (mac[0] & 1) {
+		return;
+	}
+	h = net_mac_hash(mac);
+	memcpy(sw->mac_table[h].mac, mac, 6);
+	sw->mac_table[h].port = port;
+}
+
+static int net_lookup(NetSwitch *sw, const uint8 *mac)
+{
+	int h;
+
+	if (mac[0] & 1) {
+		return -1;
+	}
+	h = net_mac_hash(mac);
+	if (sw->mac_table[h].port < 0 || memcmp(sw->mac_table[h].mac, mac, 6)!=0) {
+		return -1;
+	}
+	return sw->mac_table[h].port;
+}
+
+// 1つのポートへ送る
+static void net_deliver(NetSwitch *sw, NetSwitchPort *dst, const struct iovec *iov, int iovcnt, uint32 len)
+{
+	NetBuf *buf;
+	NetBuf *done;
+
+	if (dst->type==NET_PORT_TAP) {
+		if (writev(dst->fd, iov, iovcnt) < 0) {
+			dst->stat_rx_dropped++;
+			return;
+		}
+		dst->stat_rx_frames++;
+		dst->stat_rx_bytes += len;
+		return;
+	}
+
+	// 受信バッファがなければ捨てる(実機のNICと同じ)
+	buf = netq_front(&(dst->rx));
+	if (buf==NULL || buf->len < NET_HDR + len) {
+		dst->stat_rx_dropped++;
+		return;
+	}
+	done = netq_back(&(dst->rx_done));
+	if (done==NULL) {
+		dst->stat_rx_dropped++;
+		return;
+	}
+	net_copy(buf, iov, iovcnt);
+	done->head = buf->head;
+	done->len = NET_HDR + len;
+	// vCPUが書き終えたページを翻訳できるように戻す
+	done->iovcnt = buf->iovcnt;
+	memcpy(done->iov, buf->iov, sizeof(struct iovec) * buf->iovcnt);
+	netq_push(&(dst->rx_done));
+	netq_pop(&(dst->rx));
+	dst->wake = 1;
+	dst->stat_rx_frames++;
+	dst->stat_rx_bytes += len;
+}
+
+// 宛先のMACアドレスを覚えていればそのポートへ、なければ送り手以外のすべてへ
+static void net_forward(NetSwitch *sw, int src, const struct iovec *iov, int iovcnt, uint32 len)
+{
+	uint8 eth[12];
+	int dst;
+	int i;
+
+	if (len < NET_FRAME_MIN) {
+		return;
+	}
+	net_peek(iov, iovcnt, eth, sizeof(eth));
+	net_learn(sw, eth + 6, src);
+	if (0 <= sw->pcap_fd) {
+		net_pcap_write(sw, iov, iovcnt, len);
+	}
+	sw->port[src].stat_tx_frames++;
+	sw->port[src].stat_tx_bytes += len;
+
+	dst = net_lookup(sw, eth);
+	if (0 <= dst && sw->port[dst].active) {
+		if (dst!=src) {
+			net_deliver(sw, &(sw->port[dst]), iov, iovcnt, len);
+		}
+		return;
+	}
+	sw->stat_flooded++;
+	for (i=0; i<NET_SWITCH_PORTS; i++) {
+		if (i!=src && sw->port[i].active) {
+			net_deliver(sw, &(sw->port[i]), iov, iovcnt, len);
+		}
+	}
+}
+
+// ゲストの送信キューとTAPをすべて回し、完了を返したvCPUを1回ずつ起こす
+static void net_switch_pass(NetSwitch *sw)
+{
+	NetSwitchPort *port;
+	NetBuf *buf;
+	NetBuf *done;
+	struct iovec iov;
+	ssize_t len;
+	uint64 one = 1;
+	int i;
+	int n;
+
+	sw->stat_passes++;
+	for (i=0; i<NET_SWITCH_PORTS; i++) {
+		port = &(sw->port[i]);
+		if (!port->active) {
+			continue;
+		}
+		if (port->type==NET_PORT_TAP) {
+			for (n=0; n<VIRTQ_NUM; n++) {
+				len = read(port->fd, sw->frame, sizeof(sw->frame));
+				if (len <= 0) {
+					break;
+				}
+				iov.iov_base = sw->frame;
+				iov.iov_len = len;
+				net_forward(sw, i, &iov, 1, len);
+			}
+			continue;
+		}
+		while ((buf = netq_front(&(port->tx)))) {
+			done = netq_back(&(port->tx_done));
+			if (done==NULL) {
+				break;
+			}
+			net_forward(sw, i, buf->iov, buf->iovcnt, buf->len);
+			done->head = buf->head;
+			done->len = 0;
+			netq_push(&(port->tx_done));
+			netq_pop(&(port->tx));
+			port->wake = 1;
+		}
+	}
+	for (i=0; i<NET_SWITCH_PORTS; i++) {
+		port = &(sw->port[i]);
+		if (port->wake) {
+			port->wake = 0;
+			if (write(port->wake_fd, &one, sizeof(one)) < 0) {
+				// スライスの区切りで受け取る
+			}
+		}
+	}
+}
+
+static void* net_switch_thread(void *arg)
+{
+	NetSwitch *sw = arg;
+	struct pollfd pfd[2];
+	uint64 val;
+	int n;
+
+	for (;;) {
+		pfd[0].fd = sw->kick_fd;
+		pfd[0].events = POLLIN;
+		n = 1;
+		if (sw->port[NET_SWITCH_PORTS - 1].active) {
+			pfd[1].fd = sw->port[NET_SWITCH_PORTS - 1].fd;
+			pfd[1].events = POLLIN;
+			n = 2;
+		}
+		if (poll(pfd, n, -1) < 0 && errno!=EINTR) {
+			break;
+		}
+		if ((pfd[0].revents & POLLIN) && read(sw->kick_fd, &val, sizeof(val)) < 0) {
+			// 他で読まれた
+		}
+		pthread_mutex_lock(&(sw->lock));
+		if (sw->stop) {
+			pthread_mutex_unlock(&(sw->lock));
+			break;
+		}
+		net_switch_pass(sw);
+		pthread_mutex_unlock(&(sw->lock));
+	}
+	return NULL;
+}
+
+static void net_switch_kick(NetSwitch *sw)
+{
+	uint64 one = 1;
+
+	if (write(sw->kick_fd, &one, sizeof(one)) < 0) {
+		// 既に起きている
+	}
+}
+
+// VCPU_NET_TAP=インターフェース名、VCPU_NET_PCAP=ファイル
+static NetSwitch* net_switch_new(void)
+{
+	NetSwitch *sw;
+	char *env;
+	int i;
+
+	sw = calloc(1, sizeof(NetSwitch));
+	if (sw==NULL) {
+		return NULL;
+	}
+	for (i=0; i<NET_MAC_TABLE; i++) {
+		sw->mac_table[i].port = -1;
+	}
+	sw->pcap_fd = -1;
+	sw->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pthread_mutex_init(&(sw->lock), NULL);
+	env = getenv("VCPU_NET_PCAP");
+	if (env && *env) {
+		net_pcap_open(sw, env);
+	}
+	env = getenv("VCPU_NET_TAP");
+	if (env && *env) {
+		net_tap_open(sw, env);
+	}
+	if (sw->kick_fd < 0 || pthread_create(&(sw->thread), NULL, net_switch_thread, sw)) {
+		log_warning("net: cannot start switch\n");
+		if (0 <= sw->kick_fd) {
+			close(sw->kick_fd);
+		}
+		free(sw);
+		return NULL;
+	}
+	return sw;
+}
+
+static void net_switch_delete(NetSwitch *sw)
+{
+	pthread_mutex_lock(&(sw->lock));
+	sw->stop = 1;
+	pthread_mutex_unlock(&(sw->lock));
+	net_switch_kick(sw);
+	pthread_join(sw->thread, NULL);
+	if (sw->port[NET_SWITCH_PORTS - 1].active) {
+		close(sw->port[NET_SWITCH_PORTS - 1].fd);
+	}
+	if (0 <= sw->pcap_fd) {
+		close(sw->pcap_fd);
+	}
+	close(sw->kick_fd);
+	pthread_mutex_destroy(&(sw->lock));
+	free(sw);
+}
+
+
+// virtio-net
+
+static void vnet_interrupt(CPUx86 *cpu, VirtioNet *net)
+{
+	if (virtq_interrupt(cpu, &(net->vq[NET_RX])) || virtq_interrupt(cpu, &(net->vq[NET_TX]))) {
+		net->isr |= 1;
+		pic_set_irq(cpu, NET_IRQ, 1);
+		pic_set_irq(cpu, NET_IRQ, 0);
+	}
+}
+
+// 要素をNetBufにする(skipバイトを飛ばす、writeは期待する向き)
+static int vnet_elem(VirtqElem *elem, NetBuf *buf, CPUx86 *cpu, uint32 skip, int write)
+{
+	uint32 n;
+	int i;
+
+	buf->head = elem->head;
+	buf->iovcnt = 0;
+	buf->len = 0;
+	for (i=0; i<elem->count; i++) {
+		if (elem->seg[i].write!=write) {
+			return 0;
+		}
+		n = elem->seg[i].len < skip ? elem->seg[i].len : skip;
+		skip -= n;
+		if (elem->seg[i].len==n) {
+			continue;
+		}
+		if (NET_SEG_MAX <= buf->iovcnt) {
+			return 0;
+		}
+		buf->iov[buf->iovcnt].iov_base = cpu->mem + elem->seg[i].addr + n;
+		buf->iov[buf->iovcnt].iov_len = elem->seg[i].len - n;
+		buf->iovcnt++;
+		buf->len += elem->seg[i].len - n;
+	}
+	return skip==0 && buf->iovcnt;
+}
+
+// 送信キューのフレームをまとめてスイッチに渡す
+static void vnet_tx(CPUx86 *cpu, VirtioNet *net)
+{
+	VirtqElem elem;
+	NetBuf *buf;
+	int submitted = 0;
+	int completed = 0;
+	int ret;
+
+	while ((buf = netq_back(&(net->port->tx)))) {
+		ret = virtq_pop(cpu, &(net->vq[NET_TX]), &elem);
+		if (ret==0) {
+			break;
+		}
+		if (ret < 0 || !vnet_elem(&elem, buf, cpu, NET_HDR, 0) || NET_FRAME_MAX < buf->len) {
+			virtq_push(cpu, &(net->vq[NET_TX]), elem.head, 0);
+			completed++;
+			continue;
+		}
+		netq_push(&(net->port->tx));
+		submitted++;
+	}
+	if (submitted) {
+		net_switch_kick(net->sw);
+	}
+	if (completed) {
+		vnet_interrupt(cpu, net);
+	}
+}
+
+// スイッチが書き終えた(または返さずに捨てた)受信バッファのページを翻訳できるように戻す
+static void vnet_rx_end(CPUx86 *cpu, NetBuf *buf)
+{
+	int i;
+
+	for (i=0; i<buf->iovcnt; i++) {
+		jit_dma_end(cpu, (uint8*)buf->iov[i].iov_base - cpu->mem, buf->iov[i].iov_len);
+	}
+}
+
+static void vnet_rx_end_queue(CPUx86 *cpu, NetQueue *q)
+{
+	uint32 n;
+
+	for (n=q->tail; n!=q->head; n++) {
+		vnet_rx_end(cpu, &(q->buf[n % NET_QUEUE]));
+	}
+}
+
+// 受信バッファをスイッチに渡す
+static void vnet_rx(CPUx86 *cpu, VirtioNet *net)
+{
+	VirtqElem elem;
+	NetBuf *buf;
+	int posted = 0;
+	int completed = 0;
+	int ret;
+	int i;
+
+	while ((buf = netq_back(&(net->port->rx)))) {
+		ret = virtq_pop(cpu, &(net->vq[NET_RX]), &elem);
+		if (ret==0) {
+			break;
+		}
+		if (ret < 0 || !vnet_elem(&elem, buf, cpu, 0, 1)) {
+			virtq_push(cpu, &(net->vq[NET_RX]), elem.head, 0);
+			completed++;
+			continue;
+		}
+		// スイッチのスレッドが書くので、返ってくるまでそのページは翻訳しない
+		for (i=0; i<elem.count; i++) {
+			jit_dma_begin(cpu, elem.seg[i].addr, elem.seg[i].len);
+		}
+		netq_push(&(net->port->rx));
+		posted++;
+	}
+	if (posted) {
+		net_switch_kick(net->sw);
+	}
+	if (completed) {
+		vnet_interrupt(cpu, net);
+	}
+}
+
+static uint32 vnet_host_features(VirtioNet *net)
+{
+	return VIRTIO_NET_F_MAC;
+}
+
+// スイッチに渡したものをすべて取り戻してからリセットする
+static void vnet_reset(CPUx86 *cpu, VirtioNet *net)
+{
+	int i;
+
+	pthread_mutex_lock(&(net->sw->lock));
+	vnet_rx_end_queue(cpu, &(net->port->rx));
+	vnet_rx_end_queue(cpu, &(net->port->rx_done));
+	netq_reset(&(net->port->tx));
+	netq_reset(&(net->port->rx));
+	netq_reset(&(net->port->tx_done));
+	netq_reset(&(net->port->rx_done));
+	pthread_mutex_unlock(&(net->sw->lock));
+	for (i=0; i<NET_QUEUES; i++) {
+		virtq_reset(&(net->vq[i]));
+	}
+	net->guest_features = 0;
+	net->queue_sel = 0;
+	net->status = 0;
+	net->isr = 0;
+}
+
+static uint32 vnet_in(CPUx86 *cpu, void *opaque, uint16 port, int size)
+{
+	VirtioNet *net = opaque;
+	uint32 offset;
+	uint32 val;
+
+	offset = port - NET_PORT;
+	switch (offset) {
+	case VIRTIO_HOST_FEATURES:
+		return vnet_host_features(net);
+	case VIRTIO_GUEST_FEATURES:
+		return net->guest_features;
+	case VIRTIO_QUEUE_PFN:
+		return net->queue_sel < NET_QUEUES ? net->vq[net->queue_sel].pfn : 0;
+	case VIRTIO_QUEUE_NUM:
+		return net->queue_sel < NET_QUEUES ? VIRTQ_NUM : 0;
+	case VIRTIO_QUEUE_SEL:
+		return net->queue_sel;
+	case VIRTIO_STATUS:
+		return net->status;
+	case VIRTIO_ISR:
+		val = net->isr;
+		net->isr = 0;
+		return val;
+	}
+	if (VIRTIO_CONFIG + VIRTIO_NET_MAC <= offset && offset + size <= VIRTIO_CONFIG + VIRTIO_NET_MAC + 6) {
+		val = 0;
+		memcpy(&val, net->mac + offset - VIRTIO_CONFIG - VIRTIO_NET_MAC, size);
+		return val;
+	}
+	return 0xFFFFFFFF;
+}
+
+static void vnet_out(CPUx86 *cpu, void *opaque, uint16 port, int size, uint32 val)
+{
+	VirtioNet *net = opaque;
+
+	switch (port - NET_PORT) {
+	case VIRTIO_GUEST_FEATURES:
+		net->guest_features = val & vnet_host_features(net);
+		break;
+	case VIRTIO_QUEUE_PFN:
+		if (net->queue_sel < NET_QUEUES && !virtq_set_pfn(cpu, &(net->vq[net->queue_sel]), val)) {
+			net->status |= VIRTIO_STATUS_FAILED;
+		}
+		break;
+	case VIRTIO_QUEUE_SEL:
+		net->queue_sel = val;
+		break;
+	case VIRTIO_QUEUE_NOTIFY:
+		if (!(net->status & VIRTIO_STATUS_DRIVER_OK)) {
+			break;
+		}
+		if (val==NET_RX) {
+			vnet_rx(cpu, net);
+		} else if (val==NET_TX) {
+			vnet_tx(cpu, net);
+		}
+		break;
+	case VIRTIO_STATUS:
+		if ((val & 0xFF)==0) {
+			vnet_reset(cpu, net);
+		} else {
+			net->status = val;
+		}
+		break;
+	}
+}
+
+// ポート0xC060~0xC09Fにvirtio-netをつなぎ、スイッチの空いているポートに差す
+int vnet_attach(CPUx86 *cpu)
+{
+	VirtioNet *net;
+	NetSwitch *sw;
+	NetSwitchPort *port = NULL;
+	int i;
+
+	if (cpu->net) {
+		log_warning("vnet: already attached\n");
+		return 0;
+	}
+	pthread_mutex_lock(&net_switch_create);
+	if (net_switch==NULL) {
+		net_switch = net_switch_new();
+	}
+	sw = net_switch;
+	if (sw) {
+		pthread_mutex_lock(&(sw->lock));
+		for (i=0; i<NET_SWITCH_PORTS - 1; i++) {
+			if (!sw->port[i].active) {
+				port = &(sw->port[i]);
+				memset(port, 0, sizeof(NetSwitchPort));
+				port->type = NET_PORT_GUEST;
+				port->wake_fd = cpu->wake_fd;
+				port->fd = -1;
+				// 52:54:00:12:34:ポート番号+1
+				memcpy(port->mac, "\x52\x54\x00\x12\x34", 5);
+				port->mac[5] = i + 1;
+				port->active = 1;
+				sw->users++;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&(sw->lock));
+	}
+	pthread_mutex_unlock(&net_switch_create);
+	if (port==NULL) {
+		log_warning("vnet: no free switch port\n");
+		return 0;
+	}
+
+	net = calloc(1, sizeof(VirtioNet));
+	net->sw = sw;
+	net->port = port;
+	memcpy(net->mac, port->mac, 6);
+	vnet_reset(cpu, net);
+	io_register(cpu, NET_PORT, VIRTIO_PORTS, vnet_in, vnet_out, net);
+	cpu->net = net;
+	log_info("vnet: %02x:%02x:%02x:%02x:%02x:%02x\n", net->mac[0], net->mac[1], net->mac[2], net->mac[3], net->mac[4], net->mac[5]);
+	return 1;
+}
+
+// スイッチのパスの外でポートを外すので、以後このゲストのRAMは触られない
+void vnet_delete(CPUx86 *cpu)
+{
+	VirtioNet *net = cpu->net;
+	NetSwitch *sw;
+	int i;
+
+	if (net==NULL) {
+		return;
+	}
+	sw = net->sw;
+	pthread_mutex_lock(&net_switch_create);
+	pthread_mutex_lock(&(sw->lock));
+	net->port->active = 0;
+	for (i=0; i<NET_MAC_TABLE; i++) {
+		if (sw->mac_table[i].port==net->port - sw->port) {
+			sw->mac_table[i].port = -1;
+		}
+	}
+	sw->users--;
+	pthread_mutex_unlock(&(sw->lock));
+	if (sw->users==0) {
+		net_switch_delete(sw);
+		net_switch = NULL;
+	}
+	pthread_mutex_unlock(&net_switch_create);
+	free(net);
+	cpu->net = NULL;
+}
+
+// スライスの区切りでスイッチからの完了をusedに返す(割り込みは1回)
+void vnet_poll(CPUx86 *cpu)
+{
+	VirtioNet *net = cpu->net;
+	NetBuf *done;
+	int completed = 0;
+
+	while ((done = netq_front(&(net->port->tx_done)))) {
+		virtq_push(cpu, &(net->vq[NET_TX]), done->head, 0);
+		netq_pop(&(net->port->tx_done));
+		completed++;
+	}
+	while ((done = netq_front(&(net->port->rx_done)))) {
+		vnet_rx_end(cpu, done);
+		virtq_push(cpu, &(net->vq[NET_RX]), done->head, done->len);
+		netq_pop(&(net->port->rx_done));
+		completed++;
+	}
+	if (completed) {
+		vnet_interrupt(cpu, net);
+		if (net->status & VIRTIO_STATUS_DRIVER_OK) {
+			vnet_rx(cpu, net);
+		}
+	}
+}
+
+// 動いていればいつフレームが届くかわからない(HLTはwake_fdで待つ)
+int vnet_busy(CPUx86 *cpu)
+{
+	return cpu->net && (cpu->net->status & VIRTIO_STATUS_DRIVER_OK);
+}
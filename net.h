@@ -0,0 +1,111 @@
+#ifndef NET_H
+#define NET_H
+
+#include <pthread.h>
+#include <sys/uio.h>
+#include "cpux86.h"
+#include "virtio.h"
+
+
+// ネットワーク(virtio-net、I/Oポート0xC060、IRQ10)
+//   同じプロセスのゲストはユーザー空間のL2スイッチでつなぐ
+//   vCPUとスイッチのスレッドの間はロックのないSPSCキューで、フレームはスイッチのスレッドが
+//   送り手のRAMから受け手のRAMへ1回だけコピーする(間にバッファを挟まない)
+
+#define NET_PORT		0xC060
+#define NET_IRQ			10
+
+#define NET_RX			0		// virtqueue
+#define NET_TX			1
+#define NET_QUEUES		2
+
+#define VIRTIO_NET_F_MAC	0x00000020
+#define VIRTIO_NET_MAC		0x00	// 設定(VIRTIO_CONFIGから)
+
+#define NET_HDR			10		// virtio_net_hdr(VIRTIO_NET_F_MRG_RXBUFなし)
+#define NET_FRAME_MIN	14
+#define NET_FRAME_MAX	65535
+#define NET_SEG_MAX		8		// 1つのフレームのディスクリプタ数
+
+#define NET_SWITCH_PORTS	16
+#define NET_QUEUE		(VIRTQ_NUM * 2)		// virtqueueより長いのでいっぱいにならない
+#define NET_MAC_TABLE	256
+
+
+// SPSCキュー(生産者はheadだけ、消費者はtailだけを進める)
+
+typedef struct {
+	uint16 head;		// virtqueueの要求
+	uint16 iovcnt;
+	uint32 len;			// フレームの長さ(受信バッファは容量、完了は書いたバイト数)
+	struct iovec iov[NET_SEG_MAX];	// ゲストのRAMを直接指す
+} NetBuf;
+
+typedef struct {
+	uint32 head __attribute__((aligned(64)));
+	uint32 tail __attribute__((aligned(64)));
+	NetBuf buf[NET_QUEUE] __attribute__((aligned(64)));
+} NetQueue;
+
+
+// スイッチ
+
+#define NET_PORT_GUEST	0
+#define NET_PORT_TAP	1
+
+typedef struct {
+	int active;
+	int type;
+	int wake_fd;		// 受け手のvCPUを起こす(ゲスト)
+	int fd;				// TAP
+	uint8 mac[6];
+	uint8 wake;			// このパスで完了を返した
+
+	// ゲスト → スイッチ
+	NetQueue tx;		// 送るフレーム
+	NetQueue rx;		// 受信バッファ
+	// スイッチ → ゲスト
+	NetQueue tx_done;
+	NetQueue rx_done;
+
+	// 統計
+	uint64 stat_tx_frames;
+	uint64 stat_tx_bytes;
+	uint64 stat_rx_frames;
+	uint64 stat_rx_bytes;
+	uint64 stat_rx_dropped;	// 受信バッファがない
+} NetSwitchPort;
+
+typedef struct {
+	NetSwitchPort port[NET_SWITCH_PORTS];
+	struct {
+		uint8 mac[6];
+		int8 port;		// -1: なし
+	} mac_table[NET_MAC_TABLE];
+	int users;			// つないでいるゲスト
+	int kick_fd;		// eventfd(vCPUがフレームや受信バッファを渡した)
+	int pcap_fd;		// -1: なし
+	pthread_t thread;
+	pthread_mutex_t lock;	// スイッチのスレッドは1パスの間持つ(ポートのつなぎ外しと排他)
+	int stop;
+	uint8 frame[NET_FRAME_MAX];	// TAPから読む
+	uint64 stat_passes;
+	uint64 stat_flooded;
+} NetSwitch;
+
+
+// デバイス
+
+struct VirtioNet {
+	NetSwitch *sw;
+	NetSwitchPort *port;
+	VirtQueue vq[NET_QUEUES];
+	uint32 guest_features;
+	uint16 queue_sel;
+	uint8 status;
+	uint8 isr;
+	uint8 mac[6];
+};
+
+
+#endif
@@ -0,0 +1,785 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "cpux86.h"
+#include "machine.h"
+#include "log.h"
+
+
+// PCのデバイス(I/Oポート、8259A PIC、8254 PIT、MC146818 RTC)
+// 時刻はすべてclock_tscから求めるので、CLOCK_MODE_DETERMINISTICならタイマー割り込みも再現できる
+
+#define PIT_HZ		1193182
+#define RTC_REFRESH_HZ	66288	// ポート0x61のbit4(リフレッシュ)の周期
+
+
+// io
+
+void io_register(CPUx86 *cpu, uint16 port, uint16 count, IoIn in, IoOut out, void *opaque)
+{
+	IoPort *io;
+
+	if (IO_PORTS <= cpu->io_count) {
+		log_error("io_register: too many ports 0x%04X\n", port);
+		return;
+	}
+	io = &(cpu->io[cpu->io_count++]);
+	io->port = port;
+	io->count = count;
+	io->in = in;
+	io->out = out;
+	io->opaque = opaque;
+}
+
+static IoPort* io_find(CPUx86 *cpu, uint16 port)
+{
+	int i;
+
+	for (i=0; i<cpu->io_count; i++) {
+		if ((uint16)(port - cpu->io[i].port) < cpu->io[i].count) {
+			return &(cpu->io[i]);
+		}
+	}
+	return NULL;
+}
+
+// SMPはどのvCPUのポートI/OもBSPのデバイスに回す(io_lockで1つずつ)
+// 戻り値: デバイスを持っているvCPU
+static CPUx86* pc_lock(CPUx86 *cpu)
+{
+	if (cpu->machine==NULL) {
+		return cpu;
+	}
+	pthread_mutex_lock(&(cpu->machine->io_lock));
+	return cpu->machine->cpu[0];
+}
+
+static void pc_unlock(CPUx86 *cpu)
+{
+	if (cpu->machine) {
+		pthread_mutex_unlock(&(cpu->machine->io_lock));
+	}
+}
+
+// 何もつながっていないポートはすべて1を読む
+// 再生中はデバイスを読まずにログの値を返す
+uint32 io_in(CPUx86 *cpu, uint16 port, int size)
+{
+	CPUx86 *dev;
+	IoPort *io;
+	uint32 val;
+
+	if (cpu->replay_mode==REPLAY_PLAY) {
+		replay_sync(cpu);
+		return replay_in(cpu, port, 0);
+	}
+	dev = pc_lock(cpu);
+	io = io_find(dev, port);
+	// 統計は呼んだvCPUに数える(添字はBSPのcpu->io)
+	cpu->metrics.io_in[io ? io - dev->io : IO_PORTS]++;
+	if (io==NULL || io->in==NULL) {
+		log_info("in: unmapped port 0x%04X\n", port);
+		val = size==4 ? 0xFFFFFFFF : (1 << (size * 8)) - 1;
+	} else {
+		val = io->in(dev, io->opaque, port, size);
+	}
+	pc_unlock(cpu);
+	if (cpu->replay_mode==REPLAY_RECORD) {
+		replay_in(cpu, port, val);
+	}
+	return val;
+}
+
+// 再生中はデバイスに書かず、デバイスがこの命令でRAMに書いたものをログから戻す
+void io_out(CPUx86 *cpu, uint16 port, int size, uint32 val)
+{
+	CPUx86 *dev;
+	IoPort *io;
+
+	if (cpu->replay_mode==REPLAY_PLAY) {
+		replay_sync(cpu);
+		return;
+	}
+	dev = pc_lock(cpu);
+	io = io_find(dev, port);
+	cpu->metrics.io_out[io ? io - dev->io : IO_PORTS]++;
+	if (io==NULL || io->out==NULL) {
+		log_info("out: unmapped port 0x%04X 0x%X\n", port, val);
+	} else {
+		io->out(dev, io->opaque, port, size, val);
+	}
+	pc_unlock(cpu);
+}
+
+// プロテクトモードはCPL<=IOPL、仮想8086モードは不可(TSSのI/O許可ビットマップはない)
+int io_allowed(CPUx86 *cpu)
+{
+	if (!cpu_cr0(cpu, CR0_PE)) {
+		return 1;
+	}
+	if (cpu_eflags(cpu, CPU_EFLAGS_VM)) {
+		return 0;
+	}
+	return cpu->cpl <= cpu_eflags(cpu, CPU_EFLAGS_IOPL);
+}
+
+
+// pic
+
+// 受け付けられる最優先のIRQ(固定優先度、特殊マスクモードなし)
+static int pic_output(Pic *pic, uint8 irr)
+{
+	int i;
+
+	for (i=0; i<8; i++) {
+		if (pic->isr & (1 << i)) {
+			return -1;
+		}
+		if (irr & ~pic->imr & (1 << i)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// スレーブはマスタのIRQ2につながっている
+static uint8 pic_master_irr(CPUx86 *cpu)
+{
+	if (0 <= pic_output(&(cpu->pic[1]), cpu->pic[1].irr)) {
+		return cpu->pic[0].irr | 0x04;
+	}
+	return cpu->pic[0].irr;
+}
+
+// エッジトリガ: 立ち上がりでIRRを立てる
+void pic_set_irq(CPUx86 *cpu, int irq, int level)
+{
+	Pic *pic = &(cpu->pic[irq >> 3]);
+	uint8 bit = 1 << (irq & 7);
+
+	if (level) {
+		if (!(pic->level & bit)) {
+			if (!(pic->irr & bit)) {
+				// 受け付けるまでの時間を測る(clock.tscはpit_updateなどで読んだばかりの時刻)
+				cpu->metrics.irq_raised[irq & 15] = cpu->clock.tsc;
+			}
+			pic->irr |= bit;
+		}
+		pic->level |= bit;
+	} else {
+		pic->level &= ~bit;
+	}
+	// SMPは同じ線をI/O APICにもつなぐ(使わない方はゲストがマスクする)
+	if (cpu->machine) {
+		ioapic_set_irq(cpu, irq, level);
+	}
+}
+
+int pic_pending(CPUx86 *cpu)
+{
+	return 0 <= pic_output(&(cpu->pic[0]), pic_master_irr(cpu));
+}
+
+static void pic_latency(CPUx86 *cpu, int irq)
+{
+	uint64 tsc = cpu->clock.tsc;
+	uint64 raised = cpu->metrics.irq_raised[irq];
+
+	metrics_hist_add(&(cpu->metrics.irq_latency), clock_convert(raised < tsc ? tsc - raised : 0, CLOCK_TSC_HZ, 1000000000ULL));
+}
+
+// INTA: ベクタ番号を返してISRに移す
+int pic_ack(CPUx86 *cpu)
+{
+	Pic *master = &(cpu->pic[0]);
+	Pic *slave = &(cpu->pic[1]);
+	int irq;
+
+	irq = pic_output(master, pic_master_irr(cpu));
+	if (irq < 0) {
+		// スプリアス割り込み
+		return master->base + 7;
+	}
+	master->irr &= ~(1 << irq);
+	if (!master->auto_eoi) {
+		master->isr |= 1 << irq;
+	}
+	if (irq!=2) {
+		pic_latency(cpu, irq);
+		return master->base + irq;
+	}
+
+	irq = pic_output(slave, slave->irr);
+	if (irq < 0) {
+		return slave->base + 7;
+	}
+	slave->irr &= ~(1 << irq);
+	if (!slave->auto_eoi) {
+		slave->isr |= 1 << irq;
+	}
+	pic_latency(cpu, irq + 8);
+	return slave->base + irq;
+}
+
+static uint32 pic_in(CPUx86 *cpu, void *opaque, uint16 port, int size)
+{
+	Pic *pic = opaque;
+
+	if ((port & 1)==0) {
+		return pic->read_isr ? pic->isr : pic->irr;
+	}
+	return pic->imr;
+}
+
+static void pic_out(CPUx86 *cpu, void *opaque, uint16 port, int size, uint32 val)
+{
+	Pic *pic = opaque;
+	int i;
+
+	val &= 0xFF;
+	if ((port & 1)==0) {
+		if (val & 0x10) {
+			// ICW1
+			pic->init = 2;
+			pic->icw4 = val & 0x01;
+			pic->irr = 0;
+			pic->isr = 0;
+			pic->imr = 0;
+			pic->read_isr = 0;
+			pic->auto_eoi = 0;
+		} else if (val & 0x08) {
+			// OCW3
+			if (val & 0x02) {
+				pic->read_isr = val & 0x01;
+			}
+		} else {
+			// OCW2(ローテーションは未対応)
+			switch (val >> 5) {
+			case 1:	// non-specific EOI
+				for (i=0; i<8; i++) {
+					if (pic->isr & (1 << i)) {
+						pic->isr &= ~(1 << i);
+						break;
+					}
+				}
+				break;
+			case 3:	// specific EOI
+				pic->isr &= ~(1 << (val & 7));
+				break;
+			}
+		}
+		return;
+	}
+
+	switch (pic->init) {
+	case 2:	// ICW2
+		pic->base = val & 0xF8;
+		pic->init = 3;
+		break;
+	case 3:	// ICW3(マスタ、スレーブの接続はIRQ2に固定)
+		pic->init = pic->icw4 ? 4 : 0;
+		break;
+	case 4:	// ICW4
+		pic->auto_eoi = (val >> 1) & 1;
+		pic->init = 0;
+		break;
+	default:	// OCW1
+		pic->imr = val;
+		break;
+	}
+}
+
+
+// pit
+
+static uint32 pit_period(PitChannel *ch)
+{
+	return ch->count ? ch->count : 0x10000;
+}
+
+// カウントを始めてからのPITのクロック数
+static uint64 pit_ticks(PitChannel *ch, uint64 now)
+{
+	return clock_convert(now - ch->start, CLOCK_TSC_HZ, PIT_HZ);
+}
+
+// ticksクロック目になるTSC(切り上げ)
+static uint64 pit_tick_tsc(PitChannel *ch, uint64 ticks)
+{
+	return ch->start + ticks / PIT_HZ * CLOCK_TSC_HZ + (ticks % PIT_HZ * CLOCK_TSC_HZ + PIT_HZ - 1) / PIT_HZ;
+}
+
+// モード2、3は周期、それ以外は1回(モード6、7は2、3と同じ)
+static int pit_periodic(PitChannel *ch)
+{
+	return (ch->mode & 3)==2 || (ch->mode & 3)==3;
+}
+
+static uint16 pit_counter(PitChannel *ch, uint64 now)
+{
+	uint32 period;
+	uint64 ticks;
+
+	if (ch->start==CLOCK_NEVER) {
+		return ch->count;
+	}
+	period = pit_period(ch);
+	ticks = pit_ticks(ch, now);
+	if (!pit_periodic(ch)) {
+		return (period - ticks) & 0xFFFF;
+	}
+	if ((ch->mode & 3)==3) {
+		// 1周期に2回、2ずつ減る
+		return (period - ((ticks * 2) % period)) & 0xFFFE;
+	}
+	return period - ticks % period;
+}
+
+static int pit_out(PitChannel *ch, uint64 now)
+{
+	uint32 period;
+	uint64 ticks;
+
+	if (ch->start==CLOCK_NEVER) {
+		return ch->mode!=0;
+	}
+	period = pit_period(ch);
+	ticks = pit_ticks(ch, now);
+	if (!pit_periodic(ch)) {
+		return period <= ticks;
+	}
+	if ((ch->mode & 3)==3) {
+		return ticks % period < (period + 1) / 2;
+	}
+	return ticks % period != period - 1;
+}
+
+static void pit_schedule(PitChannel *ch, uint64 now)
+{
+	uint32 period;
+	uint64 ticks;
+
+	if (ch->start==CLOCK_NEVER) {
+		ch->next_irq = CLOCK_NEVER;
+		return;
+	}
+	period = pit_period(ch);
+	ticks = pit_ticks(ch, now);
+	if (pit_periodic(ch)) {
+		// 取りこぼした周期はまとめて1回にする
+		ch->next_irq = pit_tick_tsc(ch, (ticks / period + 1) * period);
+	} else if (ticks < period) {
+		ch->next_irq = pit_tick_tsc(ch, period);
+	} else {
+		ch->next_irq = CLOCK_NEVER;
+	}
+}
+
+static void pit_load(CPUx86 *cpu, int n, uint64 now)
+{
+	PitChannel *ch = &(cpu->pit.ch[n]);
+
+	ch->start = ch->gate ? now : CLOCK_NEVER;
+	pit_schedule(ch, now);
+}
+
+static void pit_update(CPUx86 *cpu, uint64 now)
+{
+	PitChannel *ch = &(cpu->pit.ch[0]);
+
+	if (ch->next_irq <= now) {
+		pic_set_irq(cpu, 0, 1);
+		pic_set_irq(cpu, 0, 0);
+		if (pit_periodic(ch)) {
+			pit_schedule(ch, now);
+		} else {
+			ch->next_irq = CLOCK_NEVER;
+		}
+	}
+}
+
+static void pit_latch(PitChannel *ch, uint64 now)
+{
+	if (ch->latched) {
+		return;
+	}
+	ch->latch = pit_counter(ch, now);
+	ch->latched = ch->access==3 ? 2 : 1;
+	ch->read_hi = ch->access==2;
+}
+
+// BCDカウントは未対応(バイナリとして扱う)
+static uint32 pit_in(CPUx86 *cpu, void *opaque, uint16 port, int size)
+{
+	PitChannel *ch;
+	uint64 now;
+	uint16 val;
+	uint32 result;
+
+	now = clock_tsc(cpu);
+	if (port==0x61) {
+		result = cpu->pit.speaker & 0x0F;
+		result |= (clock_convert(now, CLOCK_TSC_HZ, RTC_REFRESH_HZ) & 1) << 4;
+		result |= pit_out(&(cpu->pit.ch[2]), now) << 5;
+		return result;
+	}
+	if (port==0x43) {
+		return 0xFF;
+	}
+
+	ch = &(cpu->pit.ch[port & 3]);
+	if (ch->latched) {
+		val = ch->latch;
+		ch->latched--;
+	} else {
+		val = pit_counter(ch, now);
+	}
+	if (ch->read_hi) {
+		result = val >> 8;
+	} else {
+		result = val & 0xFF;
+	}
+	if (ch->access==3) {
+		ch->read_hi ^= 1;
+	}
+	return result;
+}
+
+static void pit_out_port(CPUx86 *cpu, void *opaque, uint16 port, int size, uint32 val)
+{
+	PitChannel *ch;
+	uint64 now;
+	int i;
+
+	now = clock_tsc(cpu);
+	val &= 0xFF;
+	if (port==0x61) {
+		// bit0: チャンネル2のゲート(立ち上がりで数え直す)
+		ch = &(cpu->pit.ch[2]);
+		if ((val & 1) && !ch->gate) {
+			ch->gate = 1;
+			pit_load(cpu, 2, now);
+		} else if (!(val & 1)) {
+			ch->gate = 0;
+		}
+		cpu->pit.speaker = val;
+		return;
+	}
+
+	if (port==0x43) {
+		if ((val >> 6)==3) {
+			// リードバック(ステータスは未対応)
+			for (i=0; i<3; i++) {
+				if (!(val & 0x20) && (val & (2 << i))) {
+					pit_latch(&(cpu->pit.ch[i]), now);
+				}
+			}
+			return;
+		}
+		ch = &(cpu->pit.ch[val >> 6]);
+		if (((val >> 4) & 3)==0) {
+			pit_latch(ch, now);
+			return;
+		}
+		ch->access = (val >> 4) & 3;
+		ch->mode = (val >> 1) & 7;
+		ch->bcd = val & 1;
+		ch->write_hi = ch->access==2;
+		ch->read_hi = ch->access==2;
+		ch->latched = 0;
+		// カウント値を書くまで止める
+		ch->start = CLOCK_NEVER;
+		ch->next_irq = CLOCK_NEVER;
+		return;
+	}
+
+	ch = &(cpu->pit.ch[port & 3]);
+	if (ch->write_hi) {
+		ch->count = (ch->count & 0x00FF) | (val << 8);
+		ch->write_hi = ch->access==2;
+		pit_load(cpu, port & 3, now);
+	} else {
+		ch->count = (ch->count & 0xFF00) | val;
+		if (ch->access==3) {
+			ch->write_hi = 1;
+		} else {
+			pit_load(cpu, port & 3, now);
+		}
+	}
+}
+
+
+// rtc
+
+static uint8 rtc_bcd(Rtc *rtc, int val)
+{
+	if (rtc->cmos[0x0B] & 0x04) {
+		return val;
+	}
+	return ((val / 10) << 4) | (val % 10);
+}
+
+// 時刻はepoch + TSCの秒(書き込みは無視する)、割り込みは未対応
+static uint32 rtc_in(CPUx86 *cpu, void *opaque, uint16 port, int size)
+{
+	Rtc *rtc = opaque;
+	struct tm tm;
+	time_t t;
+	int hour;
+	uint8 val;
+
+	if (port==0x70) {
+		return 0xFF;
+	}
+
+	t = cpu->clock.epoch + clock_convert(clock_tsc(cpu), CLOCK_TSC_HZ, 1);
+	gmtime_r(&t, &tm);
+
+	switch (rtc->index) {
+	case 0x00:
+		return rtc_bcd(rtc, tm.tm_sec);
+	case 0x02:
+		return rtc_bcd(rtc, tm.tm_min);
+	case 0x04:
+		if (rtc->cmos[0x0B] & 0x02) {
+			return rtc_bcd(rtc, tm.tm_hour);
+		}
+		hour = tm.tm_hour % 12;
+		return rtc_bcd(rtc, hour ? hour : 12) | (12 <= tm.tm_hour ? 0x80 : 0);
+	case 0x06:
+		return rtc_bcd(rtc, tm.tm_wday + 1);
+	case 0x07:
+		return rtc_bcd(rtc, tm.tm_mday);
+	case 0x08:
+		return rtc_bcd(rtc, tm.tm_mon + 1);
+	case 0x09:
+		return rtc_bcd(rtc, tm.tm_year % 100);
+	case 0x32:
+		return rtc_bcd(rtc, (tm.tm_year + 1900) / 100);
+	case 0x0A:
+		// UIPは立てない
+		return rtc->cmos[0x0A] & 0x7F;
+	case 0x0C:
+		val = rtc->cmos[0x0C];
+		rtc->cmos[0x0C] = 0;
+		return val;
+	case 0x0D:
+		return 0x80;
+	default:
+		return rtc->cmos[rtc->index];
+	}
+}
+
+static void rtc_out(CPUx86 *cpu, void *opaque, uint16 port, int size, uint32 val)
+{
+	Rtc *rtc = opaque;
+
+	if (port==0x70) {
+		// bit7はNMIマスク
+		rtc->index = val & 0x7F;
+		return;
+	}
+	switch (rtc->index) {
+	case 0x0C:
+	case 0x0D:
+		break;
+	default:
+		rtc->cmos[rtc->index] = val;
+		break;
+	}
+}
+
+
+// pc
+
+void pc_init(CPUx86 *cpu)
+{
+	uint32 kb;
+	int i;
+
+	memset(cpu->pic, 0, sizeof(cpu->pic));
+	cpu->pic[0].imr = 0xFF;
+	cpu->pic[1].imr = 0xFF;
+	io_register(cpu, 0x20, 2, pic_in, pic_out, &(cpu->pic[0]));
+	io_register(cpu, 0xA0, 2, pic_in, pic_out, &(cpu->pic[1]));
+
+	memset(&(cpu->pit), 0, sizeof(cpu->pit));
+	for (i=0; i<3; i++) {
+		cpu->pit.ch[i].gate = i!=2;
+		cpu->pit.ch[i].access = 3;
+		cpu->pit.ch[i].start = CLOCK_NEVER;
+		cpu->pit.ch[i].next_irq = CLOCK_NEVER;
+	}
+	io_register(cpu, 0x40, 4, pit_in, pit_out_port, NULL);
+	io_register(cpu, 0x61, 1, pit_in, pit_out_port, NULL);
+
+	memset(&(cpu->rtc), 0, sizeof(cpu->rtc));
+	cpu->rtc.cmos[0x0A] = 0x26;
+	cpu->rtc.cmos[0x0B] = 0x02;
+	// 基本メモリと拡張メモリ(KB、1MB~)
+	cpu->rtc.cmos[0x15] = 640 & 0xFF;
+	cpu->rtc.cmos[0x16] = 640 >> 8;
+	kb = cpu->mem_size < 0x100000 ? 0 : (cpu->mem_size - 0x100000) / 1024;
+	if (0xFFFF < kb) {
+		kb = 0xFFFF;
+	}
+	cpu->rtc.cmos[0x17] = cpu->rtc.cmos[0x30] = kb & 0xFF;
+	cpu->rtc.cmos[0x18] = cpu->rtc.cmos[0x31] = kb >> 8;
+	io_register(cpu, 0x70, 2, rtc_in, rtc_out, &(cpu->rtc));
+
+	con_init(cpu);
+
+	cpu->blk = NULL;
+	cpu->net = NULL;
+	cpu->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (cpu->wake_fd < 0) {
+		log_error("pc: eventfd: %s\n", strerror(errno));
+	}
+}
+
+void pc_delete(CPUx86 *cpu)
+{
+	vblk_delete(cpu);
+	vnet_delete(cpu);
+	con_delete(cpu);
+	if (0 <= cpu->wake_fd) {
+		close(cpu->wake_fd);
+		cpu->wake_fd = -1;
+	}
+}
+
+// スライスの区切りでタイマーを進め、次のタイマーをclock.deadlineにする
+// 再生中はデバイスがRAMに書いたものをログから戻すだけ
+// SMPはBSPだけがデバイスを動かし、どのvCPUも自分のローカルAPICのタイマーを進める
+void pc_update(CPUx86 *cpu)
+{
+	uint64 deadline;
+
+	if (cpu->replay_mode==REPLAY_PLAY) {
+		replay_sync(cpu);
+		return;
+	}
+	deadline = CLOCK_NEVER;
+	if (cpu->machine==NULL || cpu->machine->cpu[0]==cpu) {
+		pc_lock(cpu);
+		if (cpu->blk) {
+			vblk_poll(cpu);
+		}
+		if (cpu->net) {
+			vnet_poll(cpu);
+		}
+		pit_update(cpu, clock_tsc(cpu));
+		deadline = cpu->pit.ch[0].next_irq;
+		pc_unlock(cpu);
+	}
+	cpu->clock.deadline = deadline;
+	if (cpu->machine) {
+		deadline = apic_update(cpu);
+		if (deadline < cpu->clock.deadline) {
+			cpu->clock.deadline = deadline;
+		}
+	}
+}
+
+// IF=1ならローカルAPIC、PICの順に割り込みを受け付ける(HLTから起こす)
+// STIの直後の1命令は受け付けない
+// 再生中はログに記録された位置でだけ入れる
+// SMPのPICはBSPにだけつながっている(INIT、SIPIはIFに関係なく受け付ける)
+int pc_interrupt(CPUx86 *cpu)
+{
+	int vector;
+
+	if (cpu->machine && __atomic_load_n(&(cpu->apic.pending), __ATOMIC_ACQUIRE)) {
+		apic_startup(cpu);
+	}
+	if (cpu->irq_shadow) {
+		if (cpu->eip==cpu->irq_shadow_eip) {
+			return 0;
+		}
+		cpu->irq_shadow = 0;
+	}
+	if (cpu->replay_mode==REPLAY_PLAY) {
+		vector = replay_interrupt(cpu, 0);
+		if (vector < 0) {
+			return 0;
+		}
+	} else {
+		if (!cpu_eflags(cpu, CPU_EFLAGS_IF)) {
+			return 0;
+		}
+		vector = cpu->machine ? apic_interrupt(cpu) : -1;
+		if (vector < 0) {
+			if (cpu->machine && cpu->machine->cpu[0]!=cpu) {
+				return 0;
+			}
+			pc_lock(cpu);
+			vector = pic_pending(cpu) ? pic_ack(cpu) : -1;
+			pc_unlock(cpu);
+			if (vector < 0) {
+				return 0;
+			}
+		}
+		if (cpu->replay_mode==REPLAY_RECORD) {
+			replay_interrupt(cpu, vector);
+		}
+	}
+	cpu->halted = 0;
+	cpu->opcode_eip = cpu->eip;
+	cpu->opcode_esp = cpu_regist_esp(cpu);
+	cpu_interrupt(cpu, vector, 0, 0, 0);
+	return 1;
+}
+
+// 終わっていないI/Oがあるかフレームが届く(HLTで待っても起こされる)
+int pc_busy(CPUx86 *cpu)
+{
+	return vblk_busy(cpu) || vnet_busy(cpu);
+}
+
+// HLTで待っているvCPUを起こす(どのスレッドからも呼べる)
+void pc_kick(CPUx86 *cpu)
+{
+	uint64 one = 1;
+
+	if (0 <= cpu->wake_fd && write(cpu->wake_fd, &one, sizeof(one)) < 0) {
+		// カウンタがあふれるほど溜まっていれば起きる
+	}
+}
+
+// I/Oが終わるかnsナノ秒(負なら無期限)経つまで待つ
+// 戻り値: 1ならI/Oに起こされた
+int pc_wait(CPUx86 *cpu, int64 ns)
+{
+	struct pollfd pfd;
+	struct timespec ts;
+	uint64 val;
+	int ms;
+
+	if (cpu->wake_fd < 0) {
+		if (0 < ns) {
+			ts.tv_sec = ns / 1000000000LL;
+			ts.tv_nsec = ns % 1000000000LL;
+			nanosleep(&ts, NULL);
+		}
+		return 0;
+	}
+	// ミリ秒に切り上げる(早く起きると同じタイマーを何度も待つ)
+	ms = -1;
+	if (0 <= ns) {
+		ms = 2000000000LL < ns ? 2000 : (ns + 999999) / 1000000;
+	}
+	pfd.fd = cpu->wake_fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, ms) <= 0) {
+		return 0;
+	}
+	if (read(cpu->wake_fd, &val, sizeof(val)) < 0) {
+		// 他で読まれた
+	}
+	return 1;
+}
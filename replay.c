@@ -0,0 +1,522 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include "cpux86.h"
+#include "log.h"
+
+
+// 記録と再生
+//   ゲストの外から入ってくるものだけをログに書き、再生では同じ命令数の位置で同じ値を返す
+//   位置は仮想命令カウンタ(clock.icount + clock.slice)で決める
+//     IN、RDTSCはインタプリタで実行するので、その命令のカウンタがそのまま位置になる
+//     割り込みとデバイスがRAMに書いたものはスライスの区切り(またはOUTの中)の位置になる
+//   再生ではデバイスを動かさない(INはログの値、OUTは捨てる、割り込みとRAMへの書き込みはログから)
+//   スライスは次の記録の位置で切るので、翻訳済みコードで走っても同じ位置で止まる
+//
+//   ファイル
+//     ReplayHeader、CPUの状態、RAM(0でないページだけ、ページ番号+4096バイト、REPLAY_PAGE_ENDで終わり)
+//     イベント: 種類(1バイト) カウンタの差分(可変長) 中身
+//       REPLAY_EV_IN    ポート 値
+//       REPLAY_EV_TSC   前のRDTSCからの差分
+//       REPLAY_EV_INTR  ベクタ(1バイト)
+//       REPLAY_EV_DMA   アドレス 長さ データ
+//       REPLAY_EV_END   EIP 状態のハッシュ(8バイト)
+//     数値はLEB128の可変長
+
+#define REPLAY_MAGIC		0x4C505256	// "VRPL"
+#define REPLAY_VERSION		1
+#define REPLAY_PAGE			4096
+#define REPLAY_PAGE_END		0xFFFFFFFF
+#define REPLAY_BUFFER		(1024 * 1024)
+
+#define REPLAY_EV_IN		1
+#define REPLAY_EV_TSC		2
+#define REPLAY_EV_INTR		3
+#define REPLAY_EV_DMA		4
+#define REPLAY_EV_END		5
+
+// スナップショットに含めるCPUの範囲(アーキテクチャの状態、同じバイナリで再生する)
+#define REPLAY_CPU_START	offsetof(CPUx86, regs)
+#define REPLAY_CPU_END		offsetof(CPUx86, clock)
+
+typedef struct {
+	uint32 magic;
+	uint32 version;
+	uint32 cpu_size;	// REPLAY_CPU_END - REPLAY_CPU_START
+	uint32 reserved;
+	uint64 mem_size;
+	uint64 icount;
+	uint8 halted;
+	uint8 irq_shadow;
+	uint8 pad[2];
+	uint32 irq_shadow_eip;
+} ReplayHeader;
+
+struct Replay {
+	FILE *fp;
+	char *buffer;
+	uint64 counter;		// 最後のイベントの位置
+	uint64 tsc;			// 最後のRDTSC
+
+	// 再生: 次のイベント(読んだところまで、DMAのデータはまだファイルにある)
+	int type;			// 0: ログの終わり
+	uint64 next;		// 次のイベントの位置
+	uint32 arg;			// IN: ポート INTR: ベクタ DMA: アドレス END: EIP
+	uint64 val;			// IN: 値 TSC: 差分 DMA: 長さ END: ハッシュ
+
+	// 統計
+	uint64 stat_events;
+	uint64 stat_dma_bytes;
+};
+
+
+// file
+
+static void replay_put8(Replay *rp, uint8 val)
+{
+	putc(val, rp->fp);
+}
+
+static void replay_put_varint(Replay *rp, uint64 val)
+{
+	while (0x80 <= val) {
+		putc((val & 0x7F) | 0x80, rp->fp);
+		val >>= 7;
+	}
+	putc(val, rp->fp);
+}
+
+static int replay_get_varint(Replay *rp, uint64 *val)
+{
+	int shift = 0;
+	int c;
+
+	*val = 0;
+	do {
+		c = getc(rp->fp);
+		if (c==EOF || 63 < shift) {
+			return 0;
+		}
+		*val |= (uint64)(c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return 1;
+}
+
+// イベントの頭(種類と位置)
+static void replay_put_event(CPUx86 *cpu, Replay *rp, int type)
+{
+	uint64 counter = cpu->clock.icount + cpu->clock.slice;
+
+	replay_put8(rp, type);
+	replay_put_varint(rp, counter - rp->counter);
+	rp->counter = counter;
+	rp->stat_events++;
+}
+
+// 次のイベントを読む(DMAのデータは読まずに残す)
+static void replay_read_event(Replay *rp)
+{
+	uint64 delta;
+	uint64 arg;
+	int c;
+
+	rp->type = 0;
+	c = getc(rp->fp);
+	if (c==EOF || !replay_get_varint(rp, &delta)) {
+		return;
+	}
+	rp->next = rp->counter + delta;
+	rp->counter = rp->next;
+	arg = 0;
+	rp->val = 0;
+	switch (c) {
+	case REPLAY_EV_IN:
+	case REPLAY_EV_DMA:
+		if (!replay_get_varint(rp, &arg) || !replay_get_varint(rp, &(rp->val))) {
+			return;
+		}
+		break;
+	case REPLAY_EV_TSC:
+		if (!replay_get_varint(rp, &(rp->val))) {
+			return;
+		}
+		break;
+	case REPLAY_EV_INTR:
+		arg = getc(rp->fp);
+		break;
+	case REPLAY_EV_END:
+		if (!replay_get_varint(rp, &arg) || fread(&(rp->val), 8, 1, rp->fp)!=1) {
+			return;
+		}
+		break;
+	default:
+		return;
+	}
+	rp->arg = arg;
+	rp->type = c;
+}
+
+
+// state
+
+// 最後の状態を比べるハッシュ(FNV-1a、遅延評価のフラグは翻訳済みコードとインタプリタで違うので計算してから)
+static uint64 replay_hash(CPUx86 *cpu)
+{
+	uint64 hash = 0xCBF29CE484222325ULL;
+	size_t i;
+
+	cpu_eflags_sync(cpu);
+	for (i=0; i<8; i++) {
+		hash = (hash ^ cpu->regs[i]) * 0x100000001B3ULL;
+	}
+	hash = (hash ^ cpu->eip) * 0x100000001B3ULL;
+	hash = (hash ^ cpu->eflags) * 0x100000001B3ULL;
+	for (i=0; i<6; i++) {
+		hash = (hash ^ cpu->sregs[i]) * 0x100000001B3ULL;
+	}
+	for (i=0; i<cpu->mem_size; i++) {
+		hash = (hash ^ cpu->mem[i]) * 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+static void replay_save(CPUx86 *cpu, Replay *rp)
+{
+	ReplayHeader hdr;
+	static const uint8 zero[REPLAY_PAGE];
+	uint32 page;
+	uint32 end = REPLAY_PAGE_END;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = REPLAY_MAGIC;
+	hdr.version = REPLAY_VERSION;
+	hdr.cpu_size = REPLAY_CPU_END - REPLAY_CPU_START;
+	hdr.mem_size = cpu->mem_size;
+	hdr.icount = cpu->clock.icount;
+	hdr.halted = cpu->halted;
+	hdr.irq_shadow = cpu->irq_shadow;
+	hdr.irq_shadow_eip = cpu->irq_shadow_eip;
+	cpu_eflags_sync(cpu);
+	fwrite(&hdr, sizeof(hdr), 1, rp->fp);
+	fwrite((uint8*)cpu + REPLAY_CPU_START, hdr.cpu_size, 1, rp->fp);
+	for (page=0; page<cpu->mem_size / REPLAY_PAGE; page++) {
+		if (memcmp(cpu->mem + (size_t)page * REPLAY_PAGE, zero, REPLAY_PAGE)) {
+			fwrite(&page, 4, 1, rp->fp);
+			fwrite(cpu->mem + (size_t)page * REPLAY_PAGE, REPLAY_PAGE, 1, rp->fp);
+		}
+	}
+	fwrite(&end, 4, 1, rp->fp);
+	rp->counter = cpu->clock.icount;
+}
+
+static int replay_load(CPUx86 *cpu, Replay *rp)
+{
+	ReplayHeader hdr;
+	uint32 page;
+
+	if (fread(&hdr, sizeof(hdr), 1, rp->fp)!=1 || hdr.magic!=REPLAY_MAGIC || hdr.version!=REPLAY_VERSION) {
+		log_warning("replay: not a replay log\n");
+		return 0;
+	}
+	if (hdr.cpu_size!=REPLAY_CPU_END - REPLAY_CPU_START || hdr.mem_size!=cpu->mem_size) {
+		log_warning("replay: log was recorded by another build or memory size\n");
+		return 0;
+	}
+	// 翻訳済みのページを書き込み可能にしてからRAMを戻す
+	jit_flush(cpu);
+	if (fread((uint8*)cpu + REPLAY_CPU_START, hdr.cpu_size, 1, rp->fp)!=1) {
+		return 0;
+	}
+	memset(cpu->mem, 0, cpu->mem_size);
+	for (;;) {
+		if (fread(&page, 4, 1, rp->fp)!=1) {
+			return 0;
+		}
+		if (page==REPLAY_PAGE_END) {
+			break;
+		}
+		if (cpu->mem_size / REPLAY_PAGE <= page || fread(cpu->mem + (size_t)page * REPLAY_PAGE, REPLAY_PAGE, 1, rp->fp)!=1) {
+			return 0;
+		}
+	}
+	cpu->clock.icount = hdr.icount;
+	cpu->clock.slice = 0;
+	cpu->halted = hdr.halted;
+	cpu->irq_shadow = hdr.irq_shadow;
+	cpu->irq_shadow_eip = hdr.irq_shadow_eip;
+	cpu->shutdown = 0;
+	cpu_update_mode(cpu);
+	rp->counter = hdr.icount;
+	replay_read_event(rp);
+	return 1;
+}
+
+// 再生を止める(ログと違う命令列になった、ログが終わった)
+static void replay_stop(CPUx86 *cpu, const char *why)
+{
+	log_warning("replay: %s at %llu (eip 0x%X)\n", why, cpu->clock.icount + cpu->clock.slice, cpu->eip);
+	cpu->shutdown = 1;
+	cpu->halted = 1;
+}
+
+// 再生: 次のイベントが今の位置のtypeでなければ止める
+static int replay_expect(CPUx86 *cpu, Replay *rp, int type)
+{
+	if (rp->type==type && rp->next==cpu->clock.icount + cpu->clock.slice) {
+		return 1;
+	}
+	replay_stop(cpu, rp->type==0 ? "end of log" : "diverged");
+	return 0;
+}
+
+static void replay_close(CPUx86 *cpu)
+{
+	Replay *rp = cpu->replay;
+
+	fclose(rp->fp);
+	free(rp->buffer);
+	free(rp);
+	cpu->replay = NULL;
+	cpu->replay_mode = REPLAY_NONE;
+}
+
+
+// hook
+
+// IN: 記録はvalを書き、再生はログの値を返す
+uint32 replay_in(CPUx86 *cpu, uint16 port, uint32 val)
+{
+	Replay *rp = cpu->replay;
+
+	if (cpu->replay_mode==REPLAY_RECORD) {
+		replay_put_event(cpu, rp, REPLAY_EV_IN);
+		replay_put_varint(rp, port);
+		replay_put_varint(rp, val);
+		return val;
+	}
+	if (!replay_expect(cpu, rp, REPLAY_EV_IN)) {
+		return 0xFFFFFFFF;
+	}
+	if (rp->arg!=port) {
+		replay_stop(cpu, "diverged");
+		return 0xFFFFFFFF;
+	}
+	val = rp->val;
+	replay_read_event(rp);
+	return val;
+}
+
+uint64 replay_tsc(CPUx86 *cpu, uint64 tsc)
+{
+	Replay *rp = cpu->replay;
+
+	if (cpu->replay_mode==REPLAY_RECORD) {
+		replay_put_event(cpu, rp, REPLAY_EV_TSC);
+		replay_put_varint(rp, tsc - rp->tsc);
+		rp->tsc = tsc;
+		return tsc;
+	}
+	if (!replay_expect(cpu, rp, REPLAY_EV_TSC)) {
+		return rp->tsc;
+	}
+	rp->tsc += rp->val;
+	replay_read_event(rp);
+	return rp->tsc;
+}
+
+// 割り込み: 記録はvectorを書き、再生は今の位置で入れる割り込みを返す(-1: なし)
+int replay_interrupt(CPUx86 *cpu, int vector)
+{
+	Replay *rp = cpu->replay;
+
+	if (cpu->replay_mode==REPLAY_RECORD) {
+		replay_put_event(cpu, rp, REPLAY_EV_INTR);
+		replay_put8(rp, vector);
+		return vector;
+	}
+	if (rp->type!=REPLAY_EV_INTR || rp->next!=cpu->clock.icount + cpu->clock.slice) {
+		return -1;
+	}
+	vector = rp->arg;
+	replay_read_event(rp);
+	return vector;
+}
+
+// 記録: デバイスがゲストのRAMに書いた(vCPUのスレッドで、ゲストに見せる前に呼ぶ)
+void replay_dma(CPUx86 *cpu, uint32 addr, uint32 len)
+{
+	Replay *rp = cpu->replay;
+
+	if (cpu->replay_mode!=REPLAY_RECORD || len==0 || cpu->mem_size < (uint64)addr + len) {
+		return;
+	}
+	replay_put_event(cpu, rp, REPLAY_EV_DMA);
+	replay_put_varint(rp, addr);
+	replay_put_varint(rp, len);
+	fwrite(cpu->mem + addr, len, 1, rp->fp);
+	rp->stat_dma_bytes += len;
+}
+
+// 再生: 今の位置でデバイスが書いたものを戻す(スライスの区切りとOUTで呼ぶ)
+void replay_sync(CPUx86 *cpu)
+{
+	Replay *rp = cpu->replay;
+	uint64 counter;
+	uint32 len;
+
+	counter = cpu->clock.icount + cpu->clock.slice;
+	while (rp->type==REPLAY_EV_DMA && rp->next==counter) {
+		len = rp->val;
+		if (cpu->mem_size < (uint64)rp->arg + len) {
+			replay_stop(cpu, "bad log");
+			return;
+		}
+		jit_dma_write(cpu, rp->arg, len);
+		if (fread(cpu->mem + rp->arg, 1, len, rp->fp)!=len) {
+			replay_stop(cpu, "truncated log");
+			return;
+		}
+		rp->stat_dma_bytes += len;
+		replay_read_event(rp);
+	}
+	if (rp->type==REPLAY_EV_END && rp->next==counter && cpu->clock.slice==0) {
+		if (rp->arg==cpu->eip && rp->val==replay_hash(cpu)) {
+			log_warning("replay: finished at %llu, state matches the recording\n", counter);
+		} else {
+			log_warning("replay: finished at %llu, state differs from the recording\n", counter);
+		}
+		cpu->shutdown = 1;
+		cpu->halted = 1;
+		rp->type = 0;
+	}
+}
+
+// 再生: 次のイベントの位置でスライスを切る
+int replay_budget(CPUx86 *cpu, int budget)
+{
+	Replay *rp = cpu->replay;
+	uint64 now = cpu->clock.icount;
+
+	if (rp->type==0) {
+		replay_stop(cpu, "end of log");
+		return 0;
+	}
+	if (rp->next <= now) {
+		// 区切りで入れるはずのものが残っている
+		replay_stop(cpu, "diverged");
+		return 0;
+	}
+	return rp->next - now < (uint64)budget ? (int)(rp->next - now) : budget;
+}
+
+// 再生: HLT中は命令数が進まないので、起こすものは今の位置に記録されている
+int replay_idle(CPUx86 *cpu)
+{
+	Replay *rp = cpu->replay;
+
+	if (rp->type!=0 && rp->next==cpu->clock.icount) {
+		return 1;
+	}
+	if (rp->type!=0) {
+		replay_stop(cpu, "diverged");
+	}
+	return 0;
+}
+
+
+// replay
+
+static Replay* replay_open(const char *fname, const char *mode)
+{
+	Replay *rp;
+
+	rp = calloc(1, sizeof(Replay));
+	rp->fp = fopen(fname, mode);
+	if (rp->fp==NULL) {
+		log_warning("replay: cannot open %s: %s\n", fname, strerror(errno));
+		free(rp);
+		return NULL;
+	}
+	// 小さいイベントをまとめて書く
+	rp->buffer = malloc(REPLAY_BUFFER);
+	setvbuf(rp->fp, rp->buffer, _IOFBF, REPLAY_BUFFER);
+	return rp;
+}
+
+// 今の状態をスナップショットにして記録を始める(スライスの外で呼ぶ)
+int replay_record(CPUx86 *cpu, const char *fname)
+{
+	Replay *rp;
+
+	if (cpu->replay) {
+		log_warning("replay: already active\n");
+		return -1;
+	}
+	// vCPUの間の順序は記録しない
+	if (cpu->machine) {
+		log_warning("replay: SMP is not supported\n");
+		return -1;
+	}
+	rp = replay_open(fname, "wb");
+	if (rp==NULL) {
+		return -1;
+	}
+	cpu->replay = rp;
+	cpu->replay_mode = REPLAY_RECORD;
+	replay_save(cpu, rp);
+	return 0;
+}
+
+// スナップショットを読み込んで再生を始める
+int replay_play(CPUx86 *cpu, const char *fname)
+{
+	Replay *rp;
+
+	if (cpu->replay) {
+		log_warning("replay: already active\n");
+		return -1;
+	}
+	// vCPUの間の順序は記録しない
+	if (cpu->machine) {
+		log_warning("replay: SMP is not supported\n");
+		return -1;
+	}
+	rp = replay_open(fname, "rb");
+	if (rp==NULL) {
+		return -1;
+	}
+	cpu->replay = rp;
+	cpu->replay_mode = REPLAY_PLAY;
+	if (!replay_load(cpu, rp)) {
+		log_warning("replay: cannot load %s\n", fname);
+		replay_close(cpu);
+		return -1;
+	}
+	return 0;
+}
+
+// 記録は最後の状態を書いて閉じる
+void replay_delete(CPUx86 *cpu)
+{
+	Replay *rp = cpu->replay;
+	uint64 hash;
+
+	if (rp==NULL) {
+		return;
+	}
+	if (cpu->replay_mode==REPLAY_RECORD) {
+		cpu->clock.slice = 0;
+		replay_put_event(cpu, rp, REPLAY_EV_END);
+		replay_put_varint(rp, cpu->eip);
+		hash = replay_hash(cpu);
+		fwrite(&hash, 8, 1, rp->fp);
+		log_warning("replay: recorded %llu events (%llu bytes of device input) up to %llu\n", rp->stat_events, rp->stat_dma_bytes, rp->counter);
+	} else if (rp->type==REPLAY_EV_END) {
+		// 最後のスライスで呼び出し元に戻った
+		replay_sync(cpu);
+	}
+	replay_close(cpu);
+}
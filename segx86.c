@@ -0,0 +1,1207 @@
+#include <stdio.h>
+#include <string.h>
+#include "cpux86.h"
+#include "log.h"
+
+
+// プロテクトモード: ディスクリプタテーブル、セグメントのロード、特権レベルの移動
+
+
+// exception
+
+// 例外
+// 命令を中断してexec_cpux86に戻る(EIPとESPは命令の先頭に戻す)
+// 命令はメモリや状態を書き換える前に検査するので、これだけで最初から実行し直せる
+void cpu_fault(CPUx86 *cpu, int vector, uint32 error_code)
+{
+	int first;
+	int second;
+
+	cpu->eip = cpu->opcode_eip;
+	cpu_regist_esp(cpu) = cpu->opcode_esp;
+
+	// 配送中の例外: 組み合わせによってはダブルフォールト、その最中ならシャットダウン
+	if (0<=cpu->fault_delivering) {
+		if (cpu->fault_delivering==EXC_DF) {
+			log_warning("triple fault: eip 0x%X\n", cpu->opcode_eip);
+			cpu->fault_delivering = -1;
+			cpu->shutdown = 1;
+			longjmp(cpu->fault_jmp, 1);
+		}
+		first = cpu_fault_class(cpu->fault_delivering);
+		second = cpu_fault_class(vector);
+		// contributoryの後のcontributory、page faultの後のcontributoryかpage fault
+		if ((first==1 && second==1) || (first==2 && second!=0)) {
+			vector = EXC_DF;
+			error_code = 0;
+		}
+	}
+	cpu->fault_vector = vector;
+	cpu->fault_code = error_code;
+	longjmp(cpu->fault_jmp, 1);
+}
+
+// 0: benign、1: contributory、2: page fault
+int cpu_fault_class(int vector)
+{
+	switch (vector) {
+	case EXC_DE:
+	case EXC_TS:
+	case EXC_NP:
+	case EXC_SS:
+	case EXC_GP:
+		return 1;
+	case EXC_PF:
+		return 2;
+	}
+	return 0;
+}
+
+// エラーコードを積む例外
+int cpu_fault_has_error(int vector)
+{
+	switch (vector) {
+	case EXC_DF:
+	case EXC_TS:
+	case EXC_NP:
+	case EXC_SS:
+	case EXC_GP:
+	case EXC_PF:
+	case EXC_AC:
+		return 1;
+	}
+	return 0;
+}
+
+// cpu_faultで中断した例外をIDTで配送する(配送中の例外はcpu_faultに戻ってくる)
+void cpu_fault_deliver(CPUx86 *cpu)
+{
+	cpu->metrics.exceptions[cpu->fault_vector & (METRICS_VECTORS - 1)]++;
+	cpu->fault_delivering = cpu->fault_vector;
+	cpu_interrupt(cpu, cpu->fault_vector, 0, cpu_fault_has_error(cpu->fault_vector), cpu->fault_code);
+	cpu->fault_delivering = -1;
+}
+
+
+// memory
+
+// リニアアドレスのsizeバイト(RAMの外なら#GP)
+uint8* seg_mem_ptr(CPUx86 *cpu, uint32 addr, int size)
+{
+	if (cpu->mem_size < (uint64)addr + size) {
+		cpu_fault(cpu, EXC_GP, 0);
+	}
+	return &(cpu->mem[addr]);
+}
+
+uint32 seg_mem_load(CPUx86 *cpu, uint32 addr, int size)
+{
+	uint8 *p;
+	uint32 val;
+	p = seg_mem_ptr(cpu, addr, size);
+	val = p[0] | p[1] << 8;
+	if (size==4) {
+		val |= p[2] << 16 | p[3] << 24;
+	}
+	return val;
+}
+
+void seg_mem_store(CPUx86 *cpu, uint32 addr, int size, uint32 val)
+{
+	uint8 *p;
+	p = seg_mem_ptr(cpu, addr, size);
+	p[0] = val;
+	p[1] = val >> 8;
+	if (size==4) {
+		p[2] = val >> 16;
+		p[3] = val >> 24;
+	}
+}
+
+
+// descriptor
+
+void desc_decode(uint64 raw, Descriptor *desc)
+{
+	uint32 lo;
+	uint32 hi;
+	lo = (uint32)raw;
+	hi = (uint32)(raw >> 32);
+	desc->base = (lo >> 16) | (hi & 0xFF) << 16 | (hi & 0xFF000000);
+	desc->limit = (lo & 0xFFFF) | (hi & 0x000F0000);
+	desc->attribute = (hi >> 8) & 0xF0FF;
+	if (desc_g(desc)) {
+		desc->limit = desc->limit << 12 | 0xFFF;
+	}
+}
+
+// セレクタの指すディスクリプタの8バイトとリニアアドレスを読む(テーブルの範囲外なら0)
+int desc_fetch(CPUx86 *cpu, uint16 selector, uint32 *addr, uint64 *raw)
+{
+	uint32 base;
+	uint32 limit;
+
+	if (selector & 0x04) {
+		if ((cpu->ldtr & ~0x03)==0) {
+			return 0;
+		}
+		base = cpu->ldt.base;
+		limit = cpu->ldt.limit;
+	} else {
+		base = cpu->gdtr.base;
+		limit = cpu->gdtr.limit;
+	}
+	if (limit < (uint32)(selector | 0x07)) {
+		return 0;
+	}
+	*addr = base + (selector & ~0x07);
+	memcpy(raw, seg_mem_ptr(cpu, *addr, 8), 8);
+	return 1;
+}
+
+// セレクタの指すディスクリプタ(テーブルの範囲外なら0)
+// 同じ場所の同じ8バイトならデコードしない(システムコールのたびにCS/SSを読み直すため)
+int desc_load(CPUx86 *cpu, uint16 selector, Descriptor *desc, uint32 *addr)
+{
+	DescCache *cache;
+	uint64 raw;
+
+	if (!desc_fetch(cpu, selector, addr, &raw)) {
+		return 0;
+	}
+	cache = &(cpu->desc_cache[(*addr >> 3) & (CPU_DESC_CACHE - 1)]);
+	if (cache->addr!=*addr || cache->raw!=raw) {
+		desc_decode(raw, &(cache->desc));
+		cache->addr = *addr;
+		cache->raw = raw;
+		cpu->metrics.desc_miss++;
+	} else {
+		cpu->metrics.desc_hit++;
+	}
+	*desc = cache->desc;
+	return 1;
+}
+
+// アクセス済みにする
+void desc_set_accessed(CPUx86 *cpu, uint32 addr, Descriptor *desc)
+{
+	if (!(desc->attribute & DESC_ACCESSED)) {
+		desc->attribute |= DESC_ACCESSED;
+		cpu->mem[addr + 5] |= DESC_ACCESSED;
+	}
+}
+
+
+// segment register
+
+// リアルモード、仮想8086モードのセグメント
+void seg_load_real(CPUx86 *cpu, int seg, uint16 selector)
+{
+	Descriptor *desc;
+	desc = &(cpu->segs[seg]);
+	cpu->sregs[seg] = selector;
+	desc->base = (uint32)selector << 4;
+	desc->limit = 0xFFFF;
+	desc->attribute = 0x93 | (seg==SEG_CS ? DESC_CODE : 0) | (cpu->eflags & CPU_EFLAGS_VM ? 0x60 : 0);
+	if (seg==SEG_CS) {
+		cpu_update_mode(cpu);
+	}
+}
+
+// データセグメント(DS ES FS GS)とSSをロードする
+void seg_load(CPUx86 *cpu, int seg, uint16 selector)
+{
+	Descriptor desc;
+	uint32 addr;
+	int rpl;
+	int dpl;
+
+	if (!cpu_cr0(cpu, CR0_PE) || (cpu->eflags & CPU_EFLAGS_VM)) {
+		seg_load_real(cpu, seg, selector);
+		return;
+	}
+
+	// ヌルセレクタはDS ES FS GSのみ(使うと例外)
+	if ((selector & ~0x03)==0) {
+		if (seg==SEG_SS) {
+			cpu_fault(cpu, EXC_GP, 0);
+			return;
+		}
+		cpu->sregs[seg] = selector;
+		memset(&(cpu->segs[seg]), 0, sizeof(Descriptor));
+		return;
+	}
+
+	if (!desc_load(cpu, selector, &desc, &addr)) {
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return;
+	}
+	rpl = selector & 0x03;
+	dpl = desc_dpl(&desc);
+	if (seg==SEG_SS) {
+		// 書き込み可能なデータで RPL = DPL = CPL
+		if (!desc_s(&desc) || (desc_type(&desc) & (DESC_CODE | DESC_WRITABLE))!=DESC_WRITABLE || rpl!=cpu->cpl || dpl!=cpu->cpl) {
+			cpu_fault(cpu, EXC_GP, selector & ~0x03);
+			return;
+		}
+		if (!desc_p(&desc)) {
+			cpu_fault(cpu, EXC_SS, selector & ~0x03);
+			return;
+		}
+	} else {
+		// データか読み出し可能なコード(コンフォーミングコード以外は特権レベルを検査する)
+		if (!desc_s(&desc) || (desc_type(&desc) & (DESC_CODE | DESC_READABLE))==DESC_CODE) {
+			cpu_fault(cpu, EXC_GP, selector & ~0x03);
+			return;
+		}
+		if (!desc_is_conforming(&desc) && (dpl < cpu->cpl || dpl < rpl)) {
+			cpu_fault(cpu, EXC_GP, selector & ~0x03);
+			return;
+		}
+		if (!desc_p(&desc)) {
+			cpu_fault(cpu, EXC_NP, selector & ~0x03);
+			return;
+		}
+	}
+	desc_set_accessed(cpu, addr, &desc);
+	cpu->sregs[seg] = selector;
+	cpu->segs[seg] = desc;
+}
+
+// CSをロードしてCPLを変える(検査済みのディスクリプタ)
+void seg_load_cs(CPUx86 *cpu, uint16 selector, Descriptor *desc, int cpl)
+{
+	cpu->sregs[SEG_CS] = (selector & ~0x03) | cpl;
+	cpu->segs[SEG_CS] = *desc;
+	cpu->cpl = cpl;
+	cpu_update_mode(cpu);
+}
+
+// far jmp/callで同じ特権レベルのまま飛べるコードセグメントか(飛べなければ例外で0)
+int seg_check_code(CPUx86 *cpu, uint16 selector, Descriptor *desc)
+{
+	int rpl;
+	int dpl;
+
+	rpl = selector & 0x03;
+	dpl = desc_dpl(desc);
+	if (!desc_is_code(desc)) {
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return 0;
+	}
+	if (desc_is_conforming(desc) ? cpu->cpl < dpl : (cpu->cpl < rpl || dpl!=cpu->cpl)) {
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return 0;
+	}
+	if (!desc_p(desc)) {
+		cpu_fault(cpu, EXC_NP, selector & ~0x03);
+		return 0;
+	}
+	return 1;
+}
+
+// 特権レベルがcplのスタックセグメントか(TSSやretの戻り先、違えばvectorの例外で0)
+int seg_check_stack(CPUx86 *cpu, uint16 selector, Descriptor *desc, int cpl, int vector)
+{
+	uint32 addr;
+
+	if ((selector & ~0x03)==0 || !desc_load(cpu, selector, desc, &addr)) {
+		cpu_fault(cpu, vector, selector & ~0x03);
+		return 0;
+	}
+	if ((selector & 0x03)!=cpl || desc_dpl(desc)!=cpl || !desc_s(desc) || (desc_type(desc) & (DESC_CODE | DESC_WRITABLE))!=DESC_WRITABLE) {
+		cpu_fault(cpu, vector, selector & ~0x03);
+		return 0;
+	}
+	if (!desc_p(desc)) {
+		cpu_fault(cpu, EXC_SS, selector & ~0x03);
+		return 0;
+	}
+	desc_set_accessed(cpu, addr, desc);
+	return 1;
+}
+
+// 外側の特権レベルへ戻ったとき、使えなくなったデータセグメントをヌルにする
+void seg_check_outer(CPUx86 *cpu)
+{
+	static const int segs[4] = {SEG_ES, SEG_DS, SEG_FS, SEG_GS};
+	Descriptor *desc;
+	int i;
+
+	for (i=0; i<4; i++) {
+		desc = &(cpu->segs[segs[i]]);
+		if (desc_is_conforming(desc) || cpu->cpl <= desc_dpl(desc)) {
+			continue;
+		}
+		cpu->sregs[segs[i]] = 0;
+		memset(desc, 0, sizeof(Descriptor));
+	}
+}
+
+
+// stack
+
+// ss:espに積む(espは呼び出し側で反映する)
+void seg_push(CPUx86 *cpu, Descriptor *ss, uint32 *esp, int size, uint32 val)
+{
+	*esp -= size;
+	seg_mem_store(cpu, ss->base + (desc_d(ss) ? *esp : (*esp & 0xFFFF)), size, val);
+}
+
+uint32 seg_pop(CPUx86 *cpu, Descriptor *ss, uint32 *esp, int size)
+{
+	uint32 val;
+	val = seg_mem_load(cpu, ss->base + (desc_d(ss) ? *esp : (*esp & 0xFFFF)), size);
+	*esp += size;
+	return val;
+}
+
+// espを反映する(16bitスタックは下位16bitのみ)
+void seg_set_esp(CPUx86 *cpu, Descriptor *ss, uint32 esp)
+{
+	if (desc_d(ss)) {
+		cpu_regist_esp(cpu) = esp;
+	} else {
+		cpu_regist_esp(cpu) = (cpu_regist_esp(cpu) & 0xFFFF0000) | (esp & 0xFFFF);
+	}
+}
+
+// TSSから特権レベルdplのスタックを読む
+int seg_tss_stack(CPUx86 *cpu, int dpl, uint16 *ss, uint32 *esp)
+{
+	uint32 offset;
+
+	if ((desc_type(&(cpu->tss)) & ~0x02)==DESC_TSS32) {
+		offset = 4 + dpl * 8;
+		if (cpu->tss.limit < offset + 5) {
+			cpu_fault(cpu, EXC_TS, cpu->tr & ~0x03);
+			return 0;
+		}
+		*esp = seg_mem_load(cpu, cpu->tss.base + offset, 4);
+		*ss = seg_mem_load(cpu, cpu->tss.base + offset + 4, 2);
+	} else {
+		offset = 2 + dpl * 4;
+		if (cpu->tss.limit < offset + 3) {
+			cpu_fault(cpu, EXC_TS, cpu->tr & ~0x03);
+			return 0;
+		}
+		*esp = seg_mem_load(cpu, cpu->tss.base + offset, 2);
+		*ss = seg_mem_load(cpu, cpu->tss.base + offset + 2, 2);
+	}
+	return 1;
+}
+
+// EFLAGSのmaskのビットをvalにする
+void seg_set_eflags(CPUx86 *cpu, uint32 val, uint32 mask)
+{
+	cpu_eflags_sync(cpu);
+	cpu->eflags = (cpu->eflags & ~mask) | (val & mask) | 0x02;
+	if (mask & CPU_EFLAGS_VM) {
+		cpu_update_mode(cpu);
+	}
+}
+
+
+// interrupt
+
+// 割り込み、例外、INT nをIDT(リアルモードはIVT)で処理する
+// soft: INT n(ゲートのDPLを検査する) has_error: エラーコードを積む
+void cpu_interrupt(CPUx86 *cpu, int vector, int soft, int has_error, uint32 error_code)
+{
+	Descriptor desc;
+	Descriptor ss_desc;
+	uint64 raw;
+	uint32 addr;
+	uint32 eflags;
+	uint32 offset;
+	uint32 esp;
+	uint32 new_esp;
+	uint16 selector;
+	uint16 new_ss;
+	int type;
+	int size;
+	int dpl;
+	int vm;
+
+	cpu_eflags_sync(cpu);
+	eflags = cpu->eflags;
+
+	if (!cpu_cr0(cpu, CR0_PE)) {
+		// リアルモード: IVTからcs:ipを読んでflags cs ipを積む
+		if (cpu->idtr.limit < vector * 4 + 3) {
+			cpu_fault(cpu, EXC_GP, 0);
+			return;
+		}
+		offset = seg_mem_load(cpu, cpu->idtr.base + vector * 4, 2);
+		selector = seg_mem_load(cpu, cpu->idtr.base + vector * 4 + 2, 2);
+		esp = cpu_regist_esp(cpu);
+		seg_push(cpu, &(cpu->segs[SEG_SS]), &esp, 2, eflags);
+		seg_push(cpu, &(cpu->segs[SEG_SS]), &esp, 2, cpu->sregs[SEG_CS]);
+		seg_push(cpu, &(cpu->segs[SEG_SS]), &esp, 2, cpu->eip);
+		seg_set_esp(cpu, &(cpu->segs[SEG_SS]), esp);
+		seg_set_eflags(cpu, 0, CPU_EFLAGS_IF | CPU_EFLAGS_TF | CPU_EFLAGS_AC | CPU_EFLAGS_RF);
+		seg_load_real(cpu, SEG_CS, selector);
+		cpu->eip = offset;
+		return;
+	}
+
+	// ゲート
+	if (cpu->idtr.limit < vector * 8 + 7) {
+		cpu_fault(cpu, EXC_GP, vector * 8 + 2);
+		return;
+	}
+	memcpy(&raw, seg_mem_ptr(cpu, cpu->idtr.base + vector * 8, 8), 8);
+	type = (raw >> 40) & 0x0F;
+	if (type==DESC_TASK_GATE) {
+		// タスクスイッチはないのでゲートの#GPにする
+		log_warning("cpu_interrupt: task gate is not supported (vector %d)\n", vector);
+		cpu_fault(cpu, EXC_GP, vector * 8 + 2);
+		return;
+	}
+	if (type!=DESC_INT_GATE16 && type!=DESC_TRAP_GATE16 && type!=DESC_INT_GATE32 && type!=DESC_TRAP_GATE32) {
+		cpu_fault(cpu, EXC_GP, vector * 8 + 2);
+		return;
+	}
+	if (soft && ((raw >> 45) & 0x03) < cpu->cpl) {
+		cpu_fault(cpu, EXC_GP, vector * 8 + 2);
+		return;
+	}
+	if (!((raw >> 47) & 0x01)) {
+		cpu_fault(cpu, EXC_NP, vector * 8 + 2);
+		return;
+	}
+	selector = (raw >> 16) & 0xFFFF;
+	offset = (raw & 0xFFFF) | ((raw >> 32) & 0xFFFF0000);
+	size = (type & 0x08) ? 4 : 2;
+
+	// 飛び先のコードセグメント
+	if ((selector & ~0x03)==0 || !desc_load(cpu, selector, &desc, &addr)) {
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return;
+	}
+	dpl = desc_dpl(&desc);
+	if (!desc_is_code(&desc) || cpu->cpl < dpl) {
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return;
+	}
+	if (!desc_p(&desc)) {
+		cpu_fault(cpu, EXC_NP, selector & ~0x03);
+		return;
+	}
+
+	vm = (eflags & CPU_EFLAGS_VM) ? 1 : 0;
+	if (!desc_is_conforming(&desc) && dpl < cpu->cpl) {
+		// 内側の特権レベル: TSSのスタックに切り替えて元のss:espを積む
+		if (!seg_tss_stack(cpu, dpl, &new_ss, &new_esp) || !seg_check_stack(cpu, new_ss, &ss_desc, dpl, EXC_TS)) {
+			return;
+		}
+		if (vm) {
+			seg_push(cpu, &ss_desc, &new_esp, size, cpu->sregs[SEG_GS]);
+			seg_push(cpu, &ss_desc, &new_esp, size, cpu->sregs[SEG_FS]);
+			seg_push(cpu, &ss_desc, &new_esp, size, cpu->sregs[SEG_DS]);
+			seg_push(cpu, &ss_desc, &new_esp, size, cpu->sregs[SEG_ES]);
+		}
+		seg_push(cpu, &ss_desc, &new_esp, size, cpu->sregs[SEG_SS]);
+		seg_push(cpu, &ss_desc, &new_esp, size, cpu_regist_esp(cpu));
+		seg_push(cpu, &ss_desc, &new_esp, size, eflags);
+		seg_push(cpu, &ss_desc, &new_esp, size, cpu->sregs[SEG_CS]);
+		seg_push(cpu, &ss_desc, &new_esp, size, cpu->eip);
+		if (has_error) {
+			seg_push(cpu, &ss_desc, &new_esp, size, error_code);
+		}
+		if (vm) {
+			memset(&(cpu->segs[SEG_ES]), 0, sizeof(Descriptor));
+			memset(&(cpu->segs[SEG_DS]), 0, sizeof(Descriptor));
+			memset(&(cpu->segs[SEG_FS]), 0, sizeof(Descriptor));
+			memset(&(cpu->segs[SEG_GS]), 0, sizeof(Descriptor));
+			cpu->sregs[SEG_ES] = 0;
+			cpu->sregs[SEG_DS] = 0;
+			cpu->sregs[SEG_FS] = 0;
+			cpu->sregs[SEG_GS] = 0;
+		}
+		cpu->sregs[SEG_SS] = new_ss;
+		cpu->segs[SEG_SS] = ss_desc;
+		cpu_regist_esp(cpu) = new_esp;
+	} else {
+		// 同じ特権レベル(仮想8086モードからはリング0へしか行けない)
+		if (vm) {
+			cpu_fault(cpu, EXC_GP, selector & ~0x03);
+			return;
+		}
+		dpl = cpu->cpl;
+		esp = cpu_regist_esp(cpu);
+		seg_push(cpu, &(cpu->segs[SEG_SS]), &esp, size, eflags);
+		seg_push(cpu, &(cpu->segs[SEG_SS]), &esp, size, cpu->sregs[SEG_CS]);
+		seg_push(cpu, &(cpu->segs[SEG_SS]), &esp, size, cpu->eip);
+		if (has_error) {
+			seg_push(cpu, &(cpu->segs[SEG_SS]), &esp, size, error_code);
+		}
+		seg_set_esp(cpu, &(cpu->segs[SEG_SS]), esp);
+	}
+
+	desc_set_accessed(cpu, addr, &desc);
+	seg_load_cs(cpu, selector, &desc, dpl);
+	cpu->eip = offset;
+
+	// 割り込みゲートは以降の割り込みを禁止する
+	seg_set_eflags(cpu, 0, CPU_EFLAGS_TF | CPU_EFLAGS_NT | CPU_EFLAGS_RF | CPU_EFLAGS_VM | ((type & 0x01) ? 0 : CPU_EFLAGS_IF));
+}
+
+
+// opcode
+
+void opcode_call_far(CPUx86 *cpu, uintp *segment, uintp *offset)
+{
+	Descriptor desc;
+	Descriptor gate;
+	Descriptor ss_desc;
+	uint64 raw;
+	uint32 addr;
+	uint32 eip;
+	uint32 esp;
+	uint32 new_esp;
+	uint32 params[32];
+	uint16 selector;
+	uint16 new_ss;
+	int size;
+	int count;
+	int dpl;
+	int i;
+
+	selector = uintp_val_ze(segment);
+	eip = uintp_val_ze(offset);
+	size = cpu_operand_size(cpu);
+	esp = cpu_regist_esp(cpu);
+
+	if (!cpu_cr0(cpu, CR0_PE) || (cpu->eflags & CPU_EFLAGS_VM)) {
+		// real-address or virtual-8086 mode
+		seg_push(cpu, &(cpu->segs[SEG_SS]), &esp, size, cpu->sregs[SEG_CS]);
+		seg_push(cpu, &(cpu->segs[SEG_SS]), &esp, size, cpu->eip);
+		seg_set_esp(cpu, &(cpu->segs[SEG_SS]), esp);
+		seg_load_real(cpu, SEG_CS, selector);
+		cpu->eip = eip;
+		return;
+	}
+
+	// Protected mode, not virtual-8086 mode
+	if ((selector & ~0x03)==0) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
+	}
+	if (!desc_fetch(cpu, selector, &addr, &raw)) {
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return;
+	}
+	desc_load(cpu, selector, &desc, &addr);
+
+	if (desc_s(&desc)) {
+		// コードセグメント
+		if (!seg_check_code(cpu, selector, &desc)) {
+			return;
+		}
+		seg_push(cpu, &(cpu->segs[SEG_SS]), &esp, size, cpu->sregs[SEG_CS]);
+		seg_push(cpu, &(cpu->segs[SEG_SS]), &esp, size, cpu->eip);
+		seg_set_esp(cpu, &(cpu->segs[SEG_SS]), esp);
+		desc_set_accessed(cpu, addr, &desc);
+		seg_load_cs(cpu, selector, &desc, cpu->cpl);
+		cpu->eip = eip;
+		return;
+	}
+
+	switch (desc_type(&desc)) {
+	case DESC_CALL_GATE16:
+	case DESC_CALL_GATE32:
+		break;
+	case DESC_TASK_GATE:
+	case DESC_TSS16:
+	case DESC_TSS32:
+		log_warning("call far: task switch is not supported\n");
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return;
+	default:
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return;
+	}
+
+	// コールゲート
+	gate = desc;
+	if (desc_dpl(&gate) < cpu->cpl || desc_dpl(&gate) < (selector & 0x03)) {
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return;
+	}
+	if (!desc_p(&gate)) {
+		cpu_fault(cpu, EXC_NP, selector & ~0x03);
+		return;
+	}
+	size = desc_type(&gate)==DESC_CALL_GATE32 ? 4 : 2;
+	count = (raw >> 32) & 0x1F;
+	eip = (raw & 0xFFFF) | ((raw >> 32) & 0xFFFF0000);
+	selector = (raw >> 16) & 0xFFFF;
+
+	if ((selector & ~0x03)==0 || !desc_load(cpu, selector, &desc, &addr)) {
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return;
+	}
+	dpl = desc_dpl(&desc);
+	if (!desc_is_code(&desc) || cpu->cpl < dpl) {
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return;
+	}
+	if (!desc_p(&desc)) {
+		cpu_fault(cpu, EXC_NP, selector & ~0x03);
+		return;
+	}
+
+	if (!desc_is_conforming(&desc) && dpl < cpu->cpl) {
+		// 内側の特権レベル: TSSのスタックへ元のss:espと引数をコピーする
+		if (!seg_tss_stack(cpu, dpl, &new_ss, &new_esp) || !seg_check_stack(cpu, new_ss, &ss_desc, dpl, EXC_TS)) {
+			return;
+		}
+		for (i=0; i<count; i++) {
+			params[i] = seg_pop(cpu, &(cpu->segs[SEG_SS]), &esp, size);
+		}
+		seg_push(cpu, &ss_desc, &new_esp, size, cpu->sregs[SEG_SS]);
+		seg_push(cpu, &ss_desc, &new_esp, size, cpu_regist_esp(cpu));
+		for (i=count-1; 0<=i; i--) {
+			seg_push(cpu, &ss_desc, &new_esp, size, params[i]);
+		}
+		seg_push(cpu, &ss_desc, &new_esp, size, cpu->sregs[SEG_CS]);
+		seg_push(cpu, &ss_desc, &new_esp, size, cpu->eip);
+		cpu->sregs[SEG_SS] = new_ss;
+		cpu->segs[SEG_SS] = ss_desc;
+		cpu_regist_esp(cpu) = new_esp;
+	} else {
+		dpl = cpu->cpl;
+		seg_push(cpu, &(cpu->segs[SEG_SS]), &esp, size, cpu->sregs[SEG_CS]);
+		seg_push(cpu, &(cpu->segs[SEG_SS]), &esp, size, cpu->eip);
+		seg_set_esp(cpu, &(cpu->segs[SEG_SS]), esp);
+	}
+	desc_set_accessed(cpu, addr, &desc);
+	seg_load_cs(cpu, selector, &desc, dpl);
+	cpu->eip = eip;
+}
+
+void opcode_int(CPUx86 *cpu, uintp *val)
+{
+	// 仮想8086モードはIOPL=3のときだけ
+	if ((cpu->eflags & CPU_EFLAGS_VM) && cpu_eflags(cpu, CPU_EFLAGS_IOPL)!=3) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
+	}
+	cpu_interrupt(cpu, uintp_val_ze(val), 1, 0, 0);
+}
+
+void opcode_into(CPUx86 *cpu)
+{
+	if (cpu_eflags(cpu, CPU_EFLAGS_OF)) {
+		cpu_interrupt(cpu, EXC_OF, 1, 0, 0);
+	}
+}
+
+void opcode_iret(CPUx86 *cpu)
+{
+	static const int segs[4] = {SEG_ES, SEG_DS, SEG_FS, SEG_GS};
+	Descriptor desc;
+	Descriptor ss_desc;
+	uint32 addr;
+	uint32 esp;
+	uint32 eip;
+	uint32 eflags;
+	uint32 mask;
+	uint32 new_esp;
+	uint16 selector;
+	uint16 new_ss;
+	uint16 sregs[4];
+	int size;
+	int rpl;
+	int i;
+
+	size = cpu_operand_size(cpu);
+	esp = cpu_regist_esp(cpu);
+
+	if (!cpu_cr0(cpu, CR0_PE) || (cpu->eflags & CPU_EFLAGS_VM)) {
+		// real-address or virtual-8086 mode (仮想8086モードはIOPL=3のときだけでIOPLは変えない)
+		mask = size==4 ? ~(CPU_EFLAGS_VM | CPU_EFLAGS_VIF | CPU_EFLAGS_VIP) : 0xFFFF;
+		if (cpu->eflags & CPU_EFLAGS_VM) {
+			if (cpu_eflags(cpu, CPU_EFLAGS_IOPL)!=3) {
+				cpu_fault(cpu, EXC_GP, 0);
+				return;
+			}
+			mask &= ~CPU_EFLAGS_IOPL;
+		}
+		eip = seg_pop(cpu, &(cpu->segs[SEG_SS]), &esp, size);
+		selector = seg_pop(cpu, &(cpu->segs[SEG_SS]), &esp, size);
+		eflags = seg_pop(cpu, &(cpu->segs[SEG_SS]), &esp, size);
+		seg_set_esp(cpu, &(cpu->segs[SEG_SS]), esp);
+		seg_set_eflags(cpu, eflags, mask);
+		seg_load_real(cpu, SEG_CS, selector);
+		cpu->eip = eip;
+		return;
+	}
+
+	// Protected mode, not virtual-8086 mode
+	if (cpu->eflags & CPU_EFLAGS_NT) {
+		log_warning("iret: task return is not supported\n");
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
+	}
+	eip = seg_pop(cpu, &(cpu->segs[SEG_SS]), &esp, size);
+	selector = seg_pop(cpu, &(cpu->segs[SEG_SS]), &esp, size);
+	eflags = seg_pop(cpu, &(cpu->segs[SEG_SS]), &esp, size);
+
+	if (size==4 && (eflags & CPU_EFLAGS_VM) && cpu->cpl==0) {
+		// 仮想8086モードへ戻る
+		new_esp = seg_pop(cpu, &(cpu->segs[SEG_SS]), &esp, 4);
+		new_ss = seg_pop(cpu, &(cpu->segs[SEG_SS]), &esp, 4);
+		for (i=0; i<4; i++) {
+			sregs[i] = seg_pop(cpu, &(cpu->segs[SEG_SS]), &esp, 4);
+		}
+		seg_set_eflags(cpu, eflags, 0xFFFFFFFF);
+		cpu->cpl = 3;
+		seg_load_real(cpu, SEG_CS, selector);
+		seg_load_real(cpu, SEG_SS, new_ss);
+		for (i=0; i<4; i++) {
+			seg_load_real(cpu, segs[i], sregs[i]);
+		}
+		cpu_regist_esp(cpu) = new_esp;
+		cpu->eip = eip & 0xFFFF;
+		return;
+	}
+
+	// 戻り先のコードセグメント
+	rpl = selector & 0x03;
+	if ((selector & ~0x03)==0 || !desc_load(cpu, selector, &desc, &addr)) {
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return;
+	}
+	if (rpl < cpu->cpl || !desc_is_code(&desc) || (desc_is_conforming(&desc) ? rpl < desc_dpl(&desc) : rpl!=desc_dpl(&desc))) {
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return;
+	}
+	if (!desc_p(&desc)) {
+		cpu_fault(cpu, EXC_NP, selector & ~0x03);
+		return;
+	}
+
+	// 変えられるフラグ
+	mask = CPU_EFLAGS_CF | CPU_EFLAGS_PF | CPU_EFLAGS_AF | CPU_EFLAGS_ZF | CPU_EFLAGS_SF | CPU_EFLAGS_TF | CPU_EFLAGS_DF | CPU_EFLAGS_OF | CPU_EFLAGS_NT;
+	if (size==4) {
+		mask |= CPU_EFLAGS_RF | CPU_EFLAGS_AC | CPU_EFLAGS_ID;
+	}
+	if (cpu->cpl <= cpu_eflags(cpu, CPU_EFLAGS_IOPL)) {
+		mask |= CPU_EFLAGS_IF;
+	}
+	if (cpu->cpl==0) {
+		mask |= CPU_EFLAGS_IOPL;
+		if (size==4) {
+			mask |= CPU_EFLAGS_VIF | CPU_EFLAGS_VIP;
+		}
+	}
+
+	if (cpu->cpl < rpl) {
+		// 外側の特権レベルへ戻る
+		new_esp = seg_pop(cpu, &(cpu->segs[SEG_SS]), &esp, size);
+		new_ss = seg_pop(cpu, &(cpu->segs[SEG_SS]), &esp, size);
+		if (!seg_check_stack(cpu, new_ss, &ss_desc, rpl, EXC_GP)) {
+			return;
+		}
+		seg_set_eflags(cpu, eflags, mask);
+		desc_set_accessed(cpu, addr, &desc);
+		seg_load_cs(cpu, selector, &desc, rpl);
+		cpu->sregs[SEG_SS] = new_ss;
+		cpu->segs[SEG_SS] = ss_desc;
+		seg_set_esp(cpu, &ss_desc, new_esp);
+		seg_check_outer(cpu);
+	} else {
+		seg_set_eflags(cpu, eflags, mask);
+		desc_set_accessed(cpu, addr, &desc);
+		seg_load_cs(cpu, selector, &desc, rpl);
+		seg_set_esp(cpu, &(cpu->segs[SEG_SS]), esp);
+	}
+	cpu->eip = eip;
+}
+
+void opcode_jmp_far(CPUx86 *cpu, uintp *segment, uintp *offset)
+{
+	Descriptor desc;
+	uint64 raw;
+	uint32 addr;
+	uint32 eip;
+	uint16 selector;
+
+	selector = uintp_val_ze(segment);
+	eip = uintp_val_ze(offset);
+
+	if (!cpu_cr0(cpu, CR0_PE) || (cpu->eflags & CPU_EFLAGS_VM)) {
+		// real-address or virtual-8086 mode
+		seg_load_real(cpu, SEG_CS, selector);
+		cpu->eip = eip;
+		return;
+	}
+
+	// Protected mode, not virtual-8086 mode
+	if ((selector & ~0x03)==0) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
+	}
+	if (!desc_fetch(cpu, selector, &addr, &raw)) {
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return;
+	}
+	desc_load(cpu, selector, &desc, &addr);
+
+	if (!desc_s(&desc)) {
+		switch (desc_type(&desc)) {
+		case DESC_CALL_GATE16:
+		case DESC_CALL_GATE32:
+			break;
+		case DESC_TASK_GATE:
+		case DESC_TSS16:
+		case DESC_TSS32:
+			log_warning("jmp far: task switch is not supported\n");
+			cpu_fault(cpu, EXC_GP, selector & ~0x03);
+			return;
+		default:
+			cpu_fault(cpu, EXC_GP, selector & ~0x03);
+			return;
+		}
+
+		// コールゲート(特権レベルは変わらない)
+		if (desc_dpl(&desc) < cpu->cpl || desc_dpl(&desc) < (selector & 0x03)) {
+			cpu_fault(cpu, EXC_GP, selector & ~0x03);
+			return;
+		}
+		if (!desc_p(&desc)) {
+			cpu_fault(cpu, EXC_NP, selector & ~0x03);
+			return;
+		}
+		eip = (raw & 0xFFFF) | ((raw >> 32) & 0xFFFF0000);
+		selector = ((raw >> 16) & 0xFFFC) | cpu->cpl;
+		if ((selector & ~0x03)==0 || !desc_load(cpu, selector, &desc, &addr)) {
+			cpu_fault(cpu, EXC_GP, selector & ~0x03);
+			return;
+		}
+	}
+
+	if (!seg_check_code(cpu, selector, &desc)) {
+		return;
+	}
+	desc_set_accessed(cpu, addr, &desc);
+	seg_load_cs(cpu, selector, &desc, cpu->cpl);
+	cpu->eip = eip;
+}
+
+// LSS LFS LGS: m16:32のセレクタをsegへ、オフセットをdstへ
+void opcode_lfp(CPUx86 *cpu, int seg, uintp *dst, uintp *src)
+{
+	uint32 offset;
+	uint16 selector;
+
+	offset = uintp_val_ze(src);
+	selector = *(uint16*)(src->ptr.uint8p + src->type);
+	seg_load(cpu, seg, selector);
+	set_uintp_val(dst, offset);
+}
+
+void opcode_lgdt(CPUx86 *cpu, uintp *limit, uintp *base)
+{
+	if (cpu_cr0(cpu, CR0_PE) && cpu->cpl!=0) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
+	}
+	if (cpu_operand_size(cpu)==2) {
+		cpu->gdtr.limit = uintp_val(limit);
+		cpu->gdtr.base = uintp_val(base) & 0x00FFFFFF;
+	} else if (cpu_operand_size(cpu)==4) {
+		cpu->gdtr.limit = uintp_val(limit);
+		cpu->gdtr.base = uintp_val(base);
+	}
+}
+
+void opcode_lidt(CPUx86 *cpu, uintp *limit, uintp *base)
+{
+	if (cpu_cr0(cpu, CR0_PE) && cpu->cpl!=0) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
+	}
+	cpu->idtr.limit = uintp_val(limit);
+	cpu->idtr.base = uintp_val(base);
+	if (cpu_operand_size(cpu)==2) {
+		cpu->idtr.base &= 0x00FFFFFF;
+	}
+}
+
+void opcode_lldt(CPUx86 *cpu, uintp *src)
+{
+	Descriptor desc;
+	uint32 addr;
+	uint16 selector;
+
+	if (!cpu_cr0(cpu, CR0_PE) || (cpu->eflags & CPU_EFLAGS_VM)) {
+		cpu_fault(cpu, EXC_UD, 0);
+		return;
+	}
+	if (cpu->cpl!=0) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
+	}
+	selector = uintp_val_ze(src);
+	if ((selector & ~0x03)==0) {
+		cpu->ldtr = selector;
+		memset(&(cpu->ldt), 0, sizeof(Descriptor));
+		return;
+	}
+	if ((selector & 0x04) || !desc_load(cpu, selector, &desc, &addr) || desc_s(&desc) || desc_type(&desc)!=DESC_LDT) {
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return;
+	}
+	if (!desc_p(&desc)) {
+		cpu_fault(cpu, EXC_NP, selector & ~0x03);
+		return;
+	}
+	cpu->ldtr = selector;
+	cpu->ldt = desc;
+}
+
+// PE MP EM TSだけを変える(PEはクリアできない)
+void opcode_lmsw(CPUx86 *cpu, uintp *src)
+{
+	uint32 val;
+
+	if (cpu_cr0(cpu, CR0_PE) && (cpu->cpl!=0 || (cpu->eflags & CPU_EFLAGS_VM))) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
+	}
+	val = uintp_val_ze(src) & (CR0_PE | CR0_MP | CR0_EM | CR0_TS);
+	cpu->cr0 = (cpu->cr0 & ~(CR0_MP | CR0_EM | CR0_TS)) | val;
+	cpu_update_mode(cpu);
+}
+
+void opcode_ltr(CPUx86 *cpu, uintp *src)
+{
+	Descriptor desc;
+	uint32 addr;
+	uint16 selector;
+
+	if (!cpu_cr0(cpu, CR0_PE) || (cpu->eflags & CPU_EFLAGS_VM)) {
+		cpu_fault(cpu, EXC_UD, 0);
+		return;
+	}
+	if (cpu->cpl!=0) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
+	}
+	selector = uintp_val_ze(src);
+	if ((selector & ~0x03)==0) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
+	}
+	if ((selector & 0x04) || !desc_load(cpu, selector, &desc, &addr) || desc_s(&desc) || (desc_type(&desc)!=DESC_TSS16 && desc_type(&desc)!=DESC_TSS32)) {
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return;
+	}
+	if (!desc_p(&desc)) {
+		cpu_fault(cpu, EXC_NP, selector & ~0x03);
+		return;
+	}
+
+	// ビジーにする
+	desc.attribute |= 0x02;
+	cpu->mem[addr + 5] |= 0x02;
+	cpu->tr = selector;
+	cpu->tss = desc;
+}
+
+void opcode_mov_from_cr(CPUx86 *cpu, int cr, uintp *dst)
+{
+	if (cpu_cr0(cpu, CR0_PE) && (cpu->cpl!=0 || (cpu->eflags & CPU_EFLAGS_VM))) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
+	}
+	switch (cr) {
+	case 0:
+		set_uintp_val(dst, cpu->cr0);
+		break;
+	case 2:
+		set_uintp_val(dst, cpu->cr2);
+		break;
+	case 3:
+		set_uintp_val(dst, cpu->cr3);
+		break;
+	case 4:
+		set_uintp_val(dst, cpu->cr4);
+		break;
+	default:
+		cpu_fault(cpu, EXC_UD, 0);
+		break;
+	}
+}
+
+// CR0を変えたらデフォルトのオペランドサイズを決め直す(実行ループもここで切り替わる)
+void opcode_mov_to_cr(CPUx86 *cpu, int cr, uintp *src)
+{
+	uint32 val;
+
+	if (cpu_cr0(cpu, CR0_PE) && (cpu->cpl!=0 || (cpu->eflags & CPU_EFLAGS_VM))) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return;
+	}
+	val = uintp_val_ze(src);
+	switch (cr) {
+	case 0:
+		if ((val & CR0_PG) && !(val & CR0_PE)) {
+			cpu_fault(cpu, EXC_GP, 0);
+			return;
+		}
+		if (val & CR0_PG) {
+			log_warning("mov cr0: paging is not supported\n");
+			cpu_fault(cpu, EXC_GP, 0);
+			return;
+		}
+		cpu->cr0 = val | CR0_ET;
+		cpu_update_mode(cpu);
+		break;
+	case 2:
+		cpu->cr2 = val;
+		break;
+	case 3:
+		cpu->cr3 = val;
+		break;
+	case 4:
+		// CPUIDで見せていない機能のビットは予約
+		if (val & ~cpuid_cr4_mask(cpu)) {
+			cpu_fault(cpu, EXC_GP, 0);
+			return;
+		}
+		cpu->cr4 = val;
+		break;
+	default:
+		cpu_fault(cpu, EXC_UD, 0);
+		break;
+	}
+}
+
+// MOV Sreg, POP Sreg
+void opcode_mov_sreg(CPUx86 *cpu, int seg, uintp *src)
+{
+	if (seg==SEG_CS || SEG_GS < seg) {
+		cpu_fault(cpu, EXC_UD, 0);
+		return;
+	}
+	seg_load(cpu, seg, uintp_val_ze(src));
+}
+
+void opcode_pop_sreg(CPUx86 *cpu, int seg)
+{
+	uint32 esp;
+	uint32 selector;
+
+	esp = cpu_regist_esp(cpu);
+	selector = seg_pop(cpu, &(cpu->segs[SEG_SS]), &esp, cpu_operand_size(cpu));
+	seg_load(cpu, seg, selector);
+	seg_set_esp(cpu, &(cpu->segs[SEG_SS]), esp);
+}
+
+void opcode_push_sreg(CPUx86 *cpu, int seg)
+{
+	uint32 esp;
+
+	esp = cpu_regist_esp(cpu);
+	seg_push(cpu, &(cpu->segs[SEG_SS]), &esp, cpu_operand_size(cpu), cpu->sregs[seg]);
+	seg_set_esp(cpu, &(cpu->segs[SEG_SS]), esp);
+}
+
+// imm: 戻った後に捨てる引数のバイト数(NULL: なし)
+void opcode_ret_far(CPUx86 *cpu, uintp *imm)
+{
+	Descriptor desc;
+	Descriptor ss_desc;
+	uint32 addr;
+	uint32 esp;
+	uint32 eip;
+	uint32 new_esp;
+	uint32 n;
+	uint16 selector;
+	uint16 new_ss;
+	int size;
+	int rpl;
+
+	size = cpu_operand_size(cpu);
+	n = imm ? uintp_val_ze(imm) : 0;
+	esp = cpu_regist_esp(cpu);
+	eip = seg_pop(cpu, &(cpu->segs[SEG_SS]), &esp, size);
+	selector = seg_pop(cpu, &(cpu->segs[SEG_SS]), &esp, size);
+
+	if (!cpu_cr0(cpu, CR0_PE) || (cpu->eflags & CPU_EFLAGS_VM)) {
+		// real-address or virtual-8086 mode
+		seg_set_esp(cpu, &(cpu->segs[SEG_SS]), esp + n);
+		seg_load_real(cpu, SEG_CS, selector);
+		cpu->eip = eip;
+		return;
+	}
+
+	// Protected mode, not virtual-8086 mode
+	rpl = selector & 0x03;
+	if ((selector & ~0x03)==0 || !desc_load(cpu, selector, &desc, &addr)) {
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return;
+	}
+	if (rpl < cpu->cpl || !desc_is_code(&desc) || (desc_is_conforming(&desc) ? rpl < desc_dpl(&desc) : rpl!=desc_dpl(&desc))) {
+		cpu_fault(cpu, EXC_GP, selector & ~0x03);
+		return;
+	}
+	if (!desc_p(&desc)) {
+		cpu_fault(cpu, EXC_NP, selector & ~0x03);
+		return;
+	}
+
+	if (rpl==cpu->cpl) {
+		seg_set_esp(cpu, &(cpu->segs[SEG_SS]), esp + n);
+		desc_set_accessed(cpu, addr, &desc);
+		seg_load_cs(cpu, selector, &desc, rpl);
+		cpu->eip = eip;
+		return;
+	}
+
+	// 外側の特権レベルへ戻る(引数は両方のスタックで捨てる)
+	esp += n;
+	new_esp = seg_pop(cpu, &(cpu->segs[SEG_SS]), &esp, size);
+	new_ss = seg_pop(cpu, &(cpu->segs[SEG_SS]), &esp, size);
+	if (!seg_check_stack(cpu, new_ss, &ss_desc, rpl, EXC_GP)) {
+		return;
+	}
+	desc_set_accessed(cpu, addr, &desc);
+	seg_load_cs(cpu, selector, &desc, rpl);
+	cpu->sregs[SEG_SS] = new_ss;
+	cpu->segs[SEG_SS] = ss_desc;
+	seg_set_esp(cpu, &ss_desc, new_esp + n);
+	cpu->eip = eip;
+	seg_check_outer(cpu);
+}
+
+void opcode_sgdt(CPUx86 *cpu, uintp *limit, uintp *base)
+{
+	set_uintp_val(limit, cpu->gdtr.limit);
+	set_uintp_val(base, cpu_operand_size(cpu)==2 ? cpu->gdtr.base & 0x00FFFFFF : cpu->gdtr.base);
+}
+
+void opcode_sidt(CPUx86 *cpu, uintp *limit, uintp *base)
+{
+	set_uintp_val(limit, cpu->idtr.limit);
+	set_uintp_val(base, cpu_operand_size(cpu)==2 ? cpu->idtr.base & 0x00FFFFFF : cpu->idtr.base);
+}
+
+void opcode_sldt(CPUx86 *cpu, uintp *dst)
+{
+	set_uintp_val_ze(dst, cpu->ldtr);
+}
+
+void opcode_smsw(CPUx86 *cpu, uintp *dst)
+{
+	set_uintp_val_ze(dst, cpu->cr0);
+}
+
+void opcode_str(CPUx86 *cpu, uintp *dst)
+{
+	set_uintp_val_ze(dst, cpu->tr);
+}
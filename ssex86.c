@@ -0,0 +1,579 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <emmintrin.h>
+#include "cpux86.h"
+#include "log.h"
+
+
+// register
+
+// MMXレジスタはx87物理レジスタの仮数部(下位64bit)と共有する
+#define cpu_mm(cpu, i)		(*(uint64*)&((cpu)->fpu.st[i]))
+#define cpu_mm_exp(cpu, i)	(((uint16*)&((cpu)->fpu.st[i]))[4])
+
+// MMX命令の実行でFPUはTOP=0, 全レジスタ有効になる
+void mmx_enter(CPUx86 *cpu)
+{
+	cpu->fpu.status &= ~FPU_SW_TOP;
+	cpu->fpu.tag_empty = 0x00;
+}
+
+__m128i sse_load_reg(CPUx86 *cpu, int xmm, int reg)
+{
+	if (xmm) {
+		return _mm_loadu_si128((__m128i*)cpu->xmm[reg].b);
+	}
+	return _mm_loadl_epi64((__m128i*)&cpu_mm(cpu, reg));
+}
+
+void sse_store_reg(CPUx86 *cpu, int xmm, int reg, __m128i val)
+{
+	if (xmm) {
+		_mm_storeu_si128((__m128i*)cpu->xmm[reg].b, val);
+	} else {
+		_mm_storel_epi64((__m128i*)&cpu_mm(cpu, reg), val);
+		cpu_mm_exp(cpu, reg) = 0xFFFF;
+	}
+}
+
+// 第2オペランド(xmm/m128 または mm/m64)を読む
+__m128i sse_load_rm(CPUx86 *cpu, int xmm, uint8 *mem)
+{
+	if (!mem) {
+		return sse_load_reg(cpu, xmm, cpu->modrm_rm);
+	}
+	if (xmm) {
+		return _mm_loadu_si128((__m128i*)mem);
+	}
+	return _mm_loadl_epi64((__m128i*)mem);
+}
+
+// movdqa/movaps: 16byte境界でなければ#GP
+int sse_aligned(CPUx86 *cpu, uint8 *mem)
+{
+	if (mem && ((mem - cpu->mem) & 0x0F)) {
+		cpu_fault(cpu, EXC_GP, 0);
+		return 0;
+	}
+	return 1;
+}
+
+// シフト量(mm/xmmの下位64bitまたはimm8)
+__m128i sse_count(uint32 count)
+{
+	return _mm_cvtsi32_si128(count);
+}
+
+// pslldq/psrldq: バイト単位のシフト
+__m128i sse_shift_bytes(__m128i val, int count, int left)
+{
+	uint8 src[16];
+	uint8 dst[16];
+	memset(dst, 0, 16);
+	if (count<16) {
+		_mm_storeu_si128((__m128i*)src, val);
+		if (left) {
+			memcpy(dst + count, src, 16 - count);
+		} else {
+			memcpy(dst, src + count, 16 - count);
+		}
+	}
+	return _mm_loadu_si128((__m128i*)dst);
+}
+
+// pshufd/pshufw/pshufhw/pshuflw
+__m128i sse_shuffle(__m128i val, uint8 order, int words, int offset)
+{
+	XMMReg src;
+	XMMReg dst;
+	int i;
+	_mm_storeu_si128((__m128i*)src.b, val);
+	dst = src;
+	for (i=0; i<4; i++) {
+		if (words) {
+			dst.w[offset + i] = src.w[offset + ((order >> (i * 2)) & 0x03)];
+		} else {
+			dst.d[i] = src.d[(order >> (i * 2)) & 0x03];
+		}
+	}
+	return _mm_loadu_si128((__m128i*)dst.b);
+}
+
+
+// 命令に必要なCPUIDの機能
+// 66 F2 F3プリフィックスつきはSSE2、MMXレジスタのものは命令ごと
+uint32 sse_feature(CPUx86 *cpu, uint8 opcode)
+{
+	if (cpu->prefix.operand_size || cpu->prefix.rep || cpu->prefix.repne) {
+		return CPUID_SSE2;
+	}
+	switch (opcode) {
+	case 0x10:	// movups
+	case 0x11:
+	case 0x28:	// movaps
+	case 0x29:
+	case 0x2B:	// movntps
+	case 0x70:	// pshufw
+	case 0xC4:	// pinsrw
+	case 0xC5:	// pextrw
+	case 0xD7:	// pmovmskb
+	case 0xDA:	// pminub
+	case 0xDE:	// pmaxub
+	case 0xE0:	// pavgb
+	case 0xE3:	// pavgw
+	case 0xE4:	// pmulhuw
+	case 0xE7:	// movntq
+	case 0xEA:	// pminsw
+	case 0xEE:	// pmaxsw
+	case 0xF6:	// psadbw
+	case 0xF7:	// maskmovq
+		return CPUID_SSE;
+	case 0xC3:	// movnti
+	case 0xD4:	// paddq
+	case 0xF4:	// pmuludq
+	case 0xFB:	// psubq
+		return CPUID_SSE2;
+	default:
+		return CPUID_MMX;
+	}
+}
+
+
+// opcode
+
+// 0F xx : MMX/SSE/SSE2 整数命令(modrmは読み込み済み)
+// 66プリフィックスでXMM、なしでMMXのレジスタを使う
+void opcode_sse(CPUx86 *cpu, uint8 opcode)
+{
+	uintp operand;
+	uint8 *mem;
+	int xmm;
+	int reg;
+	__m128i a;
+	__m128i b;
+	__m128i r;
+	uint8 imm8;
+	uint32 val;
+
+	if (cpu_cr0(cpu, CR0_EM) || !cpu_feature(cpu, sse_feature(cpu, opcode))) {
+		cpu_fault(cpu, EXC_UD, 0);
+		return;
+	}
+	if (!fpu_available(cpu)) {
+		return;
+	}
+
+	reg = cpu->modrm_reg;
+	mem = NULL;
+	if (cpu->modrm_mod!=3) {
+		cpu_modrm_address(cpu, &operand);
+		mem = operand.ptr.uint8p;
+	}
+	xmm = cpu->prefix.operand_size;
+	switch (opcode) {
+	case 0x10:
+	case 0x11:
+	case 0x28:
+	case 0x29:
+	case 0x2B:
+	case 0x77:
+	case 0xC3:
+		break;
+	default:
+		if (!xmm && !cpu->prefix.rep && !cpu->prefix.repne) {
+			mmx_enter(cpu);
+		}
+		break;
+	}
+
+	switch (opcode) {
+	// 移動
+	case 0x10:	// 0F 10 /r : movups xmm xmm/m128
+	case 0x28:	// 0F 28 /r : movaps xmm xmm/m128
+		if (cpu->prefix.rep || cpu->prefix.repne) {
+			log_warning("not implemented opcode: 0x0F%02X (scalar)\n", opcode);
+			cpu_fault(cpu, EXC_UD, 0);
+			break;
+		}
+		if (opcode==0x28 && !sse_aligned(cpu, mem)) {
+			break;
+		}
+		sse_store_reg(cpu, 1, reg, sse_load_rm(cpu, 1, mem));
+		break;
+	case 0x11:	// 0F 11 /r : movups xmm/m128 xmm
+	case 0x29:	// 0F 29 /r : movaps xmm/m128 xmm
+	case 0x2B:	// 0F 2B /r : movntps m128 xmm
+		if (cpu->prefix.rep || cpu->prefix.repne) {
+			log_warning("not implemented opcode: 0x0F%02X (scalar)\n", opcode);
+			cpu_fault(cpu, EXC_UD, 0);
+			break;
+		}
+		if (opcode!=0x11 && !sse_aligned(cpu, mem)) {
+			break;
+		}
+		if (mem) {
+			_mm_storeu_si128((__m128i*)mem, sse_load_reg(cpu, 1, reg));
+		} else {
+			sse_store_reg(cpu, 1, cpu->modrm_rm, sse_load_reg(cpu, 1, reg));
+		}
+		break;
+	case 0x6E:	// 0F 6E /r : movd mm r/m32, 66: movd xmm r/m32
+		if (mem) {
+			memcpy(&val, mem, 4);
+		} else {
+			val = cpu->regs[cpu->modrm_rm];
+		}
+		sse_store_reg(cpu, xmm, reg, _mm_cvtsi32_si128(val));
+		break;
+	case 0x7E:
+		if (cpu->prefix.rep) {
+			// F3 0F 7E /r : movq xmm xmm/m64
+			a = mem ? _mm_loadl_epi64((__m128i*)mem) : sse_load_reg(cpu, 1, cpu->modrm_rm);
+			sse_store_reg(cpu, 1, reg, _mm_move_epi64(a));
+			break;
+		}
+		// 0F 7E /r : movd r/m32 mm, 66: movd r/m32 xmm
+		val = _mm_cvtsi128_si32(sse_load_reg(cpu, xmm, reg));
+		if (mem) {
+			memcpy(mem, &val, 4);
+		} else {
+			cpu->regs[cpu->modrm_rm] = val;
+		}
+		break;
+	case 0x6F:
+		// 0F 6F /r : movq mm mm/m64
+		// 66 0F 6F /r : movdqa xmm xmm/m128
+		// F3 0F 6F /r : movdqu xmm xmm/m128
+		if (cpu->prefix.rep) {
+			xmm = 1;
+		} else if (xmm && !sse_aligned(cpu, mem)) {
+			break;
+		}
+		sse_store_reg(cpu, xmm, reg, sse_load_rm(cpu, xmm, mem));
+		break;
+	case 0x7F:
+		// 0F 7F /r : movq mm/m64 mm
+		// 66 0F 7F /r : movdqa xmm/m128 xmm
+		// F3 0F 7F /r : movdqu xmm/m128 xmm
+		if (cpu->prefix.rep) {
+			xmm = 1;
+		} else if (xmm && !sse_aligned(cpu, mem)) {
+			break;
+		}
+	case 0xE7:
+		// 0F E7 /r : movntq m64 mm
+		// 66 0F E7 /r : movntdq m128 xmm
+		if (opcode==0xE7 && xmm && !sse_aligned(cpu, mem)) {
+			break;
+		}
+		a = sse_load_reg(cpu, xmm, reg);
+		if (!mem) {
+			sse_store_reg(cpu, xmm, cpu->modrm_rm, a);
+		} else if (xmm) {
+			_mm_storeu_si128((__m128i*)mem, a);
+		} else {
+			_mm_storel_epi64((__m128i*)mem, a);
+		}
+		break;
+	case 0xD6:	// 66 0F D6 /r : movq xmm/m64 xmm
+		a = sse_load_reg(cpu, 1, reg);
+		if (mem) {
+			_mm_storel_epi64((__m128i*)mem, a);
+		} else {
+			sse_store_reg(cpu, 1, cpu->modrm_rm, _mm_move_epi64(a));
+		}
+		break;
+	case 0xC3:	// 0F C3 /r : movnti m32 r32
+		if (mem) {
+			memcpy(mem, &(cpu->regs[reg]), 4);
+		}
+		break;
+	case 0xD7:	// 0F D7 /r : pmovmskb r32 mm, 66: pmovmskb r32 xmm
+		val = _mm_movemask_epi8(sse_load_reg(cpu, xmm, cpu->modrm_rm));
+		cpu->regs[reg] = xmm ? val : (val & 0xFF);
+		break;
+
+	// シャッフル
+	case 0x70:
+		// 0F 70 /r ib : pshufw mm mm/m64 imm8
+		// 66 0F 70 /r ib : pshufd xmm xmm/m128 imm8
+		// F3 0F 70 /r ib : pshufhw xmm xmm/m128 imm8
+		// F2 0F 70 /r ib : pshuflw xmm xmm/m128 imm8
+		if (cpu->prefix.rep || cpu->prefix.repne) {
+			xmm = 1;
+		}
+		b = sse_load_rm(cpu, xmm, mem);
+		imm8 = mem_eip_load8(cpu);
+		if (cpu->prefix.rep) {
+			r = sse_shuffle(b, imm8, 1, 4);
+		} else if (cpu->prefix.repne || !xmm) {
+			r = sse_shuffle(b, imm8, 1, 0);
+		} else {
+			r = sse_shuffle(b, imm8, 0, 0);
+		}
+		sse_store_reg(cpu, xmm, reg, r);
+		break;
+
+	// シフト(即値)
+	case 0x71:
+	case 0x72:
+	case 0x73:
+		// 0F 71 /2 /4 /6 ib : psrlw/psraw/psllw
+		// 0F 72 /2 /4 /6 ib : psrld/psrad/pslld
+		// 0F 73 /2 /6 ib : psrlq/psllq, 66 0F 73 /3 /7 ib : psrldq/pslldq
+		a = sse_load_reg(cpu, xmm, cpu->modrm_rm);
+		imm8 = mem_eip_load8(cpu);
+		b = sse_count(imm8);
+		switch (opcode << 4 | reg) {
+		case 0x712:
+			r = _mm_srl_epi16(a, b);
+			break;
+		case 0x714:
+			r = _mm_sra_epi16(a, b);
+			break;
+		case 0x716:
+			r = _mm_sll_epi16(a, b);
+			break;
+		case 0x722:
+			r = _mm_srl_epi32(a, b);
+			break;
+		case 0x724:
+			r = _mm_sra_epi32(a, b);
+			break;
+		case 0x726:
+			r = _mm_sll_epi32(a, b);
+			break;
+		case 0x732:
+			r = _mm_srl_epi64(a, b);
+			break;
+		case 0x736:
+			r = _mm_sll_epi64(a, b);
+			break;
+		case 0x733:
+			r = sse_shift_bytes(a, imm8, 0);
+			break;
+		case 0x737:
+			r = sse_shift_bytes(a, imm8, 1);
+			break;
+		default:
+			log_warning("not implemented opcode: 0x0F%02X /%d\n", opcode, reg);
+			cpu_fault(cpu, EXC_UD, 0);
+			return;
+		}
+		sse_store_reg(cpu, xmm, cpu->modrm_rm, r);
+		break;
+
+	case 0x77:	// 0F 77 : emms
+		cpu->fpu.tag_empty = 0xFF;
+		break;
+
+	// 2オペランド演算
+	default:
+		a = sse_load_reg(cpu, xmm, reg);
+		b = sse_load_rm(cpu, xmm, mem);
+		switch (opcode) {
+		case 0x60:	// punpcklbw
+			r = _mm_unpacklo_epi8(a, b);
+			break;
+		case 0x61:	// punpcklwd
+			r = _mm_unpacklo_epi16(a, b);
+			break;
+		case 0x62:	// punpckldq
+			r = _mm_unpacklo_epi32(a, b);
+			break;
+		case 0x63:	// packsswb
+			r = xmm ? _mm_packs_epi16(a, b) : _mm_packs_epi16(_mm_unpacklo_epi64(a, b), _mm_unpacklo_epi64(a, b));
+			break;
+		case 0x64:	// pcmpgtb
+			r = _mm_cmpgt_epi8(a, b);
+			break;
+		case 0x65:	// pcmpgtw
+			r = _mm_cmpgt_epi16(a, b);
+			break;
+		case 0x66:	// pcmpgtd
+			r = _mm_cmpgt_epi32(a, b);
+			break;
+		case 0x67:	// packuswb
+			r = xmm ? _mm_packus_epi16(a, b) : _mm_packus_epi16(_mm_unpacklo_epi64(a, b), _mm_unpacklo_epi64(a, b));
+			break;
+		case 0x68:	// punpckhbw (MMXは下位64bitの上半分)
+			r = xmm ? _mm_unpackhi_epi8(a, b) : _mm_srli_si128(_mm_unpacklo_epi8(a, b), 8);
+			break;
+		case 0x69:	// punpckhwd
+			r = xmm ? _mm_unpackhi_epi16(a, b) : _mm_srli_si128(_mm_unpacklo_epi16(a, b), 8);
+			break;
+		case 0x6A:	// punpckhdq
+			r = xmm ? _mm_unpackhi_epi32(a, b) : _mm_srli_si128(_mm_unpacklo_epi32(a, b), 8);
+			break;
+		case 0x6B:	// packssdw
+			r = xmm ? _mm_packs_epi32(a, b) : _mm_packs_epi32(_mm_unpacklo_epi64(a, b), _mm_unpacklo_epi64(a, b));
+			break;
+		case 0x6C:	// 66: punpcklqdq
+			r = _mm_unpacklo_epi64(a, b);
+			break;
+		case 0x6D:	// 66: punpckhqdq
+			r = _mm_unpackhi_epi64(a, b);
+			break;
+		case 0x74:	// pcmpeqb
+			r = _mm_cmpeq_epi8(a, b);
+			break;
+		case 0x75:	// pcmpeqw
+			r = _mm_cmpeq_epi16(a, b);
+			break;
+		case 0x76:	// pcmpeqd
+			r = _mm_cmpeq_epi32(a, b);
+			break;
+		case 0xD1:	// psrlw
+			r = _mm_srl_epi16(a, _mm_move_epi64(b));
+			break;
+		case 0xD2:	// psrld
+			r = _mm_srl_epi32(a, _mm_move_epi64(b));
+			break;
+		case 0xD3:	// psrlq
+			r = _mm_srl_epi64(a, _mm_move_epi64(b));
+			break;
+		case 0xD4:	// paddq
+			r = _mm_add_epi64(a, b);
+			break;
+		case 0xD5:	// pmullw
+			r = _mm_mullo_epi16(a, b);
+			break;
+		case 0xD8:	// psubusb
+			r = _mm_subs_epu8(a, b);
+			break;
+		case 0xD9:	// psubusw
+			r = _mm_subs_epu16(a, b);
+			break;
+		case 0xDA:	// pminub
+			r = _mm_min_epu8(a, b);
+			break;
+		case 0xDB:	// pand
+			r = _mm_and_si128(a, b);
+			break;
+		case 0xDC:	// paddusb
+			r = _mm_adds_epu8(a, b);
+			break;
+		case 0xDD:	// paddusw
+			r = _mm_adds_epu16(a, b);
+			break;
+		case 0xDE:	// pmaxub
+			r = _mm_max_epu8(a, b);
+			break;
+		case 0xDF:	// pandn
+			r = _mm_andnot_si128(a, b);
+			break;
+		case 0xE0:	// pavgb
+			r = _mm_avg_epu8(a, b);
+			break;
+		case 0xE1:	// psraw
+			r = _mm_sra_epi16(a, _mm_move_epi64(b));
+			break;
+		case 0xE2:	// psrad
+			r = _mm_sra_epi32(a, _mm_move_epi64(b));
+			break;
+		case 0xE3:	// pavgw
+			r = _mm_avg_epu16(a, b);
+			break;
+		case 0xE4:	// pmulhuw
+			r = _mm_mulhi_epu16(a, b);
+			break;
+		case 0xE5:	// pmulhw
+			r = _mm_mulhi_epi16(a, b);
+			break;
+		case 0xE8:	// psubsb
+			r = _mm_subs_epi8(a, b);
+			break;
+		case 0xE9:	// psubsw
+			r = _mm_subs_epi16(a, b);
+			break;
+		case 0xEA:	// pminsw
+			r = _mm_min_epi16(a, b);
+			break;
+		case 0xEB:	// por
+			r = _mm_or_si128(a, b);
+			break;
+		case 0xEC:	// paddsb
+			r = _mm_adds_epi8(a, b);
+			break;
+		case 0xED:	// paddsw
+			r = _mm_adds_epi16(a, b);
+			break;
+		case 0xEE:	// pmaxsw
+			r = _mm_max_epi16(a, b);
+			break;
+		case 0xEF:	// pxor
+			r = _mm_xor_si128(a, b);
+			break;
+		case 0xF1:	// psllw
+			r = _mm_sll_epi16(a, _mm_move_epi64(b));
+			break;
+		case 0xF2:	// pslld
+			r = _mm_sll_epi32(a, _mm_move_epi64(b));
+			break;
+		case 0xF3:	// psllq
+			r = _mm_sll_epi64(a, _mm_move_epi64(b));
+			break;
+		case 0xF4:	// pmuludq
+			r = _mm_mul_epu32(a, b);
+			break;
+		case 0xF5:	// pmaddwd
+			r = _mm_madd_epi16(a, b);
+			break;
+		case 0xF6:	// psadbw
+			r = _mm_sad_epu8(a, b);
+			break;
+		case 0xF8:	// psubb
+			r = _mm_sub_epi8(a, b);
+			break;
+		case 0xF9:	// psubw
+			r = _mm_sub_epi16(a, b);
+			break;
+		case 0xFA:	// psubd
+			r = _mm_sub_epi32(a, b);
+			break;
+		case 0xFB:	// psubq
+			r = _mm_sub_epi64(a, b);
+			break;
+		case 0xFC:	// paddb
+			r = _mm_add_epi8(a, b);
+			break;
+		case 0xFD:	// paddw
+			r = _mm_add_epi16(a, b);
+			break;
+		case 0xFE:	// paddd
+			r = _mm_add_epi32(a, b);
+			break;
+		default:
+			log_warning("not implemented opcode: 0x0F%02X\n", opcode);
+			cpu_fault(cpu, EXC_UD, 0);
+			return;
+		}
+		sse_store_reg(cpu, xmm, reg, r);
+		break;
+	}
+}
+
+// 0F AE /2 : ldmxcsr m32
+void opcode_ldmxcsr(CPUx86 *cpu, uintp *src)
+{
+	if (!cpu_feature(cpu, CPUID_SSE)) {
+		cpu_fault(cpu, EXC_UD, 0);
+		return;
+	}
+	if (fpu_available(cpu)) {
+		cpu->mxcsr = uintp_val(src) & MXCSR_MASK;
+	}
+}
+
+// 0F AE /3 : stmxcsr m32
+void opcode_stmxcsr(CPUx86 *cpu, uintp *dst)
+{
+	if (!cpu_feature(cpu, CPUID_SSE)) {
+		cpu_fault(cpu, EXC_UD, 0);
+		return;
+	}
+	if (fpu_available(cpu)) {
+		set_uintp_val(dst, cpu->mxcsr);
+	}
+}
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../cpux86.h"
+#include "../jit.h"
+#include "../virtio.h"
+#include "../blk.h"
+
+
+// virtio-blkで読んだセクタがRAMに入り、そこにあった翻訳済みのコードが捨てられるか確かめる
+//   インタプリタ、IRインタプリタ、ネイティブで同じ結果になること
+
+// 32bit、ベース0
+//   TEST_BUF: mov eax, 1; ret をcallで100回実行しておく(JITで翻訳される)
+//   キュー(PFN=2)にセクタ1をTEST_BUFに読む要求を置いて通知し、usedのidxをポーリングする
+//   読んだセクタ(mov eax, 0x1234; ret)をcallしてhlt
+#define TEST_QUEUE		0x2000
+#define TEST_AVAIL		(TEST_QUEUE + VIRTQ_NUM * 16)
+#define TEST_USED		(TEST_QUEUE + VIRTQ_ALIGN)
+#define TEST_HEADER		0x5000
+#define TEST_STATUS		0x5010
+#define TEST_BUF		0x6000
+#define TEST_STACK		0x8000
+
+static uint8 test_code[] = {
+	0xBE, 0x00, 0x60, 0x00, 0x00,				// mov esi, TEST_BUF
+	0xB9, 0x64, 0x00, 0x00, 0x00,				// mov ecx, 100
+	0xFF, 0xD6,									// L: call esi
+	0x83, 0xE9, 0x01,							// sub ecx, 1
+	0x75, 0xF9,									// jnz L
+	0xBA, 0x12, 0xC0, 0x00, 0x00,				// mov edx, BLK_PORT + VIRTIO_STATUS
+	0xB0, 0x03,									// mov al, ACKNOWLEDGE | DRIVER
+	0xEE,										// out dx, al
+	0xBA, 0x08, 0xC0, 0x00, 0x00,				// mov edx, BLK_PORT + VIRTIO_QUEUE_PFN
+	0xB8, 0x02, 0x00, 0x00, 0x00,				// mov eax, TEST_QUEUE >> 12
+	0xEF,										// out dx, eax
+	0xBA, 0x12, 0xC0, 0x00, 0x00,				// mov edx, BLK_PORT + VIRTIO_STATUS
+	0xB0, 0x07,									// mov al, ACKNOWLEDGE | DRIVER | DRIVER_OK
+	0xEE,										// out dx, al
+	0x66, 0xC7, 0x05, 0x04, 0x28, 0x00, 0x00, 0x00, 0x00,	// mov word [avail.ring[0]], 0
+	0x66, 0xC7, 0x05, 0x02, 0x28, 0x00, 0x00, 0x01, 0x00,	// mov word [avail.idx], 1
+	0xBA, 0x10, 0xC0, 0x00, 0x00,				// mov edx, BLK_PORT + VIRTIO_QUEUE_NOTIFY
+	0x31, 0xC0,									// xor eax, eax
+	0x66, 0xEF,									// out dx, ax
+	0x66, 0x83, 0x3D, 0x02, 0x30, 0x00, 0x00, 0x01,	// W: cmp word [used.idx], 1
+	0x72, 0xF6,									// jb W
+	0xFF, 0xD6,									// call esi
+	0xF4,										// hlt
+};
+
+static uint8 test_old[] = {0xB8, 0x01, 0x00, 0x00, 0x00, 0xC3};	// mov eax, 1; ret
+static uint8 test_new[] = {0xB8, 0x34, 0x12, 0x00, 0x00, 0xC3};	// mov eax, 0x1234; ret
+
+// ディスクリプタ: addr(8) len(4) flags(2) next(2)
+static void test_desc(CPUx86 *cpu, int i, uint32 addr, uint32 len, uint16 flags, uint16 next)
+{
+	uint8 *p;
+	p = &(cpu->mem[TEST_QUEUE + i * 16]);
+	memset(p, 0, 16);
+	memcpy(p, &addr, 4);
+	memcpy(p + 8, &len, 4);
+	memcpy(p + 12, &flags, 2);
+	memcpy(p + 14, &next, 2);
+}
+
+// jit: 0 インタプリタ、1 IRインタプリタ、2 ネイティブ
+static int test_run(int jit, const char *image)
+{
+	static const char *name[] = {"interp", "ir", "native"};
+	static const uint32 header[4] = {0, 0, 1, 0};	// type 0(読む)、reserved、sector 1
+	CPUx86 *cpu;
+	uint32 eax;
+	uint16 used;
+	uint8 status;
+	int ok;
+
+	cpu = new_cpux86(1024*1024);
+	memset(cpu->mem, 0, 1024*1024);
+	memcpy(cpu->mem, test_code, sizeof(test_code));
+	memcpy(&(cpu->mem[TEST_BUF]), test_old, sizeof(test_old));
+	memcpy(&(cpu->mem[TEST_HEADER]), header, sizeof(header));
+	cpu->mem[TEST_STATUS] = 0xEE;
+	test_desc(cpu, 0, TEST_HEADER, 16, VIRTQ_DESC_F_NEXT, 1);
+	test_desc(cpu, 1, TEST_BUF, 512, VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE, 2);
+	test_desc(cpu, 2, TEST_STATUS, 1, VIRTQ_DESC_F_WRITE, 0);
+	if (!vblk_attach(cpu, image, 1)) {
+		printf("FAIL: %s: cannot attach %s\n", name[jit], image);
+		delete_cpux86(cpu);
+		return 1;
+	}
+	set_cpu_cr0(cpu, CR0_PE, 1);
+	cpu->regs[4] = TEST_STACK;
+	cpu->eip = 0;
+	if (cpu->jit) {
+		cpu->jit->enabled = jit!=0;
+		cpu->jit->native &= jit==2;
+	}
+	run_cpux86(cpu);
+
+	eax = cpu->regs[0];
+	memcpy(&used, &(cpu->mem[TEST_USED + 2]), 2);
+	status = cpu->mem[TEST_STATUS];
+	ok = eax==0x1234 && used==1 && status==0 && memcmp(&(cpu->mem[TEST_BUF]), test_new, sizeof(test_new))==0;
+	delete_cpux86(cpu);
+	if (!ok) {
+		printf("FAIL: %s: eax=%08X used=%u status=%02X\n", name[jit], eax, used, status);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char image[] = "/tmp/vcpu-blk-XXXXXX";
+	uint8 sector[BLK_SECTOR * 2];
+	int fails;
+	int fd;
+	int i;
+
+	fd = mkstemp(image);
+	if (fd < 0) {
+		printf("blk: FAIL (cannot create image)\n");
+		return 1;
+	}
+	memset(sector, 0, sizeof(sector));
+	memcpy(sector + BLK_SECTOR, test_new, sizeof(test_new));
+	if (write(fd, sector, sizeof(sector))!=sizeof(sector)) {
+		printf("blk: FAIL (cannot write image)\n");
+		close(fd);
+		unlink(image);
+		return 1;
+	}
+	close(fd);
+
+	fails = 0;
+	for (i=0; i<3; i++) {
+		fails += test_run(i, image);
+	}
+	unlink(image);
+	printf("blk: %s\n", fails ? "FAIL" : "OK");
+	return fails ? 1 : 0;
+}
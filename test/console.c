@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../cpux86.h"
+#include "../jit.h"
+
+
+// コンソールのCON_DATAとリングの出力が、折り返しも含めて順番どおりにVCPU_CONSOLEへ書き出されるか確かめる
+//   インタプリタ、IRインタプリタ、ネイティブで同じ結果になること
+
+// 32bit、ベース0
+//   CON_DATAで"hi\n"を出してから、16バイトのリングをTEST_RINGに置く
+//   TEST_MSGの40バイトを1バイトずつリングに書き(空きを待ち、DOORBELLフラグが立っていれば鳴らす)、
+//   最後にドアベルを鳴らしてtailがheadに追いつくのを待ってhlt
+#define TEST_MSG		0x7000
+#define TEST_RING		0x8000
+
+static uint8 test_code[] = {
+	0xBA, 0x4C, 0xC0, 0x00, 0x00,				// mov edx, CON_PORT + CON_DATA
+	0xB0, 0x68,									// mov al, 'h'
+	0xEE,										// out dx, al
+	0xB0, 0x69,									// mov al, 'i'
+	0xEE,										// out dx, al
+	0xB0, 0x0A,									// mov al, '\n'
+	0xEE,										// out dx, al
+	0xBA, 0x44, 0xC0, 0x00, 0x00,				// mov edx, CON_PORT + CON_RING_SIZE
+	0xB8, 0x10, 0x00, 0x00, 0x00,				// mov eax, 16
+	0xEF,										// out dx, eax
+	0xBA, 0x40, 0xC0, 0x00, 0x00,				// mov edx, CON_PORT + CON_RING
+	0xB8, 0x00, 0x80, 0x00, 0x00,				// mov eax, TEST_RING
+	0xEF,										// out dx, eax
+	0xBE, 0x00, 0x70, 0x00, 0x00,				// mov esi, TEST_MSG
+	0xB9, 0x28, 0x00, 0x00, 0x00,				// mov ecx, 40
+	0xA1, 0x00, 0x80, 0x00, 0x00,				// L: mov eax, [head]
+	0x8B, 0x15, 0x04, 0x80, 0x00, 0x00,			// mov edx, [tail]
+	0x29, 0xD0,									// sub eax, edx
+	0x83, 0xF8, 0x10,							// cmp eax, 16
+	0x73, 0xEE,									// jae L
+	0x8B, 0x1D, 0x00, 0x80, 0x00, 0x00,			// mov ebx, [head]
+	0x83, 0xE3, 0x0F,							// and ebx, 15
+	0xAC,										// lodsb
+	0x88, 0x83, 0x10, 0x80, 0x00, 0x00,			// mov [ebx + data], al
+	0x83, 0x05, 0x00, 0x80, 0x00, 0x00, 0x01,	// add dword [head], 1
+	0x8B, 0x15, 0x08, 0x80, 0x00, 0x00,			// mov edx, [flags]
+	0x83, 0xE2, 0x01,							// and edx, DOORBELL
+	0x74, 0x06,									// jz 1f
+	0xBA, 0x48, 0xC0, 0x00, 0x00,				// mov edx, CON_PORT + CON_DOORBELL
+	0xEE,										// out dx, al
+	0x83, 0xE9, 0x01,							// 1: sub ecx, 1
+	0x75, 0xC1,									// jnz L
+	0xBA, 0x48, 0xC0, 0x00, 0x00,				// mov edx, CON_PORT + CON_DOORBELL
+	0xEE,										// out dx, al
+	0xA1, 0x00, 0x80, 0x00, 0x00,				// D: mov eax, [head]
+	0x3B, 0x05, 0x04, 0x80, 0x00, 0x00,			// cmp eax, [tail]
+	0x75, 0xF3,									// jne D
+	0xF4,										// hlt
+};
+
+static const char test_msg[] = "the quick brown fox jumps over the dogs\n";
+
+// jit: 0 インタプリタ、1 IRインタプリタ、2 ネイティブ
+static int test_run(int jit)
+{
+	static const char *name[] = {"interp", "ir", "native"};
+	char fname[] = "/tmp/vcpu-console-XXXXXX";
+	char expected[64];
+	char buf[128];
+	CPUx86 *cpu;
+	FILE *fp;
+	int len;
+	int fd;
+
+	fd = mkstemp(fname);
+	if (fd < 0) {
+		printf("FAIL: %s: cannot create %s\n", name[jit], fname);
+		return 1;
+	}
+	close(fd);
+	setenv("VCPU_CONSOLE", fname, 1);
+
+	cpu = new_cpux86(1024*1024);
+	memset(cpu->mem, 0, 1024*1024);
+	memcpy(cpu->mem, test_code, sizeof(test_code));
+	memcpy(&(cpu->mem[TEST_MSG]), test_msg, sizeof(test_msg) - 1);
+	set_cpu_cr0(cpu, CR0_PE, 1);
+	cpu->eip = 0;
+	if (cpu->jit) {
+		cpu->jit->enabled = jit!=0;
+		cpu->jit->native &= jit==2;
+	}
+	run_cpux86(cpu);
+	delete_cpux86(cpu);
+
+	len = 0;
+	fp = fopen(fname, "rb");
+	if (fp) {
+		len = fread(buf, 1, sizeof(buf), fp);
+		fclose(fp);
+	}
+	unlink(fname);
+	snprintf(expected, sizeof(expected), "hi\n%s", test_msg);
+	if (len!=strlen(expected) || memcmp(buf, expected, len)) {
+		printf("FAIL: %s: %d bytes: %.*s\n", name[jit], len, len, buf);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int fails;
+	int i;
+
+	fails = 0;
+	for (i=0; i<3; i++) {
+		fails += test_run(i);
+	}
+	printf("console: %s\n", fails ? "FAIL" : "OK");
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../cpux86.h"
+#include "../jit.h"
+
+
+// 例外がIVTで配送され、戻り先が例外を起こした命令になるか確かめる
+//   インタプリタ、IRインタプリタ、ネイティブで同じ結果になること
+
+// リアルモード、CS=0
+//   コードはTEST_CODEから
+//   ベクタvのハンドラはTEST_HANDLER+v*16: mov ax, v; pop dx; hlt
+//   (dxが戻り先のIP、例外が起きなければコードの最後でax = dx = TEST_NONE)
+#define TEST_CODE		0x1000
+#define TEST_HANDLER	0x2000
+#define TEST_STACK		0x8000
+#define TEST_NONE		0xFFFF
+
+typedef struct {
+	const char *name;
+	uint8 code[24];
+	int len;
+	uint32 cr0;			// 実行前にセットするCR0のビット
+	uint32 vector;		// ax
+	uint32 ip;			// dx
+} TestCase;
+
+static TestCase test_cases[] = {
+	// nop; ud2
+	{"ud2", {0x90, 0x0F, 0x0B}, 3, 0, EXC_UD, TEST_CODE + 1},
+	// lock nop
+	{"lock nop", {0xF0, 0x90}, 2, 0, EXC_UD, TEST_CODE},
+	// lock add ax, bx (レジスタオペランド)
+	{"lock reg", {0x90, 0xF0, 0x01, 0xD8}, 4, 0, EXC_UD, TEST_CODE + 1},
+	// xor cx, cx; div cx
+	{"div zero", {0x31, 0xC9, 0xF7, 0xF1}, 4, 0, EXC_DE, TEST_CODE + 2},
+	// CR0.TS=1; nop; fld1
+	{"ts fpu", {0x90, 0xD9, 0xE8}, 3, CR0_TS, EXC_NM, TEST_CODE + 1},
+	// CR0.TS=1; clts; fld1; mov ax, -1; mov dx, -1
+	{"clts fpu", {0x0F, 0x06, 0xD9, 0xE8, 0xB8, 0xFF, 0xFF, 0xBA, 0xFF, 0xFF}, 10, CR0_TS, TEST_NONE, TEST_NONE},
+	// CR0.EM=1; clts; fld1 (EMはCLTSでは消えない)
+	{"em fpu", {0x0F, 0x06, 0xD9, 0xE8}, 4, CR0_EM, EXC_NM, TEST_CODE + 2},
+};
+
+#define TEST_CASES	(sizeof(test_cases) / sizeof(test_cases[0]))
+
+// jit: 0 インタプリタ、1 IRインタプリタ、2 ネイティブ
+static int test_run(int jit, TestCase *t)
+{
+	static const char *name[] = {"interp", "ir", "native"};
+	static const uint8 handler[] = {0xB8, 0x00, 0x00, 0x5A, 0xF4};
+	CPUx86 *cpu;
+	uint32 vector;
+	uint32 ip;
+	int i;
+
+	cpu = new_cpux86(1024*1024);
+	memset(cpu->mem, 0, 1024*1024);
+	for (i=0; i<32; i++) {
+		cpu->mem[i * 4 + 0] = (TEST_HANDLER + i * 16) & 0xFF;
+		cpu->mem[i * 4 + 1] = (TEST_HANDLER + i * 16) >> 8;
+		memcpy(&(cpu->mem[TEST_HANDLER + i * 16]), handler, sizeof(handler));
+		cpu->mem[TEST_HANDLER + i * 16 + 1] = i;
+	}
+	memcpy(&(cpu->mem[TEST_CODE]), t->code, t->len);
+	cpu->mem[TEST_CODE + t->len] = 0xF4;	// hlt
+	cpu->eip = TEST_CODE;
+	cpu->regs[4] = TEST_STACK;
+	if (t->cr0 & CR0_TS) {
+		set_cpu_cr0(cpu, CR0_TS, 1);
+	}
+	if (t->cr0 & CR0_EM) {
+		set_cpu_cr0(cpu, CR0_EM, 1);
+	}
+	if (cpu->jit) {
+		cpu->jit->enabled = jit!=0;
+		cpu->jit->native &= jit==2;
+	}
+	run_cpux86(cpu);
+
+	vector = cpu->regs[0] & 0xFFFF;
+	ip = cpu->regs[2] & 0xFFFF;
+	delete_cpux86(cpu);
+	if (vector!=t->vector || ip!=t->ip) {
+		printf("FAIL: %s: %s: vector=%u ip=%04X expected vector=%u ip=%04X\n", name[jit], t->name, vector, ip, t->vector, t->ip);
+		return 1;
+	}
+	return 0;
+}
+
+// CPL=3のCLTSは#GPになり、CR0.TSは変わらない
+//   IDTは空なので#GPの配送はダブルフォールト、トリプルフォールトになる
+static int test_clts_user(void)
+{
+	CPUx86 *cpu;
+	uint64 gp;
+	int ts;
+
+	cpu = new_cpux86(1024*1024);
+	memset(cpu->mem, 0, 1024*1024);
+	cpu->mem[0] = 0x0F;	// clts
+	cpu->mem[1] = 0x06;
+	cpu->mem[2] = 0xF4;	// hlt
+	set_cpu_cr0(cpu, CR0_PE, 1);
+	set_cpu_cr0(cpu, CR0_TS, 1);
+	cpu->cpl = 3;
+	cpu->eip = 0;
+	run_cpux86(cpu);
+
+	gp = cpu->metrics.exceptions[EXC_GP];
+	ts = cpu_cr0(cpu, CR0_TS)!=0;
+	delete_cpux86(cpu);
+	if (gp==0 || !ts) {
+		printf("FAIL: clts cpl3: #GP=%llu TS=%d\n", gp, ts);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int fails;
+	int i;
+
+	fails = 0;
+	for (i=0; i<3 * TEST_CASES; i++) {
+		fails += test_run(i / TEST_CASES, &(test_cases[i % TEST_CASES]));
+	}
+	fails += test_clts_user();
+	printf("fault: %s (%d cases)\n", fails ? "FAIL" : "OK", (int)TEST_CASES + 1);
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../cpux86.h"
+#include "../jit.h"
+
+
+// INC/DEC(1byteの40~4Fも)/ADC/SBBのフラグ(遅延評価)と、その後のJcc/SETccを確かめる
+//   インタプリタ、IRインタプリタ、ネイティブで同じ結果になること
+
+// 32bit、ベース0
+//   ケースごとに新しいCPUでコード; hltを実行し、eaxとeflagsを比べる
+//   入力のCFはeflagsに入れておく(CLC/STCは使わない)
+#define TEST_FLAGS	(CPU_EFLAGS_OF | CPU_EFLAGS_SF | CPU_EFLAGS_ZF | CPU_EFLAGS_AF | CPU_EFLAGS_PF | CPU_EFLAGS_CF)
+
+typedef struct {
+	const char *name;
+	uint8 code[24];
+	int len;
+	int cf;			// 入力のCF
+	uint32 eax;
+	uint32 flags;
+} TestCase;
+
+static TestCase test_cases[] = {
+	// mov eax, 1; dec eax
+	{"dec to zero", {0xB8, 0x01, 0x00, 0x00, 0x00, 0xFF, 0xC8}, 7, 0, 0x00000000, 0x044},
+	// CF=1; mov eax, -1; inc eax (CFは変わらない)
+	{"inc keeps cf", {0xB8, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xC0}, 7, 1, 0x00000000, 0x055},
+	// mov eax, 0x7FFFFFFF; inc eax
+	{"inc overflow", {0xB8, 0xFF, 0xFF, 0xFF, 0x7F, 0xFF, 0xC0}, 7, 0, 0x80000000, 0x894},
+	// CF=1; mov eax, 0x80000000; dec eax
+	{"dec overflow", {0xB8, 0x00, 0x00, 0x00, 0x80, 0xFF, 0xC8}, 7, 1, 0x7FFFFFFF, 0x815},
+	// mov eax, 0xFF; inc al
+	{"inc r8", {0xB8, 0xFF, 0x00, 0x00, 0x00, 0xFE, 0xC0}, 7, 0, 0x00000000, 0x054},
+	// mov eax, 0x8000; dec ax
+	{"dec r16", {0xB8, 0x00, 0x80, 0x00, 0x00, 0x66, 0xFF, 0xC8}, 8, 0, 0x00007FFF, 0x814},
+	// mov eax, 0x7FFFFFFF; inc eax (1byte)
+	{"inc eax", {0xB8, 0xFF, 0xFF, 0xFF, 0x7F, 0x40}, 6, 0, 0x80000000, 0x894},
+	// CF=1; mov ecx, 1; dec ecx (1byte); mov eax, ecx
+	{"dec ecx", {0xB9, 0x01, 0x00, 0x00, 0x00, 0x49, 0x89, 0xC8}, 8, 1, 0x00000000, 0x045},
+	// mov eax, 0xFFFF; inc ax (1byte)
+	{"inc ax", {0xB8, 0xFF, 0xFF, 0x00, 0x00, 0x66, 0x40}, 7, 0, 0x00000000, 0x054},
+	// mov edi, 3; L: dec edi (1byte); jnz L; mov eax, edi
+	{"dec edi loop", {0xBF, 0x03, 0x00, 0x00, 0x00, 0x4F, 0x75, 0xFD, 0x89, 0xF8}, 10, 0, 0x00000000, 0x044},
+	// mov eax, -1; mov edx, 1; add eax, 1; adc edx, 2; mov eax, edx
+	{"adc 64bit", {0xB8, 0xFF, 0xFF, 0xFF, 0xFF, 0xBA, 0x01, 0x00, 0x00, 0x00, 0x83, 0xC0, 0x01, 0x83, 0xD2, 0x02, 0x89, 0xD0}, 18, 0, 0x00000004, 0x000},
+	// CF=1; mov eax, -1; adc eax, 0
+	{"adc carry", {0xB8, 0xFF, 0xFF, 0xFF, 0xFF, 0x83, 0xD0, 0x00}, 8, 1, 0x00000000, 0x055},
+	// CF=1; mov eax, 0x7FFFFFFF; adc eax, 0
+	{"adc overflow", {0xB8, 0xFF, 0xFF, 0xFF, 0x7F, 0x83, 0xD0, 0x00}, 8, 1, 0x80000000, 0x894},
+	// CF=1; mov eax, 0x80000000; adc eax, eax
+	{"adc same reg", {0xB8, 0x00, 0x00, 0x00, 0x80, 0x11, 0xC0}, 7, 1, 0x00000001, 0x801},
+	// mov eax, 0; mov edx, 5; sub eax, 1; sbb edx, 1; mov eax, edx
+	{"sbb 64bit", {0xB8, 0x00, 0x00, 0x00, 0x00, 0xBA, 0x05, 0x00, 0x00, 0x00, 0x83, 0xE8, 0x01, 0x83, 0xDA, 0x01, 0x89, 0xD0}, 18, 0, 0x00000003, 0x004},
+	// CF=1; mov eax, 0; sbb eax, 0
+	{"sbb borrow", {0xB8, 0x00, 0x00, 0x00, 0x00, 0x83, 0xD8, 0x00}, 8, 1, 0xFFFFFFFF, 0x095},
+	// CF=1; mov eax, 0x80000000; sbb eax, 0
+	{"sbb overflow", {0xB8, 0x00, 0x00, 0x00, 0x80, 0x83, 0xD8, 0x00}, 8, 1, 0x7FFFFFFF, 0x814},
+	// xor ebx, ebx; mov ecx, 5; L: add ebx, 1; dec ecx; jnz L; mov eax, ebx
+	{"dec loop", {0x31, 0xDB, 0xB9, 0x05, 0x00, 0x00, 0x00, 0x83, 0xC3, 0x01, 0xFF, 0xC9, 0x75, 0xF9, 0x89, 0xD8}, 16, 0, 0x00000005, 0x044},
+	// mov esi, 0; mov eax, 1; dec eax; jnz 1f; mov esi, 1; 1: mov eax, esi
+	{"jz after dec", {0xBE, 0x00, 0x00, 0x00, 0x00, 0xB8, 0x01, 0x00, 0x00, 0x00, 0xFF, 0xC8, 0x75, 0x05, 0xBE, 0x01, 0x00, 0x00, 0x00, 0x89, 0xF0}, 21, 0, 0x00000001, 0x044},
+	// mov eax, -1; inc eax; setz al
+	{"setz after inc", {0xB8, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xC0, 0x0F, 0x94, 0xC0}, 10, 0, 0x00000001, 0x054},
+	// CF=1; mov eax, 0; sbb eax, 0; setc al; movzx eax, al
+	{"setc after sbb", {0xB8, 0x00, 0x00, 0x00, 0x00, 0x83, 0xD8, 0x00, 0x0F, 0x92, 0xC0, 0x0F, 0xB6, 0xC0}, 14, 1, 0x00000001, 0x095},
+};
+
+#define TEST_CASES	(sizeof(test_cases) / sizeof(test_cases[0]))
+
+// jit: 0 インタプリタ、1 IRインタプリタ、2 ネイティブ
+static int test_run(int jit, TestCase *t)
+{
+	static const char *name[] = {"interp", "ir", "native"};
+	CPUx86 *cpu;
+	uint32 eax;
+	uint32 flags;
+
+	cpu = new_cpux86(1024*1024);
+	memset(cpu->mem, 0, 1024*1024);
+	memcpy(cpu->mem, t->code, t->len);
+	cpu->mem[t->len] = 0xF4;	// hlt
+	set_cpu_cr0(cpu, CR0_PE, 1);
+	cpu->eip = 0;
+	if (t->cf) {
+		cpu->eflags |= CPU_EFLAGS_CF;
+	}
+	if (cpu->jit) {
+		cpu->jit->enabled = jit!=0;
+		cpu->jit->native &= jit==2;
+	}
+	run_cpux86(cpu);
+
+	eax = cpu->regs[0];
+	cpu_eflags_sync(cpu);
+	flags = cpu->eflags & TEST_FLAGS;
+	delete_cpux86(cpu);
+	if (eax!=t->eax || flags!=t->flags) {
+		printf("FAIL: %s: %s: eax=%08X flags=%03X expected eax=%08X flags=%03X\n", name[jit], t->name, eax, flags, t->eax, t->flags);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int fails;
+	int i;
+
+	fails = 0;
+	for (i=0; i<3 * TEST_CASES; i++) {
+		fails += test_run(i / TEST_CASES, &(test_cases[i % TEST_CASES]));
+	}
+	printf("flags: %s (%d cases)\n", fails ? "FAIL" : "OK", (int)TEST_CASES);
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../cpux86.h"
+
+
+// VCPU_FPU=exactの丸めを確かめる
+//   丸め制御(RC)と精度制御(PC)を変えて1回だけ丸めた結果(80bitの符号と指数、仮数)と比べる
+
+// 32bit、ベース0
+//   fninit; fldcw [CW]; fld tbyte [B]; fld tbyte [A]; 演算; fstp tbyte [OUT]; hlt
+#define TEST_CW		0x1000
+#define TEST_A		0x1010
+#define TEST_B		0x1020
+#define TEST_OUT	0x1030
+
+#define OP_DIV		0
+#define OP_ADD		1
+#define OP_SQRT		2
+
+static uint8 test_head[] = {
+	0xDB, 0xE3,							// fninit
+	0xD9, 0x2D, 0x00, 0x10, 0x00, 0x00,	// fldcw [0x1000]
+	0xDB, 0x2D, 0x20, 0x10, 0x00, 0x00,	// fld tbyte [0x1020]
+	0xDB, 0x2D, 0x10, 0x10, 0x00, 0x00,	// fld tbyte [0x1010]
+};
+static uint8 test_op[][2] = {
+	{0xD8, 0xF1},						// fdiv st(0), st(1)
+	{0xD8, 0xC1},						// fadd st(0), st(1)
+	{0xD9, 0xFA},						// fsqrt
+};
+static uint8 test_tail[] = {
+	0xDB, 0x3D, 0x30, 0x10, 0x00, 0x00,	// fstp tbyte [0x1030]
+	0xF4,								// hlt
+};
+
+#define PC_24	0
+#define PC_53	2
+#define PC_64	3
+
+#define RC_NEAR	0
+#define RC_DOWN	1
+#define RC_UP	2
+#define RC_CHOP	3
+
+typedef struct {
+	const char *name;
+	int op;
+	long double a;
+	long double b;
+	int pc;
+	int rc;
+	uint16 exp;		// 符号と指数
+	uint64 mant;
+} TestCase;
+
+static TestCase test_cases[] = {
+	{"1/3",  OP_DIV, 1.0L, 3.0L, PC_24, RC_NEAR, 0x3FFD, 0xAAAAAB0000000000ULL},
+	{"1/3",  OP_DIV, 1.0L, 3.0L, PC_24, RC_DOWN, 0x3FFD, 0xAAAAAA0000000000ULL},
+	{"1/3",  OP_DIV, 1.0L, 3.0L, PC_24, RC_UP,   0x3FFD, 0xAAAAAB0000000000ULL},
+	{"1/3",  OP_DIV, 1.0L, 3.0L, PC_24, RC_CHOP, 0x3FFD, 0xAAAAAA0000000000ULL},
+	{"1/3",  OP_DIV, 1.0L, 3.0L, PC_53, RC_NEAR, 0x3FFD, 0xAAAAAAAAAAAAA800ULL},
+	{"1/3",  OP_DIV, 1.0L, 3.0L, PC_53, RC_DOWN, 0x3FFD, 0xAAAAAAAAAAAAA800ULL},
+	{"1/3",  OP_DIV, 1.0L, 3.0L, PC_53, RC_UP,   0x3FFD, 0xAAAAAAAAAAAAB000ULL},
+	{"1/3",  OP_DIV, 1.0L, 3.0L, PC_53, RC_CHOP, 0x3FFD, 0xAAAAAAAAAAAAA800ULL},
+	{"1/3",  OP_DIV, 1.0L, 3.0L, PC_64, RC_NEAR, 0x3FFD, 0xAAAAAAAAAAAAAAABULL},
+	{"1/3",  OP_DIV, 1.0L, 3.0L, PC_64, RC_CHOP, 0x3FFD, 0xAAAAAAAAAAAAAAAAULL},
+	{"-1/3", OP_DIV, -1.0L, 3.0L, PC_53, RC_DOWN, 0xBFFD, 0xAAAAAAAAAAAAB000ULL},
+	{"-1/3", OP_DIV, -1.0L, 3.0L, PC_53, RC_UP,   0xBFFD, 0xAAAAAAAAAAAAA800ULL},
+	{"-1/3", OP_DIV, -1.0L, 3.0L, PC_24, RC_DOWN, 0xBFFD, 0xAAAAAB0000000000ULL},
+	{"-1/3", OP_DIV, -1.0L, 3.0L, PC_24, RC_CHOP, 0xBFFD, 0xAAAAAA0000000000ULL},
+	{"sqrt2", OP_SQRT, 2.0L, 0.0L, PC_53, RC_NEAR, 0x3FFF, 0xB504F333F9DE6800ULL},
+	{"sqrt2", OP_SQRT, 2.0L, 0.0L, PC_53, RC_DOWN, 0x3FFF, 0xB504F333F9DE6000ULL},
+	{"sqrt2", OP_SQRT, 2.0L, 0.0L, PC_53, RC_CHOP, 0x3FFF, 0xB504F333F9DE6000ULL},
+	{"sqrt2", OP_SQRT, 2.0L, 0.0L, PC_24, RC_UP,   0x3FFF, 0xB504F40000000000ULL},
+	{"sqrt2", OP_SQRT, 2.0L, 0.0L, PC_64, RC_UP,   0x3FFF, 0xB504F333F9DE6485ULL},
+	// 80bitで丸めてから倍精度にすると1.0になる(偶数丸めが2回)
+	{"1+2^-53+2^-64", OP_ADD, 1.0L, 0x1p-53L + 0x1p-64L, PC_53, RC_NEAR, 0x3FFF, 0x8000000000000800ULL},
+	{"1+2^-53+2^-64", OP_ADD, 1.0L, 0x1p-53L + 0x1p-64L, PC_24, RC_UP,   0x3FFF, 0x8000010000000000ULL},
+};
+
+static int test_run(TestCase *t)
+{
+	CPUx86 *cpu;
+	uint16 cw;
+	uint16 exp;
+	uint64 mant;
+	int n;
+
+	cpu = new_cpux86(1024*1024);
+	memset(cpu->mem, 0, 1024*1024);
+	n = 0;
+	memcpy(cpu->mem + n, test_head, sizeof(test_head));
+	n += sizeof(test_head);
+	memcpy(cpu->mem + n, test_op[t->op], 2);
+	n += 2;
+	memcpy(cpu->mem + n, test_tail, sizeof(test_tail));
+	cw = 0x007F | t->pc << 8 | t->rc << 10;
+	memcpy(cpu->mem + TEST_CW, &cw, 2);
+	fpu_store_f80(cpu->mem + TEST_A, t->a);
+	fpu_store_f80(cpu->mem + TEST_B, t->b);
+	set_cpu_cr0(cpu, CR0_PE, 1);
+	cpu->eip = 0;
+	run_cpux86(cpu);
+
+	memcpy(&mant, cpu->mem + TEST_OUT, 8);
+	memcpy(&exp, cpu->mem + TEST_OUT + 8, 2);
+	delete_cpux86(cpu);
+	if (exp!=t->exp || mant!=t->mant) {
+		printf("FAIL: %s pc=%d rc=%d: %04X:%016llX expected %04X:%016llX\n", t->name, t->pc, t->rc, exp, mant, t->exp, t->mant);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int fails;
+	int i;
+
+	setenv("VCPU_FPU", "exact", 1);
+	fails = 0;
+	for (i=0; i<sizeof(test_cases)/sizeof(test_cases[0]); i++) {
+		fails += test_run(&(test_cases[i]));
+	}
+	printf("fpu: %s (%d cases)\n", fails ? "FAIL" : "OK", i);
+	return fails ? 1 : 0;
+}
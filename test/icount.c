@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../cpux86.h"
+#include "../jit.h"
+
+
+// インタプリタ、IRインタプリタ、ネイティブで同じプログラムを実行し、命令数(clock.icount)が同じか確かめる
+//   CMP/TEST + Jccの融合はインタプリタで2命令と数える
+//   run_cpux86がスライス(30000命令)を越えてhltまで実行し続けることも確かめる
+
+// 32bit、ベース0
+//   ecx = 100000
+//   L: eax = ecx & 3; cmp eax, 1; jne 1f; add edx, 1
+//   1: test eax, eax; jz 2f; add ebx, eax
+//   2: sub ecx, 1; cmp ecx, 0; jne L (rel32)
+//   hlt
+static uint8 test_code[] = {
+	0xB9, 0xA0, 0x86, 0x01, 0x00,	// mov ecx, 100000
+	0x89, 0xC8,						// L: mov eax, ecx
+	0x83, 0xE0, 0x03,				// and eax, 3
+	0x83, 0xF8, 0x01,				// cmp eax, 1
+	0x75, 0x03,						// jne 1f
+	0x83, 0xC2, 0x01,				// add edx, 1
+	0x85, 0xC0,						// 1: test eax, eax
+	0x74, 0x02,						// jz 2f
+	0x01, 0xC3,						// add ebx, eax
+	0x83, 0xE9, 0x01,				// 2: sub ecx, 1
+	0x83, 0xF9, 0x00,				// cmp ecx, 0
+	0x0F, 0x85, 0xE1, 0xFF, 0xFF, 0xFF,	// jne L
+	0xF4,							// hlt
+};
+
+typedef struct {
+	uint64 icount;
+	uint32 regs[8];
+	uint32 eip;
+} TestResult;
+
+// jit: 0 インタプリタ、1 IRインタプリタ、2 ネイティブ
+static void test_run(int jit, TestResult *result)
+{
+	CPUx86 *cpu;
+
+	cpu = new_cpux86(1024*1024);
+	memset(cpu->mem, 0, 1024*1024);
+	memcpy(cpu->mem, test_code, sizeof(test_code));
+	set_cpu_cr0(cpu, CR0_PE, 1);
+	cpu->eip = 0;
+	if (cpu->jit) {
+		cpu->jit->enabled = jit!=0;
+		cpu->jit->native &= jit==2;
+	}
+	run_cpux86(cpu);
+
+	result->icount = cpu->clock.icount;
+	memcpy(result->regs, cpu->regs, sizeof(result->regs));
+	result->eip = cpu->eip;
+	delete_cpux86(cpu);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *name[] = {"interp", "ir", "native"};
+	TestResult result[3];
+	int fails;
+	int i;
+
+	setenv("VCPU_CLOCK", "deterministic", 1);
+	for (i=0; i<3; i++) {
+		test_run(i, &(result[i]));
+		printf("%s: icount=%llu eip=%X ebx=%08X edx=%08X\n", name[i], result[i].icount, result[i].eip, result[i].regs[3], result[i].regs[2]);
+	}
+
+	fails = 0;
+	for (i=1; i<3; i++) {
+		if (result[i].icount!=result[0].icount || memcmp(result[i].regs, result[0].regs, sizeof(result[0].regs)) || result[i].eip!=result[0].eip) {
+			printf("FAIL: %s differs from interp\n", name[i]);
+			fails++;
+		}
+	}
+	// mov + 100000 * (9 or 10) + hlt
+	if (result[0].icount < 900000) {
+		printf("FAIL: interp icount too small\n");
+		fails++;
+	}
+	if (result[0].regs[1]!=0 || result[0].eip!=sizeof(test_code)) {
+		printf("FAIL: interp stopped before hlt\n");
+		fails++;
+	}
+	printf("icount: %s\n", fails ? "FAIL" : "OK");
+	return fails ? 1 : 0;
+}
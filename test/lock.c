@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../cpux86.h"
+#include "../jit.h"
+
+
+// LOCKを付けた読み書き命令(cpu_lock_rmw)のフラグと、その後のJcc/SETccを確かめる
+//   インタプリタ、IRインタプリタ、ネイティブで同じ結果になること
+
+// 32bit、ベース0、メモリオペランドは[0x2000]
+//   ケースごとに新しいCPUでコード; hltを実行し、eaxとeflagsを比べる
+//   入力のCFはeflagsに入れておく
+#define TEST_FLAGS	(CPU_EFLAGS_OF | CPU_EFLAGS_SF | CPU_EFLAGS_ZF | CPU_EFLAGS_AF | CPU_EFLAGS_PF | CPU_EFLAGS_CF)
+
+typedef struct {
+	const char *name;
+	uint8 code[32];
+	int len;
+	int cf;			// 入力のCF
+	uint32 eax;
+	uint32 flags;
+} TestCase;
+
+static TestCase test_cases[] = {
+	// mov dword [0x2000], 1000; xor ebx, ebx; L: add ebx, 1; lock dec dword [0x2000]; jnz L; mov eax, ebx
+	{"lock dec loop", {0xC7, 0x05, 0x00, 0x20, 0x00, 0x00, 0xE8, 0x03, 0x00, 0x00, 0x31, 0xDB, 0x83, 0xC3, 0x01, 0xF0, 0xFF, 0x0D, 0x00, 0x20, 0x00, 0x00, 0x75, 0xF4, 0x89, 0xD8}, 26, 0, 0x000003E8, 0x044},
+	// mov dword [0x2000], 1; xor esi, esi; lock dec dword [0x2000]; jnz 1f; mov esi, 1; 1: mov eax, esi
+	{"lock dec jz", {0xC7, 0x05, 0x00, 0x20, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x31, 0xF6, 0xF0, 0xFF, 0x0D, 0x00, 0x20, 0x00, 0x00, 0x75, 0x05, 0xBE, 0x01, 0x00, 0x00, 0x00, 0x89, 0xF0}, 28, 0, 0x00000001, 0x044},
+	// CF=1; mov dword [0x2000], 1; lock dec dword [0x2000]; mov eax, [0x2000] (CFは変わらない)
+	{"lock dec keeps cf", {0xC7, 0x05, 0x00, 0x20, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0xF0, 0xFF, 0x0D, 0x00, 0x20, 0x00, 0x00, 0xA1, 0x00, 0x20, 0x00, 0x00}, 22, 1, 0x00000000, 0x045},
+	// CF=1; mov byte [0x2000], 0x7F; lock inc byte [0x2000]; movzx eax, byte [0x2000]
+	{"lock inc r8 overflow", {0xC6, 0x05, 0x00, 0x20, 0x00, 0x00, 0x7F, 0xF0, 0xFE, 0x05, 0x00, 0x20, 0x00, 0x00, 0x0F, 0xB6, 0x05, 0x00, 0x20, 0x00, 0x00}, 21, 1, 0x00000080, 0x891},
+	// mov dword [0x2000], -1; lock inc dword [0x2000]; setz al; movzx eax, al
+	{"lock inc setz", {0xC7, 0x05, 0x00, 0x20, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0, 0xFF, 0x05, 0x00, 0x20, 0x00, 0x00, 0x0F, 0x94, 0xC0, 0x0F, 0xB6, 0xC0}, 23, 0, 0x00000001, 0x054},
+	// mov dword [0x2000], 1; lock add dword [0x2000], -1; mov eax, [0x2000]
+	{"lock add", {0xC7, 0x05, 0x00, 0x20, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0xF0, 0x83, 0x05, 0x00, 0x20, 0x00, 0x00, 0xFF, 0xA1, 0x00, 0x20, 0x00, 0x00}, 23, 0, 0x00000000, 0x055},
+};
+
+#define TEST_CASES	(sizeof(test_cases) / sizeof(test_cases[0]))
+
+// jit: 0 インタプリタ、1 IRインタプリタ、2 ネイティブ
+static int test_run(int jit, TestCase *t)
+{
+	static const char *name[] = {"interp", "ir", "native"};
+	CPUx86 *cpu;
+	uint32 eax;
+	uint32 flags;
+
+	cpu = new_cpux86(1024*1024);
+	memset(cpu->mem, 0, 1024*1024);
+	memcpy(cpu->mem, t->code, t->len);
+	cpu->mem[t->len] = 0xF4;	// hlt
+	set_cpu_cr0(cpu, CR0_PE, 1);
+	cpu->eip = 0;
+	if (t->cf) {
+		cpu->eflags |= CPU_EFLAGS_CF;
+	}
+	if (cpu->jit) {
+		cpu->jit->enabled = jit!=0;
+		cpu->jit->native &= jit==2;
+	}
+	run_cpux86(cpu);
+
+	eax = cpu->regs[0];
+	cpu_eflags_sync(cpu);
+	flags = cpu->eflags & TEST_FLAGS;
+	delete_cpux86(cpu);
+	if (eax!=t->eax || flags!=t->flags) {
+		printf("FAIL: %s: %s: eax=%08X flags=%03X expected eax=%08X flags=%03X\n", name[jit], t->name, eax, flags, t->eax, t->flags);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int fails;
+	int i;
+
+	fails = 0;
+	for (i=0; i<3 * TEST_CASES; i++) {
+		fails += test_run(i / TEST_CASES, &(test_cases[i % TEST_CASES]));
+	}
+	printf("lock: %s (%d cases)\n", fails ? "FAIL" : "OK", (int)TEST_CASES);
+	return fails ? 1 : 0;
+}
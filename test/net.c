@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../cpux86.h"
+#include "../jit.h"
+#include "../virtio.h"
+#include "../net.h"
+
+
+// virtio-netでスイッチにつないだ2つのゲストの間でフレームが届き、
+// 受信バッファにあった翻訳済みのコードが捨てられるか確かめる
+//   インタプリタ、IRインタプリタ、ネイティブで同じ結果になること
+
+// 32bit、ベース0、IF=0(割り込みを使わずusedのidxをポーリングする)
+//   TEST_RX_BUF + 24(フレームのペイロード): mov eax, 1; ret をcallで100回実行しておく(JITで翻訳される)
+//   受信キュー(PFN=2)と送信キュー(PFN=4)を設定し、TEST_RX_BUFを受信バッファに置いて通知し、hlt
+//   そこからはCで次を選んで再開する
+//     TEST_SEND: 送信キューにTEST_TX_BUFのフレームを置いて通知し、usedのidxをポーリングしてhlt
+//     TEST_RECV: 受信キューのusedのidxをポーリングし、届いたペイロード(mov eax, 0x1234; ret)をcallしてhlt
+#define TEST_RX_QUEUE	0x2000
+#define TEST_RX_USED	(TEST_RX_QUEUE + VIRTQ_ALIGN)
+#define TEST_TX_QUEUE	0x4000
+#define TEST_TX_USED	(TEST_TX_QUEUE + VIRTQ_ALIGN)
+#define TEST_TX_BUF		0x6000
+#define TEST_RX_BUF		0x7000
+#define TEST_PAYLOAD	(NET_HDR + 14)
+#define TEST_STACK		0x9000
+#define TEST_SEND		0x68
+#define TEST_RECV		0x91
+
+static uint8 test_code[] = {
+	0xBE, 0x18, 0x70, 0x00, 0x00,				// mov esi, TEST_RX_BUF + TEST_PAYLOAD
+	0xB9, 0x64, 0x00, 0x00, 0x00,				// mov ecx, 100
+	0xFF, 0xD6,									// L: call esi
+	0x83, 0xE9, 0x01,							// sub ecx, 1
+	0x75, 0xF9,									// jnz L
+	0xBA, 0x72, 0xC0, 0x00, 0x00,				// mov edx, NET_PORT + VIRTIO_STATUS
+	0xB0, 0x03,									// mov al, ACKNOWLEDGE | DRIVER
+	0xEE,										// out dx, al
+	0xBA, 0x6E, 0xC0, 0x00, 0x00,				// mov edx, NET_PORT + VIRTIO_QUEUE_SEL
+	0x31, 0xC0,									// xor eax, eax
+	0x66, 0xEF,									// out dx, ax
+	0xBA, 0x68, 0xC0, 0x00, 0x00,				// mov edx, NET_PORT + VIRTIO_QUEUE_PFN
+	0xB8, 0x02, 0x00, 0x00, 0x00,				// mov eax, TEST_RX_QUEUE >> 12
+	0xEF,										// out dx, eax
+	0xBA, 0x6E, 0xC0, 0x00, 0x00,				// mov edx, NET_PORT + VIRTIO_QUEUE_SEL
+	0xB8, 0x01, 0x00, 0x00, 0x00,				// mov eax, NET_TX
+	0x66, 0xEF,									// out dx, ax
+	0xBA, 0x68, 0xC0, 0x00, 0x00,				// mov edx, NET_PORT + VIRTIO_QUEUE_PFN
+	0xB8, 0x04, 0x00, 0x00, 0x00,				// mov eax, TEST_TX_QUEUE >> 12
+	0xEF,										// out dx, eax
+	0xBA, 0x72, 0xC0, 0x00, 0x00,				// mov edx, NET_PORT + VIRTIO_STATUS
+	0xB0, 0x07,									// mov al, ACKNOWLEDGE | DRIVER | DRIVER_OK
+	0xEE,										// out dx, al
+	0x66, 0xC7, 0x05, 0x04, 0x28, 0x00, 0x00, 0x00, 0x00,	// mov word [rx avail.ring[0]], 0
+	0x66, 0xC7, 0x05, 0x02, 0x28, 0x00, 0x00, 0x01, 0x00,	// mov word [rx avail.idx], 1
+	0xBA, 0x70, 0xC0, 0x00, 0x00,				// mov edx, NET_PORT + VIRTIO_QUEUE_NOTIFY
+	0x31, 0xC0,									// xor eax, eax
+	0x66, 0xEF,									// out dx, ax
+	0xF4,										// hlt
+	// TEST_SEND
+	0x66, 0xC7, 0x05, 0x04, 0x48, 0x00, 0x00, 0x00, 0x00,	// mov word [tx avail.ring[0]], 0
+	0x66, 0xC7, 0x05, 0x02, 0x48, 0x00, 0x00, 0x01, 0x00,	// mov word [tx avail.idx], 1
+	0xBA, 0x70, 0xC0, 0x00, 0x00,				// mov edx, NET_PORT + VIRTIO_QUEUE_NOTIFY
+	0xB8, 0x01, 0x00, 0x00, 0x00,				// mov eax, NET_TX
+	0x66, 0xEF,									// out dx, ax
+	0x66, 0x83, 0x3D, 0x02, 0x50, 0x00, 0x00, 0x01,	// W: cmp word [tx used.idx], 1
+	0x72, 0xF6,									// jb W
+	0xF4,										// hlt
+	// TEST_RECV
+	0x66, 0x83, 0x3D, 0x02, 0x30, 0x00, 0x00, 0x01,	// W: cmp word [rx used.idx], 1
+	0x72, 0xF6,									// jb W
+	0xFF, 0xD6,									// call esi
+	0xF4,										// hlt
+};
+
+static uint8 test_old[] = {0xB8, 0x01, 0x00, 0x00, 0x00, 0xC3};	// mov eax, 1; ret
+static uint8 test_new[] = {0xB8, 0x34, 0x12, 0x00, 0x00, 0xC3};	// mov eax, 0x1234; ret
+
+// ディスクリプタ: addr(8) len(4) flags(2) next(2)
+static void test_desc(CPUx86 *cpu, uint32 queue, uint32 addr, uint32 len, uint16 flags)
+{
+	uint8 *p;
+	p = &(cpu->mem[queue]);
+	memset(p, 0, 16);
+	memcpy(p, &addr, 4);
+	memcpy(p + 8, &len, 4);
+	memcpy(p + 12, &flags, 2);
+}
+
+static CPUx86* test_cpu(int jit)
+{
+	CPUx86 *cpu;
+	uint8 *frame;
+
+	cpu = new_cpux86(1024*1024);
+	memset(cpu->mem, 0, 1024*1024);
+	memcpy(cpu->mem, test_code, sizeof(test_code));
+	memcpy(&(cpu->mem[TEST_RX_BUF + TEST_PAYLOAD]), test_old, sizeof(test_old));
+	// ヘッダ(0)、宛先ブロードキャスト、送り元、タイプ0x88B5、ペイロード
+	frame = &(cpu->mem[TEST_TX_BUF]);
+	memset(frame + NET_HDR, 0xFF, 6);
+	memcpy(frame + NET_HDR + 6, "\x02\x00\x00\x00\x00\x01\x88\xB5", 8);
+	memcpy(frame + TEST_PAYLOAD, test_new, sizeof(test_new));
+	test_desc(cpu, TEST_RX_QUEUE, TEST_RX_BUF, 2048, VIRTQ_DESC_F_WRITE);
+	test_desc(cpu, TEST_TX_QUEUE, TEST_TX_BUF, TEST_PAYLOAD + sizeof(test_new), 0);
+	if (!vnet_attach(cpu)) {
+		delete_cpux86(cpu);
+		return NULL;
+	}
+	set_cpu_cr0(cpu, CR0_PE, 1);
+	cpu->regs[4] = TEST_STACK;
+	cpu->eip = 0;
+	if (cpu->jit) {
+		cpu->jit->enabled = jit!=0;
+		cpu->jit->native &= jit==2;
+	}
+	return cpu;
+}
+
+// hltで止まったところからeipを変えて続ける
+static void test_resume(CPUx86 *cpu, uint32 eip)
+{
+	cpu->halted = 0;
+	cpu->eip = eip;
+	run_cpux86(cpu);
+}
+
+// jit: 0 インタプリタ、1 IRインタプリタ、2 ネイティブ
+static int test_run(int jit)
+{
+	static const char *name[] = {"interp", "ir", "native"};
+	CPUx86 *a;
+	CPUx86 *b;
+	uint32 eax;
+	uint32 len;
+	uint16 tx_used;
+	uint16 rx_used;
+	int ok;
+
+	a = test_cpu(jit);
+	b = test_cpu(jit);
+	if (a==NULL || b==NULL) {
+		printf("FAIL: %s: cannot attach\n", name[jit]);
+		if (a) {
+			delete_cpux86(a);
+		}
+		if (b) {
+			delete_cpux86(b);
+		}
+		return 1;
+	}
+
+	// 両方とも受信バッファを置いてから、aがブロードキャストし、bが受け取る
+	run_cpux86(b);
+	run_cpux86(a);
+	test_resume(a, TEST_SEND);
+	test_resume(b, TEST_RECV);
+
+	eax = b->regs[0];
+	memcpy(&tx_used, &(a->mem[TEST_TX_USED + 2]), 2);
+	memcpy(&rx_used, &(b->mem[TEST_RX_USED + 2]), 2);
+	memcpy(&len, &(b->mem[TEST_RX_USED + 8]), 4);
+	ok = eax==0x1234 && tx_used==1 && rx_used==1 && len==TEST_PAYLOAD + sizeof(test_new) &&
+		memcmp(&(b->mem[TEST_RX_BUF + NET_HDR]), &(a->mem[TEST_TX_BUF + NET_HDR]), 14 + sizeof(test_new))==0;
+	delete_cpux86(a);
+	delete_cpux86(b);
+	if (!ok) {
+		printf("FAIL: %s: eax=%08X tx used=%u rx used=%u len=%u\n", name[jit], eax, tx_used, rx_used, len);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int fails;
+	int i;
+
+	fails = 0;
+	for (i=0; i<3; i++) {
+		fails += test_run(i);
+	}
+	printf("net: %s\n", fails ? "FAIL" : "OK");
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../cpux86.h"
+#include "../jit.h"
+
+
+// プロテクトモードのセグメントレジスタのロード(ディスクリプタの検査)と、
+// エラーコード付きの例外がIDTで配送されるか確かめる
+//   インタプリタ、IRインタプリタ、ネイティブで同じ結果になること
+
+// 32bit、CPL=0、コードはTEST_CODEから
+//   GDTはTEST_GDT、IDTはTEST_IDT(すべて割り込みゲート、CS=0x08)
+//   ベクタvのハンドラはTEST_HANDLER+v*16: pop edx; mov eax, v; hlt
+//   (edxはエラーコード、なければ戻り先のEIP)
+#define TEST_CODE		0x1000
+#define TEST_GDT		0x3000
+#define TEST_IDT		0x3800
+#define TEST_HANDLER	0x4000
+#define TEST_STACK		0x8000
+#define TEST_DATA		0x10000
+
+static const uint64 test_gdt[] = {
+	0x0000000000000000ULL,	// 0x00 ヌル
+	0x00CF9A000000FFFFULL,	// 0x08 コード ベース0
+	0x00CF92000000FFFFULL,	// 0x10 データ ベース0
+	0x00CF92010000FFFFULL,	// 0x18 データ ベースTEST_DATA
+	0x00CF12000000FFFFULL,	// 0x20 データ 不在
+	0x00CF98000000FFFFULL,	// 0x28 コード 実行のみ
+	0x00CFF2000000FFFFULL,	// 0x30 データ DPL=3
+};
+
+typedef struct {
+	const char *name;
+	uint8 code[24];
+	int len;
+	uint32 eax;			// ベクタ、例外が起きなければコードの結果
+	uint32 edx;
+} TestCase;
+
+static TestCase test_cases[] = {
+	// mov ax, 0x18; mov ds, ax; mov eax, [0x20]; xor edx, edx
+	{"ds base", {0x66, 0xB8, 0x18, 0x00, 0x8E, 0xD8, 0xA1, 0x20, 0x00, 0x00, 0x00, 0x31, 0xD2}, 13, 0x12345678, 0},
+	// mov ax, 0x40; mov ds, ax (GDTの外)
+	{"gdt limit", {0x66, 0xB8, 0x40, 0x00, 0x8E, 0xD8}, 6, EXC_GP, 0x40},
+	// mov ax, 0x20; mov es, ax
+	{"not present", {0x66, 0xB8, 0x20, 0x00, 0x8E, 0xC0}, 6, EXC_NP, 0x20},
+	// mov ax, 0x28; mov ds, ax
+	{"exec only", {0x66, 0xB8, 0x28, 0x00, 0x8E, 0xD8}, 6, EXC_GP, 0x28},
+	// mov ax, 0x13; mov ds, ax (RPL=3 > DPL=0)
+	{"rpl", {0x66, 0xB8, 0x13, 0x00, 0x8E, 0xD8}, 6, EXC_GP, 0x10},
+	// mov ax, 0x30; mov ss, ax (DPL!=CPL)
+	{"ss dpl", {0x66, 0xB8, 0x30, 0x00, 0x8E, 0xD0}, 6, EXC_GP, 0x30},
+	// xor eax, eax; mov ss, ax
+	{"ss null", {0x31, 0xC0, 0x8E, 0xD0}, 4, EXC_GP, 0},
+	// xor eax, eax; mov ds, ax; mov ax, 0x10; mov ds, ax; mov eax, ds; xor edx, edx (ヌルはDSに入る)
+	{"ds null", {0x31, 0xC0, 0x8E, 0xD8, 0x66, 0xB8, 0x10, 0x00, 0x8E, 0xD8, 0x8C, 0xD8, 0x31, 0xD2}, 14, 0x10, 0},
+	// jmp 0x08:TEST_CODE+7; mov eax, cs; xor edx, edx
+	{"jmp far", {0xEA, 0x07, 0x10, 0x00, 0x00, 0x08, 0x00, 0x8C, 0xC8, 0x31, 0xD2}, 11, 0x08, 0},
+	// mov ax, 0x10; mov ds, ax; ud2 (エラーコードなし)
+	{"ud2", {0x66, 0xB8, 0x10, 0x00, 0x8E, 0xD8, 0x0F, 0x0B}, 8, EXC_UD, TEST_CODE + 6},
+};
+
+#define TEST_CASES	(sizeof(test_cases) / sizeof(test_cases[0]))
+
+// jit: 0 インタプリタ、1 IRインタプリタ、2 ネイティブ
+static int test_run(int jit, TestCase *t)
+{
+	static const char *name[] = {"interp", "ir", "native"};
+	static const uint8 handler[] = {0x5A, 0xB8, 0x00, 0x00, 0x00, 0x00, 0xF4};
+	CPUx86 *cpu;
+	uint32 eax;
+	uint32 edx;
+	uint32 h;
+	int i;
+
+	cpu = new_cpux86(1024*1024);
+	memset(cpu->mem, 0, 1024*1024);
+	memcpy(&(cpu->mem[TEST_GDT]), test_gdt, sizeof(test_gdt));
+	for (i=0; i<32; i++) {
+		h = TEST_HANDLER + i * 16;
+		cpu->mem[TEST_IDT + i * 8 + 0] = h & 0xFF;
+		cpu->mem[TEST_IDT + i * 8 + 1] = h >> 8;
+		cpu->mem[TEST_IDT + i * 8 + 2] = 0x08;
+		cpu->mem[TEST_IDT + i * 8 + 5] = 0x8E;
+		memcpy(&(cpu->mem[h]), handler, sizeof(handler));
+		cpu->mem[h + 2] = i;
+	}
+	cpu->mem[TEST_DATA + 0x20] = 0x78;
+	cpu->mem[TEST_DATA + 0x21] = 0x56;
+	cpu->mem[TEST_DATA + 0x22] = 0x34;
+	cpu->mem[TEST_DATA + 0x23] = 0x12;
+	memcpy(&(cpu->mem[TEST_CODE]), t->code, t->len);
+	cpu->mem[TEST_CODE + t->len] = 0xF4;	// hlt
+
+	set_cpu_cr0(cpu, CR0_PE, 1);
+	cpu->gdtr.base = TEST_GDT;
+	cpu->gdtr.limit = sizeof(test_gdt) - 1;
+	cpu->idtr.base = TEST_IDT;
+	cpu->idtr.limit = 32 * 8 - 1;
+	cpu->regs[4] = TEST_STACK;
+	cpu->eip = TEST_CODE;
+	if (cpu->jit) {
+		cpu->jit->enabled = jit!=0;
+		cpu->jit->native &= jit==2;
+	}
+	run_cpux86(cpu);
+
+	eax = cpu->regs[0];
+	edx = cpu->regs[2];
+	delete_cpux86(cpu);
+	if (eax!=t->eax || edx!=t->edx) {
+		printf("FAIL: %s: %s: eax=%08X edx=%08X expected eax=%08X edx=%08X\n", name[jit], t->name, eax, edx, t->eax, t->edx);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int fails;
+	int i;
+
+	fails = 0;
+	for (i=0; i<3 * TEST_CASES; i++) {
+		fails += test_run(i / TEST_CASES, &(test_cases[i % TEST_CASES]));
+	}
+	printf("seg: %s (%d cases)\n", fails ? "FAIL" : "OK", (int)TEST_CASES);
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../cpux86.h"
+#include "../jit.h"
+
+
+// REP付きストリング命令の一括処理(string_chunk)がページ境界と16bitの折り返しを正しく扱うか確かめる
+//   インタプリタ、IRインタプリタ、ネイティブで同じ結果になること
+
+// コードはTEST_CODEから(リアルモードはCS=0、プロテクトモードは32bit、ベース0)
+//   TEST_FILLから上のバイトはTEST_BYTE(リニアアドレス)で埋めておく
+//   (0x1xxxxと0x2xxxxで違う値になり、折り返さずに読み書きするとわかる)
+#define TEST_CODE		0x1000
+#define TEST_FILL		0x4000
+#define TEST_FILL_END	0x30000
+#define TEST_BYTE(a)	((uint8)((a) + ((a) >> 16) * 0x40))
+
+typedef struct {
+	uint32 addr;
+	int len;
+	uint8 bytes[16];
+} TestCheck;
+
+typedef struct {
+	const char *name;
+	int pe;				// 1: プロテクトモード
+	int df;				// 実行前のDF
+	uint8 code[32];
+	int len;
+	TestCheck check[2];
+} TestCase;
+
+static TestCase test_cases[] = {
+	// mov ax, 0x1001; mov ds, ax; mov si, 0xFFFE; mov di, 0x3000; mov cx, 4; rep movsb
+	//   DS:FFFE(0x2000E), DS:FFFF, DS:0000(0x10010), DS:0001
+	{"movsb si wrap", 0, 0, {0xB8, 0x01, 0x10, 0x8E, 0xD8, 0xBE, 0xFE, 0xFF, 0xBF, 0x00, 0x30, 0xB9, 0x04, 0x00, 0xF3, 0xA4}, 16,
+		{{0x3000, 4, {0x8E, 0x8F, 0x50, 0x51}}}},
+	// mov ax, 0x1001; mov es, ax; mov ax, 0x500; mov ds, ax; mov si, 0; mov di, 0xFFFE; mov cx, 4; rep movsb
+	//   ES:FFFE(0x2000E), ES:FFFF, ES:0000(0x10010), ES:0001
+	{"movsb di wrap", 0, 0, {0xB8, 0x01, 0x10, 0x8E, 0xC0, 0xB8, 0x00, 0x05, 0x8E, 0xD8, 0xBE, 0x00, 0x00, 0xBF, 0xFE, 0xFF, 0xB9, 0x04, 0x00, 0xF3, 0xA4}, 21,
+		{{0x2000E, 4, {0x00, 0x01, 0x90, 0x91}}, {0x1000E, 4, {0x4E, 0x4F, 0x02, 0x03}}}},
+	// DF=1; mov ax, 0x1001; mov es, ax; mov di, 1; mov ax, 0xAA; mov cx, 4; rep stosb
+	//   ES:0001(0x10011), ES:0000, ES:FFFF(0x2000F), ES:FFFE
+	{"stosb di wrap down", 0, 1, {0xB8, 0x01, 0x10, 0x8E, 0xC0, 0xBF, 0x01, 0x00, 0xB8, 0xAA, 0x00, 0xB9, 0x04, 0x00, 0xF3, 0xAA}, 16,
+		{{0x2000E, 4, {0xAA, 0xAA, 0x90, 0x91}}, {0x1000E, 4, {0x4E, 0x4F, 0xAA, 0xAA}}}},
+	// mov esi, 0x4FF8; mov edi, 0x6FFA; mov ecx, 4; rep movsd
+	{"movsd page", 1, 0, {0xBE, 0xF8, 0x4F, 0x00, 0x00, 0xBF, 0xFA, 0x6F, 0x00, 0x00, 0xB9, 0x04, 0x00, 0x00, 0x00, 0xF3, 0xA5}, 17,
+		{{0x6FFA, 16, {0xF8, 0xF9, 0xFA, 0xFB, 0xFC, 0xFD, 0xFE, 0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07}}}},
+	// DF=1; mov esi, 0x5004; mov edi, 0x7002; mov ecx, 4; rep movsd
+	{"movsd page down", 1, 1, {0xBE, 0x04, 0x50, 0x00, 0x00, 0xBF, 0x02, 0x70, 0x00, 0x00, 0xB9, 0x04, 0x00, 0x00, 0x00, 0xF3, 0xA5}, 17,
+		{{0x6FF6, 16, {0xF8, 0xF9, 0xFA, 0xFB, 0xFC, 0xFD, 0xFE, 0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07}}}},
+	// mov eax, 0x11223344; mov edi, 0x6FFC; mov ecx, 2; rep stosd
+	{"stosd page", 1, 0, {0xB8, 0x44, 0x33, 0x22, 0x11, 0xBF, 0xFC, 0x6F, 0x00, 0x00, 0xB9, 0x02, 0x00, 0x00, 0x00, 0xF3, 0xAB}, 17,
+		{{0x6FFC, 8, {0x44, 0x33, 0x22, 0x11, 0x44, 0x33, 0x22, 0x11}}}},
+};
+
+#define TEST_CASES	(sizeof(test_cases) / sizeof(test_cases[0]))
+
+// jit: 0 インタプリタ、1 IRインタプリタ、2 ネイティブ
+static int test_run(int jit, TestCase *t)
+{
+	static const char *name[] = {"interp", "ir", "native"};
+	CPUx86 *cpu;
+	TestCheck *check;
+	uint32 a;
+	int fails;
+	int i;
+
+	cpu = new_cpux86(1024*1024);
+	memset(cpu->mem, 0, 1024*1024);
+	for (a=TEST_FILL; a<TEST_FILL_END; a++) {
+		cpu->mem[a] = TEST_BYTE(a);
+	}
+	memcpy(&(cpu->mem[TEST_CODE]), t->code, t->len);
+	cpu->mem[TEST_CODE + t->len] = 0xF4;	// hlt
+	if (t->pe) {
+		set_cpu_cr0(cpu, CR0_PE, 1);
+	}
+	if (t->df) {
+		cpu->eflags |= CPU_EFLAGS_DF;
+	}
+	cpu->eip = TEST_CODE;
+	if (cpu->jit) {
+		cpu->jit->enabled = jit!=0;
+		cpu->jit->native &= jit==2;
+	}
+	run_cpux86(cpu);
+
+	fails = 0;
+	for (i=0; i<2; i++) {
+		check = &(t->check[i]);
+		if (check->len && memcmp(&(cpu->mem[check->addr]), check->bytes, check->len)) {
+			printf("FAIL: %s: %s: 0x%X:", name[jit], t->name, check->addr);
+			for (a=0; a<check->len; a++) {
+				printf(" %02X", cpu->mem[check->addr + a]);
+			}
+			printf("\n");
+			fails++;
+		}
+	}
+	if (cpu->regs[1]!=0) {
+		printf("FAIL: %s: %s: ecx=%08X\n", name[jit], t->name, cpu->regs[1]);
+		fails++;
+	}
+	delete_cpux86(cpu);
+	return fails!=0;
+}
+
+int main(int argc, char *argv[])
+{
+	int fails;
+	int i;
+
+	fails = 0;
+	for (i=0; i<3 * TEST_CASES; i++) {
+		fails += test_run(i / TEST_CASES, &(test_cases[i % TEST_CASES]));
+	}
+	printf("string: %s (%d cases)\n", fails ? "FAIL" : "OK", (int)TEST_CASES);
+	return fails ? 1 : 0;
+}
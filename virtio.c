@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <string.h>
+#include "cpux86.h"
+#include "virtio.h"
+#include "log.h"
+
+
+// virtqueue
+// ゲストとデバイスは同じスレッドで動くので、リングはその場で読み書きする
+
+#define virtq_load16(cpu, addr)		(*(uint16*)((cpu)->mem + (addr)))
+#define virtq_load32(cpu, addr)		(*(uint32*)((cpu)->mem + (addr)))
+#define virtq_load64(cpu, addr)		(*(uint64*)((cpu)->mem + (addr)))
+
+void virtq_reset(VirtQueue *vq)
+{
+	memset(vq, 0, sizeof(VirtQueue));
+}
+
+// キューの場所を決める(RAMに収まらなければ0を返す)
+int virtq_set_pfn(CPUx86 *cpu, VirtQueue *vq, uint32 pfn)
+{
+	uint32 desc;
+	uint32 avail;
+	uint32 used;
+
+	virtq_reset(vq);
+	if (pfn==0) {
+		return 1;
+	}
+	desc = pfn * VIRTQ_ALIGN;
+	avail = desc + VIRTQ_NUM * 16;
+	used = (avail + 6 + VIRTQ_NUM * 2 + VIRTQ_ALIGN - 1) & ~(VIRTQ_ALIGN - 1);
+	if (pfn >= 0x100000 || cpu->mem_size < (size_t)used + 6 + VIRTQ_NUM * 8) {
+		log_warning("virtq: queue 0x%X is out of RAM\n", pfn);
+		return 0;
+	}
+	vq->pfn = pfn;
+	vq->desc = desc;
+	vq->avail = avail;
+	vq->used = used;
+	return 1;
+}
+
+// availから1つ要求を取り出す
+// 1: 取り出した 0: 空 -1: ディスクリプタが壊れている(elem->headは返す)
+int virtq_pop(CPUx86 *cpu, VirtQueue *vq, VirtqElem *elem)
+{
+	uint64 addr;
+	uint32 desc;
+	uint32 len;
+	uint16 flags;
+	uint16 i;
+	int n;
+
+	if (vq->pfn==0 || vq->last_avail==virtq_load16(cpu, vq->avail + 2)) {
+		return 0;
+	}
+	elem->head = virtq_load16(cpu, vq->avail + 4 + (vq->last_avail % VIRTQ_NUM) * 2);
+	elem->count = 0;
+	vq->last_avail++;
+
+	i = elem->head;
+	for (n=0; ; n++) {
+		if (VIRTQ_NUM <= i || VIRTQ_SEG_MAX <= n) {
+			log_warning("virtq: broken chain at %d\n", elem->head);
+			return -1;
+		}
+		desc = vq->desc + i * 16;
+		addr = virtq_load64(cpu, desc);
+		len = virtq_load32(cpu, desc + 8);
+		flags = virtq_load16(cpu, desc + 12);
+		if (cpu->mem_size < addr + len) {
+			log_warning("virtq: buffer 0x%llX+0x%X is out of RAM\n", addr, len);
+			return -1;
+		}
+		elem->seg[n].addr = addr;
+		elem->seg[n].len = len;
+		elem->seg[n].write = (flags & VIRTQ_DESC_F_WRITE)!=0;
+		elem->count++;
+		if (!(flags & VIRTQ_DESC_F_NEXT)) {
+			break;
+		}
+		i = virtq_load16(cpu, desc + 14);
+	}
+	return 1;
+}
+
+// 記録中: デバイスが書いたlenバイト(書き込み可のディスクリプタを先頭から)をログに書く
+static void virtq_record(CPUx86 *cpu, VirtQueue *vq, uint16 head, uint32 len)
+{
+	uint64 addr;
+	uint32 desc;
+	uint32 seg;
+	uint16 flags;
+	uint16 i;
+	int n;
+
+	i = head;
+	for (n=0; 0<len && i<VIRTQ_NUM && n<VIRTQ_SEG_MAX; n++) {
+		desc = vq->desc + i * 16;
+		addr = virtq_load64(cpu, desc);
+		seg = virtq_load32(cpu, desc + 8);
+		flags = virtq_load16(cpu, desc + 12);
+		if ((flags & VIRTQ_DESC_F_WRITE) && addr + seg <= cpu->mem_size) {
+			seg = seg < len ? seg : len;
+			replay_dma(cpu, addr, seg);
+			len -= seg;
+		}
+		if (!(flags & VIRTQ_DESC_F_NEXT)) {
+			break;
+		}
+		i = virtq_load16(cpu, desc + 14);
+	}
+}
+
+// 終わった要求をusedに返す
+void virtq_push(CPUx86 *cpu, VirtQueue *vq, uint16 head, uint32 len)
+{
+	uint16 idx;
+	uint32 entry;
+
+	if (vq->pfn==0) {
+		return;
+	}
+	if (cpu->replay_mode==REPLAY_RECORD) {
+		virtq_record(cpu, vq, head, len);
+	}
+	idx = virtq_load16(cpu, vq->used + 2);
+	entry = vq->used + 4 + (idx % VIRTQ_NUM) * 8;
+	*(uint32*)(cpu->mem + entry) = head;
+	*(uint32*)(cpu->mem + entry + 4) = len;
+	// 要素を書いてからidxを進める
+	__atomic_store_n((uint16*)(cpu->mem + vq->used + 2), idx + 1, __ATOMIC_RELEASE);
+	if (cpu->replay_mode==REPLAY_RECORD) {
+		replay_dma(cpu, entry, 8);
+		replay_dma(cpu, vq->used + 2, 2);
+	}
+}
+
+// ゲストが割り込みを止めていなければ1
+int virtq_interrupt(CPUx86 *cpu, VirtQueue *vq)
+{
+	return vq->pfn && !(virtq_load16(cpu, vq->avail) & VIRTQ_AVAIL_F_NO_INTERRUPT);
+}
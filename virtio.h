@@ -0,0 +1,66 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include "cpux86.h"
+
+
+// レガシーvirtio(PCIの構成空間はなく、I/Oポートにレジスタを置く)
+
+#define VIRTIO_HOST_FEATURES	0x00	// 32bit R
+#define VIRTIO_GUEST_FEATURES	0x04	// 32bit RW
+#define VIRTIO_QUEUE_PFN		0x08	// 32bit RW キューのページ番号(0でリセット)
+#define VIRTIO_QUEUE_NUM		0x0C	// 16bit R
+#define VIRTIO_QUEUE_SEL		0x0E	// 16bit RW
+#define VIRTIO_QUEUE_NOTIFY		0x10	// 16bit W
+#define VIRTIO_STATUS			0x12	// 8bit RW(0でリセット)
+#define VIRTIO_ISR				0x13	// 8bit R(読むとクリア)
+#define VIRTIO_CONFIG			0x14	// デバイスごとの設定
+#define VIRTIO_PORTS			0x40
+
+#define VIRTIO_STATUS_ACKNOWLEDGE	0x01
+#define VIRTIO_STATUS_DRIVER		0x02
+#define VIRTIO_STATUS_DRIVER_OK		0x04
+#define VIRTIO_STATUS_FAILED		0x80
+
+
+// virtqueue(スプリットリング、ゲストのRAMに置く)
+//   desc[VIRTQ_NUM] avail{flags idx ring[VIRTQ_NUM]} (VIRTQ_ALIGNに合わせる) used{flags idx ring[VIRTQ_NUM]{id len}}
+
+#define VIRTQ_NUM		128
+#define VIRTQ_ALIGN		4096
+#define VIRTQ_SEG_MAX	64		// 1つの要求のディスクリプタ数
+
+#define VIRTQ_DESC_F_NEXT		1
+#define VIRTQ_DESC_F_WRITE		2
+#define VIRTQ_AVAIL_F_NO_INTERRUPT	1
+
+typedef struct {
+	uint32 addr;	// ゲストの物理アドレス
+	uint32 len;
+	uint8 write;	// 1: デバイスが書く
+} VirtqSeg;
+
+typedef struct {
+	uint16 head;
+	int count;
+	VirtqSeg seg[VIRTQ_SEG_MAX];
+} VirtqElem;
+
+typedef struct {
+	uint32 pfn;			// 0: 未設定
+	uint32 desc;
+	uint32 avail;
+	uint32 used;
+	uint16 last_avail;	// 次に取り出すavail.ring
+} VirtQueue;
+
+
+// virtio.c
+extern void virtq_reset(VirtQueue *vq);
+extern int virtq_set_pfn(CPUx86 *cpu, VirtQueue *vq, uint32 pfn);
+extern int virtq_pop(CPUx86 *cpu, VirtQueue *vq, VirtqElem *elem);
+extern void virtq_push(CPUx86 *cpu, VirtQueue *vq, uint16 head, uint32 len);
+extern int virtq_interrupt(CPUx86 *cpu, VirtQueue *vq);
+
+
+#endif